@@ -0,0 +1,98 @@
+// Bounce buffers between USB DMA and the CPU, see bounce.h
+
+#include <string.h>
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_l1c.h"
+#include "bflb_mtimer.h"
+
+#include "stream.h"
+#include "bounce.h"
+#include "utils.h"
+
+#define TRIAL_CHUNKS        2           // full chunks each mode is timed on
+
+// DMA side is stream_buf (uncached), CPU side is this
+static BYTE __attribute__((aligned(64))) cached_buf[BOUNCE_SIZE];
+
+struct bounce_consumer bounce_jtag = {"jtag", BOUNCE_AUTO};
+
+// the consumer is done with the chunk of the running trial
+static void trial_close(struct bounce_consumer *c, uint64_t now) {
+    if (!c->trial_start)
+        return;
+    c->trial_us[c->trial_mode] += now - c->trial_start;
+    c->trial_bytes[c->trial_mode] += BOUNCE_SIZE;
+    c->trial_start = 0;
+    if (++c->trial < 3 * TRIAL_CHUNKS)
+        return;
+    // lowest time per byte. INVALIDATE may not have run, see bounce_read()
+    enum bounce_mode best = BOUNCE_DIRECT;
+    for (int m = BOUNCE_COPY; m <= BOUNCE_INVALIDATE; m++)
+        if (c->trial_bytes[m] &&
+            (uint64_t)c->trial_us[m] * c->trial_bytes[best] < (uint64_t)c->trial_us[best] * c->trial_bytes[m])
+            best = m;
+    c->mode = best;
+}
+
+void bounce_begin(struct bounce_consumer *c) {
+    c->trial_start = 0;
+}
+
+void bounce_end(struct bounce_consumer *c) {
+    if (c->mode == BOUNCE_AUTO)
+        trial_close(c, bflb_mtimer_get_time_us());
+}
+
+FRESULT bounce_read(struct bounce_consumer *c, FIL *fp, UINT len, UINT *br, const BYTE **data) {
+    uint64_t t = bflb_mtimer_get_time_us();
+    if (c->mode == BOUNCE_AUTO)
+        trial_close(c, t);              // the consumer is back for more
+    bool trial = c->mode == BOUNCE_AUTO;
+    enum bounce_mode mode = trial ? (enum bounce_mode)(c->trial % 3) : c->mode;
+    FRESULT r;
+    len = min(len, (UINT)BOUNCE_SIZE);
+
+    // DMA into cached memory only in whole cache lines: FatFs copies partial
+    // sectors with the CPU, which must not share a line with DMA data
+    if (mode == BOUNCE_INVALIDATE && f_tell(fp) % FF_MAX_SS != 0)
+        mode = BOUNCE_COPY;
+
+    if (mode == BOUNCE_INVALIDATE) {
+        UINT lines = (len + 63) & ~63;
+        bflb_l1c_dcache_clean_invalidate_range(cached_buf, lines);     // no dirty line may land on DMA data
+        r = stream_read(fp, cached_buf, len, br);
+        bflb_l1c_dcache_clean_invalidate_range(cached_buf, lines);     // keep CPU-copied tail, drop stale lines
+        *data = cached_buf;
+    } else {
+        r = stream_read(fp, stream_buf, len, br);
+        if (mode == BOUNCE_COPY) {
+            memcpy(cached_buf, stream_buf, *br);
+            *data = cached_buf;
+        } else {
+            *data = stream_buf;
+        }
+    }
+    if (trial && r == FR_OK && *br == BOUNCE_SIZE) {
+        c->trial_mode = mode;
+        c->trial_start = t;
+    }
+    c->bytes += *br;
+    c->us += bflb_mtimer_get_time_us() - t;
+    return r;
+}
+
+FRESULT bounce_read_to(FIL *fp, void *dst, UINT len, UINT *br) {
+    FRESULT r = FR_OK;
+    *br = 0;
+    while (len > 0) {
+        UINT n;
+        if ((r = stream_read(fp, stream_buf, min(len, (UINT)BOUNCE_SIZE), &n)) != FR_OK || n == 0)
+            break;
+        memcpy((BYTE *)dst + *br, stream_buf, n);
+        *br += n;
+        len -= n;
+    }
+    return r;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ff.h"
+
+#include "stream.h"
+
+// Bounce buffers between USB DMA and the CPU
+//
+// USB transfers must land in memory the data cache does not hide from the
+// DMA engine. Consumers that then walk the data byte by byte (the bitstream
+// shifter) pay an uncached load per byte. Each consumer gets data in one of
+// three ways:
+//  BOUNCE_DIRECT       read the uncached DMA buffer as is
+//  BOUNCE_COPY         DMA into the uncached buffer, memcpy() to cached RAM
+//  BOUNCE_INVALIDATE   DMA straight into cached RAM, with cache maintenance
+//                      before and after the transfer
+// A BOUNCE_AUTO consumer tries the three modes in turn on its first full
+// chunks and then keeps the fastest. A chunk is timed from its
+// bounce_read() to the next one, so the time covers the transfer, the copy
+// or cache maintenance, and the consumer's own pass over the data.
+//
+// The UART ROM senders are not consumers here: they are bound by the UART,
+// so they keep reading the uncached fbuf directly.
+
+#define BOUNCE_SIZE         STREAM_CHUNK
+
+enum bounce_mode {
+    BOUNCE_DIRECT,
+    BOUNCE_COPY,
+    BOUNCE_INVALIDATE,
+    BOUNCE_AUTO,
+};
+
+struct bounce_consumer {
+    const char *name;
+    enum bounce_mode mode;
+    uint32_t bytes;                     // bytes delivered
+    uint32_t us;                        // time spent reading and preparing them
+    // BOUNCE_AUTO trial
+    uint8_t trial;                      // chunks timed so far
+    uint8_t trial_mode;                 // of the chunk being consumed
+    uint64_t trial_start;               // its bounce_read() began, 0: none
+    uint32_t trial_us[3], trial_bytes[3];
+};
+
+extern struct bounce_consumer bounce_jtag;      // bitstream shifter in load_core()
+
+// consumer `c` starts or ends a run of bounce_read() calls. the time
+// between two calls is only charged to a mode within a run
+void bounce_begin(struct bounce_consumer *c);
+void bounce_end(struct bounce_consumer *c);
+
+// read up to `len` (<= BOUNCE_SIZE) bytes from `fp` for consumer `c`.
+// *data points at them until the next call. needs the file system lock
+FRESULT bounce_read(struct bounce_consumer *c, FIL *fp, UINT len, UINT *br, const BYTE **data);
+
+// read `len` bytes from `fp` into ordinary (cached) memory `dst`
+FRESULT bounce_read_to(FIL *fp, void *dst, UINT len, UINT *br);
@@ -0,0 +1,540 @@
+// ROM catalog and its background indexer
+//
+// CATALOG_FILE is a log of records, each followed by the ROM's path:
+//
+//   struct cat_rec, path... (path_len bytes, no terminator)
+//
+// A record with size CAT_DELETED is a tombstone for the path hash it
+// carries. Later records win. CATALOG_INDEX is the RAM index written out:
+//
+//   struct cat_idx_header, struct cat_entry * count (sorted by hash)
+//
+// and is only trusted if its log_len matches the size of the log.
+//
+// All file I/O is done in pieces smaller than a sector, so FatFs copies
+// through the uncached sector buffers of our FIL objects and USB DMA never
+// targets cached memory. The task holds the file system lock for one
+// directory entry at a time, so the menus stay responsive.
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ff.h"
+#include "usbh_core.h"
+
+#include "catalog.h"
+#include "volume.h"
+#include "utils.h"
+
+extern FATFS fs;
+extern int snes_check_header(const unsigned char* hdr, int file_size, int typ, int* score);
+
+#define CATALOG_TASK_STACK_SIZE 1024
+#define CATALOG_TASK_PRIORITY   tskIDLE_PRIORITY
+#define CATALOG_POLL_MS         10000       // check for a remounted drive this often
+#define CATALOG_MAX_DEPTH       4           // sub-directory levels below a ROM folder
+#define CATALOG_MAX_ROMS        8192
+#define CATALOG_SYNC_EVERY      32          // records between f_sync() of the log
+#define CATALOG_IO_CHUNK        256
+
+#define CAT_REC_MAGIC   0x52435443          // "TCCR"
+#define CAT_IDX_MAGIC   0x49435443          // "TCCI"
+#define CAT_DELETED     0xffffffff
+
+struct cat_rec {
+    uint32_t magic;
+    uint32_t hash;                  // hash of the path
+    uint32_t size;                  // ROM file size, CAT_DELETED for a tombstone
+    uint16_t mapper;
+    uint16_t path_len;
+    uint8_t system;
+    uint8_t map;
+    char code[4];
+    char title[30];
+};
+
+struct cat_entry {
+    uint32_t hash;
+    uint32_t off : 31;              // record offset in the log
+    uint32_t seen : 1;              // found by the current walk
+    uint32_t size;
+};
+
+struct cat_idx_header {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t log_len;
+};
+
+static StackType_t catalog_stack[CATALOG_TASK_STACK_SIZE];
+static StaticTask_t catalog_tcb;
+
+static USB_NOCACHE_RAM_SECTION FIL log_f;      // indexer: log, open for appending
+static USB_NOCACHE_RAM_SECTION FIL rom_f;      // indexer: ROM headers, index file
+static USB_NOCACHE_RAM_SECTION FIL look_f;     // catalog_lookup()
+
+// everything below is protected by the file system lock
+static struct cat_entry *cat;
+static int cat_cnt, cat_cap;
+static uint32_t log_len;            // bytes in the log
+static uint32_t durable_len;        // bytes of the log known to be on the drive
+static int unsynced;
+static bool dirty;                  // RAM index differs from CATALOG_INDEX
+static bool cat_loaded;
+static WORD cat_fs_id;              // mount the catalog was loaded from
+
+static FILINFO walk_fno;
+static char walk_path[512];
+
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619;  // FNV-1a
+    return h;
+}
+
+// binary search. return index, or -(insertion point)-1
+static int find(uint32_t hash) {
+    int lo = 0, hi = cat_cnt - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cat[mid].hash == hash) return mid;
+        if (cat[mid].hash < hash) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -lo - 1;
+}
+
+static bool insert(int pos, uint32_t hash, uint32_t off, uint32_t size) {
+    if (cat_cnt == cat_cap) {
+        int cap = cat_cap ? cat_cap * 2 : 256;
+        if (cap > CATALOG_MAX_ROMS) return false;
+        struct cat_entry *p = realloc(cat, cap * sizeof(struct cat_entry));
+        if (!p) return false;
+        cat = p;
+        cat_cap = cap;
+    }
+    memmove(&cat[pos+1], &cat[pos], (cat_cnt - pos) * sizeof(struct cat_entry));
+    cat[pos] = (struct cat_entry){ hash, off, 1, size };
+    cat_cnt++;
+    return true;
+}
+
+static void erase(int pos) {
+    memmove(&cat[pos], &cat[pos+1], (cat_cnt - pos - 1) * sizeof(struct cat_entry));
+    cat_cnt--;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Sub-sector I/O
+
+static FRESULT chunk_read(FIL *f, void *buf, UINT len) {
+    while (len > 0) {
+        UINT n = min(len, (UINT)CATALOG_IO_CHUNK), br;
+        FRESULT r = f_read(f, buf, n, &br);
+        if (r != FR_OK) return r;
+        if (br != n) return FR_INT_ERR;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return FR_OK;
+}
+
+static FRESULT chunk_write(FIL *f, const void *buf, UINT len) {
+    while (len > 0) {
+        UINT n = min(len, (UINT)CATALOG_IO_CHUNK), bw;
+        FRESULT r = f_write(f, buf, n, &bw);
+        if (r != FR_OK) return r;
+        if (bw != n) return FR_DENIED;      // disk full
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return FR_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// ROM headers
+
+static bool has_ext(const char *name, const char *ext) {
+    int n = strlen(name), e = strlen(ext);
+    return n > e && strcasecmp(name + n - e, ext) == 0;
+}
+
+static bool is_rom(uint8_t system, const char *name) {
+    switch (system) {
+    case 1: return has_ext(name, ".nes");
+    case 2: return has_ext(name, ".sfc") || has_ext(name, ".smc");
+    case 3: return has_ext(name, ".gba");
+    case 4: return has_ext(name, ".bin");
+    }
+    return false;
+}
+
+// copy a space-padded header title, dropping non-printable characters
+static void copy_title(char *dst, int dst_size, const uint8_t *src, int len) {
+    int n = 0;
+    for (int i = 0; i < len && n < dst_size - 1; i++) {
+        uint8_t c = src[i];
+        if (c < 32 || c > 126 || (c == ' ' && (n == 0 || dst[n-1] == ' ')))
+            continue;
+        dst[n++] = c;
+    }
+    while (n > 0 && dst[n-1] == ' ') n--;
+    dst[n] = '\0';
+}
+
+static bool read_at(uint32_t pos, void *buf, UINT len) {
+    return f_lseek(&rom_f, pos) == FR_OK && chunk_read(&rom_f, buf, len) == FR_OK;
+}
+
+// fill in metadata from the ROM header. rom_f is the open ROM
+static void read_header(struct cat_rec *rec) {
+    uint8_t h[128];
+    uint32_t size = rec->size;
+    switch (rec->system) {
+    case 1:     // iNES: mapper in flags 6/7, high bits in byte 8 for NES 2.0
+        if (size >= 16 && read_at(0, h, 16) && memcmp(h, "NES\x1a", 4) == 0) {
+            rec->mapper = (h[6] >> 4) | (h[7] & 0xf0);
+            if ((h[7] & 0x0c) == 0x08)
+                rec->mapper |= (h[8] & 0x0f) << 8;
+        }
+        break;
+    case 2: {   // same probing order as loadsnes()
+        static const uint32_t pos[3] = { 0x7fc0, 0xffc0, 0x40ffc0 };
+        uint32_t off = size & 0x3ff;
+        for (int typ = 0; typ < 3; typ++) {
+            if (pos[typ] + off + 64 > size || !read_at(pos[typ] + off, h, 64))
+                break;
+            if (snes_check_header(h, size - off, typ, NULL) == 0) {
+                copy_title(rec->title, sizeof(rec->title), h, 21);
+                rec->map = h[21];
+                break;
+            }
+        }
+        break;
+    }
+    case 3:     // title at 0xA0, game code at 0xAC
+        if (size >= 0xb0 && read_at(0xa0, h, 16)) {
+            copy_title(rec->title, sizeof(rec->title), h, 12);
+            memcpy(rec->code, h + 12, 4);
+        }
+        break;
+    case 4:     // "SEGA" at 0x100, overseas title at 0x150
+        if (size >= 0x180 && read_at(0x100, h, 128) &&
+            (memcmp(h, "SEGA", 4) == 0 || memcmp(h + 1, "SEGA", 4) == 0))
+            copy_title(rec->title, sizeof(rec->title), h + 0x50, 48);
+        break;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Log and index files
+
+static bool append(struct cat_rec *rec, const char *path, uint32_t *off) {
+    rec->magic = CAT_REC_MAGIC;
+    *off = log_len;
+    if (chunk_write(&log_f, rec, sizeof(*rec)) != FR_OK ||
+        chunk_write(&log_f, path, rec->path_len) != FR_OK)
+        return false;
+    log_len += sizeof(*rec) + rec->path_len;
+    dirty = true;
+    if (++unsynced >= CATALOG_SYNC_EVERY) {
+        if (f_sync(&log_f) != FR_OK) return false;
+        durable_len = log_len;
+        unsynced = 0;
+    }
+    return true;
+}
+
+static bool load_index(uint32_t len) {
+    struct cat_idx_header hdr;
+    bool ok = false;
+    if (f_open(&rom_f, CATALOG_INDEX, FA_READ) != FR_OK)
+        return false;
+    if (chunk_read(&rom_f, &hdr, sizeof(hdr)) != FR_OK || hdr.magic != CAT_IDX_MAGIC ||
+        hdr.log_len != len || hdr.count > CATALOG_MAX_ROMS ||
+        f_size(&rom_f) != sizeof(hdr) + hdr.count * sizeof(struct cat_entry))
+        goto load_index_close;
+    int cap = max((int)hdr.count, 256);
+    struct cat_entry *p = realloc(cat, cap * sizeof(struct cat_entry));
+    if (!p)
+        goto load_index_close;
+    cat = p;
+    cat_cap = cap;
+    if (chunk_read(&rom_f, cat, hdr.count * sizeof(struct cat_entry)) != FR_OK)
+        goto load_index_close;
+    cat_cnt = hdr.count;
+    log_len = len;
+    ok = true;
+load_index_close:
+    f_close(&rom_f);
+    return ok;
+}
+
+// rebuild the RAM index from the log. stops at the first damaged record
+static void replay(void) {
+    struct cat_rec rec;
+    cat_cnt = 0;
+    log_len = 0;
+    if (f_open(&rom_f, CATALOG_FILE, FA_READ) != FR_OK)
+        return;
+    uint32_t len = f_size(&rom_f);
+    while (log_len + sizeof(rec) <= len) {
+        if (chunk_read(&rom_f, &rec, sizeof(rec)) != FR_OK || rec.magic != CAT_REC_MAGIC ||
+            rec.path_len >= sizeof(walk_path) || log_len + sizeof(rec) + rec.path_len > len)
+            break;
+        int i = find(rec.hash);
+        if (rec.size == CAT_DELETED) {
+            if (i >= 0) erase(i);
+        } else if (i >= 0) {
+            cat[i].off = log_len;
+            cat[i].size = rec.size;
+        } else if (!insert(-i-1, rec.hash, log_len, rec.size)) {
+            break;
+        }
+        log_len += sizeof(rec) + rec.path_len;
+        if (f_lseek(&rom_f, log_len) != FR_OK)
+            break;
+    }
+    f_close(&rom_f);
+    dirty = true;
+}
+
+static bool save_index(void) {
+    struct cat_idx_header hdr = { CAT_IDX_MAGIC, cat_cnt, log_len };
+    if (f_open(&rom_f, CATALOG_INDEX, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return false;
+    FRESULT r = chunk_write(&rom_f, &hdr, sizeof(hdr));
+    for (int i = 0; r == FR_OK && i < cat_cnt; i++) {
+        struct cat_entry e = cat[i];
+        e.seen = 0;
+        r = chunk_write(&rom_f, &e, sizeof(e));
+    }
+    if (f_close(&rom_f) != FR_OK) r = FR_DISK_ERR;
+    if (r == FR_OK) dirty = false;
+    return r == FR_OK;
+}
+
+// load the catalog of the mounted drive
+static bool catalog_open(void) {
+    if (cat_loaded)
+        f_close(&log_f);        // from an earlier mount, nothing to flush
+    cat_loaded = false;
+    cat_cnt = 0;
+    f_mkdir(TANGCORE_DIR);
+    f_chmod(TANGCORE_DIR, AM_HID, AM_HID);
+    if (f_open(&log_f, CATALOG_FILE, FA_OPEN_ALWAYS | FA_READ | FA_WRITE) != FR_OK)
+        return false;
+    uint32_t len = f_size(&log_f);
+    dirty = false;
+    if (!load_index(len))
+        replay();
+    // drop a damaged tail, then append from there
+    if (f_lseek(&log_f, log_len) != FR_OK || (log_len < len && f_truncate(&log_f) != FR_OK)) {
+        f_close(&log_f);
+        return false;
+    }
+    durable_len = log_len;
+    unsynced = 0;
+    cat_fs_id = fs.id;
+    cat_loaded = true;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Indexer
+
+// true if entry i is the record of `path` and not just of the same hash.
+// reads through log_f, which also sees records not synced yet
+static bool stored_path_is(int i, const char *path) {
+    struct cat_rec rec;
+    char part[64];
+    bool same = f_lseek(&log_f, cat[i].off) == FR_OK &&
+                chunk_read(&log_f, &rec, sizeof(rec)) == FR_OK &&
+                rec.magic == CAT_REC_MAGIC && rec.path_len == strlen(path);
+    for (UINT done = 0; same && done < rec.path_len; done += sizeof(part)) {
+        UINT n = min(rec.path_len - done, (UINT)sizeof(part));
+        same = chunk_read(&log_f, part, n) == FR_OK && memcmp(part, path + done, n) == 0;
+    }
+    f_lseek(&log_f, log_len);               // back to appending
+    return same;
+}
+
+// bring one ROM up to date. called with the lock held
+static bool index_rom(const char *path, uint8_t system, uint32_t size) {
+    uint32_t hash = path_hash(path);
+    int i = find(hash);
+    if (i >= 0) {
+        bool same = stored_path_is(i, path);
+        if (f_tell(&log_f) != log_len)
+            return false;
+        if (!same)
+            return true;                    // another ROM has the hash, first come keeps it
+    }
+    if (i >= 0 && cat[i].size == size) {
+        cat[i].seen = 1;
+        return true;
+    }
+    if (i < 0 && cat_cnt >= CATALOG_MAX_ROMS)
+        return true;                        // catalog full, leave the ROM out
+    struct cat_rec rec = { .hash = hash, .size = size, .system = system, .path_len = strlen(path) };
+    if (f_open(&rom_f, path, FA_READ) == FR_OK) {
+        read_header(&rec);
+        f_close(&rom_f);
+    }
+    uint32_t off;
+    if (!append(&rec, path, &off))
+        return false;
+    if (i >= 0)
+        cat[i] = (struct cat_entry){ hash, off, 1, size };
+    else
+        insert(-i-1, hash, off, size);
+    return true;
+}
+
+// walk a directory tree in walk_path. return false if interrupted
+static bool walk(int depth, uint8_t system) {
+    DIR d;
+    bool ok = true;
+    int len = strlen(walk_path);
+    fs_lock();
+    FRESULT r = f_opendir(&d, walk_path);
+    fs_unlock();
+    if (r != FR_OK)
+        return r == FR_NO_PATH || r == FR_NO_FILE;     // no such ROM folder
+    for (;;) {
+        fs_lock();
+        if (fs.id != cat_fs_id || f_readdir(&d, &walk_fno) != FR_OK) {
+            ok = false;             // drive was remounted
+            fs_unlock();
+            break;
+        }
+        if (walk_fno.fname[0] == 0) {
+            fs_unlock();
+            break;
+        }
+        bool is_dir = walk_fno.fattrib & AM_DIR;
+        if ((walk_fno.fattrib & (AM_HID | AM_SYS)) ||
+            len + 1 + strlen(walk_fno.fname) >= sizeof(walk_path) ||
+            (!is_dir && !is_rom(system, walk_fno.fname))) {
+            fs_unlock();
+            continue;
+        }
+        walk_path[len] = '/';
+        strcpy(walk_path + len + 1, walk_fno.fname);
+        if (!is_dir)
+            ok = index_rom(walk_path, system, walk_fno.fsize);
+        fs_unlock();
+        if (ok && is_dir && depth < CATALOG_MAX_DEPTH)
+            ok = walk(depth + 1, system);
+        walk_path[len] = '\0';
+        if (!ok) break;
+    }
+    fs_lock();
+    f_closedir(&d);
+    fs_unlock();
+    return ok;
+}
+
+// one pass over all ROM folders. return true if it completed
+static bool walk_all(void) {
+    fs_lock();
+    for (int i = 0; i < cat_cnt; i++)
+        cat[i].seen = 0;
+    fs_unlock();
+
+    for (int i = 0; core_info_list[i].id != 0; i++) {
+        strncpy(walk_path, core_info_list[i].rom_dir, sizeof(walk_path));
+        if (!walk(0, core_info_list[i].id))
+            return false;
+    }
+
+    // tombstones for ROMs that are gone, then a fresh index
+    bool ok = true;
+    fs_lock();
+    if (fs.id != cat_fs_id) {
+        fs_unlock();
+        return false;
+    }
+    for (int i = 0; ok && i < cat_cnt; ) {
+        if (cat[i].seen) {
+            i++;
+            continue;
+        }
+        struct cat_rec rec = { .hash = cat[i].hash, .size = CAT_DELETED };
+        uint32_t off;
+        ok = append(&rec, "", &off);
+        if (ok) erase(i);
+    }
+    if (ok && dirty) {
+        ok = f_sync(&log_f) == FR_OK;
+        durable_len = log_len;
+        unsynced = 0;
+        if (ok) ok = save_index();
+    }
+    fs_unlock();
+    return ok;
+}
+
+static void catalog_task(void *pvParameters) {
+    bool walked = false;
+    WORD walked_id = 0;
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(walked ? CATALOG_POLL_MS : 1000));
+        fs_lock();
+        // (re)walk after every mount: files may have changed on another machine
+        bool go = volume_mount() == FR_OK && (!walked || fs.id != walked_id);
+        WORD id = fs.id;
+        if (go && (!cat_loaded || id != cat_fs_id) && !catalog_open()) {
+            go = false;             // drive not writable, try again after the next mount
+            walked = true;
+            walked_id = id;
+        }
+        fs_unlock();
+        if (go) {
+            // a walk cut short by a remount is retried soon, other failures after the next mount
+            walked = walk_all() || fs.id == id;
+            walked_id = id;
+        }
+    }
+}
+
+void catalog_init(void) {
+    xTaskCreateStatic(catalog_task, "catalog_task", CATALOG_TASK_STACK_SIZE, NULL,
+                      CATALOG_TASK_PRIORITY, catalog_stack, &catalog_tcb);
+}
+
+bool catalog_lookup(const char *path, struct catalog_info *info) {
+    struct cat_rec rec;
+    char p[sizeof(walk_path)];
+    if (!cat_loaded || fs.id != cat_fs_id)
+        return false;
+    int i = find(path_hash(path));
+    if (i < 0 || cat[i].off + sizeof(rec) > durable_len)
+        return false;
+    bool ok = false;
+    if (f_open(&look_f, CATALOG_FILE, FA_READ) != FR_OK)
+        return false;
+    if (f_lseek(&look_f, cat[i].off) == FR_OK && chunk_read(&look_f, &rec, sizeof(rec)) == FR_OK &&
+        rec.magic == CAT_REC_MAGIC && rec.path_len < sizeof(p) &&
+        chunk_read(&look_f, p, rec.path_len) == FR_OK) {
+        p[rec.path_len] = '\0';
+        ok = strcmp(p, path) == 0;
+    }
+    f_close(&look_f);
+    if (ok) {
+        info->system = rec.system;
+        info->map = rec.map;
+        info->mapper = rec.mapper;
+        info->size = rec.size;
+        memcpy(info->code, rec.code, 4);
+        info->code[4] = '\0';
+        memcpy(info->title, rec.title, sizeof(info->title));
+        info->title[sizeof(info->title)-1] = '\0';
+    }
+    return ok;
+}
+
+int catalog_count(void) {
+    return cat_loaded ? cat_cnt : 0;
+}
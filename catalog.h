@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ROM catalog
+//
+// An idle-priority task walks the ROM folders and records cheap header
+// metadata of every ROM in CATALOG_FILE, an append-only log of records.
+// CATALOG_INDEX holds a sorted (path hash, record offset) table of the live
+// records, so later boots load the index instead of re-reading headers, and
+// a walk only reads headers of files that are new or changed size. Files
+// that disappeared get a tombstone record. If the index is missing or stale,
+// it is rebuilt by replaying the log.
+
+#define CATALOG_FILE        "usb:.tangcore/catalog.dat"
+#define CATALOG_INDEX       "usb:.tangcore/catalog.idx"
+
+struct catalog_info {
+    uint8_t system;                 // core id: 1 NES, 2 SNES, 3 GBA, 4 MegaDrive
+    uint8_t map;                    // SNES map mode byte
+    uint16_t mapper;                // NES mapper number
+    uint32_t size;                  // file size
+    char code[5];                   // GBA game code
+    char title[30];                 // internal title, empty if the ROM has none
+};
+
+// start the indexer task
+void catalog_init(void);
+
+// look up metadata of a ROM by full path (e.g. "usb:snes/foo.sfc")
+// return false if the ROM is not (yet) in the catalog
+// needs the file system lock
+bool catalog_lookup(const char *path, struct catalog_info *info);
+
+// number of ROMs in the catalog
+int catalog_count(void);
@@ -2,19 +2,40 @@
 #include <string.h>
 
 #include "ff.h"
+#include "loader.h"
+#include "scan.h"
 
 #include "utils.h"
 
 
-extern uint32_t get_file_size(const char* fname);
-extern void send_fbuf_data(int len);
-extern void set_loading_state(int state);
-extern bool core_running;
-extern FIL* fcore;
-extern BYTE* fbuf;
+extern void set_backup_type(int type);
+
+// save types, values of UART command 0x0C
+#define GBA_BACKUP_NONE     0
+#define GBA_BACKUP_SRAM     1           // 32KB SRAM or FRAM
+#define GBA_BACKUP_EEPROM   2           // 512B or 8KB, the core sizes it from the bus
+#define GBA_BACKUP_FLASH64  3
+#define GBA_BACKUP_FLASH128 4
 
 bool gba_bios_loaded;
 bool gba_missing_bios_warned;
+int gba_backup_type;
+
+// Nintendo's save libraries leave their version string in the ROM, e.g.
+// "FLASH1M_V103". Scanning every chunk as it is sent finds it without
+// another pass over the file.
+static const char* const backup_ids[] = {
+  "EEPROM_V", "SRAM_V", "SRAM_F_V", "FLASH_V", "FLASH512_V", "FLASH1M_V"
+};
+static const uint8_t backup_types[] = {
+  GBA_BACKUP_EEPROM, GBA_BACKUP_SRAM, GBA_BACKUP_SRAM,
+  GBA_BACKUP_FLASH64, GBA_BACKUP_FLASH64, GBA_BACKUP_FLASH128
+};
+static const char* const backup_names[] = {"none", "SRAM", "EEPROM", "Flash 64K", "Flash 128K"};
+static struct scan_dfa backup_dfa;
+static bool backup_dfa_ready;
+static uint8_t backup_state;
+static int backup_found;
 
 // check if gba_bios.bin is present in the root directory
 // if not, warn user, if present, load it
@@ -31,81 +52,53 @@ void gba_load_bios() {
     return;
   }
 
-  int r = 1;
-  unsigned br;
-  if (f_open(fcore, "usb:gba/gba_bios.bin", FA_READ) != FR_OK) {
-    overlay_message("Cannot open /gba/gba_bios.bin", 1);
+  if (rom_send_file("usb:gba/gba_bios.bin", 4) != FR_OK) {
+    overlay_message("Cannot load /gba/gba_bios.bin", 1);
     return;
   }
-  set_loading_state(4);
-  do {
-    if ((r = f_read(fcore, fbuf, 1024, &br)) != FR_OK)
-      break;
-    send_fbuf_data(br);
-  } while (br == 1024);
-
-  f_close(fcore);
   gba_bios_loaded = 1;
   DEBUG("gba_load_bios end\n");
 }
 
-int loadgba(const char* fname) {
-  DEBUG("loadgba start\n");
-  FRESULT r = -1;
-
-  // check extension .gba
-  char* p = strcasestr(fname, ".gba");
-  if (p == NULL) {
-    overlay_status("Only .gba supported");
-    goto loadgba_end;
-  }
-
-  unsigned int size = get_file_size(fname);
-
-  r = f_open(fcore, fname, FA_READ);
-  if (r) {
-    overlay_status("Cannot open file");
-    goto loadgba_end;
-  }
-  unsigned int off = 0, br, total = 0;
-
-  // load actual ROM
-  set_loading_state(1);		// enable game loading, this resets GBA
-  core_running = false;
-
-  // Send rom content to gba
-  if ((r = f_lseek(fcore, off)) != FR_OK) {
-    overlay_status("Seek failure");
-    goto loadgba_close;
+static int gba_probe(struct rom_load* ld) {
+  if (!backup_dfa_ready) {
+    scan_build(&backup_dfa, backup_ids, sizeof(backup_ids) / sizeof(backup_ids[0]));
+    backup_dfa_ready = true;
   }
-  // int detect = 0; // 1: past 'EEPR', 2: past 'FLAS', 3: past 'SRAM'
-  // gba_backup_type = GBA_BACKUP_NONE;
-  do {
-    if ((r = f_read(fcore, fbuf, 1024, &br)) != FR_OK)
-      break;
-
-    send_fbuf_data(br);
-    // TODO: do backup type detection
-
-    total += br;
-    if ((total & 0xffff) == 0) {	// display progress every 64KB
-      //              01234567890123456789012345678901
-      overlay_status("%d/%dK                          ", total >> 10, size >> 10);
-    }
-  } while (br == 1024);
+  backup_state = 0;
+  backup_found = -1;
+  return 0;
+}
 
-  DEBUG("loadgba: %d bytes rom sent.\n", total);
+static void gba_transform(struct rom_load* ld, BYTE* buf, UINT len, uint32_t pos) {
+  if (backup_found < 0)
+    backup_found = scan_feed(&backup_dfa, &backup_state, buf, len);
+}
 
+// report the save type, and the BIOS goes in after the first ROM
+static int gba_finish(struct rom_load* ld) {
+  gba_backup_type = backup_found < 0 ? GBA_BACKUP_NONE : backup_types[backup_found];
+  DEBUG("gba save type: %s\n", backup_names[gba_backup_type]);
+  set_backup_type(gba_backup_type);
   gba_load_bios();
+  return 0;
+}
 
-  overlay_status("Success");
-  core_running = true;
-
-  overlay(0);		// turn off OSD
+// paged ROM: finish() only saw the first pages, the save library may sit
+// further in. the core takes a new save type while the game runs
+static void gba_streamed(struct rom_load* ld) {
+  int type = backup_found < 0 ? GBA_BACKUP_NONE : backup_types[backup_found];
+  if (type != gba_backup_type) {
+    gba_backup_type = type;
+    DEBUG("gba save type: %s\n", backup_names[gba_backup_type]);
+    set_backup_type(gba_backup_type);
+  }
+}
 
-loadgba_close:
-  set_loading_state(0);   // turn off game loading, this starts the core
-  f_close(fcore);
-loadgba_end:
-  return r;
-}
\ No newline at end of file
+const struct rom_format gba_format = {
+  .exts = {".gba"},
+  .probe = gba_probe,
+  .transform = gba_transform,
+  .finish = gba_finish,
+  .streamed = gba_streamed,
+};
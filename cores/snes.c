@@ -1,29 +1,22 @@
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "ff.h"
+#include "bflb_mtimer.h"
+#include "fastseek.h"
+#include "loader.h"
 
 #include "utils.h"
 
 
-extern uint32_t get_file_size(const char* fname);
-extern void send_fbuf_data(int len);
-extern void set_loading_state(int state);
-extern bool core_running;
-extern FIL* fcore;
-extern BYTE* fbuf;
+extern void send_rom_data(const BYTE* buf, int len);
 
 
-// return 0 if snes header is successfully parsed at off
+// check a 64-byte SNES header candidate with the usual heuristics
 // typ 0: LoROM, 1: HiROM, 2: ExHiROM
-int parse_snes_header(FIL* fp, int pos, int file_size, int typ, unsigned char* hdr,
-  int* map_ctrl, int* rom_type_header, int* rom_size,
-  int* ram_size, int* company) {
-  unsigned int br;
-  if (f_lseek(fp, pos))
-    return 1;
-  f_read(fp, hdr, 64, &br);
-  if (br != 64) return 1;
+// return 0 if the header looks valid. *score is set when non-null.
+int snes_check_header(const unsigned char* hdr, int file_size, int typ, int* score_out) {
   int mc = hdr[21];
   int rom = hdr[23];
   int ram = hdr[24];
@@ -32,8 +25,6 @@ int parse_snes_header(FIL* fp, int pos, int file_size, int typ, unsigned char* h
   int reset = (hdr[61] << 8) + hdr[60];
   int size2 = 1024 << rom;
 
-  overlay_status("size=%d", size2);
-
   // calc heuristics score
   int score = 0;
   if (size2 >= file_size) score++;
@@ -44,9 +35,7 @@ int parse_snes_header(FIL* fp, int pos, int file_size, int typ, unsigned char* h
     if (hdr[i] < 32 || hdr[i] > 127)
       all_ascii = 0;
   score += all_ascii;
-
-  overlay_status("pos=%x, type=%d, map_ctrl=%d, rom=%d, ram=%d, checksum=%x, checksum_comp=%x, reset=%x, score=%d\n",
-    pos, typ, mc, rom, ram, checksum, checksum_compliment, reset, score);
+  if (score_out) *score_out = score;
 
   if (rom < 14 && ram <= 7 && score >= 1 &&
     reset >= 0x8000 &&				// reset vector position correct
@@ -54,97 +43,73 @@ int parse_snes_header(FIL* fp, int pos, int file_size, int typ, unsigned char* h
       (typ == 0 && mc == 0x53) ||	// contra 3 has 0x53 and LoROM
       (typ == 1 && (mc & 3) == 1) ||	// HiROM
       (typ == 2 && (mc & 3) == 2))) {	// ExHiROM
-    *map_ctrl = mc;
-    *rom_type_header = hdr[22];
-    *rom_size = rom;
-    *ram_size = ram;
-    *company = hdr[26];
     return 0;
   }
   return 1;
 }
 
-// TODO: implement bsram backup
-// return 0 if successful
-int loadsnes(const char* fname) {
-  int r = 1;
-  DEBUG("loadsnes start");
-
-  // check extension .sfc or .smc
-  char* p = strcasestr(fname, ".sfc");
-  if (p == NULL)
-    p = strcasestr(fname, ".smc");
-  if (p == NULL) {
-    overlay_status("Only .smc or .sfc supported");
-    goto loadsnes_end;
-  }
+// return 0 if snes header is successfully parsed at off
+// typ 0: LoROM, 1: HiROM, 2: ExHiROM
+int parse_snes_header(FIL* fp, int pos, int file_size, int typ, unsigned char* hdr,
+  int* map_ctrl, int* rom_type_header, int* rom_size,
+  int* ram_size, int* company) {
+  unsigned int br;
+  if (f_lseek(fp, pos))
+    return 1;
+  f_read(fp, hdr, 64, &br);
+  if (br != 64) return 1;
+  int score;
+  int r = snes_check_header(hdr, file_size, typ, &score);
 
-  r = f_open(fcore, fname, FA_READ);
-  if (r) {
-    overlay_status("Cannot open file");
-    goto loadsnes_end;
+  overlay_status("pos=%x, type=%d, map_ctrl=%d, rom=%d, ram=%d, score=%d\n",
+    pos, typ, hdr[21], hdr[23], hdr[24], score);
+
+  if (r == 0) {
+    *map_ctrl = hdr[21];
+    *rom_type_header = hdr[22];
+    *rom_size = hdr[23];
+    *ram_size = hdr[24];
+    *company = hdr[26];
   }
-  unsigned int br, total = 0;
-  int size = get_file_size(fname);
+  return r;
+}
+
+static unsigned char snes_hdr[64];
+
+// find the header at the LoROM, HiROM or ExHiROM position
+static int snes_probe(struct rom_load* ld) {
   int map_ctrl, rom_type_header, rom_size, ram_size, company;
-  // parse SNES header from ROM file
-  int off = size & 0x3ff;		// rom header (0 or 512)
-  int header_pos;
+  int size = ld->size;
+  ld->off = size & 0x3ff;		// rom header (0 or 512)
+  int off = ld->off;
   overlay_status("snes rom header offset: %d\n", off);
 
-  header_pos = 0x7fc0 + off;
-  if (parse_snes_header(fcore, header_pos, size - off, 0, fbuf, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company)) {
-    header_pos = 0xffc0 + off;
-    if (parse_snes_header(fcore, header_pos, size - off, 1, fbuf, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company)) {
-      header_pos = 0x40ffc0 + off;
-      if (parse_snes_header(fcore, header_pos, size - off, 2, fbuf, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company)) {
-        overlay_status("Not a SNES ROM file");
-        delay(200);
-        goto loadsnes_close_file;
-      }
-    }
+  // the probes seek up to 4MB in. without a link map that walks the FAT chain
+  uint64_t probe_time = bflb_mtimer_get_time_us();
+  if (parse_snes_header(ld->fp, 0x7fc0 + off, size - off, 0, snes_hdr, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company) &&
+      parse_snes_header(ld->fp, 0xffc0 + off, size - off, 1, snes_hdr, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company) &&
+      parse_snes_header(ld->fp, 0x40ffc0 + off, size - off, 2, snes_hdr, &map_ctrl, &rom_type_header, &rom_size, &ram_size, &company)) {
+    overlay_status("Not a SNES ROM file");
+    delay(200);
+    return 1;
   }
+  probe_time = bflb_mtimer_get_time_us() - probe_time;
+  DEBUG("header probe: %d us, fragments: %d\n", (int)probe_time, fastseek_fragments(ld->fp));
 
-  // load actual ROM
-  set_loading_state(1);		// enable game loading, this resets SNES
-  core_running = false;
-
-  // Send 64-byte header to snes
-  send_fbuf_data(64);
+  static const char* const maps[] = {"Lo", "Hi", "ExHi", "?"};
+  snprintf(ld->detail, sizeof(ld->detail), "%s ROM=%d RAM=%d", maps[map_ctrl & 3],
+    1 << rom_size, ram_size ? (1 << ram_size) : 0);
+  return 0;
+}
 
-  // Send rom content to snes
-  if ((r = f_lseek(fcore, off)) != FR_OK) {
-    overlay_status("Seek failure");
-    goto loadsnes_snes_end;
-  }
-  do {
-    if ((r = f_read(fcore, fbuf, BLOCK_SIZE, &br)) != FR_OK)
-      break;
-    if (br == 0) break;
-    send_fbuf_data(br);
-    total += br;
-    if ((total & 0xffff) == 0) {	// display progress every 64KB
-      overlay_status("%d/%dK", total >> 10, size >> 10);
-      if ((map_ctrl & 3) == 0)
-        overlay_printf(" Lo");
-      else if ((map_ctrl & 3) == 1)
-        overlay_printf(" Hi");
-      else if ((map_ctrl & 3) == 2)
-        overlay_printf(" ExHi");
-      //              01234567890123456789012345678901
-      overlay_printf(" ROM=%d RAM=%d                 ", 1 << rom_size, ram_size ? (1 << ram_size) : 0);
-    }
-  } while (br == BLOCK_SIZE);
-
-  overlay_status("Success");
-  core_running = true;
-
-  overlay(0);		// turn off OSD
-
-loadsnes_snes_end:
-  set_loading_state(0);	// turn off game loading, this starts SNES
-loadsnes_close_file:
-  f_close(fcore);
-loadsnes_end:
-  return r;
+// the core takes the 64-byte header before the ROM
+static int snes_begin(struct rom_load* ld) {
+  send_rom_data(snes_hdr, 64);
+  return 0;
 }
+
+const struct rom_format snes_format = {
+  .exts = {".sfc", ".smc"},
+  .probe = snes_probe,
+  .begin = snes_begin,
+};
@@ -0,0 +1,697 @@
+// Directory index for the file browser
+//
+// Entries and names live in two heap blocks that grow by doubling, up to
+// DIR_INDEX_MAX_ENTRIES and DIR_INDEX_ARENA_MAX. They are kept between
+// scans, so browsing back and forth does not fragment the heap.
+//
+// Listings are sorted in natural order (case-insensitive, digit runs compared
+// as numbers), directories first. A directory that fits in RAM is sorted
+// there. A larger one is sorted externally in a fixed DIR_SORT_MEM bytes of
+// the arena, whatever its size: the scan is cut into runs of at most
+// DIR_SORT_RUN_SIZE bytes of names, every run is sorted and spilled to a
+// temporary file, and passes merge DIR_SORT_FANIN runs at a time, each read
+// through a DIR_SORT_SLICE byte slice, between two temporary files. The last
+// pass writes a sorted cache file under the hidden DIR_CACHE_DIR. Runs are
+// their length len[31:0] followed by records, which in both files are
+//
+//   is_dir[7:0] size[31:0] name... 0
+//
+// The cache file starts with the listing's entry count and a hash of all
+// names and sizes. With FF_FS_NORTC directories carry no usable timestamps,
+// so this signature, taken from a plain readdir pass, is what tells whether
+// the directory changed. A table of the file offsets of every block of
+// DIR_BLOCK records follows. It stays on the drive: a page is read by
+// looking up its block there and then reading the block.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "ff.h"
+#include "usbh_core.h"
+
+#include "dir_index.h"
+#include "utils.h"
+
+extern FATFS fs;
+extern BYTE fbuf[BLOCK_SIZE];       // DMA-safe scratch, split into write and read bounce buffers
+
+#define WBUF        fbuf
+#define WBUF_SIZE   (BLOCK_SIZE/2)
+#define RBUF        (fbuf + BLOCK_SIZE/2)
+#define RBUF_SIZE   (BLOCK_SIZE/2)
+
+#define DIR_CACHE_DIR       TANGCORE_DIR
+#define DIR_SORT_TMP        DIR_CACHE_DIR "/sort.tmp"
+#define DIR_SORT_TMP2       DIR_CACHE_DIR "/sort2.tmp"
+#define DIR_SORT_RUN_SIZE   (8*1024)        // names per run
+#define DIR_SORT_RUN_ENTRIES 512
+#define DIR_SORT_FANIN      16              // runs per merge
+#define DIR_SORT_SLICE      512             // read buffer of each run, at least REC_MAX
+#define DIR_SORT_MEM        max(DIR_SORT_RUN_SIZE, DIR_SORT_FANIN * DIR_SORT_SLICE)
+#define DIR_TABLE_CHUNK     64              // block offsets collected before they are written
+#define DIR_BLOCK           32              // entries per block in a cache file
+#define DIR_CACHE_MAGIC     0x59444354      // "TCDY"
+#define REC_MAX             (5 + 256)       // longest record
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t count;                 // entries, including entry 0
+    uint32_t sig;                   // hash of the directory contents
+    uint32_t table_off;             // file offset of the block offset table
+                                    // (count + DIR_BLOCK - 1) / DIR_BLOCK + 1 entries
+    uint32_t truncated;
+};
+
+static USB_NOCACHE_RAM_SECTION FIL tmp_f;
+static USB_NOCACHE_RAM_SECTION FIL tmp2_f;
+static USB_NOCACHE_RAM_SECTION FIL cache_f;
+
+static struct dir_entry *entries;
+static int entry_cap, entry_cnt;
+static char *arena;
+static uint32_t arena_cap, arena_len;
+static bool truncated;
+
+// large directories are served from a cache file
+static bool file_mode;
+static int file_cnt;
+static char cache_name[32];
+static uint32_t table_off;          // of the block offset table in the cache file
+static int loaded_block = -1;
+static const struct dir_entry missing_entry;    // returned if a block cannot be read
+
+// what the current index was built from
+static char index_path[1024];
+static bool (*index_filter)(char *);
+static WORD index_fs_id;
+static bool index_valid;
+
+/////////////////////////////////////////////////////////////////////////////////
+// Ordering
+
+// natural order: case-insensitive, "Game 9" before "Game 10"
+static int natural_cmp(const char *a, const char *b) {
+    const char *a0 = a, *b0 = b;
+    while (*a && *b) {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            const char *as = a, *bs = b;
+            while (isdigit((unsigned char)*a)) a++;
+            while (isdigit((unsigned char)*b)) b++;
+            if (a - as != b - bs)
+                return (a - as) - (b - bs);
+            int c = memcmp(as, bs, a - as);
+            if (c) return c;
+            continue;
+        }
+        int ca = tolower((unsigned char)*a), cb = tolower((unsigned char)*b);
+        if (ca != cb) return ca - cb;
+        a++; b++;
+    }
+    if (*a || *b)
+        return (unsigned char)*a - (unsigned char)*b;
+    return strcmp(a0, b0);          // equal apart from case or leading zeros
+}
+
+static int entry_cmp(const char *a, bool a_dir, const char *b, bool b_dir) {
+    if (a_dir != b_dir)
+        return a_dir ? -1 : 1;
+    return natural_cmp(a, b);
+}
+
+static int qsort_cmp(const void *pa, const void *pb) {
+    const struct dir_entry *a = pa, *b = pb;
+    return entry_cmp(arena + a->name_off, a->is_dir, arena + b->name_off, b->is_dir);
+}
+
+static uint32_t hash(uint32_t h, const void *data, int len) {
+    const uint8_t *p = data;
+    for (int i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619;  // FNV-1a
+    return h;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// RAM index
+
+// append an entry, growing storage as needed. return false when full
+static bool add_entry(const char *name, bool is_dir, uint32_t size) {
+    uint32_t len = strlen(name) + 1;
+    if (entry_cnt == entry_cap) {
+        int cap = entry_cap ? entry_cap * 2 : 256;
+        if (cap > DIR_INDEX_MAX_ENTRIES) cap = DIR_INDEX_MAX_ENTRIES;
+        if (cap == entry_cap) return false;
+        struct dir_entry *p = realloc(entries, cap * sizeof(struct dir_entry));
+        if (!p) return false;
+        entries = p;
+        entry_cap = cap;
+    }
+    if (arena_len + len > arena_cap) {
+        uint32_t cap = arena_cap ? arena_cap : 4096;
+        while (cap < arena_len + len) cap *= 2;
+        if (cap > DIR_INDEX_ARENA_MAX) cap = DIR_INDEX_ARENA_MAX;
+        if (cap < arena_len + len) return false;
+        char *p = realloc(arena, cap);
+        if (!p) return false;
+        arena = p;
+        arena_cap = cap;
+    }
+    struct dir_entry *e = &entries[entry_cnt++];
+    e->name_off = arena_len;
+    e->is_dir = is_dir;
+    e->size = size;
+    memcpy(arena + arena_len, name, len);
+    arena_len += len;
+    return true;
+}
+
+// make sure the arena can hold `len` bytes
+static bool reserve_arena(uint32_t len) {
+    if (arena_cap >= len) return true;
+    char *p = realloc(arena, len);
+    if (!p) return false;
+    arena = p;
+    arena_cap = len;
+    return true;
+}
+
+static bool visible(FILINFO *fno, bool (*filter)(char *)) {
+    if ((fno->fattrib & AM_HID) || (fno->fattrib & AM_SYS))
+        // skip hidden and system files
+        return false;
+    return !filter || filter(fno->fname);
+}
+
+// read the directory into RAM as far as it fits, and hash all of it
+// return true if everything fit
+static bool scan(DIR *d, bool (*filter)(char *), uint32_t *sig, int *count) {
+    FILINFO fno;
+    bool fit = true;
+    *sig = 2166136261u;
+    *count = 0;
+    while (f_readdir(d, &fno) == FR_OK && fno.fname[0]) {
+        if (!visible(&fno, filter))
+            continue;
+        uint8_t is_dir = (fno.fattrib & AM_DIR) != 0;
+        uint32_t size = fno.fsize;
+        *sig = hash(*sig, fno.fname, strlen(fno.fname) + 1);
+        *sig = hash(*sig, &is_dir, 1);
+        *sig = hash(*sig, &size, 4);
+        (*count)++;
+        if (fit && !add_entry(fno.fname, is_dir, size))
+            fit = false;
+    }
+    return fit;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// File I/O through the DMA-safe bounce buffers
+
+static UINT wbuf_len;
+
+static FRESULT wbuf_flush(FIL *f) {
+    UINT bw;
+    FRESULT r = wbuf_len ? f_write(f, WBUF, wbuf_len, &bw) : FR_OK;
+    if (r == FR_OK && wbuf_len && bw != wbuf_len)
+        r = FR_DENIED;          // disk full
+    wbuf_len = 0;
+    return r;
+}
+
+static FRESULT wbuf_put(FIL *f, const void *data, UINT len) {
+    while (len > 0) {
+        if (wbuf_len == WBUF_SIZE) {
+            FRESULT r = wbuf_flush(f);
+            if (r != FR_OK) return r;
+        }
+        UINT n = min(len, WBUF_SIZE - wbuf_len);
+        memcpy(WBUF + wbuf_len, data, n);
+        wbuf_len += n;
+        data = (const char *)data + n;
+        len -= n;
+    }
+    return FR_OK;
+}
+
+static FRESULT put_record(FIL *f, const char *name, bool is_dir, uint32_t size) {
+    uint8_t hdr[5] = { is_dir, size, size >> 8, size >> 16, size >> 24 };
+    FRESULT r = wbuf_put(f, hdr, 5);
+    if (r != FR_OK) return r;
+    return wbuf_put(f, name, strlen(name) + 1);
+}
+
+// parse a record at p (at most `avail` bytes), return its length or 0 if incomplete
+static int parse_record(const char *p, uint32_t avail, const char **name, bool *is_dir, uint32_t *size) {
+    if (avail < 6) return 0;
+    const char *end = memchr(p + 5, 0, avail - 5);
+    if (!end) return 0;
+    const uint8_t *u = (const uint8_t *)p;
+    *is_dir = u[0];
+    *size = u[1] | (u[2] << 8) | (u[3] << 16) | ((uint32_t)u[4] << 24);
+    *name = p + 5;
+    return end + 1 - p;
+}
+
+static FRESULT read_at(FIL *f, uint32_t off, void *dst, UINT len) {
+    FRESULT r = f_lseek(f, off);
+    while (r == FR_OK && len > 0) {
+        UINT n = min(len, (UINT)RBUF_SIZE), br;
+        r = f_read(f, RBUF, n, &br);
+        if (r == FR_OK && br != n) r = FR_INT_ERR;
+        if (r != FR_OK) break;
+        memcpy(dst, RBUF, n);
+        dst = (char *)dst + n;
+        len -= n;
+    }
+    return r;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// External sort
+
+struct run {
+    FIL *f;
+    uint32_t pos, end;              // unread part of the run
+    char *buf;                      // DIR_SORT_SLICE bytes of the arena
+    uint32_t len, rd;               // bytes in buf, parse position
+    const char *name;               // head record
+    bool is_dir;
+    uint32_t size;
+};
+
+static uint32_t table_chunk[DIR_TABLE_CHUNK];   // block offsets not written yet
+static int table_first, table_len;  // block of table_chunk[0], entries in it
+
+// write the RAM index, sorted, as one run: its length, then its records
+static FRESULT spill_run(FIL *f) {
+    uint32_t len = 0;
+    qsort(entries, entry_cnt, sizeof(struct dir_entry), qsort_cmp);
+    for (int i = 0; i < entry_cnt; i++)
+        len += 5 + strlen(arena + entries[i].name_off) + 1;
+    FRESULT r = wbuf_put(f, &len, sizeof(len));
+    for (int i = 0; r == FR_OK && i < entry_cnt; i++)
+        r = put_record(f, arena + entries[i].name_off, entries[i].is_dir, entries[i].size);
+    entry_cnt = 0;
+    arena_len = 0;
+    return r;
+}
+
+// load the next record of a run into its head. return false at end of run
+static bool run_next(struct run *r, FRESULT *res) {
+    int n = parse_record(r->buf + r->rd, r->len - r->rd, &r->name, &r->is_dir, &r->size);
+    if (n == 0 && r->pos < r->end) {
+        // refill: keep the partial record, read as much as fits
+        memmove(r->buf, r->buf + r->rd, r->len - r->rd);
+        r->len -= r->rd;
+        r->rd = 0;
+        UINT len = min(DIR_SORT_SLICE - r->len, r->end - r->pos);
+        *res = read_at(r->f, r->pos, r->buf + r->len, len);
+        if (*res != FR_OK) return false;
+        r->pos += len;
+        r->len += len;
+        n = parse_record(r->buf, r->len, &r->name, &r->is_dir, &r->size);
+    }
+    if (n == 0) return false;
+    r->rd += n;
+    return true;
+}
+
+static bool run_less(struct run *a, struct run *b) {
+    return entry_cmp(a->name, a->is_dir, b->name, b->is_dir) < 0;
+}
+
+static void heap_down(struct run **h, int n, int i) {
+    for (;;) {
+        int m = i, l = 2*i+1, r = 2*i+2;
+        if (l < n && run_less(h[l], h[m])) m = l;
+        if (r < n && run_less(h[r], h[m])) m = r;
+        if (m == i) return;
+        struct run *t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+// start merging the next DIR_SORT_FANIN runs of `src` from *pos: fill the
+// heap with their first records. *len: total length of the runs.
+// return the number of runs in the heap
+static int merge_open(FIL *src, uint32_t *pos, struct run *runs, struct run **heap,
+                      uint32_t *len, FRESULT *r) {
+    int n = 0;
+    *len = 0;
+    for (int i = 0; i < DIR_SORT_FANIN && *pos < f_size(src); i++) {
+        uint32_t run_len;
+        if ((*r = read_at(src, *pos, &run_len, sizeof(run_len))) != FR_OK)
+            return 0;
+        runs[i] = (struct run){ .f = src, .pos = *pos + sizeof(run_len), .buf = arena + i * DIR_SORT_SLICE };
+        runs[i].end = runs[i].pos + run_len;
+        *pos = runs[i].end;
+        *len += run_len;
+        if (run_next(&runs[i], r))
+            heap[n++] = &runs[i];
+        if (*r != FR_OK)
+            return 0;
+    }
+    for (int i = n/2 - 1; i >= 0; i--)
+        heap_down(heap, n, i);
+    return n;
+}
+
+// take the head record of the heap top out, return the new heap size
+static int merge_pop(struct run **heap, int n, FRESULT *r) {
+    if (!run_next(heap[0], r))
+        heap[0] = heap[--n];
+    heap_down(heap, n, 0);
+    return n;
+}
+
+// merge the runs of `src` in groups of DIR_SORT_FANIN into the runs of `dst`
+static FRESULT merge_pass(FIL *src, FIL *dst, int *nruns) {
+    struct run runs[DIR_SORT_FANIN], *heap[DIR_SORT_FANIN];
+    uint32_t pos = 0, len;
+    FRESULT r = f_lseek(dst, 0);
+    if (r == FR_OK) r = f_truncate(dst);
+    *nruns = 0;
+    while (r == FR_OK && pos < f_size(src)) {
+        int n = merge_open(src, &pos, runs, heap, &len, &r);
+        if (r == FR_OK) r = wbuf_put(dst, &len, sizeof(len));
+        while (r == FR_OK && n > 0) {
+            r = put_record(dst, heap[0]->name, heap[0]->is_dir, heap[0]->size);
+            n = merge_pop(heap, n, &r);
+        }
+        (*nruns)++;
+    }
+    if (r == FR_OK) r = wbuf_flush(dst);
+    return r;
+}
+
+// write the collected block offsets to their place in the table
+static FRESULT table_flush(void) {
+    FRESULT r = wbuf_flush(&cache_f);
+    uint32_t end = f_tell(&cache_f);
+    if (r == FR_OK) r = f_lseek(&cache_f, sizeof(struct cache_header) + table_first * sizeof(uint32_t));
+    if (r == FR_OK) r = wbuf_put(&cache_f, table_chunk, table_len * sizeof(uint32_t));
+    if (r == FR_OK) r = wbuf_flush(&cache_f);
+    if (r == FR_OK) r = f_lseek(&cache_f, end);
+    table_first += table_len;
+    table_len = 0;
+    return r;
+}
+
+static FRESULT table_add(uint32_t off) {
+    table_chunk[table_len++] = off;
+    return table_len == DIR_TABLE_CHUNK ? table_flush() : FR_OK;
+}
+
+// build the cache file for a directory too large to sort in RAM
+static FRESULT build_cache(const char *dir, bool (*filter)(char *), const char *entry0,
+                           uint32_t sig, int count) {
+    struct run runs[DIR_SORT_FANIN], *heap[DIR_SORT_FANIN];
+    int nruns = 0, written = 0;
+    uint32_t pos = 0, len;
+    FIL *src = &tmp_f, *dst = &tmp2_f;
+    DIR d;
+    FILINFO fno;
+    FRESULT r;
+
+    if (!reserve_arena(DIR_SORT_MEM))
+        return FR_NOT_ENOUGH_CORE;
+    f_mkdir(DIR_CACHE_DIR);
+    f_chmod(DIR_CACHE_DIR, AM_HID, AM_HID);
+    if ((r = f_open(&tmp_f, DIR_SORT_TMP, FA_CREATE_ALWAYS | FA_WRITE | FA_READ)) != FR_OK)
+        return r;
+    if ((r = f_open(&tmp2_f, DIR_SORT_TMP2, FA_CREATE_ALWAYS | FA_WRITE | FA_READ)) != FR_OK)
+        goto build_cache_close_tmp;
+    wbuf_len = 0;
+
+    // phase 1: sorted runs of DIR_SORT_RUN_SIZE bytes of names
+    entry_cnt = 0;
+    arena_len = 0;
+    if ((r = f_opendir(&d, dir)) != FR_OK)
+        goto build_cache_close_tmp;
+    while ((r = f_readdir(&d, &fno)) == FR_OK && fno.fname[0]) {
+        if (!visible(&fno, filter))
+            continue;
+        if (entry_cnt == DIR_SORT_RUN_ENTRIES || arena_len + strlen(fno.fname) + 1 > DIR_SORT_RUN_SIZE) {
+            if ((r = spill_run(&tmp_f)) != FR_OK)
+                break;
+            nruns++;
+        }
+        if (!add_entry(fno.fname, fno.fattrib & AM_DIR, fno.fsize)) {
+            r = FR_NOT_ENOUGH_CORE;
+            break;
+        }
+    }
+    f_closedir(&d);
+    if (r == FR_OK && entry_cnt > 0) {
+        r = spill_run(&tmp_f);
+        nruns++;
+    }
+    if (r == FR_OK)
+        r = wbuf_flush(&tmp_f);
+
+    // phase 2: merge DIR_SORT_FANIN runs at a time until one pass is left
+    while (r == FR_OK && nruns > DIR_SORT_FANIN) {
+        FIL *t = src;
+        r = merge_pass(src, dst, &nruns);
+        src = dst;
+        dst = t;
+    }
+    if (r != FR_OK)
+        goto build_cache_close_tmp;
+
+    // last pass into the cache file: header, block offset table, records
+    if ((r = f_open(&cache_f, cache_name, FA_CREATE_ALWAYS | FA_WRITE)) != FR_OK)
+        goto build_cache_close_tmp;
+    struct cache_header hdr = {0};
+    uint32_t zero = 0;
+    int nblocks = (count + 1 + DIR_BLOCK - 1) / DIR_BLOCK;
+    r = wbuf_put(&cache_f, &hdr, sizeof(hdr));
+    for (int i = 0; r == FR_OK && i <= nblocks; i++)
+        r = wbuf_put(&cache_f, &zero, sizeof(zero));
+    table_first = table_len = 0;
+
+    int n = r == FR_OK ? merge_open(src, &pos, runs, heap, &len, &r) : 0;
+    if (r == FR_OK) r = table_add(f_tell(&cache_f) + wbuf_len);
+    if (r == FR_OK) r = put_record(&cache_f, entry0, entry0[0] == '.', 0);
+    written = 1;
+    while (r == FR_OK && n > 0 && written <= count) {
+        if (written % DIR_BLOCK == 0 && (r = table_add(f_tell(&cache_f) + wbuf_len)) != FR_OK)
+            break;
+        if ((r = put_record(&cache_f, heap[0]->name, heap[0]->is_dir, heap[0]->size)) != FR_OK)
+            break;
+        written++;
+        n = merge_pop(heap, n, &r);
+    }
+    // the end of the last block, then the header that makes the file valid
+    if (r == FR_OK) r = table_add(f_tell(&cache_f) + wbuf_len);
+    if (r == FR_OK) r = table_flush();
+    hdr = (struct cache_header){ DIR_CACHE_MAGIC, written, sig, sizeof(hdr), n > 0 };
+    if (r == FR_OK) r = f_lseek(&cache_f, 0);
+    if (r == FR_OK) r = wbuf_put(&cache_f, &hdr, sizeof(hdr));
+    if (r == FR_OK) r = wbuf_flush(&cache_f);
+    file_cnt = written;
+    table_off = hdr.table_off;
+    truncated = hdr.truncated;
+
+    f_close(&cache_f);
+    if (r != FR_OK) f_unlink(cache_name);
+build_cache_close_tmp:
+    f_close(&tmp2_f);
+    f_close(&tmp_f);
+    f_unlink(DIR_SORT_TMP2);
+    f_unlink(DIR_SORT_TMP);
+    return r;
+}
+
+// open the cache file if it matches the directory. return true on success
+static bool load_cache(uint32_t sig, int count) {
+    struct cache_header hdr;
+    bool ok = false;
+    if (f_open(&cache_f, cache_name, FA_READ) != FR_OK)
+        return false;
+    if (read_at(&cache_f, 0, &hdr, sizeof(hdr)) != FR_OK || hdr.magic != DIR_CACHE_MAGIC ||
+        hdr.sig != sig || (!hdr.truncated && hdr.count != count + 1))
+        goto load_cache_close;
+    file_cnt = hdr.count;
+    table_off = hdr.table_off;
+    truncated = hdr.truncated;
+    ok = true;
+load_cache_close:
+    f_close(&cache_f);
+    return ok;
+}
+
+// bring block b of the cache file into the RAM index
+static bool load_block(int b) {
+    uint32_t off[2];
+    if (b == loaded_block)
+        return true;
+    loaded_block = -1;
+    entry_cnt = 0;
+    if (f_open(&cache_f, cache_name, FA_READ) != FR_OK)
+        return false;
+    FRESULT r = read_at(&cache_f, table_off + b * sizeof(uint32_t), off, sizeof(off));
+    uint32_t len = off[1] - off[0];
+    if (r == FR_OK && (off[1] < off[0] || len > DIR_BLOCK * REC_MAX || !reserve_arena(len)))
+        r = FR_INT_ERR;
+    if (r == FR_OK)
+        r = read_at(&cache_f, off[0], arena, len);
+    f_close(&cache_f);
+    if (r != FR_OK)
+        return false;
+    for (uint32_t p = 0; p < len; ) {
+        const char *name;
+        bool is_dir;
+        uint32_t size;
+        int n = parse_record(arena + p, len - p, &name, &is_dir, &size);
+        if (n == 0 || entry_cnt == entry_cap) break;
+        entries[entry_cnt++] = (struct dir_entry){ name - arena, is_dir, size };
+        p += n;
+    }
+    loaded_block = b;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+void dir_index_invalidate(void) {
+    index_valid = false;
+}
+
+int dir_index_load(const char *dir, bool (*filter)(char *)) {
+    if (index_valid && index_fs_id == fs.id && index_filter == filter &&
+        strcmp(index_path, dir) == 0)
+        return 0;
+
+    index_valid = false;
+    file_mode = false;
+    loaded_block = -1;
+    entry_cnt = 0;
+    arena_len = 0;
+    truncated = false;
+
+    DIR d;
+    FRESULT r = f_opendir(&d, dir);
+    if (r != FR_OK)
+        return r;
+
+    // an entry to return to parent dir or main menu
+    const char *entry0 = dir[1] == '\0' ? "<< Return to main menu" : "..";
+    add_entry(entry0, entry0[0] == '.', 0);
+
+    uint32_t sig;
+    int count;
+    bool fit = scan(&d, filter, &sig, &count);
+    f_closedir(&d);
+
+    if (fit) {
+        qsort(entries + 1, entry_cnt - 1, sizeof(struct dir_entry), qsort_cmp);
+    } else {
+        snprintf(cache_name, sizeof(cache_name), DIR_CACHE_DIR "/%08lx.idx",
+                 (unsigned long)hash(2166136261u, dir, strlen(dir)));
+        if (!load_cache(sig, count)) {
+            overlay_status("Sorting %d files...", count);
+            r = build_cache(dir, filter, entry0, sig, count);
+        }
+        if (r == FR_OK && load_block(0)) {
+            file_mode = true;
+        } else {
+            // cannot write the drive: show the part that fits, sorted
+            overlay_status("Sort failed: %d", r);
+            entry_cnt = 0;
+            arena_len = 0;
+            add_entry(entry0, entry0[0] == '.', 0);
+            if (f_opendir(&d, dir) == FR_OK) {
+                scan(&d, filter, &sig, &count);
+                f_closedir(&d);
+            }
+            qsort(entries + 1, entry_cnt - 1, sizeof(struct dir_entry), qsort_cmp);
+            truncated = true;
+        }
+    }
+
+    strncpy(index_path, dir, sizeof(index_path)-1);
+    index_path[sizeof(index_path)-1] = '\0';
+    index_filter = filter;
+    index_fs_id = fs.id;
+    index_valid = true;
+    return 0;
+}
+
+int dir_index_count(void) {
+    return file_mode ? file_cnt : entry_cnt;
+}
+
+bool dir_index_truncated(void) {
+    return truncated;
+}
+
+const struct dir_entry *dir_index_entry(int i) {
+    if (!file_mode)
+        return &entries[i];
+    if (!load_block(i / DIR_BLOCK) || i % DIR_BLOCK >= entry_cnt)
+        return &missing_entry;
+    return &entries[i % DIR_BLOCK];
+}
+
+const char *dir_index_name(int i) {
+    const struct dir_entry *e = dir_index_entry(i);
+    return e == &missing_entry ? "" : arena + e->name_off;
+}
+
+// first index in [lo, hi) whose name is not before `key` in natural order
+static int lower_bound(int lo, int hi, const char *key) {
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (natural_cmp(dir_index_name(mid), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// first index in [lo, hi) whose name starts with `pre`, -1 if none
+static int find_in(int lo, int hi, const char *pre, const char *base, int base_len) {
+    int i = lower_bound(lo, hi, base);
+    if (base_len == (int)strlen(pre))
+        return i < hi && prefix(pre, dir_index_name(i)) ? i : -1;
+    // prefix ends in digits: "G1" sorts "G10" after "G9", so walk the
+    // names that start with the non-digit part
+    for (; i < hi && prefix(base, dir_index_name(i)); i++)
+        if (prefix(pre, dir_index_name(i)))
+            return i;
+    return -1;
+}
+
+int dir_index_find(const char *pre) {
+    int n = dir_index_count();
+    if (!*pre || n <= 1)
+        return -1;
+
+    // directories come first, find where the files start
+    int lo = 1, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (dir_index_entry(mid)->is_dir)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int first_file = lo;
+
+    char base[64];
+    int base_len = min((int)strlen(pre), (int)sizeof(base) - 1);
+    while (base_len && isdigit((unsigned char)pre[base_len-1]))
+        base_len--;
+    memcpy(base, pre, base_len);
+    base[base_len] = '\0';
+
+    int i = find_in(1, first_file, pre, base, base_len);
+    if (i < 0)
+        i = find_in(first_file, n, pre, base, base_len);
+    return i;
+}
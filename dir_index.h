@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// In-RAM index of one directory for the file browser
+//
+// The directory is read once into compact entries that point into a string
+// arena. Pages are then served from the index without touching the drive
+// until the path, the filter or the mounted volume changes.
+//
+// Entry 0 is always the synthetic "<< Return to main menu" (root) or ".."
+// entry, followed by the visible files in directory order.
+
+#define DIR_INDEX_MAX_ENTRIES   8192
+#define DIR_INDEX_ARENA_MAX     (128*1024)
+
+struct dir_entry {
+    uint32_t name_off : 31;         // offset of name in the string arena
+    uint32_t is_dir   : 1;
+    uint32_t size;
+};
+
+// make sure the index reflects `dir` (rescanning only if needed)
+// `filter` when non-null takes a file name and returns true if the file is
+// to be included in the list.
+// return: 0 if successful, FRESULT of f_opendir otherwise
+int dir_index_load(const char *dir, bool (*filter)(char *));
+
+// forget the current index, next dir_index_load() rescans
+void dir_index_invalidate(void);
+
+// number of entries, including entry 0
+int dir_index_count(void);
+
+// true if the directory did not fit and only the first entries are indexed
+bool dir_index_truncated(void);
+
+const struct dir_entry *dir_index_entry(int i);
+const char *dir_index_name(int i);
+
+// index of the first entry whose name starts with `prefix` (case-insensitive),
+// -1 if there is none. directories are searched before files. a binary search
+// over the sorted listing, so in file mode only O(log n) blocks are read
+int dir_index_find(const char *prefix);
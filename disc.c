@@ -0,0 +1,606 @@
+// Disc images for CD-based cores, see disc.h
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_uart.h"
+
+#include "fastseek.h"
+#include "stream.h"
+#include "disc.h"
+#include "utils.h"
+
+// like the MSU-1 task: above main_task, so a reply does not wait behind
+// menu drawing
+#define DISC_TASK_STACK_SIZE    512
+#define DISC_TASK_PRIORITY      4
+#define DISC_AHEAD_RETRY_MS     5       // read-ahead retry while the file system is busy
+
+#define NO_INDEX                0xffffffff
+
+#if DISC_BUF > STREAM_SERVICE_BUF
+#error "DISC_BUF does not fit service_buf"
+#endif
+
+extern struct bflb_device_s *uart1_dev;
+
+struct disc_req {
+    uint32_t lba;
+    uint8_t op;
+};
+
+struct disc_track {
+    uint8_t number;
+    uint8_t mode;                       // 0: audio, 1: Mode 1, 2: Mode 2
+    uint8_t file;                       // index into name_off
+    uint16_t sector;                    // bytes per sector in the file: 2048, 2336 or 2352
+    // while the CUE sheet is parsed, start is INDEX 01 and gap_in_file
+    // INDEX 00 in sectors of the file, pregap is PREGAP. layout() turns
+    // them into the fields below
+    int32_t start;                      // LBA of INDEX 01
+    uint32_t pregap;                    // sectors before start that belong to the track
+    uint32_t gap_in_file;               // of those, sectors that are in the file (INDEX 00)
+    uint32_t length;                    // sectors from start on
+    uint32_t file_off;                  // byte offset of INDEX 01 in the file
+};
+
+// the mounted disc and the window. guarded by disc_mutex, which is taken
+// after the file system lock. file access needs both
+static SemaphoreHandle_t disc_mutex;
+static StaticSemaphore_t disc_mutex_buf;
+static bool mounted;
+static struct disc_track tracks[DISC_MAX_TRACKS];
+static int track_count;
+static int32_t leadout;
+static char names[DISC_NAMES];          // full paths of the track files
+static uint16_t name_off[DISC_MAX_TRACKS];
+static int file_count;
+static int last_track;                  // where find_track() starts looking
+
+// read-ahead window over the open track file
+static USB_NOCACHE_RAM_SECTION FIL disc_f;
+static BYTE *const win = service_buf;   // shared with MSU-1, see stream.h
+static int open_file = -1;
+static uint32_t win_base;               // file offset of win[0], sector aligned
+static uint32_t win_len;
+static uint32_t win_last;               // end of the last sector served
+
+static QueueHandle_t req_q;
+static struct disc_req rx_req;          // filled in by disc_rx()
+
+static StackType_t disc_stack[DISC_TASK_STACK_SIZE];
+static StaticTask_t disc_tcb;
+
+bool disc_rx(int idx, uint8_t ch) {
+    if (idx == 0)
+        rx_req.op = ch;
+    else                                // LBA, LSB first
+        rx_req.lba = idx == 1 ? ch : (rx_req.lba | (uint32_t)ch << (idx - 1) * 8);
+    if (idx < 4)
+        return false;
+    xQueueSend(req_q, &rx_req, 0);      // dropped when full, the core asks again
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// CUE sheet
+
+static bool has_ext(const char *name, const char *ext) {
+    int n = strlen(name), e = strlen(ext);
+    return n > e && strcasecmp(name + n - e, ext) == 0;
+}
+
+bool disc_is_image(const char *fname) {
+    return has_ext(fname, ".cue") || has_ext(fname, ".iso");
+}
+
+// the next word of a line, or a "quoted string". returns its length
+static int next_word(char **p, char **word) {
+    char *s = *p;
+    int n;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == '"') {
+        *word = ++s;
+        while (*s && *s != '"')
+            s++;
+        n = s - *word;
+        if (*s)
+            s++;
+    } else {
+        *word = s;
+        while (*s && *s != ' ' && *s != '\t')
+            s++;
+        n = s - *word;
+    }
+    *p = s;
+    return n;
+}
+
+static bool word_is(const char *word, int n, const char *keyword) {
+    return n == (int)strlen(keyword) && strncasecmp(word, keyword, n) == 0;
+}
+
+// mm:ss:ff to sectors, -1 if malformed
+static int32_t parse_msf(const char *s, int n) {
+    int m, sec, f;
+    char buf[12];
+    if (n >= (int)sizeof(buf))
+        return -1;
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    if (sscanf(buf, "%d:%d:%d", &m, &sec, &f) != 3 || sec >= 60 || f >= 75)
+        return -1;
+    return (m * 60 + sec) * 75 + f;
+}
+
+// add "<dir of cue>/<name>" to the name pool
+static int add_file(const char *cue, const char *name, int n) {
+    const char *slash = strrchr(cue, '/');
+    int dir = slash ? slash - cue + 1 : 0;
+    int at = file_count ? name_off[file_count - 1] + strlen(names + name_off[file_count - 1]) + 1 : 0;
+    if (file_count == DISC_MAX_TRACKS || at + dir + n + 1 > DISC_NAMES)
+        return -1;
+    memcpy(names + at, cue, dir);
+    memcpy(names + at + dir, name, n);
+    names[at + dir + n] = '\0';
+    name_off[file_count++] = at;
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    uint8_t mode;
+    uint16_t sector;
+} track_types[] = {
+    {"AUDIO", 0, 2352},
+    {"MODE1/2048", 1, 2048},
+    {"MODE1/2352", 1, 2352},
+    {"MODE2/2336", 2, 2336},
+    {"MODE2/2352", 2, 2352},
+};
+
+// parse the CUE sheet held in win. return the number of the bad line, 0 if fine
+static int parse_cue(const char *cue, char *text) {
+    int line_no = 0;
+    struct disc_track *t = NULL;
+    for (char *line = text, *next; line; line = next) {
+        char *word, *arg;
+        int n, m;
+        line_no++;
+        next = strpbrk(line, "\r\n");
+        if (next) {
+            if (next[0] == '\r' && next[1] == '\n')
+                *next++ = '\0';
+            *next++ = '\0';
+            if (!*next)
+                next = NULL;
+        }
+        n = next_word(&line, &word);
+        if (word_is(word, n, "FILE")) {
+            m = next_word(&line, &arg);
+            n = next_word(&line, &word);
+            if (!word_is(word, n, "BINARY") || add_file(cue, arg, m))
+                return line_no;         // WAVE and MP3 are not raw sectors
+        } else if (word_is(word, n, "TRACK")) {
+            if (!file_count || track_count == DISC_MAX_TRACKS)
+                return line_no;
+            t = &tracks[track_count++];
+            memset(t, 0, sizeof(*t));
+            next_word(&line, &arg);
+            t->number = atoi(arg);
+            t->file = file_count - 1;
+            t->start = -1;
+            t->gap_in_file = NO_INDEX;
+            n = next_word(&line, &word);
+            int k = 0;
+            while (k < (int)(sizeof(track_types) / sizeof(track_types[0])) &&
+                   !word_is(word, n, track_types[k].name))
+                k++;
+            if (k == sizeof(track_types) / sizeof(track_types[0]))
+                return line_no;
+            t->mode = track_types[k].mode;
+            t->sector = track_types[k].sector;
+        } else if (word_is(word, n, "INDEX")) {
+            next_word(&line, &arg);
+            int index = atoi(arg);
+            n = next_word(&line, &word);
+            int32_t at = parse_msf(word, n);
+            if (!t || at < 0)
+                return line_no;
+            if (index == 0)
+                t->gap_in_file = at;
+            else if (index == 1)
+                t->start = at;
+        } else if (word_is(word, n, "PREGAP")) {
+            n = next_word(&line, &word);
+            int32_t len = parse_msf(word, n);
+            if (!t || len < 0)
+                return line_no;
+            t->pregap = len;
+        }
+        // REM, TITLE, FLAGS, POSTGAP etc. do not change the layout
+    }
+    return track_count ? 0 : line_no;
+}
+
+// turn file positions of the CUE sheet into disc LBAs
+static int layout(void) {
+    int32_t lba = 0;
+    for (int i = 0; i < track_count; i++) {
+        struct disc_track *t = &tracks[i];
+        uint32_t idx1 = t->start, idx0 = t->gap_in_file == NO_INDEX ? idx1 : t->gap_in_file;
+        uint32_t end;
+        if (t->start < 0 || idx0 > idx1)
+            return -1;
+        // the track ends where the next one in the same file begins
+        if (i + 1 < track_count && tracks[i + 1].file == t->file) {
+            struct disc_track *n = &tracks[i + 1];
+            end = n->gap_in_file == NO_INDEX ? (uint32_t)n->start : n->gap_in_file;
+        } else {
+            FILINFO fno;
+            if (f_stat(names + name_off[t->file], &fno) != FR_OK) {
+                overlay_status("Cannot find %s", names + name_off[t->file]);
+                return -1;
+            }
+            end = fno.fsize / t->sector;
+        }
+        if (end < idx1)
+            return -1;
+        t->gap_in_file = idx1 - idx0;
+        t->pregap += t->gap_in_file;
+        if (i == 0)
+            lba -= t->pregap;           // the gap before track 1 is the lead-in
+        lba += t->pregap;
+        t->start = lba;
+        t->file_off = idx1 * t->sector;
+        t->length = end - idx1;
+        lba += t->length;
+    }
+    leadout = lba;
+    return 0;
+}
+
+// needs the file system lock and disc_mutex
+static void unmount(void) {
+    mounted = false;
+    if (open_file >= 0)
+        fastseek_close(&disc_f);
+    open_file = -1;
+    win_len = win_last = 0;
+}
+
+int disc_mount(const char *fname) {
+    int r = -1;
+    fs_lock();
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    unmount();
+    track_count = file_count = 0;
+    if (has_ext(fname, ".iso")) {
+        tracks[track_count++] = (struct disc_track){.number = 1, .mode = 1, .sector = 2048, .gap_in_file = NO_INDEX};
+        add_file("", fname, strlen(fname));
+    } else {
+        UINT br;
+        int line;
+        if (f_open(&disc_f, fname, FA_READ) != FR_OK) {
+            overlay_status("Cannot open file");
+            goto disc_mount_end;
+        }
+        FRESULT fr = f_read(&disc_f, win, DISC_BUF - 1, &br);
+        f_close(&disc_f);
+        if (fr != FR_OK || br == DISC_BUF - 1) {
+            overlay_status("CUE sheet too large");
+            goto disc_mount_end;
+        }
+        win[br] = '\0';
+        if ((line = parse_cue(fname, (char *)win)) != 0) {
+            overlay_status("Bad CUE sheet line %d", line);
+            goto disc_mount_end;
+        }
+    }
+    if (layout()) {
+        overlay_status("Bad track layout");
+        goto disc_mount_end;
+    }
+    for (int i = 0; i < track_count; i++)
+        DEBUG("disc: track %d mode %d/%d lba %d+%d, pregap %d\n", tracks[i].number,
+              tracks[i].mode, tracks[i].sector, tracks[i].start, tracks[i].length, tracks[i].pregap);
+    last_track = 0;
+    mounted = true;
+    xQueueReset(req_q);                 // requests for the last disc
+    r = 0;
+disc_mount_end:
+    xSemaphoreGive(disc_mutex);
+    fs_unlock();
+    return r;
+}
+
+void disc_unmount(void) {
+    fs_lock();
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    unmount();
+    xSemaphoreGive(disc_mutex);
+    fs_unlock();
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Sectors
+
+// the track holding lba, NULL for the lead-out and beyond
+static struct disc_track *find_track(int32_t lba) {
+    if (lba < 0 || lba >= leadout)
+        return NULL;
+    if (lba < tracks[last_track].start - (int32_t)tracks[last_track].pregap)
+        last_track = 0;
+    while (lba >= tracks[last_track].start + (int32_t)tracks[last_track].length)
+        last_track++;
+    return &tracks[last_track];
+}
+
+// make the window hold [off, off + len) of file `file`
+static FRESULT win_fill(int file, uint32_t off, uint32_t len) {
+    FRESULT r;
+    UINT br;
+    if (open_file != file) {
+        if (open_file >= 0)
+            fastseek_close(&disc_f);
+        open_file = -1;
+        win_len = win_last = 0;
+        if ((r = fastseek_open(&disc_f, names + name_off[file])) != FR_OK)
+            return r;
+        open_file = file;
+    }
+    if (off >= win_base && off + len <= win_base + win_len)
+        return FR_OK;
+    win_base = off & ~(uint32_t)511;
+    win_len = 0;
+    if ((r = f_lseek(&disc_f, win_base)) != FR_OK ||
+        (r = stream_read(&disc_f, win, DISC_BUF, &br)) != FR_OK)
+        return r;
+    win_len = br;
+    return off + len <= win_base + win_len ? FR_OK : FR_INT_ERR;
+}
+
+// the core has read past the middle of a full window: drop the first half
+// and read the next one behind the second
+static bool win_wants_ahead(void) {
+    return open_file >= 0 && win_len == DISC_BUF && win_last >= win_base + DISC_BUF / 2 &&
+           win_base + win_len < f_size(&disc_f);
+}
+
+static void win_ahead(void) {
+    UINT br = 0;
+    memmove(win, win + DISC_BUF / 2, DISC_BUF / 2);
+    win_base += DISC_BUF / 2;
+    win_len = DISC_BUF / 2;
+    if (f_lseek(&disc_f, win_base + DISC_BUF / 2) == FR_OK &&
+        stream_read(&disc_f, win + DISC_BUF / 2, DISC_BUF / 2, &br) == FR_OK)
+        win_len += br;
+}
+
+static void reply_start(uint8_t status, uint16_t len) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x11);
+    bflb_uart_putchar(uart1_dev, status);
+    bflb_uart_putchar(uart1_dev, len & 0xff);
+    bflb_uart_putchar(uart1_dev, len >> 8);
+}
+
+static void put_bytes(const uint8_t *data, int len) {
+    for (int i = 0; i < len; i++)
+        bflb_uart_putchar(uart1_dev, data ? data[i] : 0);
+}
+
+static void put32(uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        bflb_uart_putchar(uart1_dev, v >> (i * 8));
+}
+
+static void reply_end(void) {
+    uart1_unlock();
+}
+
+static void reply_status(uint8_t status) {
+    reply_start(status, 0);
+    reply_end();
+}
+
+static uint8_t bcd(int v) {
+    return (v / 10) << 4 | v % 10;
+}
+
+static void put_msf(uint8_t *p, int32_t sectors) {
+    p[0] = bcd(sectors / 4500);
+    p[1] = bcd(sectors / 75 % 60);
+    p[2] = bcd(sectors % 75);
+}
+
+static void send_toc(void) {
+    reply_start(DISC_OK, 6 + 6 * track_count);
+    bflb_uart_putchar(uart1_dev, tracks[0].number);
+    bflb_uart_putchar(uart1_dev, tracks[track_count - 1].number);
+    put32(leadout);
+    for (int i = 0; i < track_count; i++) {
+        bflb_uart_putchar(uart1_dev, tracks[i].number);
+        bflb_uart_putchar(uart1_dev, tracks[i].mode ? 4 : 0);
+        put32(tracks[i].start);
+    }
+    reply_end();
+}
+
+// Q subchannel, mode 1 (position): control/adr, track, index, relative
+// MSF (counting down in the pregap), 0, absolute MSF, CRC-16 inverted
+static void send_subq(int32_t lba) {
+    struct disc_track *t = find_track(lba);
+    uint8_t q[12];
+    int32_t rel;
+    if (lba < 0) {                      // the lead-out has Q data, the lead-in is not in the image
+        reply_status(DISC_BAD_LBA);
+        return;
+    }
+    if (t) {
+        rel = lba - t->start;
+        q[0] = (t->mode ? 0x40 : 0x00) | 1;
+        q[1] = bcd(t->number);
+        q[2] = rel < 0 ? 0 : 1;
+    } else {
+        rel = lba - leadout;
+        q[0] = (tracks[track_count - 1].mode ? 0x40 : 0x00) | 1;
+        q[1] = 0xAA;
+        q[2] = 1;
+    }
+    put_msf(q + 3, rel < 0 ? -rel : rel);
+    q[6] = 0;
+    put_msf(q + 7, lba + 150);
+    uint16_t crc = 0;
+    for (int i = 0; i < 10; i++) {
+        crc ^= q[i] << 8;
+        for (int b = 0; b < 8; b++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    crc = ~crc;
+    q[10] = crc >> 8;
+    q[11] = crc & 0xff;
+    reply_start(DISC_OK, sizeof(q));
+    put_bytes(q, sizeof(q));
+    reply_end();
+}
+
+// return false if the sector is not in the window and `drive` is false
+static bool send_sector(uint8_t op, int32_t lba, bool drive) {
+    static const uint8_t sync[12] = {0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00};
+    struct disc_track *t = find_track(lba);
+    if (!t) {
+        reply_status(DISC_BAD_LBA);
+        return true;
+    }
+    if (op == DISC_OP_DATA && t->mode == 0) {
+        reply_status(DISC_NOT_DATA);
+        return true;
+    }
+    int32_t rel = lba - t->start;
+    uint16_t len = op == DISC_OP_DATA ? 2048 : 2352;
+    if (rel < -(int32_t)t->gap_in_file) {
+        reply_start(DISC_OK, len);      // PREGAP, not in the file: silence
+        put_bytes(NULL, len);
+        reply_end();
+        return true;
+    }
+    uint32_t off = t->file_off + rel * t->sector;
+    bool hit = open_file == t->file && off >= win_base && off + t->sector <= win_base + win_len;
+    if (!hit && !drive)
+        return false;
+    if (!hit && win_fill(t->file, off, t->sector) != FR_OK) {
+        reply_status(DISC_READ_ERROR);
+        if (open_file >= 0)
+            fastseek_close(&disc_f);    // the drive may be gone, open again next time
+        open_file = -1;
+        return true;
+    }
+    const uint8_t *s = win + (off - win_base);
+    win_last = off + t->sector;
+    reply_start(DISC_OK, len);
+    if (op == DISC_OP_DATA) {
+        // user data: after sync and header, and the Mode 2 subheader
+        int skip = t->sector == 2352 ? (t->mode == 1 ? 16 : 24) : t->sector == 2336 ? 8 : 0;
+        put_bytes(s + skip, 2048);
+    } else if (t->sector == 2352) {
+        put_bytes(s, 2352);
+    } else {
+        uint8_t header[4];
+        put_bytes(sync, sizeof(sync));
+        put_msf(header, lba + 150);
+        header[3] = t->mode;
+        put_bytes(header, sizeof(header));
+        put_bytes(s, t->sector);
+        put_bytes(NULL, 2352 - 16 - t->sector);    // EDC/ECC of Mode 1
+    }
+    reply_end();
+    return true;
+}
+
+// answer a request. without `drive` only if that needs no drive access:
+// everything but a sector out of the window. needs disc_mutex, and the file
+// system lock with `drive`
+// return false if the request needs the drive
+static bool serve(const struct disc_req *q, bool drive) {
+    if (!mounted) {
+        reply_status(DISC_NO_DISC);
+        return true;
+    }
+    switch (q->op) {
+    case DISC_OP_TOC:
+        send_toc();
+        return true;
+    case DISC_OP_DATA:
+    case DISC_OP_RAW:
+        return send_sector(q->op, q->lba, drive);
+    case DISC_OP_SUBQ:
+        send_subq(q->lba);
+        return true;
+    default:
+        reply_status(DISC_BAD_OP);
+        return true;
+    }
+}
+
+// slide the window if the core reads on and no request waits. never waits
+// for the file system lock, like read_ahead() of msu.c
+// return 1 if it moved, 0 if it does not want to, -1 if the lock was busy
+static int read_ahead(void) {
+    int r = 0;
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    bool wants = mounted && win_wants_ahead();
+    xSemaphoreGive(disc_mutex);
+    if (!wants || uxQueueMessagesWaiting(req_q))
+        return 0;
+    if (!fs_trylock())
+        return -1;
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    if (mounted && win_wants_ahead() && uxQueueMessagesWaiting(req_q) == 0) {
+        win_ahead();
+        r = 1;
+    }
+    xSemaphoreGive(disc_mutex);
+    fs_unlock();
+    return r;
+}
+
+static void handle(const struct disc_req *q) {
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    bool done = !(core_caps & CORE_CAP_DISC) || serve(q, false);
+    xSemaphoreGive(disc_mutex);
+    if (done)
+        return;
+    // a miss: open, seek or refill through the file system
+    fs_lock();
+    xSemaphoreTake(disc_mutex, portMAX_DELAY);
+    if (core_caps & CORE_CAP_DISC)
+        serve(q, true);
+    xSemaphoreGive(disc_mutex);
+    fs_unlock();
+}
+
+static void disc_task(void *pvParameters) {
+    struct disc_req q;
+    for (;;) {
+        int ahead = read_ahead();
+        TickType_t wait = ahead > 0 ? 0 : ahead < 0 ? pdMS_TO_TICKS(DISC_AHEAD_RETRY_MS) : portMAX_DELAY;
+        if (xQueueReceive(req_q, &q, wait) == pdTRUE)
+            handle(&q);
+    }
+}
+
+void disc_init(void) {
+    req_q = xQueueCreate(DISC_QUEUE, sizeof(struct disc_req));
+    disc_mutex = xSemaphoreCreateMutexStatic(&disc_mutex_buf);
+    xTaskCreateStatic(disc_task, "disc_task", DISC_TASK_STACK_SIZE, NULL,
+                      DISC_TASK_PRIORITY, disc_stack, &disc_tcb);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Disc images for CD-based cores
+//
+// A CD does not fit into core memory, so on a core with CORE_CAP_DISC,
+// rom_load() mounts a .cue or .iso image instead of sending it. The core
+// then reads sectors on demand with packet 0x17 op lba, and the disc task
+// answers with command 0x11:
+//   DISC_OP_TOC    the table of contents, see below
+//   DISC_OP_DATA   2048 bytes of user data of a Mode 1 or Mode 2 Form 1 sector
+//   DISC_OP_RAW    2352 bytes of a sector: audio samples, or data with sync and
+//                  header (made up for 2048 and 2336-byte images, EDC/ECC zero)
+//   DISC_OP_SUBQ   the 12-byte Q subchannel of a sector, with CRC
+//
+// The CUE sheet is parsed once into a track table that maps disc LBAs to
+// (file, byte offset), across one file per track or all tracks in one file,
+// with INDEX 00 and PREGAP gaps. The TOC and the Q subchannel are built
+// from that table, so neither costs a drive access. LBA 0 is the start of
+// track 1, the lead-in before it is not part of the image.
+//
+// The track being read is open with a fast-seek link map. Sectors come out
+// of a DISC_BUF read-ahead window, which the disc task slides forward one
+// half at a time when the core reads on and no request waits, like the
+// MSU-1 service (msu.h): a sector in the window is answered without the file
+// system lock, and read-ahead only runs while the lock is free at once, so
+// menus and save flushes hold up only the reads that miss the window. A
+// 2352-byte reply takes 12ms on the 2Mbaud link, which keeps up with 1x CD
+// speed (75 sectors/s).
+//
+// TOC reply: first[7:0] last[7:0] leadout[31:0], then for each track
+// number[7:0] control[7:0] lba[31:0]. Control is 4 for data, 0 for audio.
+
+#define DISC_MAX_TRACKS     99
+#define DISC_NAMES          2048        // file names of all tracks
+#define DISC_BUF            (16*1024)   // read-ahead window in service_buf, also holds the CUE sheet
+#define DISC_QUEUE          4
+
+// request ops
+#define DISC_OP_TOC         0
+#define DISC_OP_DATA        1
+#define DISC_OP_RAW         2
+#define DISC_OP_SUBQ        3
+
+// reply status
+#define DISC_OK             0
+#define DISC_NO_DISC        1
+#define DISC_BAD_LBA        2           // before 0 or after the lead-out
+#define DISC_READ_ERROR     3
+#define DISC_NOT_DATA       4           // DISC_OP_DATA on an audio track
+#define DISC_BAD_OP         5
+
+// start the disc task
+void disc_init(void);
+
+// true for the file types disc_mount() takes
+bool disc_is_image(const char *fname);
+
+// parse the CUE sheet or ISO `fname` and serve its sectors to the core
+// return 0 if successful. needs the file system lock
+int disc_mount(const char *fname);
+
+// close the image and ignore requests until the next disc_mount()
+void disc_unmount(void);
+
+// bytes of packet 0x17 from the UART1 receiver, `idx` counts from the byte
+// after the packet type. return true when the packet is complete
+bool disc_rx(int idx, uint8_t ch);
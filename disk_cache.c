@@ -0,0 +1,194 @@
+// Sector cache between FatFs and the USB mass storage transport, see disk_cache.h
+
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "usbh_core.h"
+#include "usbh_msc.h"
+
+#include "disk_cache.h"
+
+#define SECTOR_SIZE 512
+
+extern FATFS fs;                    // FatFs reads metadata into fs.win
+
+struct cache_line {
+    LBA_t sect;
+    uint32_t used;                  // LRU stamp
+    bool valid;
+};
+
+static struct usbh_msc *msc;
+static struct disk_cache_stats stats;
+
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) meta_buf[DISK_CACHE_META_SECTORS][SECTOR_SIZE];
+static struct cache_line meta[DISK_CACHE_META_SECTORS];
+static uint32_t meta_clock;
+
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) ra_buf[DISK_CACHE_RA_SECTORS][SECTOR_SIZE];
+static LBA_t ra_start;
+static UINT ra_cnt;                 // sectors in the read-ahead window, 0 if empty
+
+void disk_cache_invalidate(void) {
+    for (int i = 0; i < DISK_CACHE_META_SECTORS; i++)
+        meta[i].valid = false;
+    ra_cnt = 0;
+}
+
+void disk_cache_detach(void) {
+    msc = NULL;
+    disk_cache_invalidate();
+}
+
+void disk_cache_get_stats(struct disk_cache_stats *s) {
+    *s = stats;
+}
+
+// cached copy of `sect`, NULL if none
+static BYTE *lookup(LBA_t sect) {
+    for (int i = 0; i < DISK_CACHE_META_SECTORS; i++) {
+        if (meta[i].valid && meta[i].sect == sect) {
+            meta[i].used = ++meta_clock;
+            return meta_buf[i];
+        }
+    }
+    if (sect >= ra_start && sect < ra_start + ra_cnt)
+        return ra_buf[sect - ra_start];
+    return NULL;
+}
+
+// `msc` may go away between two calls, see disk_cache_detach()
+static int msc_read(BYTE *buf, LBA_t sect, UINT count) {
+    struct usbh_msc *m = msc;
+    if (!m)
+        return RES_NOTRDY;
+    return usbh_msc_scsi_read10(m, sect, buf, count) < 0 ? RES_ERROR : RES_OK;
+}
+
+// read a metadata sector into the least recently used line
+static int meta_fill(BYTE *buff, LBA_t sect) {
+    int victim = 0;
+    for (int i = 0; i < DISK_CACHE_META_SECTORS; i++) {
+        if (!meta[i].valid) {
+            victim = i;
+            break;
+        }
+        if (meta[i].used < meta[victim].used)
+            victim = i;
+    }
+    meta[victim].valid = false;
+    int r = msc_read(meta_buf[victim], sect, 1);
+    if (r != RES_OK)
+        return r;
+    meta[victim].sect = sect;
+    meta[victim].used = ++meta_clock;
+    meta[victim].valid = true;
+    memcpy(buff, meta_buf[victim], SECTOR_SIZE);
+    return RES_OK;
+}
+
+// read a data sector and the ones following it into the read-ahead window
+static int ra_fill(BYTE *buff, LBA_t sect) {
+    UINT n = DISK_CACHE_RA_SECTORS;
+    struct usbh_msc *m = msc;
+    if (m && m->blocknum && sect + n > m->blocknum)
+        n = m->blocknum - sect;
+    ra_cnt = 0;
+    int r = msc_read(ra_buf[0], sect, n);
+    if (r != RES_OK)
+        return r;
+    ra_start = sect;
+    ra_cnt = n;
+    memcpy(buff, ra_buf[0], SECTOR_SIZE);
+    return RES_OK;
+}
+
+static int cache_status(void) {
+    return msc ? 0 : STA_NOINIT;
+}
+
+static int cache_initialize(void) {
+    disk_cache_invalidate();            // called on every mount, the drive may be a new one
+    msc = (struct usbh_msc *)usbh_find_class_instance("/dev/sda");
+    if (!msc)
+        return STA_NOINIT;
+    if (usbh_msc_scsi_init(msc) < 0) {
+        msc = NULL;
+        return STA_NOINIT;
+    }
+    return 0;
+}
+
+static int cache_read(BYTE *buff, LBA_t sector, UINT count) {
+    struct usbh_msc *m = msc;
+    if (!m)
+        return RES_NOTRDY;
+    if (count > 1 || m->blocksize != SECTOR_SIZE) {
+        stats.direct++;
+        return msc_read(buff, sector, count);
+    }
+
+    bool is_meta = buff == fs.win;
+    BYTE *p = lookup(sector);
+    if (p) {
+        if (is_meta) stats.meta_hits++; else stats.data_hits++;
+        memcpy(buff, p, SECTOR_SIZE);
+        return RES_OK;
+    }
+    if (is_meta) {
+        stats.meta_misses++;
+        return meta_fill(buff, sector);
+    }
+    stats.data_misses++;
+    return ra_fill(buff, sector);
+}
+
+static int cache_write(const BYTE *buff, LBA_t sector, UINT count) {
+    struct usbh_msc *m = msc;
+    if (!m)
+        return RES_NOTRDY;
+    if (usbh_msc_scsi_write10(m, sector, buff, count) < 0) {
+        disk_cache_invalidate();        // unknown what reached the drive
+        return RES_ERROR;
+    }
+    // keep cached copies in step
+    for (UINT i = 0; i < count; i++) {
+        BYTE *p = lookup(sector + i);
+        if (p)
+            memcpy(p, buff + i * SECTOR_SIZE, SECTOR_SIZE);
+    }
+    return RES_OK;
+}
+
+static int cache_ioctl(BYTE cmd, void *buff) {
+    struct usbh_msc *m = msc;
+    if (!m)
+        return RES_NOTRDY;
+    switch (cmd) {
+    case CTRL_SYNC:
+        return RES_OK;                  // write-through, nothing pending
+    case GET_SECTOR_COUNT:
+        *(LBA_t *)buff = m->blocknum;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD *)buff = m->blocksize;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+static FATFS_DiskioDriverTypeDef cache_driver = {
+    .disk_status = cache_status,
+    .disk_initialize = cache_initialize,
+    .disk_write = cache_write,
+    .disk_read = cache_read,
+    .disk_ioctl = cache_ioctl,
+};
+
+void disk_cache_register(void) {
+    disk_driver_callback_init(DEV_USB, &cache_driver);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Sector cache for the USB drive
+//
+// Replaces the SDK's FatFs USB host disk driver with one that keeps recently
+// used sectors in RAM:
+//  - a metadata pool for sectors FatFs reads into its window buffer (FAT,
+//    directory and boot sectors), replaced least-recently-used, so repeated
+//    f_stat()/f_opendir() calls and FAT chain walks stop going to the drive
+//  - a read-ahead window for single-sector data reads (partial f_read()s):
+//    a miss fetches the next DISK_CACHE_RA_SECTORS sectors in one transfer
+// Multi-sector reads go straight to the drive. Writes go through to the
+// drive and update cached copies.
+
+#define DISK_CACHE_META_SECTORS     32      // 16KB
+#define DISK_CACHE_RA_SECTORS       8       // 4KB
+
+struct disk_cache_stats {
+    uint32_t meta_hits, meta_misses;        // window (metadata) reads
+    uint32_t data_hits, data_misses;        // single-sector data reads
+    uint32_t direct;                        // multi-sector reads passed through
+};
+
+// register the cached driver for "usb:" (instead of fatfs_usbh_driver_register())
+void disk_cache_register(void);
+
+// drop all cached sectors (the drive may have changed)
+void disk_cache_invalidate(void);
+
+// forget the drive, which has been unplugged: drop all cached sectors, and
+// fail reads and writes with RES_NOTRDY until the next mount finds a drive
+void disk_cache_detach(void);
+
+void disk_cache_get_stats(struct disk_cache_stats *stats);
@@ -0,0 +1,143 @@
+// Fast seek through FatFs cluster link maps, see fastseek.h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ff.h"
+
+#include "fastseek.h"
+
+static DWORD pool[FASTSEEK_POOL];
+
+// a file's map in the pool, or what the last walk learned about its size
+static struct map {
+    bool used;
+    WORD fs_id;                         // the file: mount, first cluster and size
+    DWORD sclust;
+    FSIZE_t size;
+    DWORD need;                         // DWORDs its map takes, 0 if never walked
+    WORD off, len;                      // its table in the pool, len 0 if none
+    BYTE users;                         // open files on the table
+    DWORD last;                         // value of `opens` when last opened
+} maps[FASTSEEK_MAPS];
+static DWORD opens;
+
+// the entry of the file open in `fp`, or a new one in place of the least
+// recently opened entry no file uses. NULL if all are in use
+static struct map *lookup(FIL *fp) {
+    struct map *m, *old = NULL;
+    for (m = maps; m < maps + FASTSEEK_MAPS; m++) {
+        if (m->used && m->fs_id == fp->obj.fs->id && m->sclust == fp->obj.sclust &&
+            m->size == fp->obj.objsize)
+            return m;
+        if (m->users)
+            continue;
+        if (!old || (old->used && (!m->used || m->last < old->last)))
+            old = m;
+    }
+    if (old)
+        *old = (struct map){true, fp->obj.fs->id, fp->obj.sclust, fp->obj.objsize};
+    return old;
+}
+
+// the largest run of free DWORDs in the pool: return its length, its start in *off
+static DWORD largest_gap(DWORD *off) {
+    DWORD best = 0;
+    for (int i = -1; i < FASTSEEK_MAPS; i++) {
+        if (i >= 0 && !maps[i].len)
+            continue;
+        // runs start at the pool or after a table, and end at the next table
+        DWORD start = i < 0 ? 0 : maps[i].off + maps[i].len, end = FASTSEEK_POOL;
+        for (int k = 0; k < FASTSEEK_MAPS; k++)
+            if (maps[k].len && maps[k].off >= start && maps[k].off < end)
+                end = maps[k].off;
+        if (end - start > best) {
+            best = end - start;
+            *off = start;
+        }
+    }
+    return best;
+}
+
+// drop the table of the least recently opened closed file. false if none
+static bool evict(void) {
+    struct map *old = NULL;
+    for (struct map *m = maps; m < maps + FASTSEEK_MAPS; m++)
+        if (m->len && !m->users && (!old || m->last < old->last))
+            old = m;
+    if (!old)
+        return false;
+    old->len = 0;                       // the size stays known
+    return true;
+}
+
+// Walk the chain of `fp` into the pool. A file walked before gets exactly
+// the room its map takes. A new one gets the largest free run, and is only
+// walked a second time if that was too small but the pool is not.
+static void build(FIL *fp, struct map *m) {
+    for (;;) {
+        DWORD off = 0, len = largest_gap(&off), want = m->need ? m->need : 4;
+        while (len < want && evict())
+            len = largest_gap(&off);
+        if (len < want)
+            return;                     // the pool holds the maps of open files
+        if (m->need)
+            len = m->need;
+        pool[off] = len;
+        fp->cltbl = pool + off;
+        FRESULT r = f_lseek(fp, CREATE_LINKMAP);
+        fp->cltbl = NULL;
+        if (r == FR_OK) {
+            m->off = off;
+            m->len = m->need = pool[off];
+            return;
+        }
+        if (r != FR_NOT_ENOUGH_CORE || m->need)
+            return;
+        m->need = pool[off];            // FatFs tells the size it needed
+        if (m->need > FASTSEEK_POOL)
+            return;                     // too fragmented, never walked again
+    }
+}
+
+// let go of the table `fp` uses, if any
+static void release(FIL *fp) {
+    if (!fp->cltbl)
+        return;
+    for (struct map *m = maps; m < maps + FASTSEEK_MAPS; m++)
+        if (m->len && fp->cltbl == pool + m->off && m->users)
+            m->users--;
+    fp->cltbl = NULL;
+}
+
+FRESULT fastseek_open(FIL *fp, const TCHAR *path) {
+    release(fp);                        // reopened without fastseek_close()
+    FRESULT r = f_open(fp, path, FA_READ);
+    if (r != FR_OK)
+        return r;
+    if (fp->obj.objsize <= (FSIZE_t)fp->obj.fs->csize * FF_MAX_SS)
+        return FR_OK;                   // a single cluster: no chain to follow
+
+    struct map *m = lookup(fp);
+    if (!m)
+        return FR_OK;                   // all entries on open files, seek by walking the chain
+    m->last = ++opens;
+    if (!m->len && m->need <= FASTSEEK_POOL)
+        build(fp, m);
+    if (m->len) {
+        fp->cltbl = pool + m->off;
+        m->users++;
+    }
+    return FR_OK;
+}
+
+FRESULT fastseek_close(FIL *fp) {
+    release(fp);
+    return f_close(fp);
+}
+
+int fastseek_fragments(FIL *fp) {
+    if (!fp->cltbl)
+        return -1;
+    return (fp->cltbl[0] - 2) / 2;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ff.h"
+
+// Fast seek for ROM and core files
+//
+// Opening a file through fastseek_open() also attaches its cluster link map
+// (FatFs CLMT: one (length, start cluster) pair per contiguous fragment).
+// With the map attached, f_lseek() computes the target cluster from the
+// table instead of following the FAT chain, and stream_read() reads whole
+// fragments in one command, so seeking to a SNES header 4 MB into a
+// fragmented image or reading an MSU-1 track at random costs no FAT reads.
+//
+// Building a map walks the whole chain once. Maps share one static pool and
+// are sized to the file; a map stays in the pool after its file is closed,
+// so opening the same file again (the pager after the loader, a CD track on
+// every switch) costs no walk until the pool needs the space. A file known
+// to need more than the whole pool is not walked again: it seeks by
+// following the chain, as after a plain f_open().
+
+#define FASTSEEK_POOL       512         // DWORDs for all maps: 2 per fragment + 2 per map
+#define FASTSEEK_MAPS       8           // files the pool keeps a map or a size for
+
+// open `path` read-only into `fp` and attach a link map if one fits
+// return: FRESULT of f_open
+FRESULT fastseek_open(FIL *fp, const TCHAR *path);
+
+// close a file opened by fastseek_open() and release its map
+FRESULT fastseek_close(FIL *fp);
+
+// number of fragments of `fp`, -1 if it has no map
+int fastseek_fragments(FIL *fp);
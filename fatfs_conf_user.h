@@ -40,7 +40,7 @@ All configuration items must be included in the file */
 #define FF_USE_EXPAND 0
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
-#define FF_USE_CHMOD 0
+#define FF_USE_CHMOD 1
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
 
@@ -0,0 +1,129 @@
+// ROM content hashes, see hash.h
+
+#include <string.h>
+
+#include "hash.h"
+
+// slice-by-8: table k gives the CRC of a byte followed by k zero bytes, so
+// eight table lookups consume 8 input bytes per step instead of one.
+// built on first use, 8KB of RAM
+static uint32_t crc_tbl[8][256];
+static bool crc_ready;
+
+static void crc32_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (0xEDB88320 & -(c & 1));
+        crc_tbl[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc_tbl[t][i] = (crc_tbl[t-1][i] >> 8) ^ crc_tbl[0][crc_tbl[t-1][i] & 0xff];
+    crc_ready = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len) {
+    if (!crc_ready)
+        crc32_tables();
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 3)) {
+        crc = (crc >> 8) ^ crc_tbl[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t a, b;
+        memcpy(&a, p, 4);               // little endian
+        memcpy(&b, p + 4, 4);
+        a ^= crc;
+        crc = crc_tbl[7][a & 0xff] ^ crc_tbl[6][(a >> 8) & 0xff] ^
+              crc_tbl[5][(a >> 16) & 0xff] ^ crc_tbl[4][a >> 24] ^
+              crc_tbl[3][b & 0xff] ^ crc_tbl[2][(b >> 8) & 0xff] ^
+              crc_tbl[1][(b >> 16) & 0xff] ^ crc_tbl[0][b >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc_tbl[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+#if HASH_SHA1
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t h[5], const uint8_t *p) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i >= 16) {
+            uint32_t t = w[(i+13) & 15] ^ w[(i+8) & 15] ^ w[(i+2) & 15] ^ w[i & 15];
+            w[i & 15] = ROL(t, 1);
+        }
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+        uint32_t t = ROL(a, 5) + f + e + k + w[i & 15];
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+static void sha1_update(struct hash_ctx *ctx, const uint8_t *data, uint32_t len) {
+    uint32_t fill = ctx->total & 63;
+    ctx->total += len;
+    if (fill) {
+        uint32_t n = 64 - fill < len ? 64 - fill : len;
+        memcpy(ctx->block + fill, data, n);
+        data += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        sha1_block(ctx->h, ctx->block);
+    }
+    for (; len >= 64; data += 64, len -= 64)
+        sha1_block(ctx->h, data);
+    memcpy(ctx->block, data, len);
+}
+
+#endif
+
+void hash_start(struct hash_ctx *ctx) {
+    ctx->crc = 0;
+    ctx->size = 0;
+#if HASH_SHA1
+    static const uint32_t init[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    memcpy(ctx->h, init, sizeof(init));
+    ctx->total = 0;
+#endif
+}
+
+void hash_update(struct hash_ctx *ctx, const uint8_t *data, uint32_t len) {
+    ctx->crc = crc32_update(ctx->crc, data, len);
+    ctx->size += len;
+#if HASH_SHA1
+    sha1_update(ctx, data, len);
+#endif
+}
+
+void hash_finish(struct hash_ctx *ctx, struct rom_hash *out) {
+    out->valid = true;
+    out->size = ctx->size;
+    out->crc32 = ctx->crc;
+#if HASH_SHA1
+    uint64_t bits = ctx->total * 8;
+    uint8_t pad[72] = {0x80};
+    uint32_t n = 64 - (ctx->total & 63);    // 0x80, zeros, 8 length bytes
+    if (n < 9)
+        n += 64;
+    for (int i = 0; i < 8; i++)
+        pad[n - 1 - i] = bits >> (8 * i);
+    sha1_update(ctx, pad, n);
+    for (int i = 0; i < 20; i++)
+        out->sha1[i] = ctx->h[i / 4] >> (24 - 8 * (i & 3));
+#endif
+}
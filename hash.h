@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ROM content hashes
+//
+// CRC32 (the zip/No-Intro polynomial, slice-by-8) and optionally SHA-1 of a
+// byte stream fed in pieces. The ROM loader feeds every chunk it sends to the
+// core, so the hashes of a ROM are known when its upload finishes without a
+// second pass over the file.
+
+#define HASH_SHA1           1           // also compute SHA-1, 0 for CRC32 only
+
+struct hash_ctx {
+    uint32_t crc;
+    uint32_t size;
+#if HASH_SHA1
+    uint32_t h[5];
+    uint64_t total;
+    uint8_t block[64];
+#endif
+};
+
+struct rom_hash {
+    bool valid;
+    uint32_t size;                      // bytes hashed
+    uint32_t crc32;
+#if HASH_SHA1
+    uint8_t sha1[20];
+#endif
+};
+
+void hash_start(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const uint8_t *data, uint32_t len);
+void hash_finish(struct hash_ctx *ctx, struct rom_hash *out);
+
+// CRC32 of a buffer, continuing from `crc` (0 to start)
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t len);
@@ -11,7 +11,8 @@
 #include "hidparser.h"
 
 #define hidp_debugf(fmt, ...) do {} while(0)
-#define DEBUG(fmt, ...) printf(fmt, ##__VA_ARGS__)
+// printf goes to UART1, where it would land in the middle of core packets
+#define DEBUG(fmt, ...) do {} while(0)
 
 #if 0
 #define hidp_extreme_debugf(...) hidp_debugf(__VA_ARGS__)
@@ -33,6 +34,10 @@ typedef struct {
 #define JOYSTICK_COMPLETE     (JOY_MOUSE_REQ_AXIS_X | JOY_MOUSE_REQ_AXIS_Y | JOY_MOUSE_REQ_BTN_0)
 #define MOUSE_COMPLETE        (JOY_MOUSE_REQ_AXIS_X | JOY_MOUSE_REQ_AXIS_Y | JOY_MOUSE_REQ_BTN_0 | JOY_MOUSE_REQ_BTN_1)
 
+static inline uint32_t min_u32(uint32_t a, uint32_t b) {
+	return a < b ? a : b;
+}
+
 #define USAGE_PAGE_GENERIC_DESKTOP  1
 #define USAGE_PAGE_SIMULATION       2
 #define USAGE_PAGE_VR               3
@@ -64,13 +69,45 @@ typedef struct {
 #define USAGE_WHEEL   56
 #define USAGE_HAT     57
 
+//       11 10 9 8 7  6  5  4  3  2  1  0
+// SNES: R  L  X A RT LT DN UP ST SE Y  B
+// HID:            Y  B  A  X  UP DN LT RT
+// EXTRA:                ST SE       R  L
+const uint16_t hid_snes_map[16] = {
+	0x080, 0x040, 0x020, 0x010, 0x200, 0x100, 0x001, 0x002,     // RT LT DN UP X A B Y
+	0x400, 0x800, 0x000, 0x000, 0x004, 0x008, 0x000, 0x000,     // L R - - SE ST - -
+};
+
 // check if the current report 
 bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t *conf) {
 	hidp_debugf("  - total bit count: %d (%d bytes, %d bits)", 
 	      bit_count, bit_count/8, bit_count%8);
 
+	if(bit_count/8 > 0xff) {
+		hidp_debugf("  - report too long");
+		return false;
+	}
 	conf->report_size = bit_count/8;
 
+	// every joystick field has to lie inside the report, so that report
+	// parsing never reads past the received bytes
+	if(conf->type == REPORT_TYPE_JOYSTICK) {
+		for(int i=0;i<2;i++) {
+			uint8_t size = conf->joystick_mouse.axis[i].size;
+			if(size == 0 || size > 16 ||
+			   conf->joystick_mouse.axis[i].offset + size > conf->report_size*8) {
+				hidp_debugf("  - axis %d out of report", i);
+				return false;
+			}
+		}
+		for(int i=0;i<12;i++)
+			if(conf->joystick_mouse.button[i].bitmask &&
+			   conf->joystick_mouse.button[i].byte_offset >= conf->report_size) {
+				hidp_debugf("  - button %d out of report", i);
+				return false;
+			}
+	}
+
 	// check if something useful was detected
 	if( ((conf->type == REPORT_TYPE_JOYSTICK) && ((report_complete & JOYSTICK_COMPLETE) == JOYSTICK_COMPLETE)) ||
 	    ((conf->type == REPORT_TYPE_MOUSE)    && ((report_complete & MOUSE_COMPLETE) == MOUSE_COMPLETE)) ||
@@ -94,7 +131,8 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 	//
 	uint8_t buttons = 0;
-	uint8_t report_size = 0, report_count = 0;
+	uint8_t report_size = 0;
+	uint16_t report_count = 0;
 	uint16_t bit_count = 0, usage_count = 0;
 	uint16_t logical_minimum=0, logical_maximum=0;
 	uint16_t physical_minimum=0, physical_maximum=0;
@@ -122,6 +160,12 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 		rep++;
 		rep_size--;   // one byte consumed
 		if(rbytes) (*rbytes)++;
+
+		// truncated item at the end of the descriptor
+		if((size == 3 ? 4 : size) > rep_size) {
+			hidp_debugf("truncated item");
+			return false;
+		}
 		
 		uint32_t value = 0;
 		if(size) {      // size 1/2/3
@@ -182,7 +226,7 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 						// scan for up to four buttons
 							char b;
 							for(b=0;b<12;b++) {
-								if(report_count > buttons) {
+								if(report_count > buttons && buttons < 12) {
 								uint16_t this_bit = bit_count+b;
 
 									hidp_debugf("BUTTON%d @ %d (byte %d, mask %d)", buttons, 
@@ -238,7 +282,8 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 					hidp_extreme_debugf("INPUT(%lu)", value);
 
 					// reset for next inputs
-					bit_count += report_count * report_size;
+					// saturated, report_is_usable() rejects such reports
+					bit_count = min_u32((uint32_t)bit_count + report_count * report_size, 0xffff);
 					usage_count = 0;
 					btns = 0;
 					for (i=0; i<MAX_AXES; i++) axis[i] = -1;
@@ -290,6 +335,8 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 						// check if report is usable and stop parsing if it is
 						if(report_is_usable(bit_count, report_complete, conf)) {
+							if(conf->type == REPORT_TYPE_JOYSTICK)
+								hid_compile_plan(conf, hid_snes_map);
 						        return true;
 						} else {
 							// retry with next report
@@ -367,7 +414,7 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 				case 7:
 					hidp_extreme_debugf("REPORT_SIZE(%lu)", value);
-					report_size = value;
+					report_size = min_u32(value, 0xff);       // over 16 bits is no axis anyway
 					break;
 
 				case 8:
@@ -378,7 +425,7 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 				case 9:
 					hidp_extreme_debugf("REPORT_COUNT(%lu)", value);
-					report_count = value;
+					report_count = min_u32(value, 0xffff);
 					break;
 
 				default:
@@ -487,6 +534,79 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 	return false;
 }
 
+// hat position (0 = north, clockwise) -> joystick direction bits
+static const uint8_t hat_dirs[8] = { 0x08, 0x09, 0x01, 0x05, 0x04, 0x06, 0x02, 0x0a };
+
+// an 8-way hat inside a single report byte, the only kind decoded
+static bool hat_usable(const hid_report_t *conf) {
+	uint16_t offset = conf->joystick_mouse.hat.offset;
+	uint8_t size = conf->joystick_mouse.hat.size;
+	return size && size <= 4 && (offset & 7) + size <= 8 && offset/8 < conf->report_size &&
+	       conf->joystick_mouse.hat.logical.max - conf->joystick_mouse.hat.logical.min == 7;
+}
+
+void hid_compile_plan(hid_report_t *conf, const uint16_t map[16]) {
+	hid_plan_t *plan = &conf->plan;
+	memset(plan, 0, sizeof(hid_plan_t));
+	memcpy(conf->snes_map, map, sizeof(conf->snes_map));
+	for(int i=0;i<4;i++)
+		plan->dir[i] = map[i];
+
+	// axes: fixed shift/mask out of at most three bytes
+	for(int i=0;i<2;i++) {
+		uint16_t offset = conf->joystick_mouse.axis[i].offset;
+		uint8_t size = conf->joystick_mouse.axis[i].size;
+		if(size == 0 || size > 16) return;
+		uint8_t shift = offset & 7;
+		uint8_t nbytes = (shift + size + 7) / 8;
+		if(offset/8 + nbytes > conf->report_size) return;
+		plan->axis[i].byte = offset / 8;
+		plan->axis[i].nbytes = nbytes;
+		plan->axis[i].shift = shift;
+		plan->axis[i].mask = size == 16 ? 0xffff : (1 << size) - 1;
+		// same signedness rule as joystick_parse()
+		if(conf->joystick_mouse.axis[i].logical.min > conf->joystick_mouse.axis[i].logical.max)
+			plan->axis[i].sign = 1 << (size - 1);
+	}
+
+	// buttons: one 256-entry table per report byte that holds buttons
+	for(int i=0;i<12;i++) {
+		uint8_t mask = conf->joystick_mouse.button[i].bitmask;
+		uint8_t byte = conf->joystick_mouse.button[i].byte_offset;
+		if(!mask || !map[i+4]) continue;
+		if(byte >= conf->report_size) return;
+		int b;
+		for(b=0;b<plan->btn_bytes && plan->btn_byte[b] != byte;b++);
+		if(b == plan->btn_bytes) {
+			if(b == HID_PLAN_BTN_BYTES) return;     // too scattered, use the generic parser
+			plan->btn_byte[plan->btn_bytes++] = byte;
+		}
+		for(int v=0;v<256;v++)
+			if(v & mask)
+				plan->btn_lut[b][v] |= map[i+4];
+	}
+
+	// 8-way hat inside a single byte
+	uint16_t hat_offset = conf->joystick_mouse.hat.offset;
+	uint8_t hat_size = conf->joystick_mouse.hat.size;
+	uint16_t hat_min = conf->joystick_mouse.hat.logical.min;
+	if(hat_usable(conf)) {
+		plan->hat_present = 1;
+		plan->hat_byte = hat_offset / 8;
+		plan->hat_shift = hat_offset & 7;
+		plan->hat_mask = (1 << hat_size) - 1;
+		for(int v=0;v<=plan->hat_mask;v++) {
+			if(v < hat_min || v - hat_min > 7) continue;     // null state
+			uint8_t dirs = hat_dirs[v - hat_min];
+			for(int d=0;d<4;d++)
+				if(dirs & (1 << d))
+					plan->hat_lut[v] |= map[d];
+		}
+	}
+
+	plan->valid = 1;
+}
+
 // collect bits from byte stream and assemble them into a signed word
 static uint16_t collect_bits(const uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
   // mask unused bits of first byte
@@ -551,6 +671,13 @@ void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *sta
        report->joystick_mouse.button[i].bitmask)
       joy |= (0x10<<i);
 
+  // ... and the hat, as the plan decodes it
+  if(hat_usable(report)) {
+    uint16_t v = collect_bits(buffer, report->joystick_mouse.hat.offset,
+			      report->joystick_mouse.hat.size, false) - report->joystick_mouse.hat.logical.min;
+    if(v <= 7) joy |= hat_dirs[v];	// else null state
+  }
+
   // ... and the eight extra buttons
   unsigned char btn_extra = 0;
   for(int i=4;i<12;i++)
@@ -569,6 +696,13 @@ void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *sta
   ax = a[0];
   ay = a[1];
 
+  uint16_t snes = 0;
+  for(int i=0;i<8;i++) {
+    if(joy & (1<<i)) snes |= report->snes_map[i];
+    if(btn_extra & (1<<i)) snes |= report->snes_map[i+8];
+  }
+  state->snes = snes;
+
   if((joy != state->last_state) || 
      (ax != state->last_state_x) || 
      (ay != state->last_state_y) || 
@@ -582,6 +716,37 @@ void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *sta
   }
 }
 
+// load an axis with the plan's fixed shift/mask
+static inline uint16_t plan_axis(const hid_plan_t *plan, int i, const unsigned char *buffer) {
+  const unsigned char *p = buffer + plan->axis[i].byte;
+  uint32_t v = p[0];
+  if(plan->axis[i].nbytes > 1) v |= p[1] << 8;
+  if(plan->axis[i].nbytes > 2) v |= (uint32_t)p[2] << 16;
+  uint16_t rval = (v >> plan->axis[i].shift) & plan->axis[i].mask;
+  if(rval & plan->axis[i].sign)
+    rval |= ~plan->axis[i].mask;        // sign expansion
+  return rval;
+}
+
+uint16_t joystick_parse_plan(const hid_plan_t *plan, const unsigned char *buffer) {
+  uint16_t snes = 0;
+  for(int i=0;i<plan->btn_bytes;i++)
+    snes |= plan->btn_lut[i][buffer[plan->btn_byte[i]]];
+
+  if(plan->hat_present)
+    snes |= plan->hat_lut[(buffer[plan->hat_byte] >> plan->hat_shift) & plan->hat_mask];
+
+  // map directions to digital
+  int ax = plan_axis(plan, 0, buffer);
+  int ay = plan_axis(plan, 1, buffer);
+  if(ax > 0xc0) snes |= plan->dir[0];	// right
+  if(ax < 0x40) snes |= plan->dir[1];	// left
+  if(ay > 0xc0) snes |= plan->dir[2];	// down
+  if(ay < 0x40) snes |= plan->dir[3];	// up
+
+  return snes;
+}
+
 void hid_parse(const hid_report_t *report, hid_state_t *state, uint8_t const* data, uint16_t len) {
   //  usb_debugf("hid parse %d, expect %d", len, report->report_size);
   if(!len) return;
@@ -606,8 +771,50 @@ void hid_parse(const hid_report_t *report, hid_state_t *state, uint8_t const* da
     if(report->type == REPORT_TYPE_MOUSE)
       DEBUG("MOUSE");
     
-    if(report->type == REPORT_TYPE_JOYSTICK)
-      joystick_parse(report, &state->joystick, data, len);
+    if(report->type == REPORT_TYPE_JOYSTICK) {
+      if(report->plan.valid) {
+        state->joystick.snes = joystick_parse_plan(&report->plan, data);
+      } else
+        joystick_parse(report, &state->joystick, data, len);
+    }
+  }
+}
+
+
+// HID usage (keyboard page) -> ASCII
+static char keyboard_ascii(uint8_t key) {
+  if (key >= 0x04 && key <= 0x1d) return 'A' + key - 0x04;
+  if (key >= 0x1e && key <= 0x26) return '1' + key - 0x1e;
+  switch (key) {
+  case 0x27: return '0';
+  case 0x28: case 0x58: return '\n';
+  case 0x29: return 0x1b;
+  case 0x2a: return '\b';
+  case 0x2c: return ' ';
+  case 0x2d: return '-';
+  case 0x37: return '.';
   }
+  return 0;
 }
 
+int keyboard_parse(const hid_report_t *report, struct hid_kbd_state_S *state, uint8_t const* data, uint16_t len, char *out, int max) {
+  int n = 0;
+
+  // skip report id
+  if(report->report_id_present) {
+    if(!len || data[0] != report->report_id)
+      return 0;
+    data++; len--;
+  }
+  if(len < 8) return 0;
+
+  for(int i = 2; i < 8; i++) {
+    uint8_t key = data[i];
+    if(key < 0x04) continue;              // none or rollover error
+    if(memchr(state->keys, key, 6)) continue;
+    char c = keyboard_ascii(key);
+    if(c && n < max) out[n++] = c;
+  }
+  memcpy(state->keys, data + 2, 6);
+  return n;
+}
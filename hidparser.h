@@ -11,6 +11,31 @@
 
 #define MAX_AXES 4
 
+// report bytes that may hold buttons in a compiled plan
+#define HID_PLAN_BTN_BYTES 3
+
+// Extraction plan compiled from the report descriptor, so per-report parsing
+// is a few loads and table lookups instead of walking bits
+typedef struct {
+	uint8_t valid;
+	struct {
+		uint8_t byte;             // first report byte of the axis
+		uint8_t nbytes;           // bytes to load (1-3)
+		uint8_t shift;            // right shift after little-endian load
+		uint16_t mask;
+		uint16_t sign;            // sign bit, 0 if unsigned
+	} axis[2];
+	uint8_t btn_bytes;            // number of entries in btn_byte/btn_lut
+	uint8_t btn_byte[HID_PLAN_BTN_BYTES];
+	uint16_t btn_lut[HID_PLAN_BTN_BYTES][256];  // button byte -> SNES bits
+	uint8_t hat_present;
+	uint8_t hat_byte;
+	uint8_t hat_shift;
+	uint8_t hat_mask;
+	uint16_t hat_lut[16];         // hat value -> SNES direction bits
+	uint16_t dir[4];              // SNES bits for right, left, down, up
+} hid_plan_t;
+
 // currently only joysticks are supported
 typedef struct {
 	uint8_t type: 2;               // REPORT_TYPE_...
@@ -48,12 +73,25 @@ typedef struct {
 			} hat;                   // 1 hat (joystick only)
 		} joystick_mouse;
 	};
+
+	// SNES bits for joystick state bits 0-7 (RT LT DN UP, buttons 0-3)
+	// and extra buttons 0-7 (buttons 4-11)
+	uint16_t snes_map[16];
+	hid_plan_t plan;
 } hid_report_t;
 
+// default HID button order -> SNES mapping
+extern const uint16_t hid_snes_map[16];
+
 // return true if the report descriptor is a joystick
 // parse raw report descriptor `rep` into hid_report_t `conf`
+// a usable joystick report also gets a compiled plan (conf->plan) using hid_snes_map
 bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes);
 
+// (re)compile conf->plan with SNES mapping `map`. plan.valid is 0 if the
+// report does not fit a plan and the generic parser has to be used.
+void hid_compile_plan(hid_report_t *conf, const uint16_t map[16]);
+
 
 // HID report processing 
 
@@ -63,10 +101,15 @@ struct hid_joystick_state_S {
   unsigned char last_state_x;
   unsigned char last_state_y;
   unsigned char last_state_btn_extra;
+  uint16_t snes;                  // SNES-format state of the last report
+};
+
+struct hid_kbd_state_S {
+  unsigned char keys[6];          // key codes held in the last report
 };
 
 typedef union {
-//   struct hid_kbd_state_S kbd;
+  struct hid_kbd_state_S kbd;
 //   struct hid_mouse_state_S mouse;
   struct hid_joystick_state_S joystick;  
 } hid_state_t;
@@ -77,4 +120,12 @@ void hid_parse(const hid_report_t *report, hid_state_t *state, uint8_t const* da
 // Parse joystick report `buffer` into `state`
 void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *state, const unsigned char *buffer, int nbytes);
 
+// Parse boot-protocol keyboard report `data` (modifiers, reserved, 6 key codes).
+// Keys pressed since the last report are stored in `out` as upper-case ASCII,
+// '\n' (enter), '\b' (backspace) or 0x1b (escape). return number of characters
+int keyboard_parse(const hid_report_t *report, struct hid_kbd_state_S *state, uint8_t const* data, uint16_t len, char *out, int max);
+
+// Parse joystick report `buffer` with the compiled plan, return SNES-format state
+uint16_t joystick_parse_plan(const hid_plan_t *plan, const unsigned char *buffer);
+
 #endif // HIDPARSER_H
@@ -0,0 +1,227 @@
+// ROM loader engine, see loader.h
+
+#include <string.h>
+
+#include "ff.h"
+#include "bflb_mtimer.h"
+
+#include "fastseek.h"
+#include "upload.h"
+#include "hash.h"
+#include "patch.h"
+#include "save.h"
+#include "state.h"
+#include "msu.h"
+#include "disc.h"
+#include "pager.h"
+#include "loader.h"
+#include "utils.h"
+
+extern void set_loading_state(int state);
+extern bool core_running;
+
+struct rom_hash loaded_rom_hash;
+static struct hash_ctx hash;
+
+static bool has_ext(const struct rom_format *fmt, const char *fname) {
+    int n = strlen(fname);
+    for (int i = 0; i < LOADER_MAX_EXTS && fmt->exts[i]; i++) {
+        int e = strlen(fmt->exts[i]);
+        if (n >= e && strcasecmp(fname + n - e, fmt->exts[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// runs on every chunk in the reader, hashes the bytes as they are sent
+static void loader_transform(BYTE *buf, UINT len, uint32_t pos, void *ctx) {
+    struct rom_load *ld = ctx;
+    if (ld->core->format->transform)
+        ld->core->format->transform(ld, buf, len, pos);
+    hash_update(&hash, buf, len);
+}
+
+// a paged ROM (pager.h) went through transform() to the end
+static struct rom_load paged_ld;
+
+static void loader_paged_done(void *ctx) {
+    struct rom_load *ld = ctx;
+    hash_finish(&hash, &loaded_rom_hash);
+    DEBUG("rom_load: paged ROM complete, crc32 %08x\n", loaded_rom_hash.crc32);
+    if (ld->core->format->streamed)
+        ld->core->format->streamed(ld);
+}
+
+static void loader_progress(uint32_t done, uint32_t len, void *ctx) {
+    struct rom_load *ld = ctx;
+    uint64_t now = bflb_mtimer_get_time_ms();
+    if (now - ld->progress_ms < LOADER_PROGRESS_MS)
+        return;
+    ld->progress_ms = now;
+    //              01234567890123456789012345678901
+    overlay_status("%d/%dK %-24s", done >> 10, len >> 10, ld->detail);
+}
+
+// a disc stays on the drive: mount it, then start the core, which reads
+// sectors as it needs them (disc.h)
+static int disc_load(const char *fname) {
+    int r;
+    save_stop();
+    state_set_rom("");
+    msu_stop();
+    pager_stop();
+    if ((r = disc_mount(fname)) != 0)
+        return r;
+
+    set_loading_state(1);           // resets the core
+    core_running = false;
+    bool saving = true;
+    if (save_load(fname)) {
+        overlay_status("Cannot load save, not saving");
+        saving = false;
+    }
+    core_running = true;
+    if (saving)
+        save_start(fname);
+    state_set_rom(fname);
+    overlay(0);
+    set_loading_state(0);           // the core starts and reads the disc
+    return 0;
+}
+
+int rom_load(const struct core_info *core, const char *fname) {
+    const struct rom_format *fmt = core->format;
+    struct rom_load ld = {.core = core, .fname = fname, .fp = &fcore};
+    struct upload_stats st;
+    int r = 1, patch = PATCH_NONE;
+    DEBUG("rom_load: %s\n", fname);
+    loaded_rom_hash.valid = false;
+
+    if ((core_caps & CORE_CAP_DISC) && disc_is_image(fname))
+        return disc_load(fname);
+
+    if (!has_ext(fmt, fname)) {
+        char msg[32] = "Only";
+        for (int i = 0; i < LOADER_MAX_EXTS && fmt->exts[i]; i++) {
+            strcat(msg, " ");
+            strcat(msg, fmt->exts[i]);
+        }
+        overlay_status("%s supported", msg);
+        goto rom_load_end;
+    }
+
+    save_stop();                    // the running game goes away
+    state_set_rom("");
+    msu_stop();
+    pager_stop();
+    disc_unmount();
+
+    if (fastseek_open(&fcore, fname)) {
+        overlay_status("Cannot open file");
+        goto rom_load_end;
+    }
+    ld.size = f_size(&fcore);
+
+    if (fmt->probe && (r = fmt->probe(&ld)) != 0)
+        goto rom_load_close;
+    if (ld.off > ld.size) {
+        overlay_status("File too small");
+        r = 1;
+        goto rom_load_close;
+    }
+    ld.len = ld.size - ld.off;
+    if ((patch = patch_open(fname, &fcore, ld.off, ld.len, &ld.len)) < 0) {
+        r = 1;
+        goto rom_load_close;
+    }
+
+    // with the core's consent, a large ROM starts after its first pages
+    bool paged = (core_caps & CORE_CAP_PAGED) && !patch && ld.len > PAGER_FIRST * PAGER_PAGE &&
+                 ld.len <= PAGER_MAX_PAGES * PAGER_PAGE;
+    uint32_t send_len = paged ? PAGER_FIRST * PAGER_PAGE : ld.len;
+
+    set_loading_state(1);           // enable game loading, this resets the core
+    core_running = false;
+
+    if (fmt->begin && (r = fmt->begin(&ld)) != 0)
+        goto rom_load_stop;
+    if (paged)
+        pager_announce(ld.len);
+
+    if ((r = f_lseek(&fcore, ld.off)) != FR_OK) {
+        overlay_status("Seek failure");
+        goto rom_load_stop;
+    }
+    struct upload_hooks hooks = {
+        .read = patch ? patch_read : NULL,
+        .transform = loader_transform,
+        .progress = loader_progress,
+        .ctx = &ld,
+    };
+    ld.progress_ms = bflb_mtimer_get_time_ms();
+    hash_start(&hash);
+    r = upload_file(&fcore, send_len, &hooks, &st);
+    fastseek_close(&fcore);         // frees fcore for finish()
+    if (r == FR_OK && st.bytes != send_len)
+        r = FR_INT_ERR;
+    if (r) {
+        overlay_status("Read failure at %dK", st.bytes >> 10);
+        goto rom_load_stop;
+    }
+    if (!paged) {
+        hash_finish(&hash, &loaded_rom_hash);
+        DEBUG("rom_load: %d bytes sent, crc32 %08x\n", st.bytes, loaded_rom_hash.crc32);
+    }
+    if (patch && (r = patch_verify(loaded_rom_hash.crc32)) != 0)
+        goto rom_load_stop;
+    patch_close();
+
+    if (fmt->finish && (r = fmt->finish(&ld)) != 0)
+        goto rom_load_stop;
+    // without its save loaded, the game must not overwrite the save file
+    bool saving = true;
+    if (save_load(fname)) {
+        overlay_status("Cannot load save, not saving");
+        saving = false;
+    }
+
+    if (paged) {
+        // the rest follows while the game runs, through the same transform
+        struct pager_hooks ph = {loader_transform, loader_paged_done, &paged_ld};
+        paged_ld = ld;
+        paged_ld.fname = NULL;
+        paged_ld.fp = NULL;
+        if ((r = pager_start(fname, ld.off, ld.len, &ph)) != 0) {
+            overlay_status("Cannot open file");
+            goto rom_load_stop;
+        }
+    }
+
+    upload_report(&st);
+    core_running = true;
+    if (saving)
+        save_start(fname);
+    state_set_rom(fname);
+    msu_start(fname);
+
+    overlay(0);                     // turn off OSD
+
+rom_load_stop:
+    set_loading_state(0);           // turn off game loading, this starts the core
+rom_load_close:
+    fastseek_close(&fcore);         // no-op if already closed
+    patch_close();
+rom_load_end:
+    return r;
+}
+
+int rom_send_file(const char *fname, int state) {
+    struct upload_stats st;
+    FRESULT r = f_open(&fcore, fname, FA_READ);
+    if (r != FR_OK)
+        return r;
+    set_loading_state(state);
+    r = upload_file(&fcore, f_size(&fcore), NULL, &st);
+    f_close(&fcore);
+    return r;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ff.h"
+
+#include "hash.h"
+#include "utils.h"
+
+// ROM loader engine
+//
+// All cores load ROMs through rom_load(). It opens the file with a link map,
+// switches the core into loading state, streams the ROM through the upload
+// pipeline (upload.c), shows throttled progress and reports errors. A core
+// only describes its ROM format in a struct rom_format, referenced from
+// core_info_list, with optional stages for what differs between cores.
+//
+// The engine hashes the ROM data as it is sent (CRC32, and SHA-1 with
+// HASH_SHA1), so loaded_rom_hash identifies the running game. Copier headers
+// before ld->off are not part of the hash.
+//
+// An IPS, BPS or UPS patch next to the ROM is applied on the fly, see patch.h.
+//
+// On a core with CORE_CAP_DISC, a .cue or .iso file is mounted instead of
+// sent, see disc.h. On a core with CORE_CAP_PAGED, only the first pages of
+// a large unpatched ROM go out before the game starts, see pager.h. The rest
+// passes through transform() while the game runs, then streamed() is called.
+//
+// Load sequence:
+//   extension check, open, probe(), patch lookup, loading state 1, begin(),
+//   ROM data from ld->off (transform() on every chunk), finish(),
+//   save RAM (save.h), loading state 0, close
+
+#define LOADER_MAX_EXTS         4
+#define LOADER_PROGRESS_MS      250         // status line refresh while loading
+
+// the ROM file and the shared 8K transfer buffer, defined in main.c
+extern FIL fcore;
+extern BYTE fbuf[BLOCK_SIZE];
+
+// state of one load, passed to all stages
+struct rom_load {
+    const struct core_info *core;
+    const char *fname;
+    FIL *fp;                                // open ROM file
+    uint32_t size;                          // file size
+    uint32_t off;                           // start of ROM data, e.g. after a copier header
+    uint32_t len;                           // bytes of ROM data sent, differs from size - off if patched
+    char detail[24];                        // shown after the progress counter
+    void *ctx;                              // for the stages of the core
+    uint64_t progress_ms;                   // engine use
+};
+
+// each stage returns 0 to continue, non-zero aborts the load
+struct rom_format {
+    const char *exts[LOADER_MAX_EXTS];      // accepted extensions, e.g. ".sfc", NULL terminated
+    // before the core is touched. may read the file, set off and detail
+    int (*probe)(struct rom_load *ld);
+    // in loading state, before the ROM data. e.g. extra header packets
+    int (*begin)(struct rom_load *ld);
+    // on every chunk of ROM data before it is sent. pos is relative to off
+    void (*transform)(struct rom_load *ld, BYTE *buf, UINT len, uint32_t pos);
+    // after the ROM data, the ROM file is closed. e.g. extra payloads
+    int (*finish)(struct rom_load *ld);
+    // paged ROMs: the rest of the ROM went through transform() while the game
+    // runs, from the pager task. ld->fname and ld->fp are no longer valid
+    void (*streamed)(struct rom_load *ld);
+};
+
+// hashes of the last loaded ROM data, valid from finish() on, or from
+// streamed() on for a paged ROM
+extern struct rom_hash loaded_rom_hash;
+
+// load a ROM into the running core. return 0 if successful
+// needs the file system lock
+int rom_load(const struct core_info *core, const char *fname);
+
+// send a whole file to the core in loading state `state`, for extra payloads
+// of finish(). uses fcore, so only after the ROM file is closed
+int rom_send_file(const char *fname, int state);
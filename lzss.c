@@ -0,0 +1,164 @@
+// Streaming LZSS, see lzss.h
+
+#include <string.h>
+
+#include "lzss.h"
+
+#define RING(e, p)      ((e)->ring[(p) & (LZSS_RING - 1)])
+
+static uint32_t hash3(const struct lzss_enc *e, uint32_t p) {
+    uint32_t v = RING(e, p) | RING(e, p + 1) << 8 | RING(e, p + 2) << 16;
+    return (v * 2654435761u) >> (32 - 10);      // LZSS_HASH == 1 << 10
+}
+
+// remember position p as a match candidate
+static void insert(struct lzss_enc *e, uint32_t p) {
+    uint32_t h = hash3(e, p);
+    e->prev[p & (LZSS_WINDOW - 1)] = e->head[h];
+    e->head[h] = p;
+}
+
+static int emit(struct lzss_enc *e, int literal, uint8_t a, uint8_t b) {
+    if (e->items == 0) {
+        e->group[0] = 0;
+        e->group_len = 1;
+    }
+    if (literal) {
+        e->group[0] |= 1 << e->items;
+        e->group[e->group_len++] = a;
+    } else {
+        e->group[e->group_len++] = a;
+        e->group[e->group_len++] = b;
+    }
+    if (++e->items == 8) {
+        e->items = 0;
+        return e->out(e->group, e->group_len, e->ctx);
+    }
+    return 0;
+}
+
+// encode up to `limit`, matches never look past e->end
+static int encode(struct lzss_enc *e, uint32_t limit) {
+    while (e->pos < limit) {
+        uint32_t p = e->pos, avail = e->end - p;
+        int best = 0;
+        uint32_t best_dist = 0;
+        if (avail >= LZSS_MIN) {
+            int max = avail < LZSS_MAX ? avail : LZSS_MAX;
+            uint16_t c16 = e->head[hash3(e, p)];
+            for (int n = 0; n < LZSS_CHAIN; n++) {
+                // candidates hold the low 16 bits of their position
+                uint32_t dist = (uint16_t)(p - c16);
+                if (dist == 0 || dist > LZSS_WINDOW || dist > p)
+                    break;
+                uint32_t c = p - dist;
+                int len = 0;
+                while (len < max && RING(e, c + len) == RING(e, p + len))
+                    len++;
+                if (len > best) {
+                    best = len;
+                    best_dist = dist;
+                    if (len == max)
+                        break;
+                }
+                c16 = e->prev[c & (LZSS_WINDOW - 1)];
+            }
+            insert(e, p);
+        }
+        int r;
+        if (best >= LZSS_MIN) {
+            uint32_t d = best_dist - 1;
+            r = emit(e, 0, d & 0xff, (d >> 8) | (best - LZSS_MIN) << 3);
+            for (int i = 1; i < best; i++)
+                if (e->end - (p + i) >= LZSS_MIN)
+                    insert(e, p + i);
+            e->pos += best;
+        } else {
+            r = emit(e, 1, RING(e, p), 0);
+            e->pos++;
+        }
+        if (r)
+            return r;
+    }
+    return 0;
+}
+
+void lzss_enc_start(struct lzss_enc *e, lzss_out_fn out, void *ctx) {
+    e->pos = e->end = 0;
+    e->items = 0;
+    e->out = out;
+    e->ctx = ctx;
+    memset(e->head, 0, sizeof(e->head));
+}
+
+int lzss_enc_feed(struct lzss_enc *e, const uint8_t *data, uint32_t len) {
+    // the ring keeps the window behind pos and up to LZSS_MAX unencoded bytes
+    const uint32_t step = LZSS_RING - LZSS_WINDOW - LZSS_MAX;
+    while (len) {
+        uint32_t n = len < step ? len : step;
+        for (uint32_t i = 0; i < n; i++)
+            RING(e, e->end + i) = data[i];
+        e->end += n;
+        data += n;
+        len -= n;
+        if (e->end - e->pos >= LZSS_MAX) {
+            int r = encode(e, e->end - LZSS_MAX + 1);
+            if (r)
+                return r;
+        }
+    }
+    return 0;
+}
+
+int lzss_enc_finish(struct lzss_enc *e) {
+    int r = encode(e, e->end);
+    if (r == 0 && e->items) {
+        e->items = 0;
+        r = e->out(e->group, e->group_len, e->ctx);
+    }
+    return r;
+}
+
+void lzss_dec_start(struct lzss_dec *d) {
+    d->pos = 0;
+    d->items = 0;
+    d->copy = 0;
+}
+
+int lzss_dec_read(struct lzss_dec *d, uint8_t *buf, uint32_t len, int (*in)(void *ctx), void *ctx) {
+    uint32_t n = 0;
+    while (n < len) {
+        if (d->copy) {
+            uint8_t b = d->window[(d->pos - d->dist) & (LZSS_WINDOW - 1)];
+            d->window[d->pos++ & (LZSS_WINDOW - 1)] = b;
+            buf[n++] = b;
+            d->copy--;
+            continue;
+        }
+        if (d->items == 0) {
+            int f = in(ctx);
+            if (f < 0)
+                break;                          // end of stream
+            d->flags = f;
+            d->items = 8;
+        }
+        int a = in(ctx);
+        if (a < 0)
+            return n ? (int)n : -1;             // a flushed group may be short
+        d->items--;
+        if (d->flags & 1) {
+            d->window[d->pos++ & (LZSS_WINDOW - 1)] = a;
+            buf[n++] = a;
+        } else {
+            int b = in(ctx);
+            if (b < 0)
+                return -1;
+            d->dist = (a | (b & 7) << 8) + 1;
+            d->copy = (b >> 3) + LZSS_MIN;
+            if (d->dist > d->pos)
+                return -1;
+        }
+        d->flags >>= 1;
+    }
+    return n;
+}
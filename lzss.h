@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// Streaming LZSS
+//
+// Small-window LZ77 for save states: groups of 8 items follow a flag byte
+// (bit set: literal byte, clear: match), a match is 2 bytes of 11-bit
+// distance and 5-bit length (3..34). Both sides keep their state in the
+// structs below, fed and drained in pieces of any size, and use no heap.
+// The encoder takes about 10KB, the decoder 2KB.
+
+#define LZSS_WINDOW     2048            // match distance, power of 2
+#define LZSS_MIN        3
+#define LZSS_MAX        34
+#define LZSS_RING       4096            // encoder input history, power of 2
+#define LZSS_HASH       1024
+#define LZSS_CHAIN      8               // match candidates tried per position
+
+// compressed output goes through this callback
+typedef int (*lzss_out_fn)(const uint8_t *data, uint32_t len, void *ctx);
+
+struct lzss_enc {
+    uint32_t pos;                       // next byte to encode
+    uint32_t end;                       // bytes fed so far
+    uint8_t ring[LZSS_RING];
+    uint16_t head[LZSS_HASH];           // low 16 bits of positions
+    uint16_t prev[LZSS_WINDOW];
+    uint8_t group[1 + 8 * 2];           // flag byte and up to 8 items
+    int group_len, items;
+    lzss_out_fn out;
+    void *ctx;
+};
+
+struct lzss_dec {
+    uint32_t pos;                       // bytes produced so far
+    uint8_t window[LZSS_WINDOW];
+    uint8_t flags;
+    int items;                          // left in the current group
+    uint32_t dist;                      // of the match being copied
+    int copy;                           // bytes left in it
+};
+
+void lzss_enc_start(struct lzss_enc *e, lzss_out_fn out, void *ctx);
+// compress len bytes. return non-zero if the output callback failed
+int lzss_enc_feed(struct lzss_enc *e, const uint8_t *data, uint32_t len);
+// encode what is left and flush the last group
+int lzss_enc_finish(struct lzss_enc *e);
+
+void lzss_dec_start(struct lzss_dec *d);
+// produce up to len bytes into buf, compressed bytes come from in(),
+// which returns the next byte or -1 at the end
+// return bytes produced, -1 if the input ended inside an item
+int lzss_dec_read(struct lzss_dec *d, uint8_t *buf, uint32_t len, int (*in)(void *ctx), void *ctx);
@@ -15,6 +15,7 @@
 #include "bl616_glb.h"
 #include "bflb_gpio.h"
 #include "bflb_uart.h"
+#include "bflb_irq.h"
 #include "bflb_clock.h"
 #include "bl616_clock.h"
 
@@ -23,16 +24,31 @@
 
 #include "programmer.h"
 #include "usb_gamepad.h"
+#include "remap.h"
+#include "dir_index.h"
+#include "catalog.h"
+#include "fastseek.h"
+#include "stream.h"
+#include "disk_cache.h"
+#include "volume.h"
+#include "bounce.h"
+#include "upload.h"
+#include "loader.h"
+#include "save.h"
+#include "state.h"
+#include "msu.h"
+#include "disc.h"
+#include "pager.h"
 #include "utils.h"
 
 // Uncomment this to enable UART console (use with caution. it may interfere with MCU-FPGA communication)
 #define UART_CONSOLE
 
 
-extern int loadnes(const char* fname);
-extern int loadsnes(const char* fname);
-extern int loadgba(const char* fname);
-extern int loadmd(const char* fname);
+extern const struct rom_format nes_format;
+extern const struct rom_format snes_format;
+extern const struct rom_format gba_format;
+extern const struct rom_format md_format;
 
 /////////////////////////////////////////////////////////////////////////////////
 // Global state
@@ -56,9 +72,11 @@ TaskHandle_t uart1_rx_task_handle;
 volatile uint16_t joy1_state = 0;
 volatile uint16_t joy2_state = 0;
 volatile int16_t core_id = -1;
-volatile uint16_t hid1_state = 0;
-volatile uint16_t hid2_state = 0;
+volatile uint16_t hid_states[INPUT_MAX_PLAYERS];
+volatile int32_t core_caps_resp = -1;       // response to command 0x0B
+uint16_t core_caps;                         // capabilities of active core, CORE_CAP_*
 SemaphoreHandle_t state_mutex;              // for all global state access
+static SemaphoreHandle_t uart1_mutex;       // one command packet at a time on UART1
 
 #ifdef TANG_CONSOLE60K
 const char *BOARD_NAME = "console60k";
@@ -180,6 +198,63 @@ int __attribute__((weak)) putchar(int ch) {
 
 /////////////////////////////////////////////////////////////////////////////////
 // Overlay and other core control over UART
+//
+// Firmware -> core commands (multi-byte values LSB first unless noted):
+//   0x01                       get core id, answered with 0x11 id[7:0]
+//   0x04 x[7:0] y[7:0]         move overlay cursor
+//   0x05 str... 0x00           display string at cursor
+//   0x06 state[7:0]            loading state: 0 off, 1 ROM, 2 save RAM, 3 save state, 4 GBA BIOS
+//   0x07 len[23:0] data...     ROM data, length MSB first
+//   0x08 on[7:0]               overlay on/off
+//   0x09 hid1[15:0] hid2[15:0] USB gamepad state of players 1 and 2
+//   0x0A n[7:0] hid[15:0]*n    USB gamepad state of players 1..n (CORE_CAP_MULTI_INPUT)
+//   0x0B                       get core capabilities, answered with 0x12 caps[15:0]
+//   0x0C type[7:0]             GBA save type, see GBA_BACKUP_* (CORE_CAP_BACKUP_TYPE)
+//   0x0D                       get dirty save RAM pages, answered with 0x13 (CORE_CAP_SAVE_RAM)
+//   0x0E page[15:0]            read a save RAM page, answered with 0x14 (CORE_CAP_SAVE_RAM)
+//   0x0F block[15:0]           read a 512-byte block of the core state, answered with 0x15.
+//                              block 0 pauses the game until the last block, block 0xFFFF
+//                              resumes it without an answer (CORE_CAP_SAVE_STATE)
+//   0x10 status[7:0] len[15:0] data...
+//                              answer to 0x16, see MSU_OK etc. (CORE_CAP_MSU)
+//   0x11 status[7:0] len[15:0] data...
+//                              answer to 0x17, see disc.h (CORE_CAP_DISC)
+//   0x12 len[31:0]             the ROM is paged and has len bytes. sent in loading state 1
+//                              before the first pages (CORE_CAP_PAGED)
+//   0x13 page[15:0] piece[7:0] data[1024]
+//                              a piece of a 64KB ROM page, see pager.h (CORE_CAP_PAGED)
+//   0x14 len[23:0] value[7:0]  len bytes of value, continuing 0x07 data in any loading
+//                              state, length MSB first (CORE_CAP_FILL)
+// Core -> firmware:
+//   0x01 joy1[15:0] joy2[15:0] periodic joypad state
+//   0x11 id[7:0]               core id
+//   0x12 caps[15:0]            core capabilities
+//   0x13 n[15:0] bitmap...     save RAM of n 512-byte pages, (n+7)/8 bytes of bits for
+//                              pages written since 0x0E last read them, page 0 in bit 0.
+//                              0x0E clears the bit of its page before the data goes out,
+//                              so a lost reply never loses a write
+//   0x14 page[15:0] data[512]  a save RAM page
+//   0x15 block[15:0] len[15:0] data...
+//                              a block of the core state, len < 512 for the last one
+//   0x16 file[7:0] offset[31:0] len[15:0]
+//                              read up to 1024 bytes of an MSU-1 file: 0 the .msu data,
+//                              N track -N.pcm. one request at a time
+//   0x17 op[7:0] lba[31:0]     read the TOC, a sector or its Q subchannel of the mounted disc
+//   0x18 addr[31:0]            send the ROM page holding addr next
+// Cores ignore commands they do not know, so new commands are only sent
+// after the core has advertised support for them through 0x0B.
+
+// Commands are written with the UART1 lock held, not in a critical section,
+// so that USB transfers keep running while a long ROM packet goes out.
+void uart1_lock(void) {
+    if (uart1_mutex)
+        xSemaphoreTake(uart1_mutex, portMAX_DELAY);
+}
+
+void uart1_unlock(void) {
+    if (uart1_mutex)
+        xSemaphoreGive(uart1_mutex);
+}
 
 int _overlay_on = 1;
 
@@ -189,11 +264,11 @@ int overlay_on() {
 
 void overlay_cursor(int col, int row) {
     // uart1 command: 4 x[7:0] y[7:0]
-    taskENTER_CRITICAL();
+    uart1_lock();
     bflb_uart_putchar(uart1_dev, 0x04);       // command 4, move cursor
     bflb_uart_putchar(uart1_dev, col);
     bflb_uart_putchar(uart1_dev, row);
-    taskEXIT_CRITICAL();
+    uart1_unlock();
 }
 
 void overlay_printf(const char *fmt, ...) {
@@ -203,13 +278,13 @@ void overlay_printf(const char *fmt, ...) {
     vsnprintf(buf, sizeof(buf), fmt, args);
     va_end(args);
 
-    taskENTER_CRITICAL();
+    uart1_lock();
     bflb_uart_putchar(uart1_dev, 0x05);       // command 5, display string
     for(int i = 0; buf[i] != '\0' && i < sizeof(buf); i++) {
         bflb_uart_putchar(uart1_dev, buf[i]);
     }
     bflb_uart_putchar(uart1_dev, '\0');
-    taskEXIT_CRITICAL();
+    uart1_unlock();
 }
 
 void overlay_clear() {
@@ -303,21 +378,61 @@ void get_joypad_states(uint16_t *joy1, uint16_t *joy2, uint16_t *hid1, uint16_t
     if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
         *joy1 = joy1_state;
         *joy2 = joy2_state;
-        *hid1 = hid1_state;
-        *hid2 = hid2_state;
+        *hid1 = hid_states[0];
+        *hid2 = hid_states[1];
+        xSemaphoreGive(state_mutex);
+    }
+}
+
+// read USB gamepad states of all players
+void get_hid_states(uint16_t *hid)
+{
+    if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
+        for (int i = 0; i < INPUT_MAX_PLAYERS; i++)
+            hid[i] = hid_states[i];
         xSemaphoreGive(state_mutex);
     }
 }
 
+// query capabilities of the active core
+// returns 0 (no optional features) for cores that predate command 0x0B
+static uint16_t get_core_caps(void) {
+    if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
+        core_caps_resp = -1;
+        xSemaphoreGive(state_mutex);
+    }
+
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x0B);
+    uart1_unlock();
+    uint64_t start = bflb_mtimer_get_time_ms();
+    while (bflb_mtimer_get_time_ms() - start < 50) {
+        int32_t res = -1;
+        if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
+            res = core_caps_resp;
+            xSemaphoreGive(state_mutex);
+        }
+        if (res >= 0)
+            return res;
+        delay(5);
+    }
+    return 0;
+}
+
+static int16_t caps_core_id = -1;           // core id that core_caps belongs to
+
 // query over UART to return if the correct core is loaded
 // return >= 0 if request is successful, -1 if timeout (200ms)
+// core capabilities are refreshed whenever a different core shows up
 int16_t get_core_id(void) {
     if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
         core_id = -1;
         xSemaphoreGive(state_mutex);
     }
 
+    uart1_lock();
     bflb_uart_putchar(uart1_dev, 0x01);
+    uart1_unlock();
     // TODO: use a queue for better performance
     uint64_t start = bflb_mtimer_get_time_ms();
     while (bflb_mtimer_get_time_ms() - start < 200) {
@@ -325,6 +440,10 @@ int16_t get_core_id(void) {
             int16_t res = core_id;
             if (res >= 0) {
                 xSemaphoreGive(state_mutex);
+                if (res != caps_core_id) {
+                    core_caps = get_core_caps();
+                    caps_core_id = res;
+                }
                 return res;
             }
             xSemaphoreGive(state_mutex);
@@ -336,28 +455,39 @@ int16_t get_core_id(void) {
 
 // set loading state
 void set_loading_state(int state) {
-    taskENTER_CRITICAL();
+    uart1_lock();
     bflb_uart_putchar(uart1_dev, 6);        // 6 loadingstate[7:0]
     bflb_uart_putchar(uart1_dev, state);        
-    taskEXIT_CRITICAL();
+    uart1_unlock();
+}
+
+// tell the core the save type of the ROM being loaded
+// ignored by cores without CORE_CAP_BACKUP_TYPE
+void set_backup_type(int type) {
+    if (!(core_caps & CORE_CAP_BACKUP_TYPE))
+        return;
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x0C);     // 0x0C type[7:0]
+    bflb_uart_putchar(uart1_dev, type);
+    uart1_unlock();
 }
 
 // turn overlay on/off
 void overlay(int state) {
-    taskENTER_CRITICAL();
+    uart1_lock();
     _overlay_on = state;
     bflb_uart_putchar(uart1_dev, 8);        // 8 x[7:0]
     bflb_uart_putchar(uart1_dev, state);        
-    taskEXIT_CRITICAL();
+    uart1_unlock();
 }
 
 // bring FPGA to a good state by sending a few 0's
 void send_blank_packet(void) {
-    taskENTER_CRITICAL();
+    uart1_lock();
     for (int i = 0; i < 8; i++) {
         bflb_uart_putchar(uart1_dev, 0);
     }
-    taskEXIT_CRITICAL();
+    uart1_unlock();
 }
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -373,11 +503,6 @@ FRESULT res_sd = 0;
 #define TOPLINE 2
 #define PWD_SIZE 1024
 char pwd[PWD_SIZE];
-// one page of file names to display
-char file_names[PAGESIZE][256];
-int file_dir[PAGESIZE];         // this file is a directory
-int file_sizes[PAGESIZE];       
-int file_len;		            // number of files on this page
 
 uint32_t get_file_size(const char *fname) {
     FILINFO fno;
@@ -387,7 +512,13 @@ uint32_t get_file_size(const char *fname) {
 }
 
 bool load_core(const char *fname) {
-    FRESULT res_sd = f_mount(&fs, "usb:", 1);
+    save_stop();                        // keep the game's progress before the core goes
+    msu_stop();
+    disc_unmount();
+    pager_stop();
+    caps_core_id = -1;                  // new bitstream, capabilities may change
+    core_caps = 0;
+    FRESULT res_sd = volume_remount();
     if (res_sd != FR_OK) {
         overlay_printf("mount fail, res:%d\r\n", res_sd);
         return false;
@@ -395,7 +526,7 @@ bool load_core(const char *fname) {
     int len = get_file_size(fname);
     overlay_status("Writing %u bytes...", len);
 
-    res_sd = f_open(&fcore, fname, FA_READ);
+    res_sd = fastseek_open(&fcore, fname);
     if (res_sd != FR_OK) {
         overlay_printf("open fail, res:%d\r\n", res_sd);
         return false;
@@ -427,13 +558,6 @@ bool load_core(const char *fname) {
         goto load_core_close;
     }
 
-    BYTE *fbuf_cached;
-    fbuf_cached = malloc(BLOCK_SIZE);
-    if (!fbuf_cached) {
-        overlay_printf("Cannot malloc buffer\r\n");
-        goto load_core_close;
-    }
-
 #define JTAG_FAST
 
     UINT bytes = 0, total = 0;
@@ -444,25 +568,34 @@ bool load_core(const char *fname) {
 #ifdef JTAG_FAST
     taskENTER_CRITICAL();
     jtag_enter_gpio_out_mode();
+    bounce_begin(&bounce_jtag);
     for (;;) {
-        f_read(&fcore, fbuf, BLOCK_SIZE, &bytes);
+        const BYTE *data;
+        bounce_read(&bounce_jtag, &fcore, BOUNCE_SIZE, &bytes, &data);
         if (bytes == 0) break;
         total += bytes;
-        jtag_writeTDI_msb_first_gpio_out_mode(fbuf, bytes, total >= len);
-        if (bytes < BLOCK_SIZE) break;
+        jtag_writeTDI_msb_first_gpio_out_mode(data, bytes, total >= len);
+        if (bytes < BOUNCE_SIZE) break;
     }
+    bounce_end(&bounce_jtag);
     jtag_exit_gpio_out_mode();
-    if (!writeSRAM_end()) {
+    bool programmed = writeSRAM_end();
+    taskEXIT_CRITICAL();
+    if (!programmed) {
         overlay_status("Failed to program SRAM\n");
         goto load_core_close;
     }
-    taskEXIT_CRITICAL();
 
 #else
+    BYTE *fbuf_cached = malloc(BLOCK_SIZE);
+    if (!fbuf_cached) {
+        overlay_printf("Cannot malloc buffer\r\n");
+        goto load_core_close;
+    }
     taskENTER_CRITICAL();
     for (;;) {
         uint64_t time_flash_start = bflb_mtimer_get_time_us();
-        f_read(&fcore, fbuf, BLOCK_SIZE, &bytes);
+        stream_read(&fcore, fbuf, BLOCK_SIZE, &bytes);
         time_flash += bflb_mtimer_get_time_us() - time_flash_start;
         // overlay_status("f_read: offset=%u, bytes=%d, 4 bytes=%02x %02x %02x %02x", 
         //     (uint32_t)f_tell(&fcore), bytes, fbuf[0], fbuf[1], fbuf[2], fbuf[3]);
@@ -479,110 +612,167 @@ bool load_core(const char *fname) {
         total += bytes;
         uint64_t time_jtag_start = bflb_mtimer_get_time_us();
         if (!writeSRAM_send(fbuf_cached, bytes*8, total >= len)) {
+            taskEXIT_CRITICAL();
+            free(fbuf_cached);
             overlay_status("Failed to send data to SRAM\n");
-            goto free_fbuf_cached;
+            goto load_core_close;
         }
         time_jtag += bflb_mtimer_get_time_us() - time_jtag_start;
         if (bytes < BLOCK_SIZE) break;
     } 
-    if (!writeSRAM_end()) {
-        overlay_status("Failed to program SRAM\n");
-        goto free_fbuf_cached;
-    }
+    bool programmed = writeSRAM_end();
     taskEXIT_CRITICAL();
-
     free(fbuf_cached);
+    if (!programmed) {
+        overlay_status("Failed to program SRAM\n");
+        goto load_core_close;
+    }
 #endif
 
     time_total = bflb_mtimer_get_time_us() - time_total;
-    overlay_status("Time: total=%lld us, jtag=%lld us, flash=%lld us, writetdi=%lld us", time_total, time_jtag, 
-        time_flash, jtag_writetdi_time - writetdi_time_start);
+    // overlay_status("Time: total=%lld us, jtag=%lld us, flash=%lld us, writetdi=%lld us", time_total, time_jtag, 
+    //     time_flash, jtag_writetdi_time - writetdi_time_start);
+    stream_report("Core", total, time_total);
 
     // printf("Status after program sram: %x\n", readStatusReg());
     res = true;
 
 load_core_close:
-    f_close(&fcore);
+    fastseek_close(&fcore);
     return res;
 }
 
-// starting from `start`, load `len` file names into file_names, 
-// file_dir. 
-// `*count` is set to number of all valid entries and `file_len` is
-// set to valid entries on this page.
-// `filter` when non-null is a function that takes a file name and returns true if the file is
-// to be included in the list.
-// return: 0 if successful
-int load_dir(char *dir, int start, int len, int *count, bool (*filter)(char *)) {
-    // DEBUG("load_dir: %s, start=%d, len=%d\n", dir, start, len);
-    int cnt = 0;
-    DIR d;
-    file_len = 0;
-
-    if (f_opendir(&d, dir) != 0) {
-        return -1;
-    }
-    // an entry to return to parent dir or main menu 
-    int is_root = dir[1] == '\0';
-    if (start == 0 && len > 0) {
-        if (is_root) {
-            strncpy(file_names[0], "<< Return to main menu", 256);
-            file_dir[0] = 0;
-        } else {
-            strncpy(file_names[0], "..", 256);
-            file_dir[0] = 1;
-        }
-        file_len++;
-    }
-    cnt++;
-
-    // generate all file entries
-    FILINFO fno;
-    while (f_readdir(&d, &fno) == FR_OK) {
-        if (fno.fname[0] == 0)
-            break;
-        if ((fno.fattrib & AM_HID) || (fno.fattrib & AM_SYS))
-             // skip hidden and system files
-            continue;
-        if (filter && !filter(fno.fname))
-            continue;
-        if (cnt >= start && file_len < len) {
-            strncpy(file_names[file_len], fno.fname, 256);
-            file_dir[file_len] = fno.fattrib & AM_DIR;
-            file_sizes[file_len] = fno.fsize;
-            file_len++;
-//            DEBUG("%s\n", fno.fname);
-        }
-        cnt++;
-    }
-    f_closedir(&d);
-    *count = cnt;
-    // DEBUG("load_dir: count=%d\n", cnt);
-    return 0;
-}
-
-// Send a romdata packet to core of len bytes in `fbuf`
-void send_fbuf_data(int len) {
-    taskENTER_CRITICAL();
+// Send a romdata packet to core of len bytes in `buf`
+void send_rom_data(const BYTE *buf, int len) {
+    uart1_lock();
     bflb_uart_putchar(uart1_dev, 7);        // 7 len[23:0] <data>
     bflb_uart_putchar(uart1_dev, (len >> 16) & 0xff);  // MSB first
     bflb_uart_putchar(uart1_dev, (len >> 8) & 0xff);
     bflb_uart_putchar(uart1_dev, len & 0xff);
     for (int i = 0; i < len; i ++) {
-        bflb_uart_putchar(uart1_dev, fbuf[i]);
+        bflb_uart_putchar(uart1_dev, buf[i]);
     }
-    taskEXIT_CRITICAL();
+    uart1_unlock();
+}
+
+// 0x14 len[23:0] value[7:0], len bytes of value continue the ROM data
+void send_rom_fill(uint32_t len, uint8_t value) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x14);
+    bflb_uart_putchar(uart1_dev, (len >> 16) & 0xff);  // MSB first, like 0x07
+    bflb_uart_putchar(uart1_dev, (len >> 8) & 0xff);
+    bflb_uart_putchar(uart1_dev, len & 0xff);
+    bflb_uart_putchar(uart1_dev, value);
+    uart1_unlock();
 }
 
 /////////////////////////////////////////////////////////////////////////////////
 // Menu display and user interaction
 
-// Menus for "NES", "SNES" ... entries
+// wait while letting other tasks use the file system
+static void fs_idle(uint32_t ms) {
+    fs_unlock();
+    delay(ms);
+    fs_lock();
+}
+
+// draw file names of one page of the directory index
+static void draw_page(int page, int total) {
+    for (int i = 0; i < PAGESIZE; i++) {
+        int idx = page*PAGESIZE + i;
+        overlay_cursor(2, i+TOPLINE);
+        if (idx < total) {
+            overlay_printf(dir_index_name(idx));
+            if (idx != 0 && dir_index_entry(idx)->is_dir)
+                overlay_printf("/");
+        }
+    }
+}
+
+#define SEARCH_MAX 24
+static const char search_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 -.";
+
+// Type-to-search in the current directory index, called with the file system lock held.
+// Every change of the prefix jumps to the first matching entry. On the joypad
+// UP/DOWN pick a character, A/RIGHT adds it, B/LEFT deletes the last one
+// (or cancels), START/Y accepts. A USB keyboard types directly, Enter
+// accepts, Esc cancels.
+// c: first character typed, or 0
+// return true if *page and *active were moved to the match
+static bool menu_search(int *page, int *active, int c) {
+    char pre[SEARCH_MAX+1] = "";
+    int len = 0, pick = 0, match = -1;
+    int total = dir_index_count();
+    int shown_page = *page, row = *active;
+    uint16_t last = 0xffff;             // ignore buttons still held from the menu
+    bool changed = true;
+
+    while (1) {
+        if (c == '\n') {
+            if (match < 0)
+                return false;
+            *page = match / PAGESIZE;
+            *active = match % PAGESIZE;
+            return true;
+        } else if (c == 0x1b || (c == '\b' && len == 0)) {
+            return false;
+        } else if (c == '\b') {
+            pre[--len] = '\0';
+            changed = true;
+        } else if (c >= ' ' && c < 0x7f && len < SEARCH_MAX) {
+            pre[len++] = c;
+            pre[len] = '\0';
+            changed = true;
+        }
+
+        if (changed) {
+            match = dir_index_find(pre);
+            overlay_cursor(0, TOPLINE + row);
+            overlay_printf(" ");
+            if (match >= 0) {
+                if (match / PAGESIZE != shown_page) {
+                    shown_page = match / PAGESIZE;
+                    overlay_clear();
+                    draw_page(shown_page, total);
+                }
+                row = match % PAGESIZE;
+            }
+            overlay_cursor(0, TOPLINE + row);
+            overlay_printf(">");
+            overlay_status("Find: %s[%c]%-12s", pre, search_chars[pick],
+                           match < 0 && len ? " not found" : "");
+            changed = false;
+        }
+
+        fs_idle(20);
+        c = usb_keyboard_getc();
+        uint16_t joy1=0, joy2=0, hid1=0, hid2=0;
+        get_joypad_states(&joy1, &joy2, &hid1, &hid2);
+        uint16_t joy = joy1 | joy2 | hid1 | hid2;
+        uint16_t pressed = joy & ~last;
+        last = joy;
+        int n = sizeof(search_chars) - 1;
+        if (pressed & 0x10) {                   // UP: previous character
+            pick = (pick + n - 1) % n;
+            changed = true;
+        } else if (pressed & 0x20) {            // DOWN: next character
+            pick = (pick + 1) % n;
+            changed = true;
+        } else if (pressed & (0x100 | 0x80))    // A, RIGHT: add
+            c = search_chars[pick];
+        else if (pressed & (0x1 | 0x40))        // B, LEFT: delete
+            c = '\b';
+        else if (pressed & (0x8 | 0x2))         // START, Y: accept
+            c = '\n';
+    }
+}
+
+// Menus for "NES", "SNES" ... entries, called with the file system lock held
 // dir: initial dir
 // return 0: user chose a ROM (*choice), 1: no choice made, -1: error
-// file chosen: pwd / file_name[*choice]
-static int menu_loadrom(const char *dir) {
-    res_sd = f_mount(&fs, "usb:", 1);
+// file chosen: pwd / dir_index_name(*choice)
+static int menu_loadrom_locked(const char *dir) {
+    res_sd = volume_remount();
     if (res_sd != FR_OK) {
         overlay_status("Failed to mount USB drive\n");
         return -1;
@@ -591,41 +781,63 @@ static int menu_loadrom(const char *dir) {
     int page = 0, pages, total;
     int active = 0;
     strncpy(pwd, dir, PWD_SIZE);
+    while (usb_keyboard_getc() >= 0)
+        ;                                   // drop keys typed outside the menu
     while (1) {
         overlay_clear();
-        int r = load_dir(pwd, page*PAGESIZE, PAGESIZE, &total, NULL);
+        int r = dir_index_load(pwd, NULL);
         if (r == 0) {
+            total = dir_index_count();
             pages = (total+PAGESIZE-1) / PAGESIZE;
+            int file_len = min(total - page*PAGESIZE, PAGESIZE);     // number of files on this page
             overlay_status("Page ");
             overlay_printf("%d/%d", page+1, pages);
+            if (dir_index_truncated())
+                overlay_printf(" (first %d files)", total-1);
             if (active > file_len-1)
                 active = file_len-1;
-            for (int i = 0; i < PAGESIZE; i++) {
-                int idx = page*PAGESIZE + i;
-                overlay_cursor(2, i+TOPLINE);
-                if (idx < total) {
-                    overlay_printf(file_names[i]);
-                    if (idx != 0 && file_dir[i])
-                        overlay_printf("/");
-                }
-            }
-            delay(300);
+            draw_page(page, total);
+            fs_idle(300);
+            int shown = page*PAGESIZE + active;
             while (1) {
+                fs_unlock();            // the catalog indexer may use the drive while we wait for input
                 int r = joy_choice(TOPLINE, file_len, &active, OSD_KEY_CODE);
+                fs_lock();
+                int key = usb_keyboard_getc();
+                if (key == '\n')
+                    r = 4;                      // Enter picks like button A
+                if (r == 5 || (key > ' ' && key < 0x7f)) {
+                    // Y or typing on a keyboard: search
+                    menu_search(&page, &active, r == 5 ? 0 : key);
+                    break;
+                }
+                if (r == 0 && page*PAGESIZE + active != shown) {
+                    // show catalog title of the highlighted ROM
+                    struct catalog_info info;
+                    shown = page*PAGESIZE + active;
+                    strncpy(fname, pwd, 1024);
+                    strncat(fname, "/", 1024);
+                    strncat(fname, dir_index_name(shown), 1024);
+                    if (shown > 0 && catalog_lookup(fname, &info) && info.title[0])
+                        overlay_status("%d/%d %-24.24s", page+1, pages, info.title);
+                    else
+                        overlay_status("Page %d/%d%-20s", page+1, pages, "");
+                }
                 if (r == 1 || r == 4) {
+                    int idx = page*PAGESIZE + active;
+                    const char *name = dir_index_name(idx);
                     if (strcmp(pwd, dir) == 0 && page == 0 && active == 0) {
                         // return to main menu
                         return 1;
-                    } else if (file_dir[active]) {
-                        if (file_names[active][0] == '.' && file_names[active][1] == '.') {
+                    } else if (dir_index_entry(idx)->is_dir) {
+                        if (name[0] == '.' && name[1] == '.') {
                             // return to parent dir
-                            // message(file_names[active], 1);
                             char *slash = strrchr(pwd, '/');
                             if (slash)
                                 *slash = '\0';
                         } else {								// enter sub dir
                             strncat(pwd, "/", PWD_SIZE);
-                            strncat(pwd, file_names[active], PWD_SIZE);
+                            strncat(pwd, name, PWD_SIZE);
                         }
                         active = 0;
                         page = 0;
@@ -634,13 +846,13 @@ static int menu_loadrom(const char *dir) {
                         // int res = 1;
                         strncpy(fname, pwd, 1024);
                         strncat(fname, "/", 1024);
-                        strncat(fname, file_names[active], 1024);
+                        strncat(fname, name, 1024);
 
                         joy1_state = 0; joy2_state = 0; // clear joypad states
 
                         // pwd determines the type of the ROM
                         if (prefix("usb:cores", pwd)) {
-                            overlay_status("Core: %s", file_names[active]);
+                            overlay_status("Core: %s", name);
                             enable_jtag_pins();
                             load_core(fname);
                             _overlay_on = 1;                // turn on overlay after core is loaded
@@ -688,8 +900,8 @@ static int menu_loadrom(const char *dir) {
 
                                 if (active_core == core->id) {
                                     // Core is ready, load ROM
-                                    overlay_status("Loading ROM: %s", file_names[active]);
-                                    core->load_rom(fname);
+                                    overlay_status("Loading ROM: %s", name);
+                                    rom_load(core, fname);
                                     success = true;
                                     break;
 
@@ -715,7 +927,7 @@ static int menu_loadrom(const char *dir) {
                     page--;
                     break;
                 }
-                delay(10);
+                fs_idle(10);
             }
         } else {
             overlay_status("Error opening director");
@@ -726,31 +938,96 @@ static int menu_loadrom(const char *dir) {
 
 }
 
+static int menu_loadrom(const char *dir) {
+    fs_lock();
+    int r = menu_loadrom_locked(dir);
+    fs_unlock();
+    return r;
+}
+
 static void menu_options(void) {
     // to be implemented
 }
 
+// save and load states of the running game
+static void menu_states(void) {
+    if (!core_running || !(core_caps & CORE_CAP_SAVE_STATE)) {
+        overlay_status("No game with save states running");
+        return;
+    }
+    int active = 0;
+    fs_lock();
+    while (1) {
+        overlay_clear();
+        overlay_cursor(2, TOPLINE);
+        overlay_printf("<< Back");
+        for (int i = 0; i < STATE_SLOTS; i++) {
+            struct state_info info;
+            state_info(i, &info);
+            overlay_cursor(2, TOPLINE + 1 + i);
+            overlay_printf("Save slot %d", i + 1);
+            overlay_cursor(2, TOPLINE + 1 + STATE_SLOTS + i);
+            overlay_printf("Load slot %d", i + 1);
+            if (info.used)
+                overlay_printf("  %dK", info.size >> 10);
+            else
+                overlay_printf("  (empty)");
+        }
+        int r;
+        fs_unlock();
+        while ((r = joy_choice(TOPLINE, 1 + 2 * STATE_SLOTS, &active, OSD_KEY_CODE)) != 1 && r != 4)
+            delay(20);
+        fs_lock();
+        if (active == 0)
+            break;
+        int slot = (active - 1) % STATE_SLOTS;
+        if ((active <= STATE_SLOTS ? state_save(slot) : state_load(slot)) == 0) {
+            overlay(0);                 // back to the game
+            break;
+        }
+        delay(1000);                    // show the error
+    }
+    fs_unlock();
+}
+
+// send USB gamepad state of players 1..n to core
+// cores without CORE_CAP_MULTI_INPUT only get the first two players (command 9)
+static void send_hid_packet(const uint16_t *hid, int n) {
+    uart1_lock();
+    if (core_caps & CORE_CAP_MULTI_INPUT) {
+        bflb_uart_putchar(uart1_dev, 0x0A);
+        bflb_uart_putchar(uart1_dev, n);
+    } else {
+        bflb_uart_putchar(uart1_dev, 0x09);
+        n = 2;
+    }
+    for (int i = 0; i < n; i++) {
+        bflb_uart_putchar(uart1_dev, hid[i] & 0xff);
+        bflb_uart_putchar(uart1_dev, hid[i] >> 8);
+    }
+    uart1_unlock();
+}
+
 // keep sending HID state to core until OSD is turned on
 static void send_hid_to_core(void) {
-    uint16_t hid1_old = 0, hid2_old = 0;
+    uint16_t hid_old[INPUT_MAX_PLAYERS] = {0};
     bool first = true;
     overlay_status("Start sending HID to core...");
     while (1) {
-        uint16_t joy1=0, joy2=0, hid1=0, hid2=0;    
+        uint16_t joy1=0, joy2=0, hid1=0, hid2=0;
+        uint16_t hid[INPUT_MAX_PLAYERS];
         get_joypad_states(&joy1, &joy2, &hid1, &hid2);
-        if (first || hid1 != hid1_old || hid2 != hid2_old) {    // send HID if changed
-            bflb_uart_putchar(uart1_dev, 0x09);         
-            bflb_uart_putchar(uart1_dev, hid1 & 0xff);
-            bflb_uart_putchar(uart1_dev, hid1 >> 8);
-            bflb_uart_putchar(uart1_dev, hid2 & 0xff);
-            bflb_uart_putchar(uart1_dev, hid2 >> 8);
-            hid1_old = hid1;
-            hid2_old = hid2;
+        get_hid_states(hid);
+        if (first || memcmp(hid, hid_old, sizeof(hid)) != 0) {    // send HID if changed
+            send_hid_packet(hid, INPUT_MAX_PLAYERS);
+            memcpy(hid_old, hid, sizeof(hid));
             first = false;
         }
-        if (joy1 == OSD_KEY_CODE || joy2 == OSD_KEY_CODE || hid1 == OSD_KEY_CODE || hid2 == OSD_KEY_CODE) {
+        bool osd = joy1 == OSD_KEY_CODE || joy2 == OSD_KEY_CODE;
+        for (int i = 0; i < INPUT_MAX_PLAYERS; i++)
+            osd = osd || hid[i] == OSD_KEY_CODE;
+        if (osd)
             break;
-        }
         vTaskDelay(pdMS_TO_TICKS(10));
     }
     overlay_status("Stopped sending HID to core.");
@@ -758,6 +1035,7 @@ static void send_hid_to_core(void) {
 
 // // (R L X A RT LT DN UP START SELECT Y B)
 // Return 1 if a button was pressed, 0 otherwise
+// (2: next page, 3: previous page, 4: button A, 5: button Y)
 int joy_choice(int start_line, int len, int *active, int overlay_key_code) {
     if (*active < 0 || *active >= len)
         *active = 0;
@@ -793,6 +1071,8 @@ int joy_choice(int start_line, int len, int *active, int overlay_key_code) {
         return 4;      // button A pressed
     if ((joy1 & 0x1) || (joy2 & 0x1))
         return 1;      // button B pressed
+    if ((joy1 & 0x2) || (joy2 & 0x2))
+        return 5;      // button Y pressed
 
     overlay_cursor(0, start_line + (*active));
     overlay_printf(">");
@@ -809,21 +1089,21 @@ int joy_choice(int start_line, int len, int *active, int overlay_key_code) {
 
 // null-terminated list of core info
 struct core_info core_info_list[] = {
-    {1, "NES", "usb:nes", "nestang.bin", loadnes},
-    {2, "SNES", "usb:snes", "snestang.bin", loadsnes},
-    {3, "Game Boy Advance", "usb:gba", "gbatang.bin", loadgba},
-    {4, "MegaDrive / Genesis", "usb:genesis", "mdtang.bin", loadmd},
+    {1, "NES", "usb:nes", "nestang.bin", &nes_format},
+    {2, "SNES", "usb:snes", "snestang.bin", &snes_format},
+    {3, "Game Boy Advance", "usb:gba", "gbatang.bin", &gba_format},
+    {4, "MegaDrive / Genesis", "usb:genesis", "mdtang.bin", &md_format},
     {0, NULL, NULL, NULL, NULL}
 };
 
 // Main menu listing:
-// >0: core id, -1: cores menu, -2: options menu, 0: end of list
+// >0: core id, -1: cores menu, -2: options menu, -3: save states, 0: end of list
 int16_t main_menu_config[] = 
    {1,2,
 #if defined(TANG_MEGA60K) || defined(TANG_MEGA138K) || defined(TANG_CONSOLE60K) || defined(TANG_CONSOLE138K)
     3,4,
 #endif
-    -1, -2, 0};
+    -1, -3, -2, 0};
 
 // Find a core file in the search order:
 // usb:cores/${BOARD_NAME}/${core_name}
@@ -854,20 +1134,45 @@ bool find_core_for_board(char *fname, const char *core_name) {
 #define UART1_RX_TASK_STACK_SIZE  512
 #define UART1_RX_TASK_PRIORITY    3
 
-extern void fatfs_usbh_driver_register(void);
+// UART1 receive ring, filled by the interrupt handler. The RX FIFO holds
+// 32 bytes, which the 2Mbaud line fills in 160us, so polling it once per
+// tick would lose most of a save RAM page.
+#define UART1_RX_RING  1024                 // power of 2
+static uint8_t rx_ring[UART1_RX_RING];
+static volatile uint16_t rx_head, rx_tail;
+
+static void uart1_isr(int irq, void *arg)
+{
+    BaseType_t woken = pdFALSE;
+    uint32_t status = bflb_uart_get_intstatus(uart1_dev);
+    while (bflb_uart_rxavailable(uart1_dev)) {
+        uint8_t ch = bflb_uart_getchar(uart1_dev);
+        if ((uint16_t)(rx_head - rx_tail) < UART1_RX_RING)     // dropped when full
+            rx_ring[rx_head++ & (UART1_RX_RING - 1)] = ch;
+    }
+    if (status & UART_INTSTS_RTO)
+        bflb_uart_int_clear(uart1_dev, UART_INTCLR_RTO);
+    vTaskNotifyGiveFromISR(uart1_rx_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
 
 // Receive joypad updates and other UART responses from the FPGA
 static void uart1_rx_task(void *pvParameters)
 {
     uint8_t buffer[5];
-    uint8_t pos = 0;
+    int pos = 0;
     uint8_t type = 0;
-    
+
+    bflb_uart_rxint_mask(uart1_dev, false);
+    bflb_irq_attach(uart1_dev->irq_num, uart1_isr, NULL);
+    bflb_irq_enable(uart1_dev->irq_num);
+
     while (1) {
-        if (bflb_uart_rxavailable(uart1_dev)) {
-            uint8_t ch = bflb_uart_getchar(uart1_dev);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (rx_tail != rx_head) {
+            uint8_t ch = rx_ring[rx_tail++ & (UART1_RX_RING - 1)];
             
-            if ((ch == 0x01 || ch == 0x11) && pos == 0) {        // Start of new packet
+            if ((ch == 0x01 || (ch >= 0x11 && ch <= 0x18)) && pos == 0) {        // Start of new packet
                 pos = 1;
                 type = ch;
             } else if (type == 0x1 && pos > 0 && pos < 5) {      // periodic joypad state
@@ -895,11 +1200,45 @@ static void uart1_rx_task(void *pvParameters)
                     xSemaphoreGive(state_mutex);
                 }
                 pos = 0;
+            } else if (type == 0x12 && pos > 0 && pos < 3) { // response to command 0x0B (get core capabilities)
+                buffer[pos-1] = ch;
+                pos++;
+                if (pos == 3) {
+                    if (xSemaphoreTake(state_mutex, portMAX_DELAY) == pdTRUE) {
+                        core_caps_resp = (buffer[1] << 8) | buffer[0];
+                        xSemaphoreGive(state_mutex);
+                    }
+                    pos = 0;
+                }
+            } else if ((type == 0x13 || type == 0x14) && pos > 0) {  // save RAM replies
+                if (save_rx(type, pos - 1, ch))
+                    pos = 0;
+                else
+                    pos++;
+            } else if (type == 0x15 && pos > 0) {           // save state block
+                if (state_rx(pos - 1, ch))
+                    pos = 0;
+                else
+                    pos++;
+            } else if (type == 0x16 && pos > 0) {           // MSU-1 read request
+                if (msu_rx(pos - 1, ch))
+                    pos = 0;
+                else
+                    pos++;
+            } else if (type == 0x17 && pos > 0) {           // disc read request
+                if (disc_rx(pos - 1, ch))
+                    pos = 0;
+                else
+                    pos++;
+            } else if (type == 0x18 && pos > 0) {           // ROM page request
+                if (pager_rx(pos - 1, ch))
+                    pos = 0;
+                else
+                    pos++;
             } else {
                 pos = 0; // Reset if we get out of sync
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(1));
     }
 }
 
@@ -913,12 +1252,18 @@ static void main_task(void *pvParameters)
     // volatile uint32_t *reg_gpio3 = (volatile uint32_t *)0x200008d0;
 
     // wait for USB drive to be ready
+    fs_lock();
     overlay_status("Waiting for USB drive...");
     uint64_t start = bflb_mtimer_get_time_ms();
-    while (f_mount(&fs, "usb:", 1) != FR_OK) {
-        delay(100);
-    }
+    volume_wait();
     overlay_status("USB drive mounted in %d ms", bflb_mtimer_get_time_ms() - start);
+
+    // controller remap profiles
+    int profiles = remap_load(REMAP_FILE);
+    if (profiles >= 0) {
+        overlay_status("%d gamepad profiles loaded", profiles);
+        usb_gamepad_remap();
+    }
     
     // load monitor core at startup
     enable_jtag_pins();
@@ -928,6 +1273,7 @@ static void main_task(void *pvParameters)
         overlay_status("No monitor.bin found for board.");
     }
     disable_jtag_pins();
+    fs_unlock();
 
     int line_start;
     int menu_cnt = 0;
@@ -974,6 +1320,8 @@ static void main_task(void *pvParameters)
                         overlay_printf("Cores");
                     } else if (main_menu_config[i] == -2) {
                         overlay_printf("Options");
+                    } else if (main_menu_config[i] == -3) {
+                        overlay_printf("Save states");
                     }
                 }
 
@@ -981,6 +1329,9 @@ static void main_task(void *pvParameters)
                 overlay_cursor(2, line++);
                 overlay_printf("Version: ");
                 overlay_printf(__DATE__);
+                // each reuse by a loader saves a mount as slow as the last real one
+                if (volume_mounts_saved())
+                    overlay_status("Remounts saved: %u ms", volume_mounts_saved() * volume_mount_ms());
                 last_redraw_time = now;
                 redraw = false;
 
@@ -1016,7 +1367,9 @@ static void main_task(void *pvParameters)
         } else if (main_menu_config[choice] == -2) {
             // Options
             menu_options();
-        } 
+        } else if (main_menu_config[choice] == -3) {
+            menu_states();
+        }
 
         delay(300);
     }
@@ -1055,13 +1408,22 @@ int main(void)
 
     // Create mutex for joypad states
     state_mutex = xSemaphoreCreateMutex();
+    uart1_mutex = xSemaphoreCreateMutex();
+    volume_init();
 
     overlay_status("Initializing USB host...");
 
     // Initializing USB host...
     usbh_initialize();
-    fatfs_usbh_driver_register();
+    disk_cache_register();
     usb_gamepad_init();
+    catalog_init();
+    upload_init();
+    save_init();
+    state_init();
+    msu_init();
+    disc_init();
+    pager_init();
 
     overlay_status("Creating tasks...");
     // Create the tasks
@@ -0,0 +1,268 @@
+// MSU-1 block service, see msu.h
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_uart.h"
+
+#include "fastseek.h"
+#include "stream.h"
+#include "msu.h"
+#include "utils.h"
+
+// above main_task and the UART1 receiver: a reply must not wait behind
+// menu drawing, and the receiver only queues requests
+#define MSU_TASK_STACK_SIZE     512
+#define MSU_TASK_PRIORITY       4
+#define MSU_AHEAD_RETRY_MS      5       // read-ahead retry while the file system is busy
+
+#if MSU_DATA_BUF + MSU_AUDIO_BUF > STREAM_SERVICE_BUF
+#error "MSU buffers do not fit service_buf"
+#endif
+
+extern struct bflb_device_s *uart1_dev;
+
+struct msu_req {
+    uint32_t off;
+    uint16_t len;
+    uint8_t file;                       // 0: data file, N: track N
+};
+
+// a file and what of it is in the buffer
+struct msu_stream {
+    FIL *f;
+    BYTE *buf;
+    uint32_t size;                      // of buf
+    int file;                           // open file number, -1: none
+    uint32_t base;                      // file offset of buf[0], sector aligned
+    uint32_t len;                       // valid bytes in buf
+    uint32_t last;                      // end of the last request served
+};
+
+// the buffers are shared with the disc service, see stream.h
+static USB_NOCACHE_RAM_SECTION FIL data_f, audio_f;
+static struct msu_stream streams[2] = {
+    {&data_f, service_buf, MSU_DATA_BUF, -1},
+    {&audio_f, service_buf + MSU_DATA_BUF, MSU_AUDIO_BUF, -1},
+};
+
+// the running game and the streams. guarded by msu_mutex, which is taken
+// after the file system lock. file access needs both
+static bool active;
+static char base_path[256];             // ROM path without extension
+static SemaphoreHandle_t msu_mutex;
+static StaticSemaphore_t msu_mutex_buf;
+
+static QueueHandle_t req_q;
+static struct msu_req rx_req;           // filled in by msu_rx()
+
+static StackType_t msu_stack[MSU_TASK_STACK_SIZE];
+static StaticTask_t msu_tcb;
+
+bool msu_rx(int idx, uint8_t ch) {
+    if (idx == 0)
+        rx_req.file = ch;
+    else if (idx < 5)                   // offset, LSB first
+        rx_req.off = idx == 1 ? ch : (rx_req.off | (uint32_t)ch << (idx - 1) * 8);
+    else if (idx == 5)
+        rx_req.len = ch;
+    else
+        rx_req.len |= ch << 8;
+    if (idx < 6)
+        return false;
+    xQueueSend(req_q, &rx_req, 0);      // dropped when full, the core asks again
+    return true;
+}
+
+static void stream_close(struct msu_stream *s) {
+    if (s->file >= 0)
+        fastseek_close(s->f);
+    s->file = -1;
+    s->len = s->last = 0;
+}
+
+static int stream_open(struct msu_stream *s, int file) {
+    char path[sizeof(base_path) + 8];
+    if (s->file == file)
+        return 0;
+    stream_close(s);
+    if (file == 0)
+        snprintf(path, sizeof(path), "%s.msu", base_path);
+    else
+        snprintf(path, sizeof(path), "%s-%d.pcm", base_path, file);
+    if (fastseek_open(s->f, path) != FR_OK)
+        return -1;
+    DEBUG("msu: %s, %d fragments\n", path, fastseek_fragments(s->f));
+    s->file = file;
+    return 0;
+}
+
+// fill the buffer from the sector holding `off`
+static FRESULT stream_fill(struct msu_stream *s, uint32_t off) {
+    FRESULT r;
+    UINT br;
+    s->base = off & ~(uint32_t)511;
+    s->len = 0;
+    if ((r = f_lseek(s->f, s->base)) != FR_OK ||
+        (r = stream_read(s->f, s->buf, s->size, &br)) != FR_OK)
+        return r;
+    s->len = br;
+    return FR_OK;
+}
+
+// the game has read past the middle of a full buffer: drop the first half
+// and read the next one behind the second
+static bool stream_wants_ahead(struct msu_stream *s) {
+    return s->file >= 0 && s->len == s->size && s->last >= s->base + s->size / 2 &&
+           s->base + s->len < f_size(s->f);
+}
+
+static void stream_ahead(struct msu_stream *s) {
+    uint32_t half = s->size / 2;
+    UINT br = 0;
+    memmove(s->buf, s->buf + half, half);
+    s->base += half;
+    s->len = half;
+    if (f_lseek(s->f, s->base + half) == FR_OK &&
+        stream_read(s->f, s->buf + half, half, &br) == FR_OK)
+        s->len += br;
+}
+
+static void reply(uint8_t status, const BYTE *data, uint16_t len) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x10);
+    bflb_uart_putchar(uart1_dev, status);
+    bflb_uart_putchar(uart1_dev, len & 0xff);
+    bflb_uart_putchar(uart1_dev, len >> 8);
+    for (int i = 0; i < len; i++)
+        bflb_uart_putchar(uart1_dev, data[i]);
+    uart1_unlock();
+}
+
+// answer a request out of the buffer. needs only msu_mutex
+// return false if it needs the drive
+static bool serve_buffered(const struct msu_req *q) {
+    struct msu_stream *s = &streams[q->file ? 1 : 0];
+    if (s->file != q->file || q->off >= f_size(s->f))
+        return false;
+    uint16_t n = min(min(q->len, (uint16_t)MSU_MAX_REQ), f_size(s->f) - q->off);
+    if (q->off < s->base || q->off + n > s->base + s->len)
+        return false;
+    reply(MSU_OK, s->buf + (q->off - s->base), n);
+    s->last = q->off + n;
+    return true;
+}
+
+// needs the file system lock and msu_mutex
+static void serve(const struct msu_req *q) {
+    struct msu_stream *s = &streams[q->file ? 1 : 0];
+    if (stream_open(s, q->file)) {
+        reply(MSU_NO_FILE, NULL, 0);
+        return;
+    }
+    uint32_t size = f_size(s->f);
+    if (q->off >= size) {
+        reply(MSU_PAST_END, NULL, 0);
+        return;
+    }
+    uint16_t n = min(min(q->len, (uint16_t)MSU_MAX_REQ), size - q->off);
+    if ((q->off < s->base || q->off + n > s->base + s->len) &&
+        (stream_fill(s, q->off) != FR_OK || q->off + n > s->base + s->len)) {
+        reply(MSU_READ_ERROR, NULL, 0);
+        stream_close(s);                // the drive may be gone, open again next time
+        return;
+    }
+    reply(MSU_OK, s->buf + (q->off - s->base), n);
+    s->last = q->off + n;
+}
+
+// slide the buffers the game has read halfway through, while no request
+// waits. never waits for the file system lock, so a request the buffer
+// holds is not held up behind menus or loads.
+// return 1 if a buffer moved, 0 if none wants to, -1 if the lock was busy
+static int read_ahead(void) {
+    int r = 0;
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    bool wants = active && (stream_wants_ahead(&streams[0]) || stream_wants_ahead(&streams[1]));
+    xSemaphoreGive(msu_mutex);
+    if (!wants || uxQueueMessagesWaiting(req_q))
+        return 0;
+    if (!fs_trylock())
+        return -1;
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    for (int i = 0; i < 2; i++) {
+        if (active && stream_wants_ahead(&streams[i]) && uxQueueMessagesWaiting(req_q) == 0) {
+            stream_ahead(&streams[i]);
+            r = 1;
+        }
+    }
+    xSemaphoreGive(msu_mutex);
+    fs_unlock();
+    return r;
+}
+
+static void handle(const struct msu_req *q) {
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    bool done = !active || !(core_caps & CORE_CAP_MSU) || serve_buffered(q);
+    xSemaphoreGive(msu_mutex);
+    if (done)
+        return;
+    // a miss: open, seek or refill through the file system
+    fs_lock();
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    if (active && (core_caps & CORE_CAP_MSU))
+        serve(q);
+    xSemaphoreGive(msu_mutex);
+    fs_unlock();
+}
+
+static void msu_task(void *pvParameters) {
+    struct msu_req q;
+    for (;;) {
+        int ahead = read_ahead();
+        TickType_t wait = ahead > 0 ? 0 : ahead < 0 ? pdMS_TO_TICKS(MSU_AHEAD_RETRY_MS) : portMAX_DELAY;
+        if (xQueueReceive(req_q, &q, wait) == pdTRUE)
+            handle(&q);
+    }
+}
+
+void msu_init(void) {
+    req_q = xQueueCreate(MSU_QUEUE, sizeof(struct msu_req));
+    msu_mutex = xSemaphoreCreateMutexStatic(&msu_mutex_buf);
+    xTaskCreateStatic(msu_task, "msu_task", MSU_TASK_STACK_SIZE, NULL,
+                      MSU_TASK_PRIORITY, msu_stack, &msu_tcb);
+}
+
+// usb:snes/Game.sfc -> usb:snes/Game
+void msu_start(const char *fname) {
+    const char *dot = strrchr(fname, '.');
+    const char *slash = strrchr(fname, '/');
+    int len = dot && (!slash || dot > slash) ? dot - fname : (int)strlen(fname);
+    fs_lock();
+    msu_stop();
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    if ((core_caps & CORE_CAP_MSU) && len < (int)sizeof(base_path)) {
+        memcpy(base_path, fname, len);
+        base_path[len] = '\0';
+        active = true;
+        xQueueReset(req_q);             // requests of the last game
+    }
+    xSemaphoreGive(msu_mutex);
+    fs_unlock();
+}
+
+void msu_stop(void) {
+    fs_lock();
+    xSemaphoreTake(msu_mutex, portMAX_DELAY);
+    active = false;
+    for (int i = 0; i < 2; i++)
+        stream_close(&streams[i]);
+    xSemaphoreGive(msu_mutex);
+    fs_unlock();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// MSU-1 block service
+//
+// MSU-1 games read a data file (<rom>.msu, often hundreds of MB) and audio
+// tracks (<rom>-N.pcm) at any offset while they run. On a core with
+// CORE_CAP_MSU, the core asks for (file, offset, length) with packet 0x16
+// and the MSU task answers with command 0x10 from a read-ahead buffer per
+// stream: one for the data file and one for the playing track. Each open
+// file has a fast-seek link map, so a jump into a large file costs no FAT
+// reads.
+//
+// Latency: the MSU task runs above main_task, so it takes the UART from
+// the OSD and the gamepad traffic as soon as their packet in flight ends.
+// A request the buffer holds is answered without the file system lock, so
+// menus, loads and save flushes do not delay it: it waits for that packet
+// and at most a half-buffer read-ahead the task has already started.
+// Read-ahead runs only while no request waits and the lock is free at
+// once. A miss (a seek out of the buffer, a new track, or a buffer the game
+// outran) needs the file system lock and waits for whoever holds it, e.g. a
+// folder listing or a save flush. The core should ask for PCM data well
+// before its FIFO runs dry: a 44.1kHz stereo track needs 176KB/s, close to
+// the 200KB/s the 2Mbaud link carries.
+//
+// The buffers are service_buf (stream.h), shared with the disc service.
+
+#define MSU_DATA_BUF        (8*1024)    // read-ahead of the data file
+#define MSU_AUDIO_BUF       (16*1024)   // read-ahead of the track, refilled in halves
+#define MSU_MAX_REQ         1024        // bytes in one reply
+#define MSU_QUEUE           4           // requests waiting for the task
+
+// reply status
+#define MSU_OK              0
+#define MSU_NO_FILE         1           // file or track does not exist
+#define MSU_PAST_END        2           // offset at or after the end of the file
+#define MSU_READ_ERROR      3
+
+// start the MSU task
+void msu_init(void);
+
+// serve the MSU files of ROM `fname`, which is running now. does nothing
+// if the core has no CORE_CAP_MSU
+void msu_start(const char *fname);
+
+// close the files and ignore requests until the next msu_start()
+void msu_stop(void);
+
+// bytes of packet 0x16 from the UART1 receiver, `idx` counts from the byte
+// after the packet type. return true when the packet is complete
+bool msu_rx(int idx, uint8_t ch);
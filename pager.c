@@ -0,0 +1,191 @@
+// Demand-paged ROMs, see pager.h
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_uart.h"
+
+#include "fastseek.h"
+#include "stream.h"
+#include "pager.h"
+#include "utils.h"
+
+#define PAGER_TASK_STACK_SIZE   512
+#define PAGER_TASK_PRIORITY     1       // below main_task, see pager.h
+
+#define PIECES                  (PAGER_PAGE / PAGER_PIECE)
+
+extern struct bflb_device_s *uart1_dev;
+
+static USB_NOCACHE_RAM_SECTION FIL pager_f;
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) piece_buf[PAGER_PIECE];
+
+// the paged ROM. guarded by the file system lock
+static bool active;
+static struct pager_hooks hooks;
+static uint32_t rom_off, rom_len;
+static uint32_t next_pos;               // of the background pass, relative to rom_off
+static int demand = -1;                 // page going out on demand
+static int demand_piece;
+static uint8_t sent[PAGER_MAX_PAGES / 8];   // pages the core has in full
+
+static QueueHandle_t req_q;
+static uint32_t rx_addr;                // filled in by pager_rx()
+
+static StackType_t pager_stack[PAGER_TASK_STACK_SIZE];
+static StaticTask_t pager_tcb;
+static TaskHandle_t pager_handle;
+
+bool pager_rx(int idx, uint8_t ch) {
+    rx_addr = idx == 0 ? ch : (rx_addr | (uint32_t)ch << idx * 8);     // LSB first
+    if (idx < 3)
+        return false;
+    xQueueSend(req_q, &rx_addr, 0);     // dropped when full, the core asks again
+    return true;
+}
+
+void pager_announce(uint32_t len) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x12);
+    for (int i = 0; i < 4; i++)
+        bflb_uart_putchar(uart1_dev, len >> (i * 8));
+    uart1_unlock();
+}
+
+static bool is_sent(int page) {
+    return sent[page >> 3] & (1 << (page & 7));
+}
+
+static void set_sent(int page) {
+    sent[page >> 3] |= 1 << (page & 7);
+}
+
+// read a piece of the ROM into piece_buf, zero-padded at the end of the ROM
+// return its length in the ROM, 0 on failure
+static UINT read_piece(uint32_t pos) {
+    UINT n = min(rom_len - pos, (uint32_t)PAGER_PIECE), br;
+    if (f_lseek(&pager_f, rom_off + pos) != FR_OK ||
+        stream_read(&pager_f, piece_buf, n, &br) != FR_OK || br != n)
+        return 0;
+    memset(piece_buf + n, 0, PAGER_PIECE - n);
+    return n;
+}
+
+static void send_piece(int page, int piece) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x13);
+    bflb_uart_putchar(uart1_dev, page & 0xff);
+    bflb_uart_putchar(uart1_dev, page >> 8);
+    bflb_uart_putchar(uart1_dev, piece);
+    for (int i = 0; i < PAGER_PIECE; i++)
+        bflb_uart_putchar(uart1_dev, piece_buf[i]);
+    uart1_unlock();
+}
+
+// one piece of work: a piece of a requested page, or else of the background
+// pass. return false when there is nothing left to do
+static bool pager_step(void) {
+    uint32_t addr;
+    bool more = true;
+    fs_lock();
+    if (!active) {
+        more = false;
+        goto pager_step_end;
+    }
+    if (demand < 0 && xQueueReceive(req_q, &addr, 0) == pdTRUE &&
+        addr < rom_len && !is_sent(addr / PAGER_PAGE)) {
+        demand = addr / PAGER_PAGE;
+        demand_piece = 0;
+    }
+
+    if (demand >= 0) {
+        uint32_t pos = (uint32_t)demand * PAGER_PAGE + demand_piece * PAGER_PIECE;
+        if (!read_piece(pos))
+            goto pager_step_error;
+        send_piece(demand, demand_piece);
+        if (++demand_piece == PIECES || pos + PAGER_PIECE >= rom_len) {
+            set_sent(demand);
+            demand = -1;
+        }
+    } else if (next_pos < rom_len) {
+        int page = next_pos / PAGER_PAGE;
+        UINT n = read_piece(next_pos);
+        if (!n)
+            goto pager_step_error;
+        if (hooks.transform)
+            hooks.transform(piece_buf, n, next_pos, hooks.ctx);
+        if (!is_sent(page))
+            send_piece(page, next_pos % PAGER_PAGE / PAGER_PIECE);
+        next_pos += n;
+        if (next_pos % PAGER_PAGE == 0 || next_pos == rom_len)
+            set_sent(page);
+    } else {
+        DEBUG("pager: all %d pages sent\n", (int)((rom_len + PAGER_PAGE - 1) / PAGER_PAGE));
+        if (hooks.done)
+            hooks.done(hooks.ctx);
+        pager_stop();
+        more = false;
+    }
+    goto pager_step_end;
+
+pager_step_error:
+    // the core keeps asking for what it misses, which would only fail again
+    overlay_status("ROM read failure at %dK",
+                   (int)((demand >= 0 ? (uint32_t)demand * PAGER_PAGE + demand_piece * PAGER_PIECE
+                                      : next_pos) >> 10));
+    pager_stop();
+    more = false;
+pager_step_end:
+    fs_unlock();
+    return more;
+}
+
+static void pager_task(void *pvParameters) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (pager_step())
+            ;
+    }
+}
+
+void pager_init(void) {
+    req_q = xQueueCreate(PAGER_QUEUE, sizeof(uint32_t));
+    pager_handle = xTaskCreateStatic(pager_task, "pager_task", PAGER_TASK_STACK_SIZE, NULL,
+                                     PAGER_TASK_PRIORITY, pager_stack, &pager_tcb);
+}
+
+int pager_start(const char *fname, uint32_t off, uint32_t len, const struct pager_hooks *h) {
+    int r = -1;
+    fs_lock();
+    pager_stop();
+    if (len > (uint32_t)PAGER_MAX_PAGES * PAGER_PAGE || fastseek_open(&pager_f, fname) != FR_OK)
+        goto pager_start_end;
+    hooks = *h;
+    rom_off = off;
+    rom_len = len;
+    next_pos = min(len, (uint32_t)PAGER_FIRST * PAGER_PAGE);
+    demand = -1;
+    memset(sent, 0, sizeof(sent));
+    for (int i = 0; i < PAGER_FIRST; i++)
+        set_sent(i);
+    xQueueReset(req_q);                 // requests of the last game
+    active = true;
+    xTaskNotifyGive(pager_handle);
+    r = 0;
+pager_start_end:
+    fs_unlock();
+    return r;
+}
+
+void pager_stop(void) {
+    fs_lock();
+    if (active)
+        fastseek_close(&pager_f);
+    active = false;
+    fs_unlock();
+}
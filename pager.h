@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ff.h"
+
+// Demand-paged ROMs
+//
+// Sending a 32MB ROM over the 2Mbaud link takes close to three minutes
+// before the game can start. On a core with CORE_CAP_PAGED, rom_load()
+// announces the ROM size with command 0x12, sends only the first
+// PAGER_FIRST pages the usual way and starts the game. The pager task then
+// sends the rest in PAGER_PAGE pages, PAGER_PIECE bytes per command 0x13,
+// in address order in the background. When the game reaches a page that is
+// not there yet, the core asks for it with packet 0x18 addr and the pager
+// sends that page next, after at most the piece in flight. Pieces of one
+// page always go out in order, so the core marks a page present when its
+// last piece arrives. Pieces past the end of the ROM are not sent, the last
+// piece of the last page is the one holding the last byte.
+//
+// The background pass reads every byte of the ROM in address order, also
+// of pages that went out on demand, and hands it to a transform hook. So
+// the ROM hash and the GBA save type scan still see the whole ROM.
+//
+// The pager task spins on the UART FIFO, so it runs below main_task, at the
+// priority of the save task, which still gets its turns by time slicing.
+
+#define PAGER_PAGE          (64*1024)
+#define PAGER_PIECE         1024        // 5ms of UART, so gamepad packets do not wait long
+#define PAGER_FIRST         4           // pages sent before the game starts
+#define PAGER_MAX_PAGES     1024        // 64MB
+#define PAGER_QUEUE         8           // page requests of the core
+
+struct pager_hooks {
+    // on every byte of the ROM once, in address order. pos counts from the ROM start
+    void (*transform)(BYTE *buf, UINT len, uint32_t pos, void *ctx);
+    // after the last page went out
+    void (*done)(void *ctx);
+    void *ctx;
+};
+
+// start the pager task
+void pager_init(void);
+
+// tell the core the ROM is paged and has len bytes, in loading state
+// before the ROM data
+void pager_announce(uint32_t len);
+
+// send the rest of the ROM at `off` in `fname`, the first PAGER_FIRST pages
+// are in the core. return 0 if successful. needs the file system lock
+int pager_start(const char *fname, uint32_t off, uint32_t len, const struct pager_hooks *hooks);
+
+// stop sending, call before the core is reset or replaced
+void pager_stop(void);
+
+// bytes of packet 0x18 from the UART1 receiver, `idx` counts from the byte
+// after the packet type. return true when the packet is complete
+bool pager_rx(int idx, uint8_t ch);
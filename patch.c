@@ -0,0 +1,487 @@
+// Soft patching of ROMs during upload, see patch.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "usbh_core.h"
+
+#include "fastseek.h"
+#include "stream.h"
+#include "hash.h"
+#include "patch.h"
+#include "utils.h"
+
+#define IPS_RLE     0x80000000          // ips_rec.src: run of the value in the low byte
+
+struct ips_rec {
+    uint32_t off;                       // output offset
+    uint32_t src;                       // data position in the patch file, or IPS_RLE | value
+    uint16_t len;
+    uint16_t seq;                       // record order in the patch, later wins
+    uint32_t maxend;                    // max end of this and all earlier sorted records
+};
+
+static USB_NOCACHE_RAM_SECTION FIL patch_f;
+static USB_NOCACHE_RAM_SECTION BYTE pbuf[512];
+static UINT pbuf_pos, pbuf_len;
+static uint32_t patch_size;
+static uint32_t patch_crc;              // CRC32 of the patch without its last 4 bytes
+
+static int type;
+static FIL *src_fp;
+static uint32_t src_off, src_size;
+static uint32_t out_pos, out_size;
+
+// IPS records and BPS window are never needed at the same time
+static union {
+    struct ips_rec ips[PATCH_MAX_RECORDS];
+    BYTE window[PATCH_WINDOW];
+} pool;
+static uint16_t ips_hits[PATCH_MAX_RECORDS];
+static int ips_count, ips_first;
+static bool ips_overlap;                // some records overlap, order matters
+
+// UPS and BPS state
+static uint32_t body_end;               // patch position of the footer
+static uint32_t next_pos;               // UPS: output position of the next XOR byte
+static bool in_run;                     // UPS: inside an XOR run
+static int action;                      // BPS: current action, -1: none
+static uint32_t action_len;             // BPS: bytes left in it
+static int64_t src_rel, tgt_rel;        // BPS: copy cursors
+
+static char patch_path[1024];
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffered sequential reading of the patch file
+
+static uint32_t ptell(void) {
+    return f_tell(&patch_f) - (pbuf_len - pbuf_pos);
+}
+
+static int prefill(void) {
+    UINT br;
+    uint32_t at = f_tell(&patch_f);
+    if (f_read(&patch_f, pbuf, sizeof(pbuf), &br) != FR_OK || br == 0)
+        return -1;
+    if (at + 4 < patch_size)
+        patch_crc = crc32_update(patch_crc, pbuf, min(br, patch_size - 4 - at));
+    pbuf_pos = 0;
+    pbuf_len = br;
+    return 0;
+}
+
+// next byte of the patch, -1 at end of file
+static int pget(void) {
+    if (pbuf_pos == pbuf_len && prefill())
+        return -1;
+    return pbuf[pbuf_pos++];
+}
+
+static int pread(BYTE *dst, uint32_t n) {
+    while (n) {
+        if (pbuf_pos == pbuf_len && prefill())
+            return -1;
+        uint32_t k = min(n, pbuf_len - pbuf_pos);
+        memcpy(dst, pbuf + pbuf_pos, k);
+        pbuf_pos += k;
+        dst += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// skip n bytes. seeks, so only for IPS, which has no patch checksum
+static int pskip(uint32_t n) {
+    if (n <= pbuf_len - pbuf_pos) {
+        pbuf_pos += n;
+        return 0;
+    }
+    uint32_t to = ptell() + n;
+    pbuf_pos = pbuf_len = 0;
+    return f_lseek(&patch_f, to) != FR_OK || to > patch_size ? -1 : 0;
+}
+
+static int pbytes(int n, uint32_t *v) {           // big endian, IPS
+    *v = 0;
+    for (int i = 0; i < n; i++) {
+        int c = pget();
+        if (c < 0)
+            return -1;
+        *v = *v << 8 | c;
+    }
+    return 0;
+}
+
+static int pvlq(uint64_t *v) {                   // BPS and UPS numbers
+    uint64_t data = 0, shift = 1;
+    for (;;) {
+        int x = pget();
+        if (x < 0 || shift > (1ULL << 56))
+            return -1;
+        data += (x & 0x7f) * shift;
+        if (x & 0x80)
+            break;
+        shift <<= 7;
+        data += shift;
+    }
+    *v = data;
+    return 0;
+}
+
+static int pvlq_signed(int64_t *v) {
+    uint64_t d;
+    if (pvlq(&d))
+        return -1;
+    *v = (d & 1 ? -1 : 1) * (int64_t)(d >> 1);
+    return 0;
+}
+
+// read n bytes of the unpatched ROM at `pos`, zeros past its end
+static FRESULT src_read(uint32_t pos, BYTE *dst, uint32_t n) {
+    uint32_t have = pos < src_size ? min(n, src_size - pos) : 0;
+    if (have) {
+        FRESULT r;
+        UINT br;
+        if (f_tell(src_fp) != src_off + pos && (r = f_lseek(src_fp, src_off + pos)) != FR_OK)
+            return r;
+        if ((r = stream_read(src_fp, dst, have, &br)) != FR_OK)
+            return r;
+        if (br != have)
+            return FR_INT_ERR;
+    }
+    memset(dst + have, 0, n - have);
+    return FR_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IPS
+
+static int ips_cmp(const void *a, const void *b) {
+    const struct ips_rec *x = a, *y = b;
+    if (x->off != y->off)
+        return x->off < y->off ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+// return -1 if the patch is malformed, -2 if it does not fit the index
+static int ips_index(void) {
+    uint32_t off, len, v;
+    out_size = src_size;
+    ips_count = 0;
+    for (;;) {
+        if (pbytes(3, &off))
+            return -1;
+        if (off == 0x454f46) {                  // "EOF", optional truncation size
+            if (pbytes(3, &v) == 0)
+                out_size = v;
+            break;
+        }
+        if (pbytes(2, &len))
+            return -1;
+        if (ips_count == PATCH_MAX_RECORDS)
+            return -2;
+        struct ips_rec *rec = &pool.ips[ips_count];
+        rec->off = off;
+        rec->seq = ips_count++;
+        if (len) {
+            rec->src = ptell();
+            if (pskip(len))
+                return -1;
+        } else {                                // RLE record
+            if (pbytes(2, &len) || pbytes(1, &v))
+                return -1;
+            rec->src = IPS_RLE | v;
+        }
+        rec->len = len;
+        out_size = max(out_size, off + len);
+    }
+
+    qsort(pool.ips, ips_count, sizeof(struct ips_rec), ips_cmp);
+    uint32_t end = 0;
+    ips_overlap = false;
+    for (int i = 0; i < ips_count; i++) {
+        if (pool.ips[i].off < end)
+            ips_overlap = true;
+        end = max(end, pool.ips[i].off + pool.ips[i].len);
+        pool.ips[i].maxend = end;
+    }
+    ips_first = 0;
+    return 0;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    return pool.ips[*(const uint16_t *)a].seq - pool.ips[*(const uint16_t *)b].seq;
+}
+
+static FRESULT ips_read(BYTE *buf, uint32_t pos, uint32_t len) {
+    FRESULT r = src_read(pos, buf, len);
+    if (r != FR_OK)
+        return r;
+
+    // records before ips_first all end before this chunk. chunks arrive in
+    // order, so the cursor only moves forward
+    while (ips_first < ips_count && pool.ips[ips_first].maxend <= pos)
+        ips_first++;
+    int hits = 0;
+    for (int i = ips_first; i < ips_count && pool.ips[i].off < pos + len; i++)
+        if (pool.ips[i].off + pool.ips[i].len > pos)
+            ips_hits[hits++] = i;
+    if (ips_overlap)
+        qsort(ips_hits, hits, sizeof(uint16_t), seq_cmp);
+
+    for (int h = 0; h < hits; h++) {
+        struct ips_rec *rec = &pool.ips[ips_hits[h]];
+        uint32_t a = max(rec->off, pos);
+        uint32_t b = min(rec->off + rec->len, pos + len);
+        if (rec->src & IPS_RLE) {
+            memset(buf + a - pos, rec->src & 0xff, b - a);
+        } else {
+            UINT br;
+            if ((r = f_lseek(&patch_f, rec->src + a - rec->off)) != FR_OK ||
+                (r = f_read(&patch_f, buf + a - pos, b - a, &br)) != FR_OK)
+                return r;
+        }
+    }
+    return FR_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UPS
+
+static FRESULT ups_read(BYTE *buf, uint32_t pos, uint32_t len) {
+    FRESULT r = src_read(pos, buf, len);
+    if (r != FR_OK)
+        return r;
+    while (next_pos < pos + len) {
+        if (!in_run) {
+            uint64_t skip;
+            if (ptell() >= body_end)
+                return FR_OK;                   // no more runs
+            if (pvlq(&skip))
+                return FR_INT_ERR;
+            next_pos += skip;
+            in_run = true;
+            continue;
+        }
+        int x = pget();
+        if (x < 0)
+            return FR_INT_ERR;
+        buf[next_pos - pos] ^= x;
+        next_pos++;
+        if (x == 0)
+            in_run = false;
+    }
+    return FR_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BPS
+
+enum { BPS_SOURCE_READ, BPS_TARGET_READ, BPS_SOURCE_COPY, BPS_TARGET_COPY };
+
+static void window_put(const BYTE *p, uint32_t pos, uint32_t n) {
+    while (n) {
+        uint32_t at = pos & (PATCH_WINDOW - 1);
+        uint32_t k = min(n, PATCH_WINDOW - at);
+        memcpy(pool.window + at, p, k);
+        p += k;
+        pos += k;
+        n -= k;
+    }
+}
+
+static FRESULT bps_read(BYTE *buf, uint32_t pos, uint32_t len) {
+    uint32_t i = 0;
+    FRESULT r;
+    while (i < len) {
+        if (action < 0) {
+            uint64_t data;
+            if (ptell() >= body_end || pvlq(&data))
+                return FR_INT_ERR;
+            action = data & 3;
+            action_len = (data >> 2) + 1;
+            if (action == BPS_SOURCE_COPY || action == BPS_TARGET_COPY) {
+                int64_t d;
+                if (pvlq_signed(&d))
+                    return FR_INT_ERR;
+                if (action == BPS_SOURCE_COPY)
+                    src_rel += d;
+                else
+                    tgt_rel += d;
+            }
+        }
+        uint32_t n = min(action_len, len - i);
+        uint32_t at = pos + i;
+        switch (action) {
+        case BPS_SOURCE_READ:
+            if (at + n > src_size || (r = src_read(at, buf + i, n)) != FR_OK)
+                return FR_INT_ERR;
+            break;
+        case BPS_TARGET_READ:
+            if (pread(buf + i, n))
+                return FR_INT_ERR;
+            break;
+        case BPS_SOURCE_COPY:
+            if (src_rel < 0 || src_rel + n > src_size || (r = src_read(src_rel, buf + i, n)) != FR_OK)
+                return FR_INT_ERR;
+            src_rel += n;
+            break;
+        case BPS_TARGET_COPY:
+            if (tgt_rel < 0 || tgt_rel >= at || at - tgt_rel > PATCH_WINDOW) {
+                overlay_status("BPS copy beyond %dK window", PATCH_WINDOW >> 10);
+                return FR_INT_ERR;
+            }
+            // byte by byte, the copy may overlap its own output
+            for (uint32_t k = 0; k < n; k++) {
+                BYTE b = pool.window[tgt_rel++ & (PATCH_WINDOW - 1)];
+                buf[i + k] = b;
+                pool.window[(at + k) & (PATCH_WINDOW - 1)] = b;
+            }
+            break;
+        }
+        if (action != BPS_TARGET_COPY)
+            window_put(buf + i, at, n);
+        action_len -= n;
+        if (action_len == 0)
+            action = -1;
+        i += n;
+    }
+    return FR_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int open_patch(const char *fname) {
+    static const char *const exts[] = {".ips", ".bps", ".ups"};
+    const char *dot = strrchr(fname, '.');
+    int base = dot ? dot - fname : (int)strlen(fname);
+    if (base + 5 > (int)sizeof(patch_path))
+        return PATCH_NONE;
+    memcpy(patch_path, fname, base);
+    for (int i = 0; i < 3; i++) {
+        strcpy(patch_path + base, exts[i]);
+        if (fastseek_open(&patch_f, patch_path) == FR_OK)
+            return i == 0 ? PATCH_IPS : i == 1 ? PATCH_BPS : PATCH_UPS;
+    }
+    return PATCH_NONE;
+}
+
+int patch_open(const char *fname, FIL *src, uint32_t src_offset, uint32_t size,
+               uint32_t *out) {
+    uint64_t in_len, out_len, meta;
+    BYTE magic[5];
+    int e;
+
+    type = open_patch(fname);
+    if (type == PATCH_NONE)
+        return PATCH_NONE;
+    src_fp = src;
+    src_off = src_offset;
+    src_size = size;
+    out_pos = 0;
+    patch_size = f_size(&patch_f);
+    patch_crc = 0;
+    pbuf_pos = pbuf_len = 0;
+    body_end = patch_size - 12;
+
+    switch (type) {
+    case PATCH_IPS:
+        if (pread(magic, 5) || memcmp(magic, "PATCH", 5) || (e = ips_index()) == -1)
+            goto patch_open_bad;
+        if (e) {
+            overlay_status("IPS patch over %d records", PATCH_MAX_RECORDS);
+            patch_close();
+            return -1;
+        }
+        break;
+    case PATCH_UPS:
+        if (patch_size < 18 || pread(magic, 4) || memcmp(magic, "UPS1", 4) ||
+            pvlq(&in_len) || pvlq(&out_len))
+            goto patch_open_bad;
+        if (in_len != src_size)
+            goto patch_open_wrong_rom;
+        out_size = out_len;
+        next_pos = 0;
+        in_run = false;
+        break;
+    case PATCH_BPS:
+        if (patch_size < 19 || pread(magic, 4) || memcmp(magic, "BPS1", 4) ||
+            pvlq(&in_len) || pvlq(&out_len) || pvlq(&meta))
+            goto patch_open_bad;
+        if (in_len != src_size)
+            goto patch_open_wrong_rom;
+        while (meta--)
+            if (pget() < 0)
+                goto patch_open_bad;
+        out_size = out_len;
+        action = -1;
+        src_rel = tgt_rel = 0;
+        break;
+    }
+    *out = out_size;
+    overlay_status("Patching with %s", strrchr(patch_path, '/') ? strrchr(patch_path, '/') + 1 : patch_path);
+    return type;
+
+patch_open_wrong_rom:
+    overlay_status("Patch is for a different ROM size");
+    patch_close();
+    return -1;
+patch_open_bad:
+    overlay_status("Bad patch file");
+    patch_close();
+    return -1;
+}
+
+FRESULT patch_read(BYTE *buf, UINT len, UINT *br, void *ctx) {
+    FRESULT r;
+    len = min(len, out_size - out_pos);
+    *br = 0;
+    if (type == PATCH_IPS)
+        r = ips_read(buf, out_pos, len);
+    else if (type == PATCH_UPS)
+        r = ups_read(buf, out_pos, len);
+    else
+        r = bps_read(buf, out_pos, len);
+    if (r != FR_OK)
+        return r;
+    out_pos += len;
+    *br = len;
+    return FR_OK;
+}
+
+int patch_verify(uint32_t out_crc) {
+    BYTE footer[12];
+    if (type != PATCH_UPS && type != PATCH_BPS)
+        return 0;
+    if (ptell() != body_end) {
+        // a UPS patch may end in runs past the output, skip them
+        while (ptell() < body_end)
+            if (pget() < 0)
+                break;
+    }
+    if (ptell() != body_end || pread(footer, 12))
+        goto patch_verify_bad;
+    uint32_t target = footer[4] | footer[5] << 8 | footer[6] << 16 | (uint32_t)footer[7] << 24;
+    uint32_t crc = footer[8] | footer[9] << 8 | footer[10] << 16 | (uint32_t)footer[11] << 24;
+    if (crc != patch_crc) {
+        overlay_status("Patch file is corrupt");
+        return 1;
+    }
+    if (target != out_crc) {
+        overlay_status("Patched ROM CRC mismatch");
+        return 1;
+    }
+    return 0;
+
+patch_verify_bad:
+    overlay_status("Bad patch file");
+    return 1;
+}
+
+void patch_close(void) {
+    if (type == PATCH_NONE)
+        return;
+    fastseek_close(&patch_f);
+    type = PATCH_NONE;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ff.h"
+
+// Soft patching of ROMs during upload
+//
+// If an IPS, BPS or UPS patch with the ROM's base name sits next to it
+// (game.sfc -> game.ips, game.bps or game.ups), the loader uploads the
+// patched ROM. patch_read() produces the patched data chunk by chunk from
+// the ROM and the patch file, so the result never exists in full:
+//
+// - IPS: the records are indexed once, sorted by offset. A chunk only visits
+//   the records that overlap it.
+// - UPS: XOR runs applied in one forward pass over the patch.
+// - BPS: the actions run in one forward pass. Target copies read from a
+//   window of the last PATCH_WINDOW output bytes.
+//
+// Patches apply to the ROM data after a copier header (the loader's off).
+// The CRCs in BPS and UPS footers are checked by patch_verify() after the
+// upload.
+
+#define PATCH_MAX_RECORDS   2048        // IPS records
+#define PATCH_WINDOW        (16*1024)   // reach of BPS target copies, power of 2
+
+enum {
+    PATCH_NONE,
+    PATCH_IPS,
+    PATCH_UPS,
+    PATCH_BPS,
+};
+
+// look for a patch for ROM `fname`. `src` is the open ROM, its data is
+// `src_size` bytes at `src_off`.
+// return PATCH_NONE if there is none, the patch type with *out_size set to
+// the size of the patched ROM, or -1 if the patch is unusable (message shown)
+int patch_open(const char *fname, FIL *src, uint32_t src_off, uint32_t src_size,
+               uint32_t *out_size);
+
+// next `len` bytes of the patched ROM, upload read hook
+FRESULT patch_read(BYTE *buf, UINT len, UINT *br, void *ctx);
+
+// check the patch footer against the CRC32 of the uploaded data
+// return 0 if it matches or the format has no checksums
+int patch_verify(uint32_t out_crc);
+
+// close the patch file, no-op if none is open
+void patch_close(void);
@@ -0,0 +1,170 @@
+// Controller remapping with per-device profiles
+//
+// Profile file format, one pad per line:
+//
+//   # 8bitdo SN30 in D-input mode
+//   2dc8:6101 b0=B b1=A b3=Y b4=X b6=L b7=R b10=SELECT b11=START
+//
+// Inputs are right, left, down, up and b0-b11 (button number in the pad's own
+// order; for Xinput pads b0-b3 are A B X Y, b4/b5 LB/RB, b8/b9 BACK/START).
+// Targets are SNES buttons B Y SELECT START UP DOWN LEFT RIGHT A X L R, or
+// NONE, and may be combined with '+'. Inputs not listed keep their default.
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ff.h"
+#include "usbh_core.h"
+
+#include "remap.h"
+#include "bounce.h"
+#include "utils.h"
+
+struct remap_profile {
+    uint16_t vid;
+    uint16_t pid;
+    uint16_t set;                   // inputs assigned by this profile
+    uint16_t map[REMAP_INPUTS];
+};
+
+static struct remap_profile profiles[REMAP_MAX_PROFILES];
+static int profile_cnt;
+
+#define REMAP_FILE_MAX 4096
+
+static const char *snes_names[12] = {
+    "B", "Y", "SELECT", "START", "UP", "DOWN", "LEFT", "RIGHT", "A", "X", "L", "R"
+};
+
+static const char *dir_names[4] = { "right", "left", "down", "up" };
+
+void remap_compile(const uint16_t map[REMAP_INPUTS], struct remap_lut *lut) {
+    for (int v = 0; v < 256; v++) {
+        uint16_t m = 0, e = 0;
+        for (int i = 0; i < 8; i++) {
+            if (v & (1 << i)) {
+                m |= map[i];
+                e |= map[i+8];
+            }
+        }
+        lut->main[v] = m;
+        lut->extra[v] = e;
+    }
+}
+
+const uint16_t *remap_find(uint16_t vid, uint16_t pid, const uint16_t def[REMAP_INPUTS], uint16_t out[REMAP_INPUTS]) {
+    const uint16_t *res = def;
+    taskENTER_CRITICAL();
+    for (int i = 0; i < profile_cnt; i++) {
+        struct remap_profile *p = &profiles[i];
+        if (p->vid != vid || p->pid != pid) continue;
+        for (int j = 0; j < REMAP_INPUTS; j++)
+            out[j] = (p->set & (1 << j)) ? p->map[j] : def[j];
+        res = out;
+        break;
+    }
+    taskEXIT_CRITICAL();
+    return res;
+}
+
+// input name -> logical input index, -1 if unknown
+static int parse_input(const char *s, int len) {
+    for (int i = 0; i < 4; i++)
+        if (strlen(dir_names[i]) == len && strncasecmp(s, dir_names[i], len) == 0)
+            return i;
+    if (len >= 2 && len <= 3 && (s[0] == 'b' || s[0] == 'B')) {
+        int n = 0;
+        for (int i = 1; i < len; i++) {
+            if (s[i] < '0' || s[i] > '9') return -1;
+            n = n * 10 + s[i] - '0';
+        }
+        if (n < 12) return n + 4;
+    }
+    return -1;
+}
+
+// "A+B" -> SNES bits, -1 if unknown
+static int parse_target(const char *s, int len) {
+    int bits = 0;
+    while (len > 0) {
+        int n = 0;
+        while (n < len && s[n] != '+') n++;
+        if (n == 4 && strncasecmp(s, "NONE", 4) == 0) {
+            // nothing
+        } else {
+            int i;
+            for (i = 0; i < 12; i++)
+                if (strlen(snes_names[i]) == n && strncasecmp(s, snes_names[i], n) == 0)
+                    break;
+            if (i == 12) return -1;
+            bits |= 1 << i;
+        }
+        s += n + 1;
+        len -= n + 1;
+    }
+    return bits;
+}
+
+static bool parse_line(char *line, struct remap_profile *p) {
+    char *s = line;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '#' || *s == '\0') return false;
+
+    char *end;
+    memset(p, 0, sizeof(*p));
+    p->vid = strtoul(s, &end, 16);
+    if (*end != ':') return false;
+    p->pid = strtoul(end+1, &end, 16);
+
+    for (s = end; *s; ) {
+        while (*s == ' ' || *s == '\t') s++;
+        char *tok = s;
+        while (*s && *s != ' ' && *s != '\t') s++;
+        char *eq = memchr(tok, '=', s - tok);
+        if (!eq) continue;
+        int input = parse_input(tok, eq - tok);
+        int target = parse_target(eq+1, s - eq - 1);
+        if (input < 0 || target < 0) {
+            overlay_status("gamepads.txt: bad entry %.*s", (int)(s - tok), tok);
+            continue;
+        }
+        p->map[input] = target;
+        p->set |= 1 << input;
+    }
+    return true;
+}
+
+static USB_NOCACHE_RAM_SECTION FIL remap_f;     // its sector buffer is a DMA target
+
+int remap_load(const char *fname) {
+    char *buf = malloc(REMAP_FILE_MAX + 1);
+    int cnt = -1;
+    UINT br = 0;
+    if (!buf) goto remap_load_end;
+    if (f_open(&remap_f, fname, FA_READ) != FR_OK) goto remap_load_end;
+    bounce_read_to(&remap_f, buf, REMAP_FILE_MAX, &br);
+    f_close(&remap_f);
+    buf[br] = '\0';
+
+    // parse into a local table first, so the input task never sees half a profile
+    struct remap_profile *tmp = malloc(sizeof(profiles));
+    if (!tmp) goto remap_load_end;
+    cnt = 0;
+    for (char *line = buf; line && *line && cnt < REMAP_MAX_PROFILES; ) {
+        char *eol = strpbrk(line, "\r\n");
+        if (eol) *eol++ = '\0';
+        if (parse_line(line, &tmp[cnt]))
+            cnt++;
+        line = eol;
+    }
+
+    taskENTER_CRITICAL();
+    memcpy(profiles, tmp, sizeof(profiles));
+    profile_cnt = cnt;
+    taskEXIT_CRITICAL();
+    free(tmp);
+
+remap_load_end:
+    free(buf);
+    return cnt;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Controller remapping
+//
+// A pad reports 16 logical inputs: joystick state bits 0-7 (right, left, down,
+// up, buttons 0-3) and extra button bits 0-7 (buttons 4-11). A map gives the
+// SNES bits for each of them. Maps are compiled into two 256-entry tables, so
+// translating a report costs two loads and an OR whatever the mapping is.
+//
+// Profiles keyed by VID/PID are loaded from REMAP_FILE on the USB drive.
+
+#define REMAP_FILE          "usb:gamepads.txt"
+#define REMAP_MAX_PROFILES  16
+#define REMAP_INPUTS        16
+
+struct remap_lut {
+    uint16_t main[256];             // joystick state byte -> SNES bits
+    uint16_t extra[256];            // extra button byte -> SNES bits
+};
+
+static inline uint16_t remap_apply(const struct remap_lut *lut, uint8_t state, uint8_t extra) {
+    return lut->main[state] | lut->extra[extra];
+}
+
+// build lookup tables from `map`
+void remap_compile(const uint16_t map[REMAP_INPUTS], struct remap_lut *lut);
+
+// look up the mapping for a device. returns `def` if there is no profile,
+// otherwise `def` with the profile's assignments applied, in `out`.
+const uint16_t *remap_find(uint16_t vid, uint16_t pid, const uint16_t def[REMAP_INPUTS], uint16_t out[REMAP_INPUTS]);
+
+// (re)load profiles from a file on the USB drive
+// return number of profiles loaded, -1 if the file cannot be read
+int remap_load(const char *fname);
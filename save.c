@@ -0,0 +1,259 @@
+// Battery save RAM service, see save.h
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_mtimer.h"
+#include "bflb_uart.h"
+
+#include "loader.h"
+#include "save.h"
+#include "utils.h"
+
+#define SAVE_TASK_STACK_SIZE    512
+#define SAVE_TASK_PRIORITY      1       // below main_task and the upload task
+
+extern struct bflb_device_s *uart1_dev;
+extern bool core_running;
+
+// write-behind buffer, sorted by page. uncached, f_write() sends whole
+// sectors straight from here
+static USB_NOCACHE_RAM_SECTION FIL save_f;
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) wb[SAVE_BUF_PAGES][SAVE_PAGE];
+static uint16_t wb_page[SAVE_BUF_PAGES];
+static int wb_count;
+
+// the running game and the buffer. guarded by save_mutex, which is taken
+// after the file system lock. The save task holds the file system lock only
+// to write the buffer, pages come from the core without it
+static SemaphoreHandle_t save_mutex;
+static char save_path[256];
+static bool active;
+static uint32_t file_size;              // of the save file when the game started
+static uint16_t pages;                  // save RAM size of the game, 0: not known yet
+static uint8_t pending[SAVE_MAX_PAGES / 8];  // dirty in the core, not fetched yet
+static bool filling;                    // all pages pending, to complete a short file
+static uint64_t last_change_ms;         // when a page last went into the buffer
+
+// replies of the core, filled in by save_rx()
+static uint16_t rx_pages;
+static uint8_t rx_bitmap[SAVE_MAX_PAGES / 8];
+static uint16_t rx_page_no;
+static uint8_t rx_page[SAVE_PAGE];
+static SemaphoreHandle_t reply_sem;
+
+static StackType_t save_stack[SAVE_TASK_STACK_SIZE];
+static StaticTask_t save_tcb;
+static StaticSemaphore_t reply_sem_buf;
+static StaticSemaphore_t save_mutex_buf;
+
+bool save_rx(uint8_t type, int idx, uint8_t ch) {
+    if (idx < 2) {                      // page count or page number, LSB first
+        uint16_t *v = type == 0x13 ? &rx_pages : &rx_page_no;
+        *v = idx == 0 ? ch : (*v | ch << 8);
+        if (type != 0x13 || idx == 0 || rx_pages != 0)
+            return false;
+    } else if (type == 0x13) {
+        int i = idx - 2;
+        if (i < (int)sizeof(rx_bitmap))
+            rx_bitmap[i] = ch;
+        if (i < (rx_pages + 7) / 8 - 1)
+            return false;
+    } else {
+        rx_page[idx - 2] = ch;
+        if (idx - 2 < SAVE_PAGE - 1)
+            return false;
+    }
+    xSemaphoreGive(reply_sem);
+    return true;
+}
+
+// send a command and wait for the reply. page < 0: command without argument
+static int request(uint8_t cmd, int page) {
+    xSemaphoreTake(reply_sem, 0);       // drop a late reply to an earlier request
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, cmd);
+    if (page >= 0) {
+        bflb_uart_putchar(uart1_dev, page & 0xff);
+        bflb_uart_putchar(uart1_dev, page >> 8);
+    }
+    uart1_unlock();
+    return xSemaphoreTake(reply_sem, pdMS_TO_TICKS(SAVE_TIMEOUT_MS)) == pdTRUE ? 0 : -1;
+}
+
+static void wb_add(uint16_t page, const uint8_t *data) {
+    int i = 0;
+    while (i < wb_count && wb_page[i] < page)
+        i++;
+    if (i == wb_count || wb_page[i] != page) {
+        memmove(wb[i + 1], wb[i], (wb_count - i) * SAVE_PAGE);
+        memmove(&wb_page[i + 1], &wb_page[i], (wb_count - i) * sizeof(uint16_t));
+        wb_page[i] = page;
+        wb_count++;
+    }
+    memcpy(wb[i], data, SAVE_PAGE);
+}
+
+// write out the buffer, one f_write per run of consecutive pages. on
+// failure its pages are pending again. needs the file system lock
+static FRESULT wb_flush(void) {
+    FRESULT r;
+    UINT bw;
+    if (wb_count == 0)
+        return FR_OK;
+    f_mkdir(SAVE_DIR);
+    if ((r = f_open(&save_f, save_path, FA_WRITE | FA_OPEN_ALWAYS)) != FR_OK)
+        goto wb_flush_end;
+    for (int i = 0, j; i < wb_count; i = j) {
+        for (j = i + 1; j < wb_count && wb_page[j] == wb_page[j - 1] + 1; j++)
+            ;
+        if ((r = f_lseek(&save_f, (uint32_t)wb_page[i] * SAVE_PAGE)) != FR_OK ||
+            (r = f_write(&save_f, wb[i], (j - i) * SAVE_PAGE, &bw)) != FR_OK)
+            break;
+    }
+    file_size = max(file_size, (uint32_t)f_size(&save_f));
+    if (f_close(&save_f) != FR_OK && r == FR_OK)
+        r = FR_DISK_ERR;
+wb_flush_end:
+    if (r) {
+        DEBUG("save: write failed %d\n", r);
+        // the core has cleared their dirty bits: fetch the pages again next time
+        for (int i = 0; i < wb_count; i++)
+            pending[wb_page[i] >> 3] |= 1 << (wb_page[i] & 7);
+    }
+    wb_count = 0;
+    return r;
+}
+
+// fetch dirty pages into the buffer, as many as fit. UART only, no drive access
+// return true if the buffer filled up with pages still pending
+static bool save_fetch(void) {
+    bool full = false;
+    if (request(0x0D, -1) == 0) {
+        bool dirty = false;
+        pages = min(rx_pages, (uint16_t)SAVE_MAX_PAGES);
+        for (int i = 0; i < (pages + 7) / 8; i++) {
+            pending[i] |= rx_bitmap[i];
+            dirty |= pending[i] != 0;
+        }
+        // the file must hold all pages before single pages go into it. they
+        // may take several buffers
+        if (dirty && !filling && file_size < (uint32_t)pages * SAVE_PAGE) {
+            memset(pending, 0xff, (pages + 7) / 8);
+            filling = true;
+        }
+
+        int p;
+        for (p = 0; dirty && p < pages; p++) {
+            if (!(pending[p >> 3] & (1 << (p & 7))))
+                continue;
+            if (wb_count == SAVE_BUF_PAGES) {
+                full = true;
+                break;
+            }
+            if (request(0x0E, p) || rx_page_no != p)
+                break;                  // still pending, try again next time
+            wb_add(p, rx_page);
+            pending[p >> 3] &= ~(1 << (p & 7));
+            last_change_ms = bflb_mtimer_get_time_ms();
+        }
+        if (p == pages)
+            filling = false;            // all fetched. a failed write refills next time
+    }
+    return full;
+}
+
+// fetch what the game changed, write the buffer when it is full or the game
+// went quiet
+static void save_poll(void) {
+    bool full, flush;
+    do {
+        xSemaphoreTake(save_mutex, portMAX_DELAY);
+        full = flush = false;
+        if (active && core_running && (core_caps & CORE_CAP_SAVE_RAM)) {
+            full = save_fetch();
+            flush = wb_count && (full || bflb_mtimer_get_time_ms() - last_change_ms >= SAVE_FLUSH_MS);
+        }
+        xSemaphoreGive(save_mutex);
+        if (flush) {
+            fs_lock();
+            xSemaphoreTake(save_mutex, portMAX_DELAY);
+            // save_stop() may have written it already. after a failure
+            // try again at the next poll, not at once
+            if (active && wb_flush() != FR_OK)
+                full = false;
+            xSemaphoreGive(save_mutex);
+            fs_unlock();
+        }
+    } while (full);                     // the rest of the pages right away
+}
+
+static void save_task(void *pvParameters) {
+    for (;;) {
+        delay(SAVE_POLL_MS);
+        save_poll();
+    }
+}
+
+void save_init(void) {
+    reply_sem = xSemaphoreCreateBinaryStatic(&reply_sem_buf);
+    save_mutex = xSemaphoreCreateMutexStatic(&save_mutex_buf);
+    xTaskCreateStatic(save_task, "save_task", SAVE_TASK_STACK_SIZE, NULL,
+                      SAVE_TASK_PRIORITY, save_stack, &save_tcb);
+}
+
+// usb:snes/Game.sfc -> usb:saves/Game.srm
+static bool make_path(const char *fname) {
+    const char *name = strrchr(fname, '/');
+    name = name ? name + 1 : strchr(fname, ':') ? strchr(fname, ':') + 1 : fname;
+    const char *dot = strrchr(name, '.');
+    int len = dot ? dot - name : (int)strlen(name);
+    if (len + sizeof(SAVE_DIR "/.srm") > sizeof(save_path))
+        return false;
+    strcpy(save_path, SAVE_DIR "/");
+    strncat(save_path, name, len);
+    strcat(save_path, ".srm");
+    return true;
+}
+
+int save_load(const char *fname) {
+    FILINFO fno;
+    if (!(core_caps & CORE_CAP_SAVE_RAM) || !make_path(fname) ||
+        f_stat(save_path, &fno) != FR_OK)
+        return 0;
+    DEBUG("save: loading %s\n", save_path);
+    return rom_send_file(save_path, 2);
+}
+
+void save_start(const char *fname) {
+    FILINFO fno;
+    fs_lock();
+    xSemaphoreTake(save_mutex, portMAX_DELAY);
+    active = (core_caps & CORE_CAP_SAVE_RAM) && make_path(fname);
+    file_size = f_stat(save_path, &fno) == FR_OK ? fno.fsize : 0;
+    pages = 0;
+    filling = false;
+    wb_count = 0;
+    memset(pending, 0, sizeof(pending));
+    xSemaphoreGive(save_mutex);
+    fs_unlock();
+}
+
+void save_stop(void) {
+    fs_lock();                          // callers load a ROM or core, they hold it anyway
+    xSemaphoreTake(save_mutex, portMAX_DELAY);
+    if (active && core_running) {
+        while (save_fetch())
+            if (wb_flush() != FR_OK)
+                break;                  // the drive is gone, the pages stay pending
+        wb_flush();
+    }
+    active = false;
+    xSemaphoreGive(save_mutex);
+    fs_unlock();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Battery save RAM service
+//
+// While a game runs on a core with CORE_CAP_SAVE_RAM, the save task asks
+// the core every SAVE_POLL_MS for a bitmap of the SAVE_PAGE byte pages of
+// its save RAM written since they were last read (command 0x0D), and reads
+// back only those pages (command 0x0E). Pages stay pending until their data
+// arrives, so a lost reply is retried on the next poll.
+//
+// Pages collect in a write-behind buffer, kept sorted by page number. The
+// buffer goes to usb:saves/<rom>.srm when the game has not written for
+// SAVE_FLUSH_MS, when it fills up, or when the game is left. Runs of
+// consecutive pages are written with one sector-aligned f_write each. The
+// first write of a game without a complete save file fetches all pages.
+//
+// When a ROM is loaded, rom_load() streams an existing save file into the
+// core (loading state 2) before the game starts.
+
+#define SAVE_DIR            "usb:saves"
+#define SAVE_PAGE           512         // one sector, so page writes stay sector aligned
+#define SAVE_MAX_PAGES      2048        // 1MB of save RAM
+#define SAVE_BUF_PAGES      16          // write-behind buffer
+#define SAVE_POLL_MS        1000
+#define SAVE_FLUSH_MS       3000
+#define SAVE_TIMEOUT_MS     100         // for a reply of the core
+
+// start the save task
+void save_init(void);
+
+// stream the save file of ROM `fname` into the core, in loading state
+// return 0 if there was none or it was sent
+int save_load(const char *fname);
+
+// start saving the game of ROM `fname`, which is running now
+void save_start(const char *fname);
+
+// write out everything the running game changed and stop saving.
+// call before the core is reset or replaced
+void save_stop(void);
+
+// bytes of packets 0x13 and 0x14 from the UART1 receiver, `idx` counts from
+// the byte after the packet type. return true when the packet is complete
+bool save_rx(uint8_t type, int idx, uint8_t ch);
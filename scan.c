@@ -0,0 +1,72 @@
+// Multi-pattern byte scanner, see scan.h
+
+#include <string.h>
+
+#include "scan.h"
+
+int scan_build(struct scan_dfa *d, const char *const *patterns, int n) {
+    uint8_t fail[SCAN_MAX_STATES];
+    uint8_t queue[SCAN_MAX_STATES];
+    int states = 1, classes = 1;
+
+    memset(d, 0, sizeof(*d));
+    memset(d->match, -1, sizeof(d->match));
+
+    // trie. next[][] == 0 means no edge yet, the root is never a target
+    for (int i = 0; i < n; i++) {
+        int s = 0;
+        for (const uint8_t *p = (const uint8_t *)patterns[i]; *p; p++) {
+            if (!d->cls[*p]) {
+                if (classes == SCAN_MAX_CLASSES)
+                    return -1;
+                d->cls[*p] = classes++;
+            }
+            uint8_t *t = &d->next[s][d->cls[*p]];
+            if (!*t) {
+                if (states == SCAN_MAX_STATES)
+                    return -1;
+                *t = states++;
+            }
+            s = *t;
+        }
+        if (d->match[s] < 0)
+            d->match[s] = i;
+    }
+
+    // breadth first: failure links, then missing edges follow the failure
+    // link, which turns the trie into a DFA
+    int head = 0, tail = 0;
+    for (int c = 0; c < classes; c++)
+        if (d->next[0][c]) {
+            fail[d->next[0][c]] = 0;
+            queue[tail++] = d->next[0][c];
+        }
+    while (head < tail) {
+        int s = queue[head++];
+        if (d->match[s] < 0)
+            d->match[s] = d->match[fail[s]];     // a pattern that is a suffix
+        for (int c = 0; c < classes; c++) {
+            int t = d->next[s][c];
+            if (t) {
+                fail[t] = d->next[fail[s]][c];
+                queue[tail++] = t;
+            } else {
+                d->next[s][c] = d->next[fail[s]][c];
+            }
+        }
+    }
+    return 0;
+}
+
+int scan_feed(const struct scan_dfa *d, uint8_t *state, const uint8_t *buf, uint32_t len) {
+    int s = *state;
+    for (uint32_t i = 0; i < len; i++) {
+        s = d->next[s][d->cls[buf[i]]];
+        if (d->match[s] >= 0) {
+            *state = s;
+            return d->match[s];
+        }
+    }
+    *state = s;
+    return -1;
+}
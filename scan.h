@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Multi-pattern byte scanner
+//
+// An Aho-Corasick automaton for a few short patterns, compiled into a DFA
+// over byte classes: bytes that occur in no pattern share class 0, so the
+// transition table stays small. scan_feed() takes one table lookup per byte
+// and keeps its state between calls, so a pattern split over two chunks of
+// a stream is still found.
+
+#define SCAN_MAX_STATES     64          // total pattern length + 1
+#define SCAN_MAX_CLASSES    32          // distinct pattern bytes + 1
+
+struct scan_dfa {
+    uint8_t cls[256];                   // byte -> class
+    uint8_t next[SCAN_MAX_STATES][SCAN_MAX_CLASSES];
+    int8_t match[SCAN_MAX_STATES];      // pattern ending at this state, -1: none
+};
+
+// compile n patterns. return 0 if successful, -1 if they do not fit
+int scan_build(struct scan_dfa *d, const char *const *patterns, int n);
+
+// scan buf starting from *state (0 at start of stream), *state is updated.
+// return index of the first pattern found, -1 if none. on a match, *state
+// is left after the match, so scanning can continue.
+int scan_feed(const struct scan_dfa *d, uint8_t *state, const uint8_t *buf, uint32_t len);
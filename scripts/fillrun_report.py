@@ -0,0 +1,131 @@
+#!/usr/bin/python3
+
+# Report how much fill-run elision (CORE_CAP_FILL, upload.c) saves on a set
+# of ROMs: bytes on the UART with and without fill commands, and the upload
+# time at 2Mbaud. Models the firmware sender exactly, chunk by chunk.
+#
+# Usage: fillrun_report.py [-m min_run] <dir or file>...
+
+import os
+import re
+import sys
+
+CHUNK = 4096            # UPLOAD_CHUNK
+FILL_MIN = 32           # UPLOAD_FILL_MIN
+FILL_MAX = 0xffffff     # UPLOAD_FILL_MAX
+DATA_HDR = 4            # command 0x07 len[23:0]
+FILL_CMD = 5            # command 0x14 len[23:0] value[7:0]
+UART_BPS = 2000000 // 10    # 8N1
+
+ROM_EXTS = ('.gba', '.bin', '.md', '.gen', '.sfc', '.smc', '.nes')
+
+
+class Sender:
+    def __init__(self, fill_min):
+        self.fill_min = fill_min
+        self.run = re.compile(rb'(.)\1{%d,}' % (fill_min - 1), re.DOTALL)
+        self.run_len = 0
+        self.run_val = 0
+        self.wire = 0
+        self.filled = 0
+
+    def data(self, n):
+        self.wire += DATA_HDR + n
+
+    def flush(self):
+        if self.run_len:
+            self.wire += FILL_CMD
+            self.filled += self.run_len
+        self.run_len = 0
+
+    def chunk(self, buf):
+        n = len(buf)
+        i = 0
+        if self.run_len and buf[0] == self.run_val:
+            # the run of the last chunk goes on, up to FILL_MAX
+            i = min(n - len(buf.lstrip(bytes([self.run_val]))), FILL_MAX - self.run_len)
+            self.run_len += i
+            if self.run_len == FILL_MAX:
+                self.flush()
+        if i < n:
+            self.flush()
+        else:
+            return
+        # a long run at the end is held back
+        last = buf[-1]
+        tail = max(i, len(buf.rstrip(bytes([last]))))
+        if n - tail < self.fill_min:
+            tail = n
+        raw = i
+        for m in self.run.finditer(buf, i, tail):
+            if m.start() > raw:
+                self.data(m.start() - raw)
+            self.wire += FILL_CMD
+            self.filled += m.end() - m.start()
+            raw = m.end()
+        if tail > raw:
+            self.data(tail - raw)
+        self.run_val = last
+        self.run_len = n - tail
+
+
+def report_file(path, fill_min):
+    s = Sender(fill_min)
+    size = 0
+    with open(path, 'rb') as f:
+        while True:
+            buf = f.read(CHUNK)
+            if not buf:
+                break
+            size += len(buf)
+            s.chunk(buf)
+    s.flush()
+    plain = size + DATA_HDR * ((size + CHUNK - 1) // CHUNK)
+    return size, s.filled, plain, s.wire
+
+
+def rom_files(args):
+    for a in args:
+        if os.path.isdir(a):
+            for root, dirs, files in os.walk(a):
+                dirs.sort()
+                for name in sorted(files):
+                    if name.lower().endswith(ROM_EXTS):
+                        yield os.path.join(root, name)
+        else:
+            yield a
+
+
+def main():
+    args = sys.argv[1:]
+    fill_min = FILL_MIN
+    if len(args) >= 2 and args[0] == '-m':
+        fill_min = int(args[1])
+        args = args[2:]
+    if not args:
+        print(f"Usage: {sys.argv[0]} [-m min_run] <dir or file>...")
+        sys.exit(1)
+
+    total = [0, 0, 0, 0]
+    count = 0
+    print(f"{'ROM':40} {'size':>9} {'filled':>9} {'saved':>6} {'plain s':>8} {'fill s':>7}")
+    for path in rom_files(args):
+        size, filled, plain, wire = report_file(path, fill_min)
+        name = os.path.basename(path)
+        name = name if len(name) <= 40 else name[:37] + '...'
+        saved = 100 * (plain - wire) / plain if plain else 0
+        print(f"{name:40} {size >> 10:>8}K {filled >> 10:>8}K {saved:>5.1f}% "
+              f"{plain / UART_BPS:>8.1f} {wire / UART_BPS:>7.1f}")
+        for i, v in enumerate((size, filled, plain, wire)):
+            total[i] += v
+        count += 1
+
+    if count:
+        size, filled, plain, wire = total
+        print(f"{count} ROMs, {size >> 20}MB: {filled >> 20}MB as fills, "
+              f"{100 * (plain - wire) / plain:.1f}% fewer UART bytes, "
+              f"{(plain - wire) / UART_BPS / count:.1f}s saved per load on average")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,279 @@
+// Save states, see state.h
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_mtimer.h"
+#include "bflb_uart.h"
+
+#include "lzss.h"
+#include "hash.h"
+#include "upload.h"
+#include "state.h"
+#include "utils.h"
+
+#define STATE_MAGIC         0x31534354  // "TCS1"
+#define STATE_HEADER        16
+#define STATE_OUT           4096        // written to the drive in pieces of this
+
+extern struct bflb_device_s *uart1_dev;
+extern void set_loading_state(int state);
+extern int16_t active_core;
+
+struct state_header {
+    uint32_t magic;
+    uint8_t core;                       // core id
+    uint8_t reserved[3];
+    uint32_t size;                      // uncompressed
+    uint32_t crc;                       // CRC32 of the uncompressed state
+};
+
+static USB_NOCACHE_RAM_SECTION FIL state_f;
+// compressed data to the drive, or from it when loading
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) io[STATE_OUT + STATE_BLOCK];
+static uint32_t io_len, io_pos;
+static union {
+    struct lzss_enc enc;
+    struct lzss_dec dec;
+} lz;
+
+static char rom_name[128];
+static char state_path[sizeof(rom_name) + 24];
+
+// reply of the core, filled in by state_rx()
+static uint16_t rx_block_no, rx_len;
+static uint8_t rx_block[STATE_BLOCK];
+static SemaphoreHandle_t reply_sem;
+static StaticSemaphore_t reply_sem_buf;
+
+bool state_rx(int idx, uint8_t ch) {
+    if (idx < 4) {                      // block[15:0] len[15:0]
+        uint16_t *v = idx < 2 ? &rx_block_no : &rx_len;
+        *v = idx & 1 ? (*v | ch << 8) : ch;
+        if (idx < 3 || rx_len != 0)
+            return false;
+    } else {
+        if (idx - 4 < STATE_BLOCK)
+            rx_block[idx - 4] = ch;
+        if (idx - 4 < rx_len - 1)
+            return false;
+    }
+    xSemaphoreGive(reply_sem);
+    return true;
+}
+
+void state_init(void) {
+    reply_sem = xSemaphoreCreateBinaryStatic(&reply_sem_buf);
+}
+
+// usb:snes/Game.sfc -> Game
+void state_set_rom(const char *fname) {
+    const char *name = strrchr(fname, '/');
+    name = name ? name + 1 : fname;
+    const char *dot = strrchr(name, '.');
+    int len = dot ? dot - name : (int)strlen(name);
+    len = min(len, (int)sizeof(rom_name) - 1);
+    memcpy(rom_name, name, len);
+    rom_name[len] = '\0';
+}
+
+static void make_path(int slot) {
+    snprintf(state_path, sizeof(state_path), STATE_DIR "/%s.%d", rom_name, slot + 1);
+}
+
+static int write_out(const uint8_t *data, uint32_t len, void *ctx) {
+    memcpy(io + io_len, data, len);     // a group is at most 17 bytes
+    io_len += len;
+    if (io_len >= STATE_OUT) {
+        UINT bw;
+        if (f_write(&state_f, io, STATE_OUT, &bw) != FR_OK || bw != STATE_OUT)
+            return -1;
+        io_len -= STATE_OUT;
+        memcpy(io, io + STATE_OUT, io_len);
+    }
+    return 0;
+}
+
+static void request(uint16_t block) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x0F);
+    bflb_uart_putchar(uart1_dev, block & 0xff);
+    bflb_uart_putchar(uart1_dev, block >> 8);
+    uart1_unlock();
+}
+
+// ask for `block` until the core answers it, at most STATE_RETRIES times
+static bool fetch(uint16_t block) {
+    for (int i = 0; i < STATE_RETRIES; i++) {
+        xSemaphoreTake(reply_sem, 0);   // drop a late reply to an earlier request
+        request(block);
+        if (xSemaphoreTake(reply_sem, pdMS_TO_TICKS(STATE_TIMEOUT_MS)) == pdTRUE &&
+            rx_block_no == block && rx_len <= STATE_BLOCK)
+            return true;
+    }
+    return false;
+}
+
+int state_save(int slot) {
+    struct state_header h = {.magic = STATE_MAGIC, .core = active_core};
+    uint64_t start = bflb_mtimer_get_time_ms();
+    bool write_failed = false;
+    UINT bw;
+    int r = -1;
+
+    if (!(core_caps & CORE_CAP_SAVE_STATE) || !rom_name[0])
+        return -1;
+    make_path(slot);
+    f_mkdir(STATE_DIR);
+    if (f_open(&state_f, state_path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        overlay_status("Cannot create %s", state_path);
+        return -1;
+    }
+    // header goes first, filled in at the end
+    memset(io, 0, STATE_HEADER);
+    io_len = STATE_HEADER;
+    lzss_enc_start(&lz.enc, write_out, NULL);
+
+    // the game is paused from block 0 until the core has sent the last
+    // block, so every way out of here must get the core to that point
+    for (uint16_t block = 0; ; block++) {
+        if (!fetch(block) || h.size + rx_len > STATE_MAX_SIZE) {
+            request(STATE_ABORT);
+            overlay_status("No state from core");
+            goto state_save_close;
+        }
+        h.size += rx_len;
+        // after a write error, keep reading to the last block to resume the game
+        if (!write_failed) {
+            h.crc = crc32_update(h.crc, rx_block, rx_len);
+            write_failed = lzss_enc_feed(&lz.enc, rx_block, rx_len) != 0;
+        }
+        if (rx_len < STATE_BLOCK)
+            break;
+    }
+    if (write_failed || lzss_enc_finish(&lz.enc) ||
+        f_write(&state_f, io, io_len, &bw) != FR_OK || bw != io_len ||
+        f_lseek(&state_f, 0) != FR_OK ||
+        f_write(&state_f, &h, sizeof(h), &bw) != FR_OK || bw != sizeof(h))
+        goto state_save_write_error;
+    overlay_status("Saved slot %d: %dK -> %dK, %d ms", slot + 1, h.size >> 10,
+                   (uint32_t)f_size(&state_f) >> 10, (int)(bflb_mtimer_get_time_ms() - start));
+    r = 0;
+    goto state_save_close;
+
+state_save_write_error:
+    overlay_status("Cannot write %s", state_path);
+state_save_close:
+    f_close(&state_f);
+    if (r)
+        f_unlink(state_path);           // no half states
+    return r;
+}
+
+// next compressed byte from the state file
+static int read_in(void *ctx) {
+    if (io_pos == io_len) {
+        UINT br;
+        if (f_read(&state_f, io, STATE_OUT, &br) != FR_OK || br == 0)
+            return -1;
+        io_pos = 0;
+        io_len = br;
+    }
+    return io[io_pos++];
+}
+
+static FRESULT restart(void) {
+    io_pos = io_len = 0;
+    lzss_dec_start(&lz.dec);
+    return f_lseek(&state_f, STATE_HEADER);
+}
+
+// upload read hook
+static FRESULT state_read(BYTE *buf, UINT len, UINT *br, void *ctx) {
+    int n = lzss_dec_read(&lz.dec, buf, len, read_in, NULL);
+    if (n != (int)len)
+        return FR_INT_ERR;
+    *br = n;
+    return FR_OK;
+}
+
+static int read_header(struct state_header *h) {
+    UINT br;
+    if (f_open(&state_f, state_path, FA_READ) != FR_OK)
+        return -1;
+    if (f_read(&state_f, h, sizeof(*h), &br) != FR_OK || br != sizeof(*h) ||
+        h->magic != STATE_MAGIC || h->size > STATE_MAX_SIZE) {
+        f_close(&state_f);
+        return -1;
+    }
+    return 0;
+}
+
+int state_load(int slot) {
+    struct state_header h;
+    struct upload_stats st;
+    uint8_t check[STATE_BLOCK];
+    uint32_t crc = 0;
+    uint64_t start = bflb_mtimer_get_time_ms();
+    int r = -1;
+
+    if (!(core_caps & CORE_CAP_SAVE_STATE) || !rom_name[0])
+        return -1;
+    make_path(slot);
+    if (read_header(&h)) {
+        overlay_status("No state in slot %d", slot + 1);
+        return -1;
+    }
+    if (h.core != active_core) {
+        overlay_status("State is for another core");
+        goto state_load_close;
+    }
+
+    // decompress once to check, so a damaged file never reaches the core
+    restart();
+    for (uint32_t done = 0; done < h.size; ) {
+        int n = lzss_dec_read(&lz.dec, check, min(h.size - done, (uint32_t)STATE_BLOCK), read_in, NULL);
+        if (n <= 0)
+            break;
+        crc = crc32_update(crc, check, n);
+        done += n;
+    }
+    if (crc != h.crc) {
+        overlay_status("State file is damaged");
+        goto state_load_close;
+    }
+
+    struct upload_hooks hooks = {.read = state_read};
+    if (restart() != FR_OK)
+        goto state_load_close;
+    set_loading_state(3);               // the core takes the state, paused
+    r = upload_file(&state_f, h.size, &hooks, &st);
+    set_loading_state(0);               // and continues from it
+    if (r == FR_OK && st.bytes != h.size)
+        r = -1;
+    if (r)
+        overlay_status("Cannot read %s", state_path);
+    else
+        overlay_status("Loaded slot %d: %dK, %d ms", slot + 1, h.size >> 10,
+                       (int)(bflb_mtimer_get_time_ms() - start));
+
+state_load_close:
+    f_close(&state_f);
+    return r;
+}
+
+void state_info(int slot, struct state_info *info) {
+    struct state_header h;
+    memset(info, 0, sizeof(*info));
+    make_path(slot);
+    if (!rom_name[0] || read_header(&h))
+        return;
+    info->used = true;
+    info->size = h.size;
+    info->stored = f_size(&state_f);
+    f_close(&state_f);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Save states
+//
+// On a core with CORE_CAP_SAVE_STATE, state_save() reads the core state in
+// 512-byte blocks (command 0x0F, the core pauses until the last, short
+// block), LZSS-compresses it as it arrives (lzss.h) and writes it to
+// usb:states/<rom>.<slot> in sector-sized pieces. If the drive fails, the
+// blocks are still read to the last one; if the core stops answering, block
+// STATE_ABORT ends the read. Either way the game resumes. state_load() checks the
+// file, then streams the decompressed state back through the upload
+// pipeline in loading state 3.
+//
+// Everything is static: about 10KB for the encoder, which the decoder
+// shares, plus the 4.5KB output buffer. Nothing comes from the heap.
+
+#define STATE_DIR           "usb:states"
+#define STATE_SLOTS         4
+#define STATE_BLOCK         512
+#define STATE_MAX_SIZE      (2*1024*1024)
+#define STATE_TIMEOUT_MS    200         // for a block of the core
+#define STATE_RETRIES       3           // requests of a block before giving up
+#define STATE_ABORT         0xffff      // block number that ends a read early
+
+struct state_info {
+    bool used;
+    uint32_t size;                      // uncompressed
+    uint32_t stored;                    // file size
+};
+
+// create the reply semaphore
+void state_init(void);
+
+// the ROM whose states are saved and loaded, set by rom_load()
+void state_set_rom(const char *fname);
+
+// return 0 if successful. need the file system lock
+int state_save(int slot);
+int state_load(int slot);
+void state_info(int slot, struct state_info *info);
+
+// bytes of packet 0x15 from the UART1 receiver, `idx` counts from the byte
+// after the packet type. return true when the packet is complete
+bool state_rx(int idx, uint8_t ch);
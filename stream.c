@@ -0,0 +1,79 @@
+// Streaming reads of contiguous file fragments, see stream.h
+
+#include "ff.h"
+#include "diskio.h"
+#include "usbh_core.h"
+
+#include "stream.h"
+#include "utils.h"
+
+USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) stream_buf[STREAM_CHUNK];
+USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) service_buf[STREAM_SERVICE_BUF];
+
+#define SS(fs)  FF_MAX_SS
+
+// Look up the drive sector of file offset `pos` (sector aligned) in the link
+// map, and how many sectors follow it contiguously in the same fragment.
+// return false if the file has no map
+static bool map_sector(FIL *fp, FSIZE_t pos, LBA_t *sect, DWORD *run) {
+    FATFS *fs = fp->obj.fs;
+    DWORD *tbl = fp->cltbl;
+    if (!tbl)
+        return false;
+    tbl++;                              // skip table size
+    DWORD cl = (DWORD)(pos / SS(fs) / fs->csize);   // cluster index in the file
+    DWORD ncl;
+    while ((ncl = *tbl++) != 0) {
+        if (cl < ncl)
+            break;
+        cl -= ncl;
+        tbl++;
+    }
+    if (ncl == 0)
+        return false;                   // past the end of the chain
+    DWORD in_cl = (DWORD)(pos / SS(fs) % fs->csize);
+    *sect = fs->database + (LBA_t)fs->csize * (*tbl + cl - 2) + in_cl;
+    *run = (ncl - cl) * fs->csize - in_cl;
+    return true;
+}
+
+FRESULT stream_read(FIL *fp, BYTE *buf, UINT len, UINT *br) {
+    FATFS *fs = fp->obj.fs;
+    FRESULT r = FR_OK;
+    *br = 0;
+
+    while (len > 0) {
+        FSIZE_t pos = f_tell(fp);
+        FSIZE_t left = f_size(fp) - pos;
+        if (left == 0)
+            break;
+        UINT n = (UINT)min((FSIZE_t)len, left) / SS(fs);   // whole sectors wanted
+        LBA_t sect;
+        DWORD run;
+        if (pos % SS(fs) == 0 && n > 0 && map_sector(fp, pos, &sect, &run)) {
+            n = min(n, (UINT)run);
+            if (disk_read(fs->pdrv, buf, sect, n) != RES_OK)
+                return FR_DISK_ERR;
+            n *= SS(fs);
+            if ((r = f_lseek(fp, pos + n)) != FR_OK)  // O(1) with the link map
+                return r;
+        } else {
+            // up to the next sector boundary (or the whole request without a map)
+            UINT want = fp->cltbl ? SS(fs) - (UINT)(pos % SS(fs)) : len;
+            if ((r = f_read(fp, buf, min(want, len), &n)) != FR_OK)
+                return r;
+            if (n == 0)
+                break;
+        }
+        buf += n;
+        len -= n;
+        *br += n;
+    }
+    return r;
+}
+
+void stream_report(const char *what, uint32_t bytes, uint64_t us) {
+    uint32_t ms = max((uint32_t)(us / 1000), (uint32_t)1);
+    uint32_t rate = (uint32_t)((uint64_t)bytes * 100000 / ms / 1048576);     // MB/s * 100
+    overlay_status("%s %uK in %ums, %u.%02u MB/s", what, bytes >> 10, ms, rate / 100, rate % 100);
+}
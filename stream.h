@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ff.h"
+
+// Streaming reads of ROM and core files
+//
+// For a file opened with fastseek_open(), the link map tells where each
+// contiguous fragment lies on the drive. stream_read() turns whole-sector
+// runs inside a fragment into single multi-sector disk reads (MSC READ(10)),
+// straight into the caller's buffer, and only goes through f_read() for
+// partial sectors, fragment boundaries and files without a map.
+
+#define STREAM_CHUNK        (32*1024)   // bytes per stream_read() in the loaders
+#define STREAM_SERVICE_BUF  (24*1024)   // read-ahead of the services below
+
+// DMA-safe buffer of STREAM_CHUNK bytes for core loading
+extern BYTE stream_buf[STREAM_CHUNK];
+
+// DMA-safe read-ahead buffer of the services that read files while a game
+// runs: MSU-1 (msu.h) or a mounted disc (disc.h). A game has at most one of
+// them, the loaders stop the other before starting one
+extern BYTE service_buf[STREAM_SERVICE_BUF];
+
+// like f_read(). `buf` must be DMA-safe (uncached)
+FRESULT stream_read(FIL *fp, BYTE *buf, UINT len, UINT *br);
+
+// show transfer rate of a finished load on the status line
+void stream_report(const char *what, uint32_t bytes, uint64_t us);
@@ -0,0 +1,115 @@
+// Corpus files of the HID host tests, see corpus/*.hid
+//
+// One device per file, one item per line, '#' starts a comment:
+//   desc <hex>...                  report descriptor bytes, may span several lines
+//   type joystick|keyboard|mouse|none
+//                                  what parse_report_descriptor() makes of it,
+//                                  none if it rejects the descriptor
+//   report <hex>... = <snes>       a joystick report and the SNES word that the
+//                                  pad sends to the core after it, in hex
+//   keys <hex>... = <chars>        a keyboard report and the characters it types
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hidparser.h"
+
+#define CORPUS_DESC_MAX     1024
+#define CORPUS_REPORT_MAX   64
+#define CORPUS_LINES_MAX    256
+
+struct corpus_report {
+    int line;
+    int len;
+    uint8_t data[CORPUS_REPORT_MAX];
+    int is_keys;
+    unsigned snes;                  // report lines
+    char keys[16];                  // keys lines
+};
+
+struct corpus {
+    const char *path;
+    int desc_len;
+    uint8_t desc[CORPUS_DESC_MAX];
+    int type;                       // REPORT_TYPE_..., -1 if not given
+    int count;
+    struct corpus_report rep[CORPUS_LINES_MAX];
+};
+
+// hex bytes of `s` up to '=' or the end. return the count, -1 if there are too many
+static int corpus_hex(const char *s, uint8_t *out, int max) {
+    int n = 0;
+    for (;;) {
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (!*s || *s == '=' || *s == '\n' || *s == '\r')
+            return n;
+        char *end;
+        unsigned long v = strtoul(s, &end, 16);
+        if (end == s || v > 0xff || n == max)
+            return -1;
+        out[n++] = v;
+        s = end;
+    }
+}
+
+// return 0 if successful
+static int corpus_load(const char *path, struct corpus *c) {
+    FILE *f = fopen(path, "r");
+    char line[512];
+    int no = 0;
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+    c->type = -1;
+    while (fgets(line, sizeof(line), f)) {
+        no++;
+        char *s = line, *eq = strchr(line, '=');
+        int n;
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '#' || *s == '\n' || *s == '\r' || !*s)
+            continue;
+        if (!strncmp(s, "desc ", 5)) {
+            n = corpus_hex(s + 5, c->desc + c->desc_len, CORPUS_DESC_MAX - c->desc_len);
+            if (n < 0)
+                goto corpus_load_error;
+            c->desc_len += n;
+        } else if (!strncmp(s, "type ", 5)) {
+            static const char *names[] = {"none", "mouse", "keyboard", "joystick"};
+            for (int t = 0; t < 4; t++)
+                if (!strncmp(s + 5, names[t], strlen(names[t])))
+                    c->type = t;
+            if (c->type < 0)
+                goto corpus_load_error;
+        } else if ((!strncmp(s, "report ", 7) || !strncmp(s, "keys ", 5)) && eq &&
+                   c->count < CORPUS_LINES_MAX) {
+            struct corpus_report *r = &c->rep[c->count++];
+            r->line = no;
+            r->is_keys = s[0] == 'k';
+            r->len = corpus_hex(s + (r->is_keys ? 5 : 7), r->data, CORPUS_REPORT_MAX);
+            if (r->len <= 0)
+                goto corpus_load_error;
+            if (r->is_keys) {
+                sscanf(eq + 1, "%15s", r->keys);
+            } else if (sscanf(eq + 1, "%x", &r->snes) != 1) {
+                goto corpus_load_error;
+            }
+        } else {
+            goto corpus_load_error;
+        }
+    }
+    fclose(f);
+    return 0;
+
+corpus_load_error:
+    fprintf(stderr, "%s:%d: bad line\n", path, no);
+    fclose(f);
+    return -1;
+}
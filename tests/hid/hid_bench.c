@@ -0,0 +1,100 @@
+// Compiled plans against the legacy joystick path
+//
+// The legacy path is what usb_gamepad.c did before plans: joystick_parse()
+// into last_state/last_state_btn_extra, then a fixed shuffle into the SNES
+// word. The plan path is joystick_parse_plan(). Both run on the same random
+// reports of each corpus pad that has a plan, with the hat nulled (the
+// legacy shuffle had no hat). The SNES words must agree; then each path is
+// timed over the same reports.
+//
+// Usage: hid_bench [-n reports] corpus/*.hid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+
+static struct corpus corpus;
+static hid_report_t report;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//       11 10 9 8 7  6  5  4  3  2  1  0
+// SNES: R  L  X A RT LT DN UP ST SE Y  B
+// HID:            Y  B  A  X  UP DN LT RT
+// EXTRA:                ST SE       R  L
+static uint16_t legacy_shuffle(const struct hid_joystick_state_S *st) {
+    uint8_t hid_state = st->last_state;
+    uint8_t hid_extra = st->last_state_btn_extra;
+    return (hid_state & 1) << 7 | (hid_state & 2) << 5 | (hid_state & 4) << 3 | (hid_state & 8) << 1 |
+           (hid_state & 0x10) << 5 | (hid_state & 0x20) << 3 | (hid_state & 0x40) >> 6 | (hid_state & 0x80) >> 6 |
+           (hid_extra & 0x01) << 10 | (hid_extra & 0x02) << 10 | (hid_extra & 0x10) >> 2 | (hid_extra & 0x20) >> 2;
+}
+
+// random reports of the pad with the hat field set to its null value
+static uint8_t *make_reports(const hid_report_t *r, int len, long n) {
+    uint8_t *reps = malloc(n * len);
+    for (long i = 0; i < n * len; i++)
+        reps[i] = rand();
+    for (long i = 0; r->plan.hat_present && i < n; i++)
+        reps[i * len + r->plan.hat_byte] |= r->plan.hat_mask << r->plan.hat_shift;    // past the max
+    return reps;
+}
+
+static int bench(const char *path, long n) {
+    if (corpus_load(path, &corpus) ||
+        !parse_report_descriptor(corpus.desc, corpus.desc_len, &report, NULL) ||
+        report.type != REPORT_TYPE_JOYSTICK || !report.plan.valid || report.report_id_present)
+        return 0;
+    int len = report.report_size;
+    uint8_t *reps = make_reports(&report, len, n);
+    struct hid_joystick_state_S st;
+    long bad = 0;
+
+    memset(&st, 0, sizeof(st));
+    for (long i = 0; i < n; i++) {
+        joystick_parse(&report, &st, reps + i * len, len);
+        uint16_t a = legacy_shuffle(&st), b = joystick_parse_plan(&report.plan, reps + i * len);
+        if (a != b && bad++ < 4)
+            printf("%s: report %ld legacy %04x, plan %04x\n", path, i, a, b);
+    }
+
+    volatile uint16_t sink = 0;
+    double t = now();
+    for (long i = 0; i < n; i++) {
+        joystick_parse(&report, &st, reps + i * len, len);
+        sink ^= legacy_shuffle(&st);
+    }
+    double legacy = now() - t;
+    t = now();
+    for (long i = 0; i < n; i++)
+        sink ^= joystick_parse_plan(&report.plan, reps + i * len);
+    double plan = now() - t;
+
+    printf("%-40s legacy %6.1f ns/report, plan %5.1f ns/report, %4.1fx%s\n", path,
+           legacy * 1e9 / n, plan * 1e9 / n, legacy / plan, bad ? ", MISMATCH" : "");
+    free(reps);
+    return bad != 0;
+}
+
+int main(int argc, char **argv) {
+    long n = 1 << 20;
+    int fails = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            n = atol(argv[++i]);
+        else
+            fails += bench(argv[i], n);
+    }
+    if (argc < 2) {
+        printf("Usage: %s [-n reports] <corpus file>...\n", argv[0]);
+        return 1;
+    }
+    return fails != 0;
+}
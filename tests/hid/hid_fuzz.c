@@ -0,0 +1,100 @@
+// Fuzz hidparser.c with mutated corpus descriptors
+//
+// Each round takes a corpus descriptor, applies a few random mutations
+// (byte overwrite, bit flip, item size change, truncation, insertion) and
+// parses it from an exactly sized heap copy, so that AddressSanitizer sees
+// every read past its end. Descriptors that still parse are fed random
+// reports of the right and of wrong lengths, as a misbehaving pad would.
+// Build it with the sanitizers, see the Makefile.
+//
+// Usage: hid_fuzz [-n rounds] [-s seed] corpus/*.hid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+
+static struct corpus corpus[32];
+
+static int mutate(uint8_t *d, int n, int max) {
+    int muts = 1 + rand() % 4;
+    for (int m = 0; m < muts && n > 0; m++) {
+        int p = rand() % n;
+        switch (rand() % 5) {
+        case 0: d[p] = rand(); break;
+        case 1: d[p] ^= 1 << (rand() % 8); break;
+        case 2: d[p] = (d[p] & 0xfc) | (rand() & 3); break;     // item size
+        case 3: n = rand() % (n + 1); break;
+        case 4:
+            if (n < max) {
+                memmove(d + p + 1, d + p, n - p);
+                d[p] = rand();
+                n++;
+            }
+            break;
+        }
+    }
+    return n;
+}
+
+static void feed(const hid_report_t *r) {
+    hid_state_t st;
+    memset(&st, 0, sizeof(st));
+    int size = r->report_size + (r->report_id_present ? 1 : 0);
+    for (int k = 0; k < 8; k++) {
+        int len = k < 4 ? size : rand() % (size + 8);
+        uint8_t *rep = malloc(len ? len : 1);
+        for (int j = 0; j < len; j++)
+            rep[j] = rand();
+        if (len && r->report_id_present && (rand() & 1))
+            rep[0] = r->report_id;
+        if (r->type == REPORT_TYPE_KEYBOARD) {
+            char keys[6];
+            keyboard_parse(r, &st.kbd, rep, len, keys, sizeof(keys));
+        } else {
+            hid_parse(r, &st, rep, len);
+        }
+        free(rep);
+    }
+}
+
+int main(int argc, char **argv) {
+    long rounds = 1000000, parsed = 0, joysticks = 0;
+    unsigned seed = 1;
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            rounds = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else if (files < 32 && corpus_load(argv[i], &corpus[files]) == 0)
+            files++;
+    }
+    if (!files) {
+        printf("Usage: %s [-n rounds] [-s seed] <corpus file>...\n", argv[0]);
+        return 1;
+    }
+    srand(seed);
+    for (long it = 0; it < rounds; it++) {
+        struct corpus *c = &corpus[it % files];
+        uint8_t tmp[CORPUS_DESC_MAX + 8];
+        memcpy(tmp, c->desc, c->desc_len);
+        int n = mutate(tmp, c->desc_len, sizeof(tmp));
+        uint8_t *d = malloc(n ? n : 1);
+        memcpy(d, tmp, n);
+        hid_report_t *r = malloc(sizeof(hid_report_t));
+        if (parse_report_descriptor(d, n, r, NULL)) {
+            parsed++;
+            joysticks += r->type == REPORT_TYPE_JOYSTICK;
+            // what usb_gamepad.c takes: whole reports of up to 64 bytes
+            if (r->report_size + (r->report_id_present ? 1 : 0) <= 64)
+                feed(r);
+        }
+        free(r);
+        free(d);
+    }
+    printf("%ld rounds, seed %u: %ld descriptors parsed, %ld joysticks\n",
+           rounds, seed, parsed, joysticks);
+    return 0;
+}
@@ -0,0 +1,134 @@
+// Replay the HID corpus through hidparser.c and check the results
+//
+// Descriptors go through parse_report_descriptor() and reports through
+// hid_parse() and keyboard_parse(), as in usb_gamepad.c. Pads with a
+// compiled plan are also run through the generic parser, which must give
+// the same SNES words, hat included. Then all joystick reports are replayed in
+// a loop to print the parser throughput.
+//
+// Usage: hid_replay corpus/*.hid
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+
+#define BENCH_REPORTS   (4 * 1024 * 1024)
+
+static struct corpus corpus;
+static hid_report_t report, generic;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// one file. return the number of failures
+static int replay(const char *path) {
+    static const char *type_names[] = {"none", "mouse", "keyboard", "joystick"};
+    hid_state_t st, gst;
+    int fails = 0;
+    if (corpus_load(path, &corpus))
+        return 1;
+
+    memset(&report, 0, sizeof(report));
+    int type = parse_report_descriptor(corpus.desc, corpus.desc_len, &report, NULL) ?
+               report.type : REPORT_TYPE_NONE;
+    if (corpus.type >= 0 && type != corpus.type) {
+        printf("%s: descriptor parses as %s, expected %s\n", path, type_names[type],
+               type_names[corpus.type]);
+        return 1;
+    }
+
+    // the generic parser on the same descriptor
+    generic = report;
+    generic.plan.valid = 0;
+    bool cross = type == REPORT_TYPE_JOYSTICK && report.plan.valid;
+
+    memset(&st, 0, sizeof(st));
+    memset(&gst, 0, sizeof(gst));
+    for (int i = 0; i < corpus.count; i++) {
+        struct corpus_report *r = &corpus.rep[i];
+        if (r->is_keys) {
+            char out[8] = "";
+            int n = keyboard_parse(&report, &st.kbd, r->data, r->len, out, sizeof(out) - 1);
+            out[n] = '\0';
+            if (strcmp(out, r->keys)) {
+                printf("%s:%d: keys \"%s\", expected \"%s\"\n", path, r->line, out, r->keys);
+                fails++;
+            }
+            continue;
+        }
+        hid_parse(&report, &st, r->data, r->len);
+        if (st.joystick.snes != r->snes) {
+            printf("%s:%d: SNES %04x, expected %04x\n", path, r->line, st.joystick.snes, r->snes);
+            fails++;
+        }
+        if (cross) {
+            hid_parse(&generic, &gst, r->data, r->len);
+            if (gst.joystick.snes != st.joystick.snes) {
+                printf("%s:%d: generic parser %04x, plan %04x\n", path, r->line,
+                       gst.joystick.snes, st.joystick.snes);
+                fails++;
+            }
+        }
+    }
+    printf("%-40s %-8s %3d lines%s %s\n", path, type_names[type], corpus.count,
+           report.plan.valid ? ", plan" : "", fails ? "FAILED" : "ok");
+    return fails;
+}
+
+// reports/s of hid_parse() on the joystick reports of all files
+static void bench(int files, char **paths) {
+    static struct corpus c;
+    static hid_report_t rep[2];
+    double plan_time = 0, generic_time = 0;
+    long plan_n = 0, generic_n = 0;
+    volatile uint16_t sink = 0;
+    for (int f = 0; f < files; f++) {
+        if (corpus_load(paths[f], &c) || !parse_report_descriptor(c.desc, c.desc_len, &rep[0], NULL) ||
+            rep[0].type != REPORT_TYPE_JOYSTICK || c.count == 0)
+            continue;
+        rep[1] = rep[0];
+        rep[1].plan.valid = 0;
+        for (int g = 0; g < 2; g++) {
+            hid_state_t st;
+            memset(&st, 0, sizeof(st));
+            long n = BENCH_REPORTS / files;
+            double t = now();
+            for (long k = 0; k < n; k++) {
+                struct corpus_report *r = &c.rep[k % c.count];
+                hid_parse(&rep[g], &st, r->data, r->len);
+                sink ^= st.joystick.snes;
+            }
+            t = now() - t;
+            if (g == 0 && rep[0].plan.valid) {
+                plan_time += t;
+                plan_n += n;
+            } else if (g == 1) {
+                generic_time += t;
+                generic_n += n;
+            }
+        }
+    }
+    if (plan_n)
+        printf("plan:    %.1fM reports/s\n", plan_n / plan_time / 1e6);
+    if (generic_n)
+        printf("generic: %.1fM reports/s\n", generic_n / generic_time / 1e6);
+}
+
+int main(int argc, char **argv) {
+    int fails = 0;
+    if (argc < 2) {
+        printf("Usage: %s <corpus file>...\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++)
+        fails += replay(argv[i]);
+    bench(argc - 1, argv + 1);
+    if (fails)
+        printf("%d failures\n", fails);
+    return fails != 0;
+}
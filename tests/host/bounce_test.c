@@ -0,0 +1,89 @@
+// bounce.c mode trial
+//
+// A consumer reads a bitstream through bounce_read() and passes over each
+// chunk. The host has no uncached memory, so the consumer charges the
+// simulated clock for its pass: more per KB from the uncached stream_buf
+// than from cached RAM in one run, the other way round in the next. The
+// trial must settle on a mode of the cheaper kind, every chunk must match
+// the file in every mode, also on reads that do not start on a sector, and
+// the idle time between two runs must not be charged to a mode.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "bounce.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define FILE_SIZE   (BOUNCE_SIZE * 7 / 2)
+
+static uint8_t file[FILE_SIZE];
+static uint32_t direct_us_kb, cached_us_kb;     // the consumer's pass
+
+// stream the file from `off` like load_core() does
+static void load(struct bounce_consumer *c, uint32_t off) {
+    static FIL f;
+    UINT br, total = off;
+    assert(f_open(&f, "usb:core.bin", FA_READ) == FR_OK);
+    f_lseek(&f, off);
+    bounce_begin(c);
+    do {
+        const BYTE *data;
+        enum bounce_mode m = c->mode;
+        assert(bounce_read(c, &f, BOUNCE_SIZE, &br, &data) == FR_OK);
+        assert(!memcmp(data, file + total, br));
+        if (m != BOUNCE_AUTO)
+            assert((data == stream_buf) == (m == BOUNCE_DIRECT));
+        shim_advance_us((uint64_t)br / 1024 * (data == stream_buf ? direct_us_kb : cached_us_kb));
+        total += br;
+    } while (br == BOUNCE_SIZE);
+    bounce_end(c);
+    f_close(&f);
+    assert(total == FILE_SIZE);
+}
+
+static enum bounce_mode trial(uint32_t direct, uint32_t cached) {
+    struct bounce_consumer c = {"test", BOUNCE_AUTO};
+    direct_us_kb = direct;
+    cached_us_kb = cached;
+    load(&c, 0);                        // 3 full chunks: half the trial
+    assert(c.mode == BOUNCE_AUTO && c.trial == 3);
+    shim_advance_us(10000000);          // the menu, between two loads
+    load(&c, 0);
+    assert(c.mode != BOUNCE_AUTO);
+    for (int m = 0; m < 3; m++)
+        assert(c.trial_us[m] < 1000000);
+    printf("pass %3u us/KB uncached, %3u us/KB cached: ms per 32KB direct %.1f copy %.1f inval %.1f -> %s\n",
+           direct, cached, c.trial_us[0] / 1e3 / TRIAL_CHUNKS, c.trial_us[1] / 1e3 / TRIAL_CHUNKS,
+           c.trial_us[2] / 1e3 / TRIAL_CHUNKS, (const char *[]){"direct", "copy", "inval"}[c.mode]);
+    load(&c, 0);                        // the choice stays
+    return c.mode;
+}
+
+int main(void) {
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    srand(4);
+    for (int i = 0; i < FILE_SIZE; i++)
+        file[i] = rand();
+    FILE *f = fopen(ffshim_host_path("usb:core.bin"), "wb");
+    fwrite(file, 1, FILE_SIZE, f);
+    fclose(f);
+
+    assert(trial(300, 20) != BOUNCE_DIRECT);
+    assert(trial(20, 300) == BOUNCE_DIRECT);
+
+    // fixed modes, from a sector boundary and from within a sector
+    for (int m = BOUNCE_DIRECT; m <= BOUNCE_INVALIDATE; m++) {
+        struct bounce_consumer c = {"fixed", m};
+        load(&c, 0);
+        load(&c, 100);
+    }
+    assert(shim_fs_held() == 0);
+    puts("bounce_test: ok");
+    return 0;
+}
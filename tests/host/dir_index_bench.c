@@ -0,0 +1,140 @@
+// External sort of large ROM folders in dir_index.c
+//
+// Makes folders of 10k and more ROM-like names (mixed case, numbers, a few
+// subfolders, hidden files) and lists them through dir_index_load(). The
+// listing must hold every visible entry once, in natural order with folders
+// first. Prints per folder size: host time and simulated drive time of the
+// first load (sort) and of a reload (cache hit), the bytes spilled, the
+// heap the index holds, and the cost of a page flip. Sort memory is fixed,
+// so the heap must not grow with the folder.
+//
+// Usage: dir_index_bench [entries]...
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "dir_index.c"
+
+#define CMD_US      250                 // per USB command
+#define SECTOR_US   12                  // per sector, about 40MB/s
+
+static const char *words[] = {
+    "Super", "mega", "Castle", "Dragon", "quest", "Star", "Fighter", "Kart",
+    "Soccer", "Zone", "Blaster", "Metal", "Ninja", "Racing", "world", "Tennis",
+};
+static const char *regions[] = {"(USA)", "(Europe)", "(Japan)", "(World)", "(USA, Europe)"};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool is_rom(char *name) {
+    return true;
+}
+
+// a folder of n entries, return the number of visible ones
+static int make_folder(const char *dir, int n) {
+    char path[512], name[256];
+    int visible = 0;
+    mkdir(ffshim_host_path(dir), 0755);
+    for (int i = 0; i < n; i++) {
+        int k = snprintf(name, sizeof(name), "%s%s %s", i % 97 == 0 ? "." : "",
+                         words[rand() % 16], words[rand() % 16]);
+        if (rand() % 2)
+            k += snprintf(name + k, sizeof(name) - k, " %d", rand() % (rand() % 3 ? 20 : 2000));
+        snprintf(name + k, sizeof(name) - k, " %s #%d%s", regions[rand() % 5], i,
+                 i % 50 == 1 ? "" : ".sfc");
+        snprintf(path, sizeof(path), "%s/%s", ffshim_host_path(dir), name);
+        if (i % 50 == 1) {
+            mkdir(path, 0755);
+        } else {
+            int fd = open(path, O_CREAT | O_WRONLY, 0644);
+            ftruncate(fd, (rand() % 64 + 1) * 16384);
+            close(fd);
+        }
+        visible += name[0] != '.';
+    }
+    return visible;
+}
+
+// every entry after entry 0 must be in order and unique
+static void check(int visible) {
+    int n = dir_index_count();
+    assert(n == visible + 1 && !dir_index_truncated());
+    static char prev[256];
+    bool prev_dir = true;
+    prev[0] = '\0';
+    for (int i = 1; i < n; i++) {
+        const struct dir_entry *e = dir_index_entry(i);
+        const char *name = dir_index_name(i);
+        assert(name[0] && name[0] != '.');
+        if (i > 1 && entry_cmp(prev, prev_dir, name, e->is_dir) >= 0) {
+            printf("entry %d \"%s\" after \"%s\"\n", i, name, prev);
+            exit(1);
+        }
+        snprintf(prev, sizeof(prev), "%s", name);
+        prev_dir = e->is_dir;
+    }
+}
+
+static void bench(int n) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "usb:/bench%d", n);
+    int visible = make_folder(dir, n);
+
+    dir_index_invalidate();
+    struct ffshim_stats s0 = ffshim_stats;
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    double h = now();
+    assert(dir_index_load(dir, is_rom) == 0);
+    h = now() - h;
+    double sim = (bflb_mtimer_get_time_us() - t0) / 1e6 - h;
+    uint64_t spilled = ffshim_stats.bytes_written - s0.bytes_written;
+    uint32_t heap = arena_cap + entry_cap * sizeof(struct dir_entry);
+    check(visible);
+
+    // reload from the cache
+    dir_index_invalidate();
+    s0 = ffshim_stats;
+    t0 = bflb_mtimer_get_time_us();
+    double h2 = now();
+    assert(dir_index_load(dir, is_rom) == 0 && file_mode);
+    h2 = now() - h2;
+    double sim2 = (bflb_mtimer_get_time_us() - t0) / 1e6 - h2;
+    uint64_t cmds2 = ffshim_stats.cmds - s0.cmds;
+    check(visible);
+
+    // page flips to random blocks
+    s0 = ffshim_stats;
+    for (int i = 0; i < 100; i++)
+        dir_index_name(rand() % dir_index_count());
+    double flip = (ffshim_stats.cmds - s0.cmds) / 100.0;
+
+    printf("%6d entries: sort %.2fs host + %5.2fs drive, %5lluK spilled | reload %.2fs host + %.2fs drive, "
+           "%llu cmds | page %.1f cmds | index heap %uK, sort memory %uK\n",
+           visible, h, sim, (unsigned long long)spilled >> 10, h2, sim2, (unsigned long long)cmds2,
+           flip, heap >> 10, (unsigned)DIR_SORT_MEM >> 10);
+}
+
+int main(int argc, char **argv) {
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    srand(1);
+    if (argc < 2) {
+        bench(12000);
+        bench(50000);
+    }
+    for (int i = 1; i < argc; i++)
+        bench(atoi(argv[i]));
+    return 0;
+}
@@ -0,0 +1,322 @@
+// disc.c against the access patterns of a CD core
+//
+// The same disc, a 4000-sector Mode 1 data track and two 1500-sector audio
+// tracks with a 2 second gap before track 2, is mounted three ways: all
+// tracks in one BIN with the gap as INDEX 00, one BIN per track with the
+// gap as PREGAP, and the data track alone as an ISO. The core then boots
+// (TOC, the system area and a program load), plays a 2000-sector movie,
+// loads levels (seeks followed by 20-100 sectors), plays both audio tracks
+// while polling the Q subchannel, and reads single sectors at random.
+// After each request the task may read ahead, as it does while the core
+// waits for the next one. Last, another task holds the file system lock:
+// sectors in the window must still be served, and read-ahead must give up
+// at once rather than wait for the lock.
+//
+// Every sector must match the image, the pregap must be silence, and the
+// TOC, the Q subchannel and the error replies are checked. Prints drive
+// commands, the drive time spent on requests (worst case and total), the
+// drive time of read-ahead and the UART time per pattern.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "disc.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define UART_BAUD   2000000
+
+#define DATA        4000                // sectors of track 1
+#define GAP         150                 // before track 2
+#define AUDIO       1500                // sectors of tracks 2 and 3
+#define LEADOUT     (DATA + GAP + 2 * AUDIO)
+
+// the byte at `off` of host file `id`
+static uint8_t pat(int id, uint32_t off) {
+    return (off * 2654435761u) >> 13 ^ id * 31;
+}
+
+static void write_file(const char *path, int id, uint32_t size) {
+    static uint8_t b[64 * 1024];
+    FILE *f = fopen(ffshim_host_path(path), "wb");
+    for (uint32_t off = 0; off < size; off += sizeof(b)) {
+        uint32_t n = min(sizeof(b), size - off);
+        for (uint32_t i = 0; i < n; i++)
+            b[i] = pat(id, off + i);
+        fwrite(b, 1, n, f);
+    }
+    fclose(f);
+}
+
+static void write_text(const char *path, const char *text) {
+    FILE *f = fopen(ffshim_host_path(path), "wb");
+    fputs(text, f);
+    fclose(f);
+}
+
+// where a disc sector is in the image: host file id and byte offset, and
+// bytes per sector. id 0 for the pregap that is not in the file
+struct layout {
+    const char *name, *path;
+    bool audio;
+    int frags;                          // of the file holding track 1
+    void (*locate)(int32_t lba, int *id, uint32_t *off, int *sector);
+};
+
+static void locate_bin(int32_t lba, int *id, uint32_t *off, int *sector) {
+    *id = 1;
+    *off = lba * 2352;
+    *sector = 2352;
+}
+
+static void locate_tracks(int32_t lba, int *id, uint32_t *off, int *sector) {
+    *sector = 2352;
+    if (lba < DATA)
+        *id = 2, *off = lba * 2352;
+    else if (lba < DATA + GAP)
+        *id = 0, *off = 0;
+    else if (lba < DATA + GAP + AUDIO)
+        *id = 3, *off = (lba - DATA - GAP) * 2352;
+    else
+        *id = 4, *off = (lba - DATA - GAP - AUDIO) * 2352;
+}
+
+static void locate_iso(int32_t lba, int *id, uint32_t *off, int *sector) {
+    *id = 5;
+    *off = lba * 2048;
+    *sector = 2048;
+}
+
+static const struct layout layouts[] = {
+    {"one BIN, INDEX 00", "usb:cd/One.cue", true, (LEADOUT * 2352 + 524287) / 524288, locate_bin},
+    {"BIN per track, PREGAP", "usb:cd/Tracks.cue", true, (DATA * 2352 + 524287) / 524288, locate_tracks},
+    {"ISO", "usb:cd/Data.iso", false, (DATA * 2048 + 524287) / 524288, locate_iso},
+};
+static const struct layout *cur;
+
+// the reply the core got
+static uint8_t rx[4 + 2352];
+static int rx_len;
+
+static void core_rx(uint8_t ch) {
+    if (rx_len == 0 && ch != 0x11)
+        return;
+    assert(rx_len < (int)sizeof(rx));
+    rx[rx_len++] = ch;
+}
+
+// what a pattern cost
+struct cost {
+    uint32_t requests, slow;            // slow: needed the drive
+    uint64_t cmds, req_us, worst_us, ahead_us, uart_bytes;
+};
+static struct cost cost;
+
+// send a request, let the task answer it and read ahead. return the status
+static int ask(uint8_t op, int32_t lba) {
+    uint8_t b[5] = {op, lba, lba >> 8, lba >> 16, lba >> 24};
+    struct disc_req q;
+    for (int i = 0; i < 5; i++)
+        assert(disc_rx(i, b[i]) == (i == 4));
+    rx_len = 0;
+    assert(xQueueReceive(req_q, &q, 0) == pdTRUE);
+    uint64_t t = bflb_mtimer_get_time_us(), c = ffshim_stats.cmds, u = shim_uart_bytes;
+    handle(&q);
+    t = bflb_mtimer_get_time_us() - t;
+    cost.requests++;
+    cost.slow += ffshim_stats.cmds != c;
+    cost.req_us += t;
+    cost.worst_us = max(cost.worst_us, t);
+    cost.uart_bytes += shim_uart_bytes - u;
+    t = bflb_mtimer_get_time_us();
+    while (read_ahead() > 0)
+        ;
+    cost.ahead_us += bflb_mtimer_get_time_us() - t;
+    assert(rx_len >= 4 && rx_len == 4 + (rx[2] | rx[3] << 8));
+    return rx[1];
+}
+
+// read a sector and check it against the image
+static void sector(uint8_t op, int32_t lba) {
+    int id, n;
+    uint32_t off;
+    cur->locate(lba, &id, &off, &n);
+    assert(ask(op, lba) == DISC_OK);
+    const uint8_t *d = rx + 4;
+    if (op == DISC_OP_DATA) {
+        assert(rx_len == 4 + 2048);
+        off += n == 2352 ? 16 : 0;      // after sync and header
+    } else {
+        assert(rx_len == 4 + 2352);
+        if (n == 2048) {                // made up: sync, header, data, no EDC/ECC
+            assert(d[0] == 0 && d[1] == 0xff && d[11] == 0 && d[15] == 1);
+            d += 16;
+        }
+    }
+    for (int i = 0; i < (op == DISC_OP_DATA ? 2048 : n); i++)
+        assert(d[i] == (id ? pat(id, off + i) : 0));
+}
+
+static void read_run(uint8_t op, int32_t lba, int n) {
+    for (int i = 0; i < n; i++)
+        sector(op, lba + i);
+}
+
+// Q subchannel: track (BCD), index and relative MSF
+static void subq(int32_t lba, int track, int index, int rel) {
+    assert(ask(DISC_OP_SUBQ, lba) == DISC_OK && rx_len == 4 + 12);
+    const uint8_t *q = rx + 4;
+    assert(q[1] == track && q[2] == index);
+    assert(q[3] == bcd(rel / 4500) && q[4] == bcd(rel / 75 % 60) && q[5] == bcd(rel % 75));
+    assert(q[7] == bcd((lba + 150) / 4500) && q[9] == bcd((lba + 150) % 75));
+}
+
+static void check_toc(bool audio) {
+    assert(ask(DISC_OP_TOC, 0) == DISC_OK);
+    const uint8_t *t = rx + 4;
+    int n = audio ? 3 : 1;
+    int32_t start[] = {0, DATA + GAP, DATA + GAP + AUDIO};
+    assert(t[0] == 1 && t[1] == n);
+    assert((t[2] | t[3] << 8 | t[4] << 16) == (audio ? LEADOUT : DATA));
+    for (int i = 0; i < n; i++) {
+        const uint8_t *e = t + 6 + 6 * i;
+        assert(e[0] == i + 1 && e[1] == (i ? 0 : 4) && (e[2] | e[3] << 8) == start[i]);
+    }
+}
+
+static void boot(void) {
+    check_toc(cur->audio);
+    subq(0, 1, 1, 0);
+    read_run(DISC_OP_DATA, 0, 16);      // system area and volume descriptor
+    read_run(DISC_OP_DATA, 16, 384);    // initial program
+}
+
+static void movie(void) {
+    read_run(DISC_OP_DATA, 1000, 2000);
+}
+
+static void levels(void) {
+    for (int i = 0; i < 40; i++) {
+        int n = 20 + rand() % 81;
+        read_run(DISC_OP_DATA, rand() % (DATA - n), n);
+    }
+}
+
+static void music(void) {
+    for (int32_t lba = DATA + GAP - 30; lba < LEADOUT; lba++) {
+        sector(DISC_OP_RAW, lba);
+        if (lba % 5 == 0) {
+            int32_t t2 = DATA + GAP, t3 = t2 + AUDIO;
+            int track = lba < t3 ? 2 : 3;
+            int32_t start = track == 2 ? t2 : t3;
+            subq(lba, track, lba >= start, lba >= start ? lba - start : start - lba);
+        }
+    }
+}
+
+static void random_sectors(void) {
+    for (int i = 0; i < 500; i++)
+        sector(DISC_OP_DATA, rand() % DATA);
+}
+
+static void run(const char *name, void (*pattern)(void)) {
+    memset(&cost, 0, sizeof(cost));
+    uint64_t c = ffshim_stats.cmds;
+    pattern();
+    cost.cmds = ffshim_stats.cmds - c;
+    printf("  %-8s %5u req, %4.1f%% need the drive, %5llu cmds | drive on requests %5.0f ms, "
+           "worst %4.1f ms | read-ahead %5.0f ms | UART %6.0f ms\n",
+           name, cost.requests, 100.0 * cost.slow / cost.requests, (unsigned long long)cost.cmds,
+           cost.req_us / 1e3, cost.worst_us / 1e3, cost.ahead_us / 1e3,
+           cost.uart_bytes * 10.0 / UART_BAUD * 1e3);
+}
+
+int main(void) {
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    ffshim_frag_clusters = 128;
+    shim_uart_tx = core_rx;
+    core_caps = CORE_CAP_DISC;
+    srand(11);
+
+    f_mkdir("usb:cd");
+    write_file("usb:cd/One.bin", 1, LEADOUT * 2352);
+    write_text("usb:cd/One.cue",
+               "REM one file\r\n"
+               "FILE \"One.bin\" BINARY\r\n"
+               "  TRACK 01 MODE1/2352\r\n"
+               "    INDEX 01 00:00:00\r\n"
+               "  TRACK 02 AUDIO\r\n"
+               "    INDEX 00 00:53:25\r\n"
+               "    INDEX 01 00:55:25\r\n"
+               "  TRACK 03 AUDIO\r\n"
+               "    INDEX 01 01:15:25\r\n");
+    write_file("usb:cd/Tracks (Track 1).bin", 2, DATA * 2352);
+    write_file("usb:cd/Tracks (Track 2).bin", 3, AUDIO * 2352);
+    write_file("usb:cd/Tracks (Track 3).bin", 4, AUDIO * 2352);
+    write_text("usb:cd/Tracks.cue",
+               "FILE \"Tracks (Track 1).bin\" BINARY\n"
+               "  TRACK 01 MODE1/2352\n"
+               "    INDEX 01 00:00:00\n"
+               "FILE \"Tracks (Track 2).bin\" BINARY\n"
+               "  TRACK 02 AUDIO\n"
+               "    PREGAP 00:02:00\n"
+               "    INDEX 01 00:00:00\n"
+               "FILE \"Tracks (Track 3).bin\" BINARY\n"
+               "  TRACK 03 AUDIO\n"
+               "    INDEX 01 00:00:00\n");
+    write_file("usb:cd/Data.iso", 5, DATA * 2048);
+    write_text("usb:cd/Bad.cue", "FILE \"One.bin\" BINARY\n  TRACK 01 MODE3/2352\n");
+
+    disc_init();
+    assert(disc_mount("usb:cd/Bad.cue") != 0 && !strcmp(shim_status, "Bad CUE sheet line 2"));
+    assert(ask(DISC_OP_DATA, 0) == DISC_NO_DISC);
+
+    for (int i = 0; i < 3; i++) {
+        cur = &layouts[i];
+        assert(disc_mount(cur->path) == 0);
+        printf("%s:\n", cur->name);
+        run("boot", boot);
+        printf("  data file: %d fragments of 128 clusters, link map %s\n", cur->frags,
+               fastseek_fragments(&disc_f) < 0 ? "does not fit" : "attached");
+        run("movie", movie);
+        run("levels", levels);
+        if (cur->audio) {
+            run("music", music);
+            assert(ask(DISC_OP_DATA, DATA + GAP) == DISC_NOT_DATA);
+            assert(ask(DISC_OP_RAW, LEADOUT) == DISC_BAD_LBA);
+            subq(LEADOUT + 10, 0xAA, 1, 10);
+        }
+        run("random", random_sectors);
+        assert(ask(DISC_OP_DATA, -1) == DISC_BAD_LBA);
+        assert(ask(9, 0) == DISC_BAD_OP);
+    }
+
+    // another task holds the file system lock: the window plays on, and
+    // read-ahead gives up at once instead of waiting (shim_fs_busy makes
+    // any fs_lock() fatal)
+    sector(DISC_OP_DATA, DATA - 1000);
+    sector(DISC_OP_DATA, 100);          // a new window from 100 on
+    uint32_t locks = shim_fs_locks, served = 0;
+    int32_t lba = 101;
+    shim_fs_busy = true;
+    for (; (lba + 1) * 2048 <= win_base + win_len; lba++, served++)
+        sector(DISC_OP_DATA, lba);
+    assert(read_ahead() == -1 && shim_fs_locks == locks);
+    printf("file system lock busy: %u sectors served from the window, read-ahead waits\n", served);
+    assert(served >= DISC_BUF / 2 / 2048);
+    shim_fs_busy = false;
+    assert(read_ahead() > 0);           // the lock is back: read-ahead catches up
+    assert((lba + 1) * 2048 <= win_base + win_len);
+    sector(DISC_OP_DATA, lba);
+
+    disc_unmount();
+    assert(ask(DISC_OP_TOC, 0) == DISC_NO_DISC);
+    assert(shim_fs_held() == 0 && !shim_uart1_held());
+    printf("1x CD: 13.3 ms per sector, UART 11.8 ms per raw sector\n");
+    return 0;
+}
@@ -0,0 +1,148 @@
+// disk_cache.c over a drive image
+//
+// The drive is a 4MB image in memory behind mocks of the USB mass storage
+// commands, each costing CMD_US plus SECTOR_US per sector on the simulated
+// clock. The workload is what FatFs sends for menu use and a ROM header
+// probe: f_stat() of three paths (FAT sector, root directory, subfolder),
+// a folder listing with FAT lookups, single-sector data reads in a row, a
+// 64-sector bulk read, and a directory write halfway. It runs once on a
+// driver that passes every read to the drive and once on the cache. Every
+// sector read must match the image. After a detach the cache must refuse
+// reads and writes, and the next mount must read the drive again.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "disk_cache.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define SECTORS     8192
+
+static struct usbh_msc drive = {.blocknum = SECTORS, .blocksize = SECTOR_SIZE};
+static BYTE image[SECTORS * SECTOR_SIZE], ref[SECTORS * SECTOR_SIZE];
+static FATFS_DiskioDriverTypeDef *drv;
+static uint32_t cmds, bad;
+
+void *usbh_find_class_instance(const char *name) {
+    return &drive;
+}
+
+int usbh_msc_scsi_init(struct usbh_msc *m) {
+    return 0;
+}
+
+static void usb_cmd(uint32_t count) {
+    cmds++;
+    shim_advance_us(CMD_US + SECTOR_US * count);
+}
+
+int usbh_msc_scsi_read10(struct usbh_msc *m, uint32_t start, uint8_t *buf, uint32_t count) {
+    usb_cmd(count);
+    memcpy(buf, image + start * SECTOR_SIZE, count * SECTOR_SIZE);
+    return 0;
+}
+
+int usbh_msc_scsi_write10(struct usbh_msc *m, uint32_t start, const uint8_t *buf, uint32_t count) {
+    usb_cmd(count);
+    memcpy(image + start * SECTOR_SIZE, buf, count * SECTOR_SIZE);
+    return 0;
+}
+
+void disk_driver_callback_init(uint8_t pdrv, FATFS_DiskioDriverTypeDef *d) {
+    drv = d;
+}
+
+// the SDK driver: every read goes to the drive
+static int raw_read(BYTE *buff, LBA_t sector, UINT count) {
+    return msc_read(buff, sector, count);
+}
+
+static int raw_write(const BYTE *buff, LBA_t sector, UINT count) {
+    return usbh_msc_scsi_write10(msc, sector, buff, count) < 0 ? RES_ERROR : RES_OK;
+}
+
+static void rd(BYTE *b, LBA_t s, UINT n) {
+    assert(drv->disk_read(b, s, n) == RES_OK);
+    if (memcmp(b, ref + s * SECTOR_SIZE, n * SECTOR_SIZE))
+        bad++;
+}
+
+static void workload(void) {
+    static BYTE data[SECTOR_SIZE], big[64 * SECTOR_SIZE];
+    for (int k = 0; k < 40; k++) {
+        for (int p = 0; p < 3; p++) {
+            rd(fs.win, 32 + p, 1);
+            rd(fs.win, 2000, 1);
+            rd(fs.win, 2001, 1);
+            rd(fs.win, 2100 + p, 1);
+        }
+        for (int d = 0; d < 20; d++) {
+            rd(fs.win, 2200 + d, 1);
+            if (d % 8 == 0)
+                rd(fs.win, 40, 1);
+        }
+        for (int s = 0; s < 32; s++)
+            rd(data, 4000 + s, 1);
+        rd(big, 5000, 64);
+        if (k == 20) {
+            memset(data, k, SECTOR_SIZE);
+            assert(drv->disk_write(data, 2001, 1) == RES_OK);
+            memcpy(ref + 2001 * SECTOR_SIZE, data, SECTOR_SIZE);
+        }
+    }
+}
+
+static void run(const char *name) {
+    memcpy(image, ref, sizeof(image));
+    cmds = bad = 0;
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    workload();
+    printf("%-8s %5u cmds, %6.1f ms drive, %u bad sectors\n", name, cmds,
+           (bflb_mtimer_get_time_us() - t0) / 1000.0, bad);
+    assert(bad == 0);
+}
+
+int main(void) {
+    for (int i = 0; i < (int)sizeof(ref); i++)
+        ref[i] = rand();
+    static BYTE keep[sizeof(ref)];
+    memcpy(keep, ref, sizeof(ref));
+
+    disk_cache_register();
+    FATFS_DiskioDriverTypeDef cached = *drv, raw = cached;
+    raw.disk_read = raw_read;
+    raw.disk_write = raw_write;
+    assert(cached.disk_initialize() == 0);
+
+    drv = &raw;
+    run("uncached");
+    memcpy(ref, keep, sizeof(ref));
+    drv = &cached;
+    run("cached");
+
+    struct disk_cache_stats st;
+    disk_cache_get_stats(&st);
+    printf("meta %u hits, %u misses | data %u hits, %u misses | %u direct\n", st.meta_hits,
+           st.meta_misses, st.data_hits, st.data_misses, st.direct);
+
+    // unplugged: nothing from the cache, nothing to the drive
+    static BYTE b[SECTOR_SIZE];
+    rd(b, 2000, 1);
+    uint32_t c = cmds;
+    rd(b, 2000, 1);
+    assert(cmds == c);                  // cached
+    disk_cache_detach();
+    assert(cached.disk_read(fs.win, 0, 1) == RES_NOTRDY && cached.disk_read(b, 2000, 1) == RES_NOTRDY);
+    assert(cached.disk_write(b, 2001, 1) == RES_NOTRDY && cmds == c);
+    assert(cached.disk_status() == STA_NOINIT);
+    // plugged in again: the sector that was cached comes from the drive
+    assert(cached.disk_initialize() == 0);
+    rd(b, 2000, 1);
+    assert(cmds == c + 1 && bad == 0);
+    puts("disk_cache_bench: detach ok");
+    return 0;
+}
@@ -0,0 +1,128 @@
+// SNES header probing and ROM loading with and without fast seek
+//
+// Runs snes_probe() of cores/snes.c on a 6MB ExHiROM image with a copier
+// header, so that all three header positions are read (LoROM, HiROM, then
+// ExHiROM 4MB in), then streams the ROM with stream_read() in STREAM_CHUNK
+// requests as the loader does, then reads 2KB at 256 random offsets as the
+// MSU-1 and CD services do. The file is laid out contiguously, in fragments
+// next to each other, and in fragments scattered over the drive so that
+// each fragment has its FAT entries in another FAT sector. Each layout is
+// run after a plain f_open(), which seeks and streams by following the
+// chain, after the first fastseek_open(), which walks the chain once to
+// build the link map, and after a second fastseek_open(), which finds the
+// map in the pool, or knows that the file is too fragmented for it and does
+// not walk. Prints FAT sectors read, USB commands and simulated drive time.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shim.h"
+#include "fastseek.c"
+#include "stream.c"
+#include "cores/snes.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define ROM_SIZE    (6 << 20)
+#define COPIER      512
+#define SCATTER     1000                // clusters between scattered fragments
+#define READS       256
+
+void send_rom_data(const BYTE *buf, int len) {
+}
+
+static uint8_t rom[COPIER + ROM_SIZE];
+
+static void make_rom(const char *path) {
+    for (int i = 0; i < (int)sizeof(rom); i++)
+        rom[i] = rand();
+    memset(rom + COPIER + 0x7fc0, 0, 64);           // no LoROM or HiROM header
+    memset(rom + COPIER + 0xffc0, 0, 64);
+    uint8_t *h = rom + COPIER + 0x40ffc0;
+    memcpy(h, "HOST BENCH EXHIROM   ", 21);
+    h[21] = 0x36;                       // ExHiROM as snes_check_header() wants it
+    h[23] = 13;                         // 8MB
+    h[24] = 0;
+    h[28] = 0x12, h[29] = 0x34, h[30] = 0xed, h[31] = 0xcb;
+    h[60] = 0x00, h[61] = 0x80;         // reset vector
+    FILE *f = fopen(ffshim_host_path(path), "wb");
+    fwrite(rom, 1, sizeof(rom), f);
+    fclose(f);
+}
+
+struct cost {
+    uint64_t fat, cmds, us;
+};
+
+static struct cost since(struct ffshim_stats *s0, uint64_t *t0) {
+    struct cost c = {ffshim_stats.fat_sectors - s0->fat_sectors, ffshim_stats.cmds - s0->cmds,
+                     bflb_mtimer_get_time_us() - *t0};
+    *s0 = ffshim_stats;
+    *t0 = bflb_mtimer_get_time_us();
+    return c;
+}
+
+// open and probe, stream the ROM as the loader does, then read at random
+static void load(const char *path, int how) {
+    static FIL f;
+    static const char *const hows[] = {"f_open", "fastseek", "again"};
+    struct rom_load ld = {.fname = path, .fp = &f};
+    struct ffshim_stats s0 = ffshim_stats;
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    assert((how ? fastseek_open(&f, path) : f_open(&f, path, FA_READ)) == FR_OK);
+    ld.size = f_size(&f);
+    assert(snes_probe(&ld) == 0 && !strncmp(ld.detail, "ExHi", 4));
+    struct cost probe = since(&s0, &t0);
+
+    UINT br, got = 0;
+    f_lseek(&f, ld.off);
+    do {
+        assert(stream_read(&f, stream_buf, STREAM_CHUNK, &br) == FR_OK);
+        assert(!memcmp(stream_buf, rom + ld.off + got, br));
+        got += br;
+    } while (br == STREAM_CHUNK);
+    assert(got == ROM_SIZE);
+    struct cost all = since(&s0, &t0);
+
+    srand(7);
+    for (int i = 0; i < READS; i++) {
+        uint32_t pos = rand() % (COPIER + ROM_SIZE - 2048);
+        assert(f_lseek(&f, pos) == FR_OK && stream_read(&f, stream_buf, 2048, &br) == FR_OK);
+        assert(br == 2048 && !memcmp(stream_buf, rom + pos, br));
+    }
+    struct cost seeks = since(&s0, &t0);
+    int frags = fastseek_fragments(&f);
+    how ? fastseek_close(&f) : f_close(&f);
+
+    char map[24] = "no map";
+    if (frags >= 0)
+        snprintf(map, sizeof(map), "%d fragments", frags);
+    printf("  %-8s %-13s probe %3llu FAT %3llu cmds %6.2f ms | load %4llu FAT %4llu cmds %4.0f ms"
+           " | %d reads %5llu FAT %5llu cmds %5.0f ms\n", hows[how], map,
+           (unsigned long long)probe.fat, (unsigned long long)probe.cmds, probe.us / 1000.0,
+           (unsigned long long)all.fat, (unsigned long long)all.cmds, all.us / 1000.0, READS,
+           (unsigned long long)seeks.fat, (unsigned long long)seeks.cmds, seeks.us / 1000.0);
+}
+
+int main(void) {
+    static const struct {
+        uint32_t frag, gap;
+    } layouts[] = {{0, 1}, {64, 1}, {256, SCATTER}, {64, SCATTER}, {16, SCATTER}, {4, SCATTER}};
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    make_rom("usb:Game.sfc");
+    for (int i = 0; i < (int)(sizeof(layouts) / sizeof(layouts[0])); i++) {
+        ffshim_frag_clusters = layouts[i].frag;
+        ffshim_frag_gap = layouts[i].gap;
+        if (!layouts[i].frag)
+            printf("contiguous\n");
+        else
+            printf("%u-cluster fragments, %s\n", layouts[i].frag,
+                   layouts[i].gap > 1 ? "scattered" : "adjacent");
+        for (int how = 0; how < 3; how++)
+            load("usb:Game.sfc", how);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// hash.c correctness and throughput
+//
+// Checks CRC32 against a bitwise reference and SHA-1 against the FIPS 180
+// test vectors, with the data fed whole and in odd-sized pieces. Then times
+// CRC32 alone and CRC32 with SHA-1 over a 4MB ROM in 4KB pieces, the
+// granularity the loader feeds, next to the time the UART needs to send
+// the same data.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.c"
+
+#define ROM_SIZE    (4 << 20)
+#define PIECE       4096
+#define UART_BAUD   2000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t crc32_bitwise(const uint8_t *p, uint32_t len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// hash in pieces of 1, 9, 64, 449... bytes, crossing the SHA-1 blocks
+static void hash_pieces(const uint8_t *p, uint32_t len, struct rom_hash *out) {
+    struct hash_ctx ctx;
+    hash_start(&ctx);
+    for (uint32_t pos = 0, step = 1; pos < len; step = step * 7 % 4099 + 1) {
+        uint32_t n = step < len - pos ? step : len - pos;
+        hash_update(&ctx, p + pos, n);
+        pos += n;
+    }
+    hash_finish(&ctx, out);
+}
+
+static void hash_whole(const uint8_t *p, uint32_t len, struct rom_hash *out) {
+    struct hash_ctx ctx;
+    hash_start(&ctx);
+    hash_update(&ctx, p, len);
+    hash_finish(&ctx, out);
+}
+
+static bool same(const struct rom_hash *a, const struct rom_hash *b) {
+    return a->valid == b->valid && a->size == b->size && a->crc32 == b->crc32
+#if HASH_SHA1
+           && !memcmp(a->sha1, b->sha1, sizeof(a->sha1))
+#endif
+        ;
+}
+
+static void check_sha1(const char *msg, uint32_t repeat, const char *want) {
+    uint32_t len = strlen(msg) * repeat;
+    uint8_t *p = malloc(len + 1);
+    for (uint32_t i = 0; i < repeat; i++)
+        memcpy(p + i * strlen(msg), msg, strlen(msg));
+    struct rom_hash a, b;
+    hash_whole(p, len, &a);
+    hash_pieces(p, len, &b);
+    char hex[41];
+    for (int i = 0; i < 20; i++)
+        sprintf(hex + 2 * i, "%02x", a.sha1[i]);
+    assert(!strcmp(hex, want) && same(&a, &b));
+    free(p);
+}
+
+int main(void) {
+    uint8_t *rom = malloc(ROM_SIZE);
+    for (int i = 0; i < ROM_SIZE; i++)
+        rom[i] = rand();
+
+    assert(crc32_update(0, (const uint8_t *)"123456789", 9) == 0xcbf43926);
+    struct rom_hash a, b;
+    hash_whole(rom, ROM_SIZE, &a);
+    hash_pieces(rom, ROM_SIZE, &b);
+    assert(a.valid && a.size == ROM_SIZE && a.crc32 == crc32_bitwise(rom, ROM_SIZE));
+    assert(same(&a, &b));
+#if HASH_SHA1
+    check_sha1("", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    check_sha1("abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d");
+    check_sha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+               "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+    check_sha1("a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+#endif
+    puts("hash_bench: CRC32 and SHA-1 ok");
+
+    volatile uint32_t sink = 0;
+    double t = now();
+    for (int r = 0; r < 10; r++)
+        for (int p = 0; p < ROM_SIZE; p += PIECE)
+            sink = crc32_update(sink, rom + p, PIECE);
+    double crc = (now() - t) / 10;
+    t = now();
+    for (int r = 0; r < 10; r++) {
+        struct hash_ctx ctx;
+        hash_start(&ctx);
+        for (int p = 0; p < ROM_SIZE; p += PIECE)
+            hash_update(&ctx, rom + p, PIECE);
+        hash_finish(&ctx, &a);
+    }
+    double both = (now() - t) / 10;
+    double uart = ROM_SIZE * 10.0 / UART_BAUD;      // 8N1
+    printf("4MB ROM: CRC32 %.1f ms (%.0f MB/s), CRC32+SHA-1 %.1f ms (%.0f MB/s), UART upload %.0f ms\n",
+           crc * 1e3, 4 / crc, both * 1e3, 4 / both, uart * 1e3);
+    printf("per 4KB piece: CRC32+SHA-1 %.1f us, UART %.1f ms\n", both * 1e6 / (ROM_SIZE / PIECE),
+           PIECE * 10.0 / UART_BAUD * 1e3);
+    free(rom);
+    return 0;
+}
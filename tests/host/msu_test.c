@@ -0,0 +1,154 @@
+// msu.c against a simulated core
+//
+// The core asks for MSU-1 data through msu_rx() and takes the 0x10 replies.
+// A 2MB track is played in 1KB requests with read-ahead between them, and
+// the data file is read at random offsets while the track plays; every
+// reply must match the file. While another task holds the file system lock
+// (shim_fs_busy), requests the buffer holds must still be answered and
+// read-ahead must give up at once instead of waiting: the shim reports any
+// fs_lock() then as a wait that never ends. Also checks the replies for a
+// missing track, an offset past the end and a request over the end.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "msu.c"
+
+#define DATA_SIZE   (4 << 20)
+#define TRACK_SIZE  (2 << 20)
+
+static uint8_t *data, *track;
+
+// the reply the core got
+static uint8_t rx[4 + MSU_MAX_REQ];
+static int rx_len;
+
+static void core_rx(uint8_t ch) {
+    if (rx_len == 0 && ch != 0x10)
+        return;
+    rx[rx_len++] = ch;
+}
+
+static void write_file(const char *path, const void *p, uint32_t n) {
+    FILE *f = fopen(ffshim_host_path(path), "wb");
+    fwrite(p, 1, n, f);
+    fclose(f);
+}
+
+// send a request and let the task take it. return the status, -1 if no reply
+static int ask(uint8_t file, uint32_t off, uint16_t len, uint16_t *got) {
+    uint8_t b[7] = {file, off, off >> 8, off >> 16, off >> 24, len, len >> 8};
+    struct msu_req q;
+    for (int i = 0; i < 7; i++)
+        assert(msu_rx(i, b[i]) == (i == 6));
+    rx_len = 0;
+    assert(xQueueReceive(req_q, &q, 0) == pdTRUE);
+    handle(&q);
+    if (rx_len == 0)
+        return -1;
+    *got = rx[2] | rx[3] << 8;
+    assert(rx_len == 4 + *got);
+    return rx[1];
+}
+
+// ask and check the data against the file
+static void ask_ok(uint8_t file, uint32_t off, uint16_t len) {
+    const uint8_t *want = file ? track : data;
+    uint32_t size = file ? TRACK_SIZE : DATA_SIZE;
+    uint16_t got;
+    assert(ask(file, off, len, &got) == MSU_OK);
+    assert(got == min(min(len, MSU_MAX_REQ), size - off));
+    assert(!memcmp(rx + 4, want + off, got));
+}
+
+// the task between requests
+static int idle(void) {
+    int r, n = 0;
+    while ((r = read_ahead()) > 0)
+        n++;
+    return r < 0 ? -1 : n;
+}
+
+int main(void) {
+    ffshim_temp_root();
+    ffshim_frag_clusters = 64;
+    shim_uart_tx = core_rx;
+    core_caps = CORE_CAP_MSU;
+    srand(5);
+    data = malloc(DATA_SIZE);
+    track = malloc(TRACK_SIZE);
+    for (int i = 0; i < DATA_SIZE; i++)
+        data[i] = rand();
+    for (int i = 0; i < TRACK_SIZE; i++)
+        track[i] = rand();
+    f_mkdir("usb:snes");
+    write_file("usb:snes/Game.msu", data, DATA_SIZE);
+    write_file("usb:snes/Game-1.pcm", track, TRACK_SIZE);
+    msu_init();
+    msu_start("usb:snes/Game.sfc");
+    for (int i = 0; i < 2; i++)
+        assert(streams[i].buf >= service_buf &&
+               streams[i].buf + streams[i].size <= service_buf + STREAM_SERVICE_BUF);
+
+    // play the track, with a data read every 16 requests
+    uint32_t locks0 = shim_fs_locks, aheads = 0, hit = 0, miss = 0;
+    uint64_t miss_us = 0;
+    for (uint32_t off = 0, k = 0; off < TRACK_SIZE; off += MSU_MAX_REQ, k++) {
+        uint32_t l = shim_fs_locks;
+        uint64_t t = bflb_mtimer_get_time_us();
+        ask_ok(1, off, MSU_MAX_REQ);
+        if (shim_fs_locks == l)
+            hit++;
+        else
+            miss++, miss_us = max(miss_us, bflb_mtimer_get_time_us() - t);
+        if (k % 16 == 15)
+            ask_ok(0, rand() % DATA_SIZE, 1 + rand() % MSU_MAX_REQ);
+        aheads += idle();
+    }
+    printf("2MB track in 1KB requests, 128 data seeks: %u hits, %u misses (worst %llu us), "
+           "%u read-aheads, %u fs locks\n", hit, miss, (unsigned long long)miss_us, aheads,
+           shim_fs_locks - locks0);
+    assert(miss == 1 && hit == TRACK_SIZE / MSU_MAX_REQ - 1);
+
+    // another task holds the lock: the buffered part of the track plays on
+    ask_ok(1, 0, MSU_MAX_REQ);
+    idle();
+    struct msu_stream *s = &streams[1];
+    uint32_t off = MSU_MAX_REQ, served = 0, locks = shim_fs_locks;
+    shim_fs_busy = true;
+    while (off + MSU_MAX_REQ <= s->base + s->len) {
+        ask_ok(1, off, MSU_MAX_REQ);
+        off += MSU_MAX_REQ;
+        served += MSU_MAX_REQ;
+        assert(idle() <= 0);
+    }
+    assert(read_ahead() == -1 && shim_fs_locks == locks);
+    printf("file system lock busy: %uKB served from the buffer, read-ahead waits\n", served >> 10);
+    assert(served >= MSU_AUDIO_BUF / 2);
+    shim_fs_busy = false;
+    // the lock is back: read-ahead catches up before the next request
+    assert(idle() > 0);
+    locks = shim_fs_locks;
+    ask_ok(1, off, MSU_MAX_REQ);
+    assert(shim_fs_locks == locks);
+
+    // errors and the end of a file
+    uint16_t got;
+    assert(ask(9, 0, 16, &got) == MSU_NO_FILE && got == 0);
+    assert(ask(0, DATA_SIZE, 16, &got) == MSU_PAST_END && got == 0);
+    ask_ok(0, DATA_SIZE - 10, MSU_MAX_REQ);
+    ask_ok(1, TRACK_SIZE - 1, 2000);
+
+    // stopped: no replies
+    msu_stop();
+    assert(ask(0, 0, 16, &got) == -1);
+    msu_start("usb:snes/Game.sfc");
+    ask_ok(0, 12345, 512);
+    msu_stop();
+    assert(shim_fs_held() == 0 && !shim_uart1_held());
+    puts("msu_test: ok");
+    return 0;
+}
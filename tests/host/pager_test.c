@@ -0,0 +1,175 @@
+// pager.c against a simulated core
+//
+// The core takes 0x13 pieces into its memory and, while its game boots,
+// asks with packet 0x18 for the first page the game needs that is not
+// there yet: the first pages, then three pages spread over the ROM. Every
+// byte on the UART costs 5us of the simulated clock (2Mbaud 8N1), so the
+// time the game waits can be compared with sending the whole ROM before
+// the start. Checks that each page is complete and equal to the ROM when
+// its last piece arrives, that the transform hook sees every byte after
+// the first pages once and in address order, that the done hook runs once,
+// and that a read failure on a demanded page reports that page.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "pager.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define UART_BAUD   2000000
+#define COPIER      512
+
+static uint8_t *rom, *mem;
+static uint32_t len;
+static bool present[PAGER_MAX_PAGES];
+static uint32_t pieces;
+
+// 0x13 page[15:0] piece[7:0] data[PAGER_PIECE]
+static uint8_t cmd[4 + PAGER_PIECE];
+static int cmd_len;
+
+static void core_rx(uint8_t ch) {
+    shim_advance_us(10 * 1000000 / UART_BAUD);
+    if (cmd_len == 0 && ch != 0x13)
+        return;
+    cmd[cmd_len++] = ch;
+    if (cmd_len < (int)sizeof(cmd))
+        return;
+    cmd_len = 0;
+    int page = cmd[1] | cmd[2] << 8, piece = cmd[3];
+    uint32_t pos = page * PAGER_PAGE + piece * PAGER_PIECE;
+    assert(pos < len && !present[page]);
+    memcpy(mem + pos, cmd + 4, min((uint32_t)PAGER_PIECE, len - pos));
+    pieces++;
+    if (piece == PIECES - 1 || pos + PAGER_PIECE >= len) {
+        uint32_t start = page * PAGER_PAGE;
+        assert(!memcmp(mem + start, rom + start, min((uint32_t)PAGER_PAGE, len - start)));
+        present[page] = true;
+    }
+}
+
+// what the hooks saw
+static uint32_t transform_pos;
+static int done_calls;
+
+static void transform(BYTE *buf, UINT n, uint32_t pos, void *ctx) {
+    assert(pos == transform_pos && !memcmp(buf, rom + pos, n));
+    transform_pos += n;
+}
+
+static void done(void *ctx) {
+    done_calls++;
+}
+
+static void ask(uint32_t addr) {
+    for (int i = 0; i < 4; i++)
+        assert(pager_rx(i, addr >> (i * 8)) == (i == 3));
+}
+
+static void write_rom(uint32_t n) {
+    FILE *f = fopen(ffshim_host_path("usb:Game.gba"), "wb");
+    static uint8_t header[COPIER];
+    fwrite(header, 1, COPIER, f);
+    fwrite(rom, 1, n, f);
+    fclose(f);
+}
+
+// load a ROM of `size` bytes while the game boots. return the time until
+// the pages the game starts with are in the core, and in *all_ms the time
+// until the whole ROM is
+static double boot(uint32_t size, double *all_ms, double *worst_ms) {
+    len = size;
+    memset(present, 0, sizeof(present));
+    memset(mem, 0, len);
+    write_rom(len);
+    uint32_t need[] = {0x100, 3 * PAGER_PAGE + 5, len / 2 + 0x1234, len / 4 * 3, len - 1};
+    int needed = sizeof(need) / sizeof(need[0]);
+
+    // rom_load() sends the first pages itself, before pager_start()
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    uint32_t first = min(len, (uint32_t)PAGER_FIRST * PAGER_PAGE);
+    shim_advance_us((uint64_t)first * 10 * 1000000 / UART_BAUD);
+    memcpy(mem, rom, first);
+    for (uint32_t p = 0; p * PAGER_PAGE < first; p++)
+        present[p] = true;
+    transform_pos = first;
+    done_calls = 0;
+    assert(pager_start("usb:Game.gba", COPIER, len, &(struct pager_hooks){transform, done, NULL}) == 0);
+
+    // the game waits for each page it needs, and asks again if it was dropped
+    int k = 0;
+    uint64_t asked = 0, booted = 0, worst = 0;
+    bool more;
+    do {
+        while (k < needed && present[need[k] / PAGER_PAGE]) {
+            if (asked)
+                worst = max(worst, bflb_mtimer_get_time_us() - asked);
+            asked = 0;
+            k++;
+        }
+        if (k == needed && !booted)
+            booted = bflb_mtimer_get_time_us();
+        if (k < needed && (!asked || bflb_mtimer_get_time_us() - asked > 500000)) {
+            ask(need[k]);
+            asked = bflb_mtimer_get_time_us();
+        }
+        more = pager_step();
+    } while (more);
+    assert(k == needed && transform_pos == len && done_calls == 1 && !memcmp(mem, rom, len));
+    for (uint32_t p = 0; p * PAGER_PAGE < len; p++)
+        assert(present[p]);
+    *all_ms = (bflb_mtimer_get_time_us() - t0) / 1e3;
+    *worst_ms = worst / 1e3;
+    return (booted - t0) / 1e3;
+}
+
+int main(void) {
+    uint32_t max_len = 32 << 20;
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    shim_uart_tx = core_rx;
+    rom = malloc(max_len);
+    mem = malloc(max_len);
+    srand(9);
+    for (uint32_t i = 0; i < max_len; i++)
+        rom[i] = rand();
+    pager_init();
+
+    static const uint32_t sizes[] = {4 << 20, 8 << 20, 16 << 20, (32 << 20) - 1000};
+    for (int i = 0; i < 4; i++) {
+        double all, worst, first = boot(sizes[i], &all, &worst);
+        printf("%5.1fMB ROM: game starts after %5.0f ms (worst page wait %3.0f ms), "
+               "whole ROM in %6.0f ms, sent before the start %6.0f ms\n", sizes[i] / 1048576.0,
+               first, worst, all, sizes[i] * 10.0 / UART_BAUD * 1e3);
+    }
+
+    // requests for pages the core has, or past the end, send nothing
+    len = 1 << 20;
+    write_rom(len);
+    assert(pager_start("usb:Game.gba", COPIER, len, &(struct pager_hooks){0}) == 0);
+    ask(0);
+    ask(len + 5);
+    pieces = 0;
+    memset(present, 0, sizeof(present));
+    for (int p = 0; p < PAGER_FIRST; p++)
+        present[p] = true;
+    assert(pager_step() && pieces == 1 && cmd[1] == PAGER_FIRST && cmd[3] == 0);
+    pager_stop();
+    assert(!pager_step());
+
+    // the file ends before the ROM does: the demanded page is the one reported
+    len = 2 << 20;
+    write_rom(1 << 20);
+    assert(pager_start("usb:Game.gba", COPIER, len, &(struct pager_hooks){0}) == 0);
+    ask(len - 1);
+    assert(!pager_step() && !strcmp(shim_status, "ROM read failure at 1984K"));
+    assert(!pager_step());
+    assert(shim_fs_held() == 0 && !shim_uart1_held());
+    puts("pager_test: ok");
+    return 0;
+}
@@ -0,0 +1,279 @@
+// patch.c against patches made here
+//
+// For each format, random patches are generated against a random ROM with
+// a 512-byte copier header, together with the ROM they must produce:
+//  - IPS: data and RLE records in random order, overlapping, some past the
+//    ROM end, sometimes with a truncation size after EOF
+//  - UPS: XOR runs, with the ROM grown or shrunk
+//  - BPS: all four actions, target copies within 16000 bytes
+// The patched ROM is read with patch_read() in STREAM_CHUNK pieces, as the
+// loader does, and must match; patch_verify() must accept the CRC of the
+// output. A patch with a flipped byte and a ROM of the wrong size must be
+// rejected. Prints the drive commands of a patched load next to a plain
+// one.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shim.h"
+#include "patch.c"
+
+#define COPIER      512
+
+struct bytes {
+    uint8_t *p;
+    uint32_t len, cap;
+};
+
+static void put(struct bytes *b, const void *p, uint32_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+}
+
+static void put8(struct bytes *b, uint8_t v) {
+    put(b, &v, 1);
+}
+
+static void put_be(struct bytes *b, uint32_t v, int n) {
+    while (n--)
+        put8(b, v >> (8 * n));
+}
+
+static void put_le32(struct bytes *b, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        put8(b, v >> (8 * i));
+}
+
+static void put_vlq(struct bytes *b, uint64_t v) {
+    for (;;) {
+        uint8_t x = v & 0x7f;
+        v >>= 7;
+        if (!v) {
+            put8(b, 0x80 | x);
+            return;
+        }
+        put8(b, x);
+        v--;
+    }
+}
+
+static void put_svlq(struct bytes *b, int64_t d) {
+    put_vlq(b, (uint64_t)(d < 0 ? -d : d) << 1 | (d < 0));
+}
+
+static void resize(struct bytes *b, uint32_t n) {
+    if (n > b->cap) {
+        b->cap = n;
+        b->p = realloc(b->p, n);
+    }
+    if (n > b->len)
+        memset(b->p + b->len, 0, n - b->len);
+    b->len = n;
+}
+
+static void footer(struct bytes *p, const struct bytes *src, const struct bytes *tgt) {
+    put_le32(p, crc32_update(0, src->p, src->len));
+    put_le32(p, crc32_update(0, tgt->p, tgt->len));
+    put_le32(p, crc32_update(0, p->p, p->len));
+}
+
+static void make_ips(const struct bytes *src, struct bytes *p, struct bytes *tgt) {
+    put(tgt, src->p, src->len);
+    put(p, "PATCH", 5);
+    for (int n = 1 + rand() % 2000; n; n--) {
+        uint32_t off = rand() % (src->len + 5000), len;
+        if (off == 0x454f46)
+            continue;
+        if (rand() % 10 < 3) {
+            len = 1 + rand() % 3000;
+            uint8_t v = rand();
+            put_be(p, off, 3);
+            put_be(p, 0, 2);
+            put_be(p, len, 2);
+            put8(p, v);
+            resize(tgt, max(tgt->len, off + len));
+            memset(tgt->p + off, v, len);
+        } else {
+            len = 1 + rand() % 600;
+            put_be(p, off, 3);
+            put_be(p, len, 2);
+            resize(tgt, max(tgt->len, off + len));
+            for (uint32_t i = 0; i < len; i++)
+                tgt->p[off + i] = rand();
+            put(p, tgt->p + off, len);
+        }
+    }
+    put(p, "EOF", 3);
+    if (rand() % 10 < 3) {
+        uint32_t t = tgt->len / 2 + rand() % (tgt->len / 2);
+        put_be(p, t, 3);
+        tgt->len = t;
+    }
+}
+
+static void make_ups(const struct bytes *src, struct bytes *p, struct bytes *tgt) {
+    static const int grow[] = {0, 0, 1000, -1000};
+    uint32_t n = src->len + grow[rand() % 4];
+    put(tgt, src->p, min(n, src->len));
+    resize(tgt, n);
+    for (int k = 0; k < 2000; k++) {
+        uint32_t o = rand() % n, l = 1 + rand() % 200;
+        for (uint32_t i = o; i < min(n, o + l); i++)
+            tgt->p[i] = rand();
+    }
+    put(p, "UPS1", 4);
+    put_vlq(p, src->len);
+    put_vlq(p, n);
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < n;) {
+        uint8_t s = i < src->len ? src->p[i] : 0;
+        if (!(s ^ tgt->p[i])) {
+            i++;
+            continue;
+        }
+        put_vlq(p, i - last);
+        for (; i < n && ((i < src->len ? src->p[i] : 0) ^ tgt->p[i]); i++)
+            put8(p, (i < src->len ? src->p[i] : 0) ^ tgt->p[i]);
+        put8(p, 0);
+        last = ++i;
+    }
+    footer(p, src, tgt);
+}
+
+static void make_bps(const struct bytes *src, struct bytes *p, struct bytes *tgt) {
+    uint32_t n = src->len + rand() % 10001 - 5000;
+    int64_t sr = 0, tr = 0;
+    put(p, "BPS1", 4);
+    put_vlq(p, src->len);
+    put_vlq(p, n);
+    put_vlq(p, 3);
+    put(p, "abc", 3);
+    while (tgt->len < n) {
+        uint32_t o = tgt->len, l = min(1 + rand() % 3000, n - o);
+        int a = rand() % 4;
+        if (a == 0 && o + l > src->len)
+            a = 1;
+        if (a == 3 && o == 0)
+            a = 1;
+        if (a == 0) {
+            put_vlq(p, (uint64_t)(l - 1) << 2 | 0);
+            put(tgt, src->p + o, l);
+        } else if (a == 1) {
+            put_vlq(p, (uint64_t)(l - 1) << 2 | 1);
+            for (uint32_t i = 0; i < l; i++)
+                put8(tgt, rand());
+            put(p, tgt->p + o, l);
+        } else if (a == 2) {
+            uint32_t s = rand() % (src->len - l);
+            put_vlq(p, (uint64_t)(l - 1) << 2 | 2);
+            put_svlq(p, s - sr);
+            put(tgt, src->p + s, l);
+            sr = s + l;
+        } else {
+            uint32_t s = o - 1 - rand() % min(o, 16000u);
+            put_vlq(p, (uint64_t)(l - 1) << 2 | 3);
+            put_svlq(p, s - tr);
+            for (uint32_t i = 0; i < l; i++)
+                put8(tgt, tgt->p[s + i]);
+            tr = s + l;
+        }
+    }
+    footer(p, src, tgt);
+}
+
+static void write_file(const char *path, const void *p, uint32_t n) {
+    FILE *f = fopen(ffshim_host_path(path), "wb");
+    fwrite(p, 1, n, f);
+    fclose(f);
+}
+
+// load usb:Game.sfc as the loader does, return 0 if the output is `want`
+static int load(const struct bytes *want, uint32_t src_size, uint64_t *cmds) {
+    static FIL rom;
+    uint32_t out, crc = 0, done = 0;
+    int r = -1;
+    struct ffshim_stats s0 = ffshim_stats;
+    assert(fastseek_open(&rom, "usb:Game.sfc") == FR_OK);
+    if (patch_open("usb:Game.sfc", &rom, COPIER, src_size, &out) <= 0)
+        goto load_close;
+    if (out != want->len)
+        goto load_patch_close;
+    f_lseek(&rom, COPIER);
+    while (done < out) {
+        UINT br;
+        if (patch_read(stream_buf, min(STREAM_CHUNK, out - done), &br, NULL) != FR_OK || !br ||
+            memcmp(stream_buf, want->p + done, br))
+            goto load_patch_close;
+        crc = crc32_update(crc, stream_buf, br);
+        done += br;
+    }
+    r = patch_verify(crc);
+load_patch_close:
+    patch_close();
+load_close:
+    fastseek_close(&rom);
+    if (cmds)
+        *cmds = ffshim_stats.cmds - s0.cmds;
+    return r;
+}
+
+// drive commands of loading usb:Game.sfc without a patch
+static uint64_t plain_cmds(void) {
+    static FIL rom;
+    UINT br;
+    struct ffshim_stats s0 = ffshim_stats;
+    assert(fastseek_open(&rom, "usb:Game.sfc") == FR_OK);
+    f_lseek(&rom, COPIER);
+    do
+        assert(stream_read(&rom, stream_buf, STREAM_CHUNK, &br) == FR_OK);
+    while (br == STREAM_CHUNK);
+    fastseek_close(&rom);
+    return ffshim_stats.cmds - s0.cmds;
+}
+
+static void run(const char *ext, void (*make)(const struct bytes *, struct bytes *, struct bytes *),
+                int rounds) {
+    char path[32];
+    snprintf(path, sizeof(path), "usb:Game.%s", ext);
+    for (int k = 0; k < rounds; k++) {
+        struct bytes rom = {0}, src = {0}, p = {0}, tgt = {0};
+        uint32_t size = 100000 + rand() % 1400000;
+        resize(&rom, COPIER + size);
+        for (uint32_t i = 0; i < rom.len; i++)
+            rom.p[i] = rand();
+        put(&src, rom.p + COPIER, size);
+        make(&src, &p, &tgt);
+        write_file("usb:Game.sfc", rom.p, rom.len);
+        write_file(path, p.p, p.len);
+
+        uint64_t cmds;
+        assert(load(&tgt, size, &cmds) == 0);
+        if (k == 0)
+            printf("%s: %uK ROM, %uK patch, %llu drive cmds, unpatched %llu\n", ext, size >> 10,
+                   p.len >> 10, (unsigned long long)cmds, (unsigned long long)plain_cmds());
+        if (strcmp(ext, "ips")) {
+            // checksummed formats: a flipped byte and the wrong ROM
+            p.p[p.len / 2] ^= 0x20;
+            write_file(path, p.p, p.len);
+            assert(load(&tgt, size, NULL) != 0);
+            assert(load(&tgt, size - 1, NULL) != 0);
+        }
+        remove(ffshim_host_path(path));
+        free(rom.p), free(src.p), free(p.p), free(tgt.p);
+    }
+}
+
+int main(void) {
+    ffshim_temp_root();
+    srand(7);
+    run("ips", make_ips, 20);
+    run("ups", make_ups, 20);
+    run("bps", make_bps, 20);
+    puts("patch_test: ok");
+    return 0;
+}
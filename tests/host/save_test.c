@@ -0,0 +1,154 @@
+// save.c against a simulated core
+//
+// The core has NP pages of save RAM and answers commands 0x0D (dirty bitmap)
+// and 0x0E (page data) through save_rx(), dropping some replies. The game
+// writes in bursts with quiet gaps. The save file must equal the core's save
+// RAM after save_stop(), be written in whole sectors, and be read back
+// unchanged by save_load(). Pages must come from the core without the file
+// system lock, so menus and loads are not held up by UART traffic. A failed
+// write must not lose the pages it held: they are fetched and written again.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shim.h"
+#include "save.c"
+
+#define NP  40                          // 20KB of save RAM
+
+static uint8_t ram[NP * SAVE_PAGE], dirty[(NP + 7) / 8];
+static int drop_pct;
+static bool stopping;                   // in save_stop(), which holds the lock
+static long fetches_locked;
+
+// commands from the firmware, answered at once
+static uint8_t cmd[3];
+static int cmd_len;
+
+static void reply(uint8_t type, const uint8_t *b, int n) {
+    if (rand() % 100 < drop_pct)
+        return;
+    for (int i = 0; i < n; i++)
+        if (save_rx(type, i, b[i]))
+            assert(i == n - 1);
+}
+
+static void core_rx(uint8_t ch) {
+    cmd[cmd_len++] = ch;
+    if (cmd[0] == 0x0D) {
+        uint8_t b[2 + sizeof(dirty)] = {NP & 0xff, NP >> 8};
+        memcpy(b + 2, dirty, sizeof(dirty));
+        cmd_len = 0;
+        reply(0x13, b, sizeof(b));
+    } else if (cmd[0] == 0x0E && cmd_len == 3) {
+        int p = cmd[1] | cmd[2] << 8;
+        uint8_t b[2 + SAVE_PAGE] = {cmd[1], cmd[2]};
+        if (shim_fs_held() && !stopping)
+            fetches_locked++;
+        dirty[p / 8] &= ~(1 << (p % 8));
+        memcpy(b + 2, ram + p * SAVE_PAGE, SAVE_PAGE);
+        cmd_len = 0;
+        reply(0x14, b, sizeof(b));
+    } else if (cmd[0] != 0x0E) {
+        cmd_len = 0;
+    }
+}
+
+static void game_write(int addr, uint8_t v) {
+    ram[addr] = v;
+    dirty[addr / SAVE_PAGE / 8] |= 1 << (addr / SAVE_PAGE % 8);
+}
+
+// stands in for loader.c: loading state 2 streams the file into save RAM
+int rom_send_file(const char *fname, int state) {
+    FILE *f = fopen(ffshim_host_path(fname), "rb");
+    assert(state == 2 && f);
+    memset(ram, 0, sizeof(ram));
+    fread(ram, 1, sizeof(ram), f);
+    fclose(f);
+    return 0;
+}
+
+static bool file_equal(void) {
+    static uint8_t b[sizeof(ram)];
+    FILE *f = fopen(ffshim_host_path("usb:saves/Game.srm"), "rb");
+    if (!f)
+        return false;
+    size_t n = fread(b, 1, sizeof(b), f);
+    fclose(f);
+    return n == sizeof(b) && !memcmp(b, ram, sizeof(b));
+}
+
+// a second of game time, as the save task would spend it
+static void tick(void) {
+    vTaskDelay(SAVE_POLL_MS);
+    save_poll();
+}
+
+int main(void) {
+    ffshim_temp_root();
+    shim_uart_tx = core_rx;
+    core_caps = CORE_CAP_SAVE_RAM;
+    core_running = true;
+    srand(5);
+    save_init();
+    for (size_t i = 0; i < sizeof(ram); i++)
+        ram[i] = rand();                // power-on garbage
+
+    save_start("usb:snes/Game.sfc");
+    assert(!strcmp(save_path, "usb:saves/Game.srm"));
+    for (int i = 0; i < 3; i++)
+        tick();
+    assert(ffshim_stats.f_writes == 0);     // nothing written by the game yet
+
+    // the first write fetches all pages, more than fit the buffer
+    game_write(100, 1);
+    tick();
+    assert(!file_equal());
+    for (int i = 0; i < 3; i++)
+        tick();
+    printf("first save: %u writes, %llu sectors\n", ffshim_stats.f_writes,
+           (unsigned long long)ffshim_stats.sectors);
+    assert(file_equal());
+
+    // the drive fails a write: its pages are written by a later poll
+    game_write(5 * SAVE_PAGE, 7);
+    game_write(30 * SAVE_PAGE + 1, 8);
+    ffshim_fail_write = 1;
+    for (int i = 0; i < 8; i++)
+        tick();
+    assert(ffshim_fail_write == 0 && file_equal());
+
+    // play: bursts of writes, quiet gaps, lost replies
+    drop_pct = 10;
+    uint32_t writes = ffshim_stats.f_writes;
+    for (int t = 0; t < 600; t++) {
+        if (t % 40 < 10)
+            for (int k = 0; k < 20; k++)
+                game_write(rand() % sizeof(ram), rand());
+        if (t % 40 < 10 && t % 3 == 0)
+            for (int k = 0; k < 3 * SAVE_PAGE; k++)
+                game_write(8 * SAVE_PAGE + k, t);       // 3 pages in a row
+        tick();
+    }
+    drop_pct = 0;
+    stopping = true;
+    save_stop();
+    stopping = false;
+    printf("600s of play: %u writes, file %s\n", ffshim_stats.f_writes - writes,
+           file_equal() ? "equal" : "DIFFERENT");
+    assert(file_equal());
+    assert(fetches_locked == 0 && ffshim_stats.unaligned_writes == 0);
+    assert(shim_fs_held() == 0 && !shim_sem_held(save_mutex));
+
+    // reload into a fresh core
+    static uint8_t keep[sizeof(ram)];
+    memcpy(keep, ram, sizeof(ram));
+    memset(ram, 0xaa, sizeof(ram));
+    core_running = false;
+    save_load("usb:snes/Game.sfc");
+    assert(!memcmp(keep, ram, sizeof(ram)));
+    puts("save_test: ok");
+    return 0;
+}
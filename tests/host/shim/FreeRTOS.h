@@ -0,0 +1,35 @@
+// Host shim of FreeRTOS, see rtos.c
+//
+// Everything runs on one thread. Tests call the work functions of a module
+// directly instead of running its task. Ticks are milliseconds of simulated
+// time: blocking calls that would wait advance the clock instead, and wait
+// forever on something that can never come is reported as a deadlock.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define pdFAIL                  0
+#define portMAX_DELAY           0xffffffffUL
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms))
+#define configMAX_PRIORITIES    32
+#define configMINIMAL_STACK_SIZE 128
+#define tskIDLE_PRIORITY        0
+#define portYIELD_FROM_ISR(x)   (void)(x)
+#define configASSERT(x)         do { if (!(x)) shim_fatal("configASSERT(" #x ")"); } while (0)
+
+void *pvPortMalloc(size_t size);
+void vPortFree(void *p);
+
+// report a condition the firmware would hang or crash on, and exit
+void shim_fatal(const char *what);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct bflb_device_s {
+    int irq_num;
+};
+
+#define GPIO_PIN_0  0
+#define GPIO_PIN_1  1
+#define GPIO_PIN_2  2
+#define GPIO_PIN_3  3
+#define GPIO_PIN_10 10
+#define GPIO_PIN_12 12
+#define GPIO_PIN_14 14
+#define GPIO_PIN_16 16
+
+void bflb_gpio_set(struct bflb_device_s *dev, uint8_t pin);
+void bflb_gpio_reset(struct bflb_device_s *dev, uint8_t pin);
+bool bflb_gpio_read(struct bflb_device_s *dev, uint8_t pin);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// the host has coherent caches. these only count calls
+void bflb_l1c_dcache_clean_range(void *addr, uint32_t len);
+void bflb_l1c_dcache_invalidate_range(void *addr, uint32_t len);
+void bflb_l1c_dcache_clean_invalidate_range(void *addr, uint32_t len);
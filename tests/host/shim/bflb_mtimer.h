@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// host time plus the simulated time of waits and drive commands
+uint64_t bflb_mtimer_get_time_us(void);
+uint64_t bflb_mtimer_get_time_ms(void);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "bflb_gpio.h"
+
+// bytes to the core go to shim_uart_tx, see shim.h
+int bflb_uart_putchar(struct bflb_device_s *dev, int ch);
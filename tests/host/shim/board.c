@@ -0,0 +1,100 @@
+// What main.c and volume.c give the modules: UART1 to the core, the locks,
+// the overlay and the globals of the running core
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "bflb_uart.h"
+#include "ff.h"
+
+#include "shim.h"
+
+#define BLOCK_SIZE (8*1024)
+
+struct bflb_device_s *uart1_dev;
+int16_t active_core = -1;
+bool core_running;
+uint16_t core_caps;
+BYTE __attribute__((aligned(64))) fbuf[BLOCK_SIZE];
+
+void (*shim_uart_tx)(uint8_t ch);
+uint64_t shim_uart_bytes;
+bool shim_verbose;
+char shim_status[256];
+bool shim_fs_busy;
+uint32_t shim_fs_locks;
+
+static int fs_depth;
+static bool uart1_held;
+
+int bflb_uart_putchar(struct bflb_device_s *dev, int ch) {
+    if (!uart1_held)
+        shim_fatal("UART1 written without uart1_lock()");
+    shim_uart_bytes++;
+    if (shim_uart_tx)
+        shim_uart_tx((uint8_t)ch);
+    return 0;
+}
+
+void fs_lock(void) {
+    if (uart1_held)
+        shim_fatal("fs_lock() taken while holding uart1_lock()");
+    if (shim_fs_busy)
+        shim_fatal("fs_lock() would wait for another task");
+    fs_depth++;
+    shim_fs_locks++;
+}
+
+bool fs_trylock(void) {
+    if (uart1_held)
+        shim_fatal("fs_trylock() taken while holding uart1_lock()");
+    if (shim_fs_busy)
+        return false;
+    fs_depth++;
+    shim_fs_locks++;
+    return true;
+}
+
+void fs_unlock(void) {
+    if (fs_depth == 0)
+        shim_fatal("fs_unlock() without fs_lock()");
+    fs_depth--;
+}
+
+void uart1_lock(void) {
+    if (uart1_held)
+        shim_fatal("uart1_lock() taken twice");
+    uart1_held = true;
+}
+
+void uart1_unlock(void) {
+    uart1_held = false;
+}
+
+int shim_fs_held(void) {
+    return fs_depth;
+}
+
+bool shim_uart1_held(void) {
+    return uart1_held;
+}
+
+void overlay_status(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(shim_status, sizeof(shim_status), fmt, ap);
+    va_end(ap);
+    if (shim_verbose)
+        printf("status: %s\n", shim_status);
+}
+
+void overlay_printf(const char *fmt, ...) {
+    va_list ap;
+    if (!shim_verbose)
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "ff.h"
+
+typedef BYTE DSTATUS;
+typedef enum { RES_OK = 0, RES_ERROR, RES_WRPRT, RES_NOTRDY, RES_PARERR } DRESULT;
+
+#define STA_NOINIT          0x01
+#define STA_NODISK          0x02
+
+#define CTRL_SYNC           0
+#define GET_SECTOR_COUNT    1
+#define GET_SECTOR_SIZE     2
+#define GET_BLOCK_SIZE      3
+
+#define DEV_USB             4
+
+typedef struct {
+    int (*disk_status)(void);
+    int (*disk_initialize)(void);
+    int (*disk_write)(const BYTE *buff, LBA_t sector, UINT count);
+    int (*disk_read)(BYTE *buff, LBA_t sector, UINT count);
+    int (*disk_ioctl)(BYTE cmd, void *buff);
+} FATFS_DiskioDriverTypeDef;
+
+void disk_driver_callback_init(uint8_t pdrv, FATFS_DiskioDriverTypeDef *drv);
+
+// sectors of the simulated drive, see ff.c
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct shim_events *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+typedef struct { void *dummy[2]; } StaticEventGroup_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *buf);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t ticks);
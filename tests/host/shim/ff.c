@@ -0,0 +1,460 @@
+// FatFs over a host directory, see ff.h
+//
+// Drive access is modeled after FatFs on the USB drive: partial sectors go
+// through the sector buffer of the file, whole sectors are read or written
+// with one command per cluster, and seeking or moving to the next cluster
+// without a link map follows the FAT chain. FatFs holds one FAT sector (in
+// fs.win, which directory lookups also use), so following a chain costs a
+// FAT sector read whenever the next entry is in another sector: one per 128
+// clusters of a contiguous file, one per fragment when fragments lie far
+// apart. The cost goes on the simulated clock (ffshim_cmd_us,
+// ffshim_sector_us).
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// FatFs and the host both have a DIR
+#define DIR FF_DIR
+#include "FreeRTOS.h"
+#include "ff.h"
+#include "diskio.h"
+
+#include "shim.h"
+#undef DIR
+#include <dirent.h>
+
+#define SECTOR          FF_MAX_SS
+#define CLUSTER_SECTORS 8           // 4KB clusters
+#define CLUSTER         (SECTOR * CLUSTER_SECTORS)
+#define FAT_ENTRIES     128         // FAT32 entries per FAT sector
+#define MAX_MAPS        256
+
+FATFS fs = {FS_FAT32, DEV_USB, 1, CLUSTER_SECTORS, 2048};
+
+uint32_t ffshim_cmd_us, ffshim_sector_us;
+uint32_t ffshim_frag_clusters, ffshim_frag_gap = 1;
+int ffshim_fail_write;
+struct ffshim_stats ffshim_stats;
+
+static char root[512] = ".";
+
+// clusters of a mapped file on the simulated drive: fragments of
+// `frag` clusters from `first`, with `gap` foreign clusters between them
+static struct map {
+    char path[512];
+    DWORD first, clusters, frag, gap;
+} maps[MAX_MAPS];
+static int map_count;
+static DWORD next_cluster = 2;
+static long fat_win = -1;           // FAT sector in fs.win, -1 if none
+
+void ffshim_root(const char *dir) {
+    snprintf(root, sizeof(root), "%s", dir);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void remove_root(void) {
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+const char *ffshim_temp_root(void) {
+    snprintf(root, sizeof(root), "/tmp/ffshim.XXXXXX");
+    if (!mkdtemp(root))
+        shim_fatal("ffshim: no temporary directory");
+    atexit(remove_root);
+    return root;
+}
+
+const char *ffshim_host_path(const char *path) {
+    static char host[1024];
+    if (!strncmp(path, "usb:", 4))
+        path += 4;
+    while (*path == '/')
+        path++;
+    snprintf(host, sizeof(host), "%s/%s", root, path);
+    return host;
+}
+
+static void io(uint32_t sectors) {
+    ffshim_stats.cmds++;
+    ffshim_stats.sectors += sectors;
+    shim_advance_us(ffshim_cmd_us + (uint64_t)ffshim_sector_us * sectors);
+}
+
+// a directory lookup: one directory sector per path component
+static void lookup(const char *path) {
+    fat_win = -1;
+    io(1);
+    for (const char *p = path; *p; p++)
+        if (*p == '/')
+            io(1);
+}
+
+static int fragments(const struct map *m) {
+    return m->frag ? (m->clusters + m->frag - 1) / m->frag : 1;
+}
+
+// drive cluster of cluster `cl` of the file
+static DWORD map_cluster(const struct map *m, DWORD cl) {
+    if (!m->frag)
+        return m->first + cl;
+    return m->first + cl / m->frag * (m->frag + m->gap) + cl % m->frag;
+}
+
+// follow the chain of `m` from cluster `from` of the file to cluster `to`:
+// FatFs reads the FAT entry of each cluster on the way
+static void walk(const struct map *m, DWORD from, DWORD to) {
+    for (DWORD cl = from; cl < to; cl++) {
+        long s = map_cluster(m, cl) / FAT_ENTRIES;
+        if (s != fat_win) {
+            fat_win = s;
+            ffshim_stats.fat_sectors++;
+            io(1);
+        }
+    }
+}
+
+static int map_file(FIL *fp, const char *host) {
+    DWORD clusters = (DWORD)((fp->obj.objsize + CLUSTER - 1) / CLUSTER);
+    for (int i = 0; i < map_count; i++)
+        if (!strcmp(maps[i].path, host) && maps[i].clusters >= clusters && maps[i].frag == ffshim_frag_clusters &&
+            maps[i].gap == ffshim_frag_gap)
+            return i;
+    if (map_count == MAX_MAPS)
+        shim_fatal("ffshim: too many mapped files");
+    struct map *m = &maps[map_count];
+    snprintf(m->path, sizeof(m->path), "%s", host);
+    m->first = next_cluster;
+    m->clusters = clusters ? clusters : 1;
+    m->frag = ffshim_frag_clusters;
+    m->gap = ffshim_frag_gap;
+    next_cluster = map_cluster(m, m->clusters - 1) + 2;
+    return map_count++;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+    ffshim_stats.disk_reads++;
+    io(count);
+    for (UINT i = 0; i < count; i++, buff += SECTOR) {
+        DWORD cl = (sector + i - fs.database) / CLUSTER_SECTORS + 2;
+        memset(buff, 0, SECTOR);
+        for (int k = 0; k < map_count; k++) {
+            struct map *m = &maps[k];
+            if (cl < m->first || cl > map_cluster(m, m->clusters - 1))
+                continue;
+            DWORD rel = cl - m->first;
+            if (m->frag && rel % (m->frag + m->gap) >= m->frag)
+                continue;               // the gap between fragments
+            DWORD file_cl = m->frag ? rel / (m->frag + m->gap) * m->frag + rel % (m->frag + m->gap) : rel;
+            off_t pos = (off_t)file_cl * CLUSTER + (sector + i - fs.database) % CLUSTER_SECTORS * SECTOR;
+            int fd = open(m->path, O_RDONLY);
+            if (fd >= 0) {
+                if (pread(fd, buff, SECTOR, pos) < 0)
+                    memset(buff, 0, SECTOR);
+                close(fd);
+            }
+            break;
+        }
+    }
+    return RES_OK;
+}
+
+FRESULT f_mount(FATFS *fsp, const TCHAR *path, BYTE opt) {
+    return FR_OK;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+    const char *host = ffshim_host_path(path);
+    int flags = (mode & FA_WRITE) ? O_RDWR : O_RDONLY;
+    if (mode & FA_CREATE_ALWAYS)
+        flags |= O_CREAT | O_TRUNC;
+    else if (mode & FA_CREATE_NEW)
+        flags |= O_CREAT | O_EXCL;
+    else if (mode & FA_OPEN_ALWAYS)
+        flags |= O_CREAT;
+    struct stat st;
+
+    memset(fp, 0, sizeof(*fp));
+    fp->fd = -1;
+    fp->map = -1;
+    ffshim_stats.opens++;
+    lookup(path);
+    if (stat(host, &st) == 0 && S_ISDIR(st.st_mode))
+        return FR_NO_FILE;
+    int fd = open(host, flags, 0644);
+    if (fd < 0) {
+        if (errno == EEXIST)
+            return FR_EXIST;
+        return errno == ENOENT ? FR_NO_FILE : FR_DENIED;
+    }
+    fstat(fd, &st);
+    fp->obj.fs = &fs;
+    fp->obj.objsize = st.st_size;
+    fp->flag = mode;
+    fp->fd = fd;
+    fp->host = strdup(host);
+    if ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+        fp->fptr = st.st_size;
+    if (!(mode & FA_WRITE) && st.st_size && map_count < MAX_MAPS) {
+        fp->map = map_file(fp, host);
+        fp->obj.sclust = maps[fp->map].first;
+    }
+    return FR_OK;
+}
+
+FRESULT f_close(FIL *fp) {
+    if (fp->fd < 0)
+        return FR_INVALID_OBJECT;
+    close(fp->fd);
+    free(fp->host);
+    fp->fd = -1;
+    fp->host = NULL;
+    return FR_OK;
+}
+
+// drive commands of moving `len` bytes at the file position through FatFs
+static void file_io(FIL *fp, UINT len) {
+    FSIZE_t pos = fp->fptr, end = pos + len;
+    if (!fp->cltbl && len && fp->map >= 0) {
+        // FatFs moves to the next cluster when it starts on one: at
+        // each cluster boundary in [pos, end) but at 0
+        DWORD first = pos ? (DWORD)((pos + CLUSTER - 1) / CLUSTER) : 1, last = (end - 1) / CLUSTER;
+        if (last >= first)
+            walk(&maps[fp->map], first - 1, last);
+    } else if (!fp->cltbl && len) {
+        // the next cluster comes from the FAT, one sector per FAT_ENTRIES
+        uint64_t fat = (end - 1) / CLUSTER / FAT_ENTRIES - pos / CLUSTER / FAT_ENTRIES;
+        ffshim_stats.fat_sectors += fat;
+        for (uint64_t i = 0; i < fat; i++)
+            io(1);
+    }
+    while (pos < end) {
+        LBA_t sect = pos / SECTOR;
+        if (pos % SECTOR || end - pos < SECTOR) {
+            if (fp->sect != sect + 1)   // through the sector buffer
+                io(1);
+            fp->sect = sect + 1;
+            pos = (sect + 1) * SECTOR;
+        } else {
+            // whole sectors in one command, up to the end of the cluster
+            FSIZE_t n = (end - pos) / SECTOR;
+            if (n > CLUSTER_SECTORS - sect % CLUSTER_SECTORS)
+                n = CLUSTER_SECTORS - sect % CLUSTER_SECTORS;
+            io(n);
+            pos += n * SECTOR;
+        }
+    }
+}
+
+FRESULT f_read(FIL *fp, void *buf, UINT len, UINT *br) {
+    *br = 0;
+    if (fp->fd < 0)
+        return FR_INVALID_OBJECT;
+    if (!(fp->flag & FA_READ))
+        return FR_DENIED;
+    if (fp->fptr >= fp->obj.objsize)
+        return FR_OK;
+    if (len > fp->obj.objsize - fp->fptr)
+        len = fp->obj.objsize - fp->fptr;
+    ffshim_stats.f_reads++;
+    file_io(fp, len);
+    ssize_t n = pread(fp->fd, buf, len, fp->fptr);
+    if (n < 0)
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    ffshim_stats.bytes_read += n;
+    *br = n;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buf, UINT len, UINT *bw) {
+    *bw = 0;
+    if (fp->fd < 0)
+        return FR_INVALID_OBJECT;
+    if (!(fp->flag & FA_WRITE))
+        return FR_DENIED;
+    ffshim_stats.f_writes++;
+    if (fp->fptr % SECTOR || len % SECTOR)
+        ffshim_stats.unaligned_writes++;
+    if (ffshim_fail_write && --ffshim_fail_write == 0)
+        return FR_DISK_ERR;
+    file_io(fp, len);
+    ssize_t n = pwrite(fp->fd, buf, len, fp->fptr);
+    if (n < 0)
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    ffshim_stats.bytes_written += n;
+    if (fp->fptr > fp->obj.objsize)
+        fp->obj.objsize = fp->fptr;
+    *bw = n;
+    return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs) {
+    if (fp->fd < 0)
+        return FR_INVALID_OBJECT;
+    if (ofs == CREATE_LINKMAP) {
+        if (!fp->cltbl)
+            return FR_INVALID_PARAMETER;
+        if (fp->map < 0) {
+            fp->map = map_file(fp, fp->host);
+            fp->obj.sclust = maps[fp->map].first;
+        }
+        struct map *m = &maps[fp->map];
+        DWORD need = 2 * fragments(m) + 2;
+        // FatFs walks the whole chain to build the map, also when it does not fit
+        walk(m, 0, m->clusters);
+        if (fp->cltbl[0] < need) {
+            fp->cltbl[0] = need;
+            return FR_NOT_ENOUGH_CORE;
+        }
+        DWORD *t = fp->cltbl + 1;
+        for (DWORD cl = 0; cl < m->clusters; cl += m->frag ? m->frag : m->clusters) {
+            DWORD n = m->clusters - cl;
+            if (m->frag && n > m->frag)
+                n = m->frag;
+            *t++ = n;
+            *t++ = map_cluster(m, cl);
+        }
+        *t = 0;
+        fp->cltbl[0] = need;
+        return FR_OK;
+    }
+    if (ofs > fp->obj.objsize && !(fp->flag & FA_WRITE))
+        ofs = fp->obj.objsize;
+    if (!fp->cltbl && fp->map >= 0 && ofs > 0) {
+        // FatFs stops on the cluster of the byte before `ofs`, going on from
+        // the current one if that is not past it, from the start otherwise
+        DWORD to = (ofs - 1) / CLUSTER, cur = fp->fptr ? (fp->fptr - 1) / CLUSTER : 0;
+        walk(&maps[fp->map], fp->fptr && to >= cur ? cur : 0, to);
+    } else if (!fp->cltbl) {
+        // follow the chain from the start, or from the current cluster forward
+        FSIZE_t from = ofs >= fp->fptr ? fp->fptr / CLUSTER : 0;
+        uint64_t fat = (ofs / CLUSTER - from) / FAT_ENTRIES;
+        ffshim_stats.fat_sectors += fat;
+        for (uint64_t i = 0; i < fat; i++)
+            io(1);
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp) {
+    if (fp->fd < 0 || ftruncate(fp->fd, fp->fptr))
+        return FR_DISK_ERR;
+    fp->obj.objsize = fp->fptr;
+    fat_win = -1;                   // the directory entry goes through fs.win
+    io(1);
+    return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp) {
+    if (fp->fd < 0)
+        return FR_INVALID_OBJECT;
+    fat_win = -1;                   // the directory entry goes through fs.win
+    io(1);
+    return FR_OK;
+}
+
+FRESULT f_opendir(FF_DIR *dp, const TCHAR *path) {
+    memset(dp, 0, sizeof(*dp));
+    snprintf(dp->path, sizeof(dp->path), "%s", ffshim_host_path(path));
+    lookup(path);
+    dp->dir = opendir(dp->path);
+    if (!dp->dir)
+        return FR_NO_PATH;
+    dp->obj.fs = &fs;
+    return FR_OK;
+}
+
+FRESULT f_closedir(FF_DIR *dp) {
+    if (dp->dir)
+        closedir(dp->dir);
+    dp->dir = NULL;
+    return FR_OK;
+}
+
+static void fill_info(const char *host, const char *name, FILINFO *fno) {
+    struct stat st;
+    memset(fno, 0, sizeof(*fno));
+    snprintf(fno->fname, sizeof(fno->fname), "%s", name);
+    if (stat(host, &st) == 0) {
+        fno->fsize = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+        fno->fattrib = S_ISDIR(st.st_mode) ? AM_DIR : AM_ARC;
+    }
+    if (name[0] == '.')
+        fno->fattrib |= AM_HID;         // stands in for f_chmod(AM_HID)
+}
+
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno) {
+    struct dirent *e;
+    if (!fno) {
+        rewinddir(dp->dir);
+        dp->count = 0;
+        return FR_OK;
+    }
+    do {
+        e = readdir(dp->dir);
+    } while (e && (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")));
+    if (dp->count++ % 4 == 0) {         // 32-byte entries plus long names
+        fat_win = -1;
+        io(1);
+    }
+    if (!e) {
+        memset(fno, 0, sizeof(*fno));
+        return FR_OK;
+    }
+    char host[1024 + 256];
+    snprintf(host, sizeof(host), "%s/%s", dp->path, e->d_name);
+    fill_info(host, e->d_name, fno);
+    return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR *path, FILINFO *fno) {
+    const char *host = ffshim_host_path(path);
+    const char *name = strrchr(path, '/');
+    lookup(path);
+    if (access(host, F_OK))
+        return FR_NO_FILE;
+    if (fno)
+        fill_info(host, name ? name + 1 : path, fno);
+    return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR *path) {
+    const char *host = ffshim_host_path(path);
+    lookup(path);
+    if (unlink(host) && rmdir(host))
+        return FR_NO_FILE;
+    return FR_OK;
+}
+
+FRESULT f_rename(const TCHAR *old_name, const TCHAR *new_name) {
+    char from[1024];
+    snprintf(from, sizeof(from), "%s", ffshim_host_path(old_name));
+    lookup(old_name);
+    if (access(ffshim_host_path(new_name), F_OK) == 0)
+        return FR_EXIST;
+    return rename(from, ffshim_host_path(new_name)) ? FR_NO_FILE : FR_OK;
+}
+
+FRESULT f_chmod(const TCHAR *path, BYTE attr, BYTE mask) {
+    return access(ffshim_host_path(path), F_OK) ? FR_NO_FILE : FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR *path) {
+    lookup(path);
+    if (mkdir(ffshim_host_path(path), 0755) == 0)
+        return FR_OK;
+    return access(ffshim_host_path(path), F_OK) == 0 ? FR_EXIST : FR_NO_PATH;
+}
@@ -0,0 +1,114 @@
+// Host shim of FatFs, see ff.c
+//
+// The API of the firmware's FatFs over a directory of the host. Files opened
+// for reading get clusters on a simulated drive, so that fast seek and raw
+// sector reads (disk_read()) work on them like on the drive.
+
+#pragma once
+
+#include <stdint.h>
+
+#define FF_MAX_SS           512
+#define FF_MAX_LFN          255
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef DWORD LBA_t;
+typedef QWORD FSIZE_t;
+
+typedef struct {
+    BYTE fs_type;
+    BYTE pdrv;
+    WORD id;                    // volume mount id
+    WORD csize;                 // sectors per cluster
+    LBA_t database;             // first sector of cluster 2
+    BYTE win[FF_MAX_SS];
+} FATFS;
+
+typedef struct {
+    FATFS *fs;
+    DWORD sclust;               // first cluster, 0 if the file has none on the simulated drive
+    FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    BYTE flag;
+    BYTE err;
+    FSIZE_t fptr;
+    LBA_t sect;                 // sector of the file in buf, +1. 0 if none
+    DWORD *cltbl;
+    BYTE buf[FF_MAX_SS];
+    int fd;                     // of the host file
+    char *host;                 // its path
+    int map;                    // index of its clusters on the simulated drive, -1 if none
+} FIL;
+
+typedef struct {
+    FFOBJID obj;
+    void *dir;                  // host DIR
+    char path[512];
+    int count;
+} DIR;
+
+typedef struct {
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+    BYTE fattrib;
+    TCHAR altname[13];
+    TCHAR fname[FF_MAX_LFN + 1];
+} FILINFO;
+
+typedef enum {
+    FR_OK = 0, FR_DISK_ERR, FR_INT_ERR, FR_NOT_READY, FR_NO_FILE, FR_NO_PATH,
+    FR_INVALID_NAME, FR_DENIED, FR_EXIST, FR_INVALID_OBJECT, FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE, FR_NOT_ENABLED, FR_NO_FILESYSTEM, FR_MKFS_ABORTED, FR_TIMEOUT,
+    FR_LOCKED, FR_NOT_ENOUGH_CORE, FR_TOO_MANY_OPEN_FILES, FR_INVALID_PARAMETER
+} FRESULT;
+
+#define FA_READ             0x01
+#define FA_WRITE            0x02
+#define FA_OPEN_EXISTING    0x00
+#define FA_CREATE_NEW       0x04
+#define FA_CREATE_ALWAYS    0x08
+#define FA_OPEN_ALWAYS      0x10
+#define FA_OPEN_APPEND      0x30
+
+#define AM_RDO              0x01
+#define AM_HID              0x02
+#define AM_SYS              0x04
+#define AM_DIR              0x10
+#define AM_ARC              0x20
+
+#define FS_FAT32            3
+#define FS_EXFAT            4
+
+#define CREATE_LINKMAP      ((FSIZE_t)0 - 1)
+
+#define f_size(fp)          ((fp)->obj.objsize)
+#define f_tell(fp)          ((fp)->fptr)
+#define f_eof(fp)           ((int)((fp)->fptr == (fp)->obj.objsize))
+#define f_rewind(fp)        f_lseek((fp), 0)
+#define f_unmount(path)     f_mount(0, path, 0)
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buf, UINT len, UINT *br);
+FRESULT f_write(FIL *fp, const void *buf, UINT len, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_opendir(DIR *dp, const TCHAR *path);
+FRESULT f_closedir(DIR *dp);
+FRESULT f_readdir(DIR *dp, FILINFO *fno);
+FRESULT f_stat(const TCHAR *path, FILINFO *fno);
+FRESULT f_unlink(const TCHAR *path);
+FRESULT f_rename(const TCHAR *old_name, const TCHAR *new_name);
+FRESULT f_chmod(const TCHAR *path, BYTE attr, BYTE mask);
+FRESULT f_mkdir(const TCHAR *path);
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct shim_queue *QueueHandle_t;
+typedef struct { void *dummy[8]; } StaticQueue_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size);
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size, uint8_t *buf,
+                                 StaticQueue_t *q);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+BaseType_t xQueueReset(QueueHandle_t q);
@@ -0,0 +1,317 @@
+// Single-threaded FreeRTOS and timer shim, see FreeRTOS.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+#include "event_groups.h"
+#include "bflb_mtimer.h"
+#include "bflb_l1c.h"
+
+#include "shim.h"
+
+struct shim_task {
+    TaskFunction_t fn;
+    uint32_t notified;
+};
+
+struct shim_queue {
+    UBaseType_t len, item_size;
+    UBaseType_t head, count;
+    uint8_t *items;
+};
+
+enum { SEM_BINARY, SEM_MUTEX, SEM_RECURSIVE };
+
+struct shim_sem {
+    int type;
+    int count;                          // binary: given, mutexes: held
+};
+
+struct shim_events {
+    EventBits_t bits;
+};
+
+static uint64_t sim_us;
+static struct shim_task tasks[32];
+static int task_count;
+
+void shim_fatal(const char *what) {
+    fprintf(stderr, "fatal: %s\n", what);
+    abort();
+}
+
+void *pvPortMalloc(size_t size) {
+    return malloc(size);
+}
+
+void vPortFree(void *p) {
+    free(p);
+}
+
+void shim_advance_us(uint64_t us) {
+    sim_us += us;
+}
+
+uint64_t bflb_mtimer_get_time_us(void) {
+    static uint64_t start;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t t = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (!start)
+        start = t;
+    return t - start + sim_us;
+}
+
+uint64_t bflb_mtimer_get_time_ms(void) {
+    return bflb_mtimer_get_time_us() / 1000;
+}
+
+void bflb_l1c_dcache_clean_range(void *addr, uint32_t len) {
+}
+
+void bflb_l1c_dcache_invalidate_range(void *addr, uint32_t len) {
+}
+
+void bflb_l1c_dcache_clean_invalidate_range(void *addr, uint32_t len) {
+}
+
+// a wait of `ticks` that nothing ends on a single thread
+static void wait(TickType_t ticks, const char *what) {
+    if (ticks == portMAX_DELAY)
+        shim_fatal(what);
+    shim_advance_us((uint64_t)ticks * 1000);
+}
+
+// tasks ------------------------------------------------------------------
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                               UBaseType_t prio, StackType_t *stack_buf, StaticTask_t *tcb) {
+    if (task_count == 32)
+        shim_fatal("too many tasks");
+    struct shim_task *t = &tasks[task_count++];
+    t->fn = fn;
+    return t;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                       UBaseType_t prio, TaskHandle_t *handle) {
+    TaskHandle_t t = xTaskCreateStatic(fn, name, stack, param, prio, NULL, NULL);
+    if (handle)
+        *handle = t;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+}
+
+void vTaskDelay(TickType_t ticks) {
+    shim_advance_us((uint64_t)ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)bflb_mtimer_get_time_ms();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return NULL;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    if (task)
+        task->notified++;
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    wait(ticks, "ulTaskNotifyTake() would wait forever");
+    return 0;
+}
+
+uint32_t shim_task_notified(TaskHandle_t task) {
+    uint32_t n = task->notified;
+    task->notified = 0;
+    return n;
+}
+
+// queues -----------------------------------------------------------------
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size) {
+    struct shim_queue *q = calloc(1, sizeof(*q));
+    q->len = len;
+    q->item_size = item_size;
+    q->items = calloc(len, item_size);
+    return q;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size, uint8_t *buf,
+                                 StaticQueue_t *sq) {
+    return xQueueCreate(len, item_size);
+}
+
+static BaseType_t send(QueueHandle_t q, const void *item, TickType_t ticks, bool front) {
+    if (q->count == q->len) {
+        wait(ticks, "queue full forever");
+        return pdFALSE;
+    }
+    UBaseType_t slot;
+    if (front) {
+        q->head = (q->head + q->len - 1) % q->len;
+        slot = q->head;
+    } else {
+        slot = (q->head + q->count) % q->len;
+    }
+    memcpy(q->items + slot * q->item_size, item, q->item_size);
+    q->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks) {
+    return send(q, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t ticks) {
+    return send(q, item, ticks, true);
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken) {
+    return send(q, item, 0, false);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks) {
+    if (q->count == 0) {
+        wait(ticks, "queue empty forever");
+        return pdFALSE;
+    }
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    return q->count;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    q->head = q->count = 0;
+    return pdPASS;
+}
+
+// semaphores -------------------------------------------------------------
+
+static SemaphoreHandle_t sem_new(int type) {
+    struct shim_sem *s = calloc(1, sizeof(*s));
+    s->type = type;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return sem_new(SEM_BINARY);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf) {
+    return sem_new(SEM_BINARY);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return sem_new(SEM_MUTEX);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf) {
+    return sem_new(SEM_MUTEX);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+    return sem_new(SEM_RECURSIVE);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks) {
+    if (s->type == SEM_BINARY) {
+        if (!s->count) {
+            wait(ticks, "semaphore never given");
+            return pdFALSE;
+        }
+        s->count = 0;
+        return pdTRUE;
+    }
+    if (s->count) {
+        // the one thread holds it already
+        wait(ticks, "mutex taken twice");
+        return pdFALSE;
+    }
+    s->count = 1;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+    if (s->type == SEM_BINARY) {
+        s->count = 1;
+        return pdTRUE;
+    }
+    if (!s->count)
+        return pdFALSE;
+    s->count = 0;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t s, BaseType_t *woken) {
+    return xSemaphoreGive(s);
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t ticks) {
+    s->count++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s) {
+    if (!s->count)
+        return pdFALSE;
+    s->count--;
+    return pdTRUE;
+}
+
+int shim_sem_held(SemaphoreHandle_t s) {
+    return s->type == SEM_BINARY ? 0 : s->count;
+}
+
+// event groups -----------------------------------------------------------
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    return calloc(1, sizeof(struct shim_events));
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *buf) {
+    return xEventGroupCreate();
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits) {
+    return g->bits |= bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits) {
+    EventBits_t old = g->bits;
+    g->bits &= ~bits;
+    return old;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g) {
+    return g->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t ticks) {
+    EventBits_t got = g->bits;
+    if (all ? (got & bits) == bits : (got & bits) != 0) {
+        if (clear)
+            g->bits &= ~bits;
+    } else {
+        wait(ticks, "event bits never set");
+    }
+    return got;
+}
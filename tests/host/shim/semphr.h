@@ -0,0 +1,20 @@
+#pragma once
+
+#include "queue.h"
+
+typedef struct shim_sem *SemaphoreHandle_t;
+typedef struct { void *dummy[8]; } StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t s, BaseType_t *woken);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s);
+
+// how often `s` is held, 0 if it is free
+int shim_sem_held(SemaphoreHandle_t s);
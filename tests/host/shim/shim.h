@@ -0,0 +1,70 @@
+// Knobs and counters of the host shims, for tests and benchmarks
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ff.h"
+
+// rtos.c ------------------------------------------------------------------
+
+// advance the simulated clock (waits, drive commands)
+void shim_advance_us(uint64_t us);
+
+// board.c -----------------------------------------------------------------
+
+// bytes the firmware sends to the core on UART1. the test plays the core
+// and answers through the module's *_rx() function. NULL drops them
+extern void (*shim_uart_tx)(uint8_t ch);
+extern uint64_t shim_uart_bytes;
+
+// print overlay output (DEBUG and status lines) to stdout
+extern bool shim_verbose;
+// the last status line
+extern char shim_status[256];
+
+// fs_lock() depth and whether uart1_lock() is held. taking them in the
+// wrong order, or uart1_lock() twice, is reported as a deadlock
+int shim_fs_held(void);
+bool shim_uart1_held(void);
+
+// another task holds the file system lock: fs_trylock() fails and fs_lock()
+// is reported as a wait that never ends
+extern bool shim_fs_busy;
+// times fs_lock() or fs_trylock() took the lock
+extern uint32_t shim_fs_locks;
+
+// ff.c --------------------------------------------------------------------
+
+// directory of the host that "usb:" maps to
+void ffshim_root(const char *dir);
+
+// make "usb:" an empty temporary directory, removed at exit. return its path
+const char *ffshim_temp_root(void);
+
+// host path of `path` on the drive
+const char *ffshim_host_path(const char *path);
+
+// cost of drive access on the simulated clock: per USB command and per sector
+extern uint32_t ffshim_cmd_us, ffshim_sector_us;
+
+// files get fragments of this many clusters when mapped, 0 for contiguous
+extern uint32_t ffshim_frag_clusters;
+
+// clusters of other files between two fragments, 1 by default. Fragments
+// more than 128 clusters apart have their FAT entries in different sectors
+extern uint32_t ffshim_frag_gap;
+
+// the n-th next f_write() (counting from 1) fails with FR_DISK_ERR, 0 for never
+extern int ffshim_fail_write;
+
+struct ffshim_stats {
+    uint64_t cmds;                  // USB commands
+    uint64_t sectors;               // sectors moved
+    uint64_t fat_sectors;           // of them, FAT sectors read to follow chains
+    uint64_t bytes_read, bytes_written;     // by f_read() and f_write()
+    uint32_t f_reads, f_writes, disk_reads, opens;
+    uint32_t unaligned_writes;      // f_write()s not in whole sectors
+};
+extern struct ffshim_stats ffshim_stats;
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct shim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct { void *dummy[8]; } StaticTask_t;
+
+// tasks are created but never run
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                               UBaseType_t prio, StackType_t *stack_buf, StaticTask_t *tcb);
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                       UBaseType_t prio, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+// notifications given to `task` and not taken yet. clears them
+uint32_t shim_task_notified(TaskHandle_t task);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// no uncached RAM on the host
+#define USB_NOCACHE_RAM_SECTION
+#define USB_MEM_ALIGNX __attribute__((aligned(64)))
+
+struct usbh_hubport;
+
+void *usbh_find_class_instance(const char *name);
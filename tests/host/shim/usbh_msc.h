@@ -0,0 +1,18 @@
+#pragma once
+
+#include "usbh_core.h"
+
+struct usbh_msc {
+    struct usbh_hubport *hport;
+    uint8_t intf;
+    uint8_t sdchar;
+    uint32_t blocknum;
+    uint32_t blocksize;
+};
+
+// provided by the test that uses them, see disk_cache_bench.c
+int usbh_msc_scsi_init(struct usbh_msc *msc);
+int usbh_msc_scsi_read10(struct usbh_msc *msc, uint32_t start, uint8_t *buf, uint32_t count);
+int usbh_msc_scsi_write10(struct usbh_msc *msc, uint32_t start, const uint8_t *buf, uint32_t count);
+void usbh_msc_run(struct usbh_msc *msc);
+void usbh_msc_stop(struct usbh_msc *msc);
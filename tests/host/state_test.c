@@ -0,0 +1,126 @@
+// state.c against a simulated core
+//
+// The core holds a 200KB state, part repetitive and part random, and
+// answers command 0x0F through state_rx(). Block 0 pauses its game, the
+// last (short) block or block STATE_ABORT resumes it. Checks that a saved
+// state loads back unchanged, that lost replies are retried, and that the
+// game is never left paused: not when the drive fails mid-save, and not
+// when the core stops answering.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shim.h"
+#include "state.c"
+
+#define SIZE        (200 * 1024 + 123)
+
+static uint8_t core_state[SIZE], loaded[SIZE];
+static bool paused;
+static int silent_from = -1;            // block the core stops answering at
+static int drop_pct;
+static uint32_t requests;
+
+// commands from the firmware, answered at once
+static uint8_t cmd[3];
+static int cmd_len;
+
+static void core_rx(uint8_t ch) {
+    cmd[cmd_len++] = ch;
+    if (cmd[0] != 0x0F) {
+        cmd_len = 0;
+        return;
+    }
+    if (cmd_len < 3)
+        return;
+    cmd_len = 0;
+    uint16_t block = cmd[1] | cmd[2] << 8;
+    requests++;
+    if (block == STATE_ABORT) {
+        paused = false;
+        return;
+    }
+    if (block == 0)
+        paused = true;
+    uint32_t off = block * STATE_BLOCK;
+    uint16_t len = off < SIZE ? (SIZE - off < STATE_BLOCK ? SIZE - off : STATE_BLOCK) : 0;
+    if (len < STATE_BLOCK)
+        paused = false;                 // the last block is on its way
+    if ((silent_from >= 0 && block >= silent_from) || rand() % 100 < drop_pct)
+        return;
+    uint8_t b[4] = {block & 0xff, block >> 8, len & 0xff, len >> 8};
+    for (int i = 0; i < 4 + len; i++)
+        if (state_rx(i, i < 4 ? b[i] : core_state[off + i - 4]))
+            assert(i == 3 + len);
+}
+
+void set_loading_state(int state) {
+}
+
+// stands in for upload.c: the core takes the state
+FRESULT upload_file(FIL *fp, uint32_t len, const struct upload_hooks *hooks, struct upload_stats *st) {
+    memset(st, 0, sizeof(*st));
+    while (st->bytes < len) {
+        UINT n = len - st->bytes < UPLOAD_CHUNK ? len - st->bytes : UPLOAD_CHUNK, br;
+        FRESULT r = hooks->read(loaded + st->bytes, n, &br, hooks->ctx);
+        if (r != FR_OK)
+            return r;
+        st->bytes += br;
+    }
+    return FR_OK;
+}
+
+static bool slot_exists(int slot) {
+    struct state_info info;
+    state_info(slot, &info);
+    return info.used;
+}
+
+int main(void) {
+    ffshim_temp_root();
+    shim_uart_tx = core_rx;
+    core_caps = CORE_CAP_SAVE_STATE;
+    active_core = 1;
+    srand(3);
+    for (int i = 0; i < SIZE; i++)
+        core_state[i] = i < SIZE / 2 ? "WRAM\0\0\0\0"[i % 8] + i / 4096 : rand();
+    state_init();
+    state_set_rom("usb:snes/Game.sfc");
+
+    // save and load back
+    assert(state_save(0) == 0 && !paused);
+    struct state_info info;
+    state_info(0, &info);
+    printf("saved %uK -> %uK in %u requests\n", info.size >> 10, info.stored >> 10, requests);
+    assert(info.used && info.size == SIZE);
+    assert(state_load(0) == 0 && !memcmp(loaded, core_state, SIZE));
+
+    // lost replies are asked for again
+    drop_pct = 20;
+    requests = 0;
+    assert(state_save(1) == 0 && !paused);
+    drop_pct = 0;
+    memset(loaded, 0, SIZE);
+    assert(state_load(1) == 0 && !memcmp(loaded, core_state, SIZE));
+    printf("20%% replies lost: saved in %u requests\n", requests);
+
+    // the drive fails after a few pieces: no file, the game runs on
+    ffshim_fail_write = 5;
+    requests = 0;
+    assert(state_save(2) != 0 && !paused && !slot_exists(2));
+    printf("write error: %u requests, all %u blocks read\n", requests, SIZE / STATE_BLOCK + 1);
+    assert(requests == SIZE / STATE_BLOCK + 1);
+
+    // the core stops answering halfway
+    requests = 0;
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    silent_from = 150;
+    assert(state_save(3) != 0 && !paused && !slot_exists(3));
+    printf("core silent from block 150: gave up after %u requests, %.1f s\n", requests,
+           (bflb_mtimer_get_time_us() - t0) / 1e6);
+    assert(requests == 150 + STATE_RETRIES + 1);
+    assert(shim_fs_held() == 0 && !shim_uart1_held());
+    puts("state_test: ok");
+    return 0;
+}
@@ -0,0 +1,86 @@
+// stream_read() against f_read()
+//
+// Reads a 6MB ROM with a 512-byte copier header from its header onwards,
+// in STREAM_CHUNK requests, once with f_read() on a plain f_open() and once
+// with stream_read() after fastseek_open(), for contiguous and fragmented
+// layouts. The data must match the file. Then checks odd request sizes and
+// a file too fragmented for a link map, where stream_read() falls back to
+// f_read(). Prints USB commands and simulated drive time per layout.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_mtimer.h"
+#include "shim.h"
+#include "fastseek.c"
+#include "stream.c"
+
+#define CMD_US      250
+#define SECTOR_US   12
+#define ROM_SIZE    (6 << 20)
+#define COPIER      512
+
+static uint8_t rom[COPIER + ROM_SIZE], out[COPIER + ROM_SIZE + STREAM_CHUNK];
+
+// read the file from the copier header on, `chunk` bytes per call
+static bool read_all(const char *path, bool stream, UINT chunk, uint64_t *cmds, uint64_t *us) {
+    static FIL f;
+    struct ffshim_stats s0 = ffshim_stats;
+    uint64_t t0 = bflb_mtimer_get_time_us();
+    assert((stream ? fastseek_open(&f, path) : f_open(&f, path, FA_READ)) == FR_OK);
+    f_lseek(&f, COPIER);
+    UINT got = 0, br;
+    do {
+        assert((stream ? stream_read(&f, out + got, chunk, &br) : f_read(&f, out + got, chunk, &br)) == FR_OK);
+        got += br;
+    } while (br == chunk);
+    stream ? fastseek_close(&f) : f_close(&f);
+    if (cmds)
+        *cmds = ffshim_stats.cmds - s0.cmds;
+    if (us)
+        *us = bflb_mtimer_get_time_us() - t0;
+    return got == ROM_SIZE && !memcmp(out, rom + COPIER, ROM_SIZE);
+}
+
+static void bench(const char *path, uint32_t frag) {
+    uint64_t cmds[2], us[2];
+    ffshim_frag_clusters = frag;
+    for (int s = 0; s < 2; s++)
+        assert(read_all(path, s, STREAM_CHUNK, &cmds[s], &us[s]));
+    char layout[32];
+    snprintf(layout, sizeof(layout), frag ? "%u-cluster fragments" : "contiguous", frag);
+    printf("%-22s f_read %5llu cmds, %4.0f ms, %5.2f MB/s | stream_read %5llu cmds, %4.0f ms, %5.2f MB/s\n",
+           layout, (unsigned long long)cmds[0], us[0] / 1000.0, ROM_SIZE / (us[0] / 1e6) / 1048576,
+           (unsigned long long)cmds[1], us[1] / 1000.0, ROM_SIZE / (us[1] / 1e6) / 1048576);
+}
+
+int main(void) {
+    static const uint32_t frags[] = {0, 256, 64, 16};
+    static const UINT chunks[] = {1000, 4096, 8191, 32768, 40000};
+    ffshim_temp_root();
+    ffshim_cmd_us = CMD_US;
+    ffshim_sector_us = SECTOR_US;
+    for (int i = 0; i < (int)sizeof(rom); i++)
+        rom[i] = rand();
+    FILE *f = fopen(ffshim_host_path("usb:Game.sfc"), "wb");
+    fwrite(rom, 1, sizeof(rom), f);
+    fclose(f);
+
+    for (int i = 0; i < 4; i++)
+        bench("usb:Game.sfc", frags[i]);
+
+    // partial sectors and fragment ends at any request size
+    for (int i = 0; i < 4; i++) {
+        ffshim_frag_clusters = frags[i];
+        for (int k = 0; k < 5; k++)
+            assert(read_all("usb:Game.sfc", true, chunks[k], NULL, NULL));
+    }
+    // 384 fragments do not fit the pool, stream_read() is f_read()
+    ffshim_frag_clusters = 4;
+    static FIL fp;
+    assert(fastseek_open(&fp, "usb:Game.sfc") == FR_OK && fastseek_fragments(&fp) < 0);
+    fastseek_close(&fp);
+    puts("stream_bench: data ok");
+    return 0;
+}
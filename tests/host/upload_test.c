@@ -0,0 +1,174 @@
+// upload.c against a simulated core
+//
+// The core takes romdata (0x07) and fill (0x14) commands from the UART and
+// rebuilds the upload from them; it must equal the image. The upload task
+// is played between the chunks, from the progress hook, and after
+// upload_file() for the end marker. Images cover a run that goes on over
+// two chunk boundaries, a run ending exactly at the end of a chunk, a run
+// longer than UPLOAD_FILL_MAX, runs too short for a fill command, a core
+// without CORE_CAP_FILL, and a read failure right after a chunk that ends
+// in a run: the run held back must still reach the core.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bflb_uart.h"
+#include "shim.h"
+#include "upload.c"
+
+#define BIG     (UPLOAD_FILL_MAX + 3 * UPLOAD_CHUNK)
+
+static uint8_t *image, *out;
+static uint32_t out_len;
+static uint32_t fills, fill_max;        // fill commands the core got, the longest
+
+// 0x07 len[23:0] data, 0x14 len[23:0] value
+static uint8_t cmd[5];
+static int cmd_len;
+static uint32_t data_left;
+
+static void core_rx(uint8_t ch) {
+    if (data_left) {
+        out[out_len++] = ch;
+        data_left--;
+        return;
+    }
+    cmd[cmd_len++] = ch;
+    assert(cmd[0] == 0x07 || cmd[0] == 0x14);
+    if (cmd_len < (cmd[0] == 0x07 ? 4 : 5))
+        return;
+    cmd_len = 0;
+    uint32_t len = cmd[1] << 16 | cmd[2] << 8 | cmd[3];
+    assert(len > 0);
+    if (cmd[0] == 0x07) {
+        data_left = len;
+        return;
+    }
+    assert(len >= UPLOAD_FILL_MIN && len <= UPLOAD_FILL_MAX);
+    memset(out + out_len, cmd[4], len);
+    out_len += len;
+    fills++;
+    fill_max = max(fill_max, len);
+}
+
+// stand in for main.c
+extern struct bflb_device_s *uart1_dev;
+
+void send_rom_data(const BYTE *buf, int len) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 7);
+    bflb_uart_putchar(uart1_dev, (len >> 16) & 0xff);
+    bflb_uart_putchar(uart1_dev, (len >> 8) & 0xff);
+    bflb_uart_putchar(uart1_dev, len & 0xff);
+    for (int i = 0; i < len; i++)
+        bflb_uart_putchar(uart1_dev, buf[i]);
+    uart1_unlock();
+}
+
+void send_rom_fill(uint32_t len, uint8_t value) {
+    uart1_lock();
+    bflb_uart_putchar(uart1_dev, 0x14);
+    bflb_uart_putchar(uart1_dev, (len >> 16) & 0xff);
+    bflb_uart_putchar(uart1_dev, (len >> 8) & 0xff);
+    bflb_uart_putchar(uart1_dev, len & 0xff);
+    bflb_uart_putchar(uart1_dev, value);
+    uart1_unlock();
+}
+
+// the image as the read hook's file, failing at `fail_at`
+struct src {
+    uint32_t pos, fail_at;
+};
+
+static FRESULT read_image(BYTE *buf, UINT len, UINT *br, void *ctx) {
+    struct src *s = ctx;
+    *br = 0;
+    if (s->pos >= s->fail_at)
+        return FR_DISK_ERR;
+    memcpy(buf, image + s->pos, len);
+    s->pos += len;
+    *br = len;
+    return FR_OK;
+}
+
+// the upload task sends what the reader has queued
+static void progress(uint32_t done, uint32_t len, void *ctx) {
+    while (send_next(0))
+        ;
+}
+
+// upload the first `len` bytes of the image. return what upload_file() did
+static FRESULT upload(uint32_t len, uint32_t fail_at) {
+    struct src s = {0, fail_at};
+    struct upload_hooks hooks = {.read = read_image, .progress = progress, .ctx = &s};
+    struct upload_stats st;
+    out_len = fills = fill_max = 0;
+    xSemaphoreGive(done_sem);           // upload_file() waits for the end marker, sent below
+    FRESULT r = upload_file(NULL, len, &hooks, &st);
+    assert(send_next(0) && !send_next(0));
+    xSemaphoreTake(done_sem, 0);
+    assert(cmd_len == 0 && data_left == 0 && run_len == 0);
+    return r;
+}
+
+static void noise(uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++)
+        image[i] = 1 + rand() % 255;    // no zeros, no runs
+    for (uint32_t i = from + 1; i < to; i++)
+        if (image[i] == image[i - 1])
+            image[i] ^= 0x80;
+}
+
+int main(void) {
+    shim_uart_tx = core_rx;
+    image = malloc(BIG);
+    out = malloc(BIG);
+    srand(6);
+    upload_init();
+
+    // 0xff from 100 bytes before the end of the first chunk into the third,
+    // 0x00 up to the end of the fourth, a 31-byte run and a 32-byte run
+    uint32_t len = 6 * UPLOAD_CHUNK;
+    noise(0, len);
+    memset(image + UPLOAD_CHUNK - 100, 0xff, UPLOAD_CHUNK + 150);
+    memset(image + 3 * UPLOAD_CHUNK, 0x00, UPLOAD_CHUNK);
+    memset(image + 4 * UPLOAD_CHUNK + 200, 0x55, UPLOAD_FILL_MIN - 1);
+    memset(image + 5 * UPLOAD_CHUNK + 200, 0x66, UPLOAD_FILL_MIN);
+    core_caps = CORE_CAP_FILL;
+    assert(upload(len, len) == FR_OK);
+    printf("fill core: %u bytes in %u fill commands\n", out_len, fills);
+    assert(out_len == len && !memcmp(out, image, len));
+    assert(fills == 3 && fill_max == UPLOAD_CHUNK + 150);
+
+    // the same to a core without fill commands
+    core_caps = 0;
+    assert(upload(len, len) == FR_OK);
+    assert(out_len == len && !memcmp(out, image, len) && fills == 0);
+    core_caps = CORE_CAP_FILL;
+
+    // an upload that ends in a run, exactly at the end of a chunk
+    noise(0, len);
+    memset(image + len - 64, 0xee, 64);
+    assert(upload(len, len) == FR_OK);
+    assert(out_len == len && !memcmp(out, image, len) && fills == 1 && fill_max == 64);
+
+    // a run longer than a fill command holds
+    noise(0, BIG);
+    memset(image + 100, 0xff, UPLOAD_FILL_MAX + 5000);
+    assert(upload(BIG, BIG) == FR_OK);
+    printf("%u bytes of 0xff: %u fill commands, the longest %u bytes\n", UPLOAD_FILL_MAX + 5000,
+           fills, fill_max);
+    assert(out_len == BIG && !memcmp(out, image, BIG));
+    assert(fills == 2 && fill_max == UPLOAD_FILL_MAX);
+
+    // the drive fails after the second chunk, which ends in a run: the run
+    // held back goes out with the end of the upload
+    noise(0, len);
+    memset(image + 2 * UPLOAD_CHUNK - 500, 0x00, 500);
+    assert(upload(len, 2 * UPLOAD_CHUNK) == FR_DISK_ERR);
+    assert(out_len == 2 * UPLOAD_CHUNK && !memcmp(out, image, out_len) && fills == 1);
+    assert(!shim_uart1_held());
+    puts("upload_test: ok");
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Pipelined ROM upload to the core, see upload.h
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "bflb_mtimer.h"
+
+#include "stream.h"
+#include "upload.h"
+#include "utils.h"
+
+// below main_task: the sender spins on the UART FIFO, and the reader must
+// get the CPU as soon as a drive transfer completes to start the next one
+#define UPLOAD_TASK_STACK_SIZE  512
+#define UPLOAD_TASK_PRIORITY    2
+
+extern void send_rom_data(const BYTE *buf, int len);
+extern void send_rom_fill(uint32_t len, uint8_t value);
+
+struct chunk {
+    uint16_t idx;
+    uint16_t len;                       // 0: end of upload
+};
+
+static USB_NOCACHE_RAM_SECTION BYTE __attribute__((aligned(64))) ring[UPLOAD_DEPTH][UPLOAD_CHUNK];
+static QueueHandle_t free_q;            // indexes of empty buffers
+static QueueHandle_t full_q;            // struct chunk, in file order
+static SemaphoreHandle_t done_sem;      // sender reached the end marker
+static volatile uint32_t send_us;
+static volatile uint32_t fill_bytes;    // sent as fill commands
+
+// run of equal bytes at the end of the last chunk, not sent yet
+static uint32_t run_len;
+static uint8_t run_val;
+
+static StackType_t upload_stack[UPLOAD_TASK_STACK_SIZE];
+static StaticTask_t upload_tcb;
+
+static void run_flush(void) {
+    if (run_len) {
+        send_rom_fill(run_len, run_val);
+        fill_bytes += run_len;
+    }
+    run_len = 0;
+}
+
+// send a chunk, runs of UPLOAD_FILL_MIN or more equal bytes as fill commands.
+// such a run at the end of the chunk is held back, the next chunk may continue it
+static void send_chunk(const BYTE *buf, uint32_t len) {
+    uint32_t i = 0, raw;
+    if (!(core_caps & CORE_CAP_FILL)) {
+        send_rom_data(buf, len);
+        return;
+    }
+    while (i < len && run_len && buf[i] == run_val) {
+        i++;
+        if (++run_len == UPLOAD_FILL_MAX)
+            run_flush();
+    }
+    if (i < len)
+        run_flush();
+    for (raw = i; i < len; ) {
+        uint32_t j = i + 1;
+        while (j < len && buf[j] == buf[i])
+            j++;
+        if (j - i >= UPLOAD_FILL_MIN) {
+            if (i > raw)
+                send_rom_data(buf + raw, i - raw);
+            run_val = buf[i];
+            run_len = j - i;
+            if (j < len)
+                run_flush();
+            raw = j;
+        }
+        i = j;
+    }
+    if (raw < len)
+        send_rom_data(buf + raw, len - raw);
+}
+
+// send the next chunk of the reader, or at the end marker the run held back.
+// return false if nothing came within `wait`
+static bool send_next(TickType_t wait) {
+    struct chunk c;
+    if (xQueueReceive(full_q, &c, wait) != pdTRUE)
+        return false;
+    if (c.len == 0) {
+        run_flush();
+        xSemaphoreGive(done_sem);
+        return true;
+    }
+    uint64_t t = bflb_mtimer_get_time_us();
+    send_chunk(ring[c.idx], c.len);
+    send_us += bflb_mtimer_get_time_us() - t;
+    xQueueSend(free_q, &c.idx, portMAX_DELAY);
+    return true;
+}
+
+static void upload_task(void *pvParameters) {
+    for (;;)
+        send_next(portMAX_DELAY);
+}
+
+void upload_init(void) {
+    free_q = xQueueCreate(UPLOAD_DEPTH, sizeof(uint16_t));
+    full_q = xQueueCreate(UPLOAD_DEPTH + 1, sizeof(struct chunk));
+    done_sem = xSemaphoreCreateBinary();
+    xTaskCreateStatic(upload_task, "upload_task", UPLOAD_TASK_STACK_SIZE, NULL,
+                      UPLOAD_TASK_PRIORITY, upload_stack, &upload_tcb);
+}
+
+FRESULT upload_file(FIL *fp, uint32_t len, const struct upload_hooks *hooks,
+                    struct upload_stats *stats) {
+    FRESULT r = FR_OK;
+    uint64_t start = bflb_mtimer_get_time_us();
+    uint32_t done = 0, read_us = 0;
+
+    xQueueReset(free_q);
+    for (uint16_t i = 0; i < UPLOAD_DEPTH; i++)
+        xQueueSend(free_q, &i, 0);
+    send_us = 0;
+    fill_bytes = 0;
+
+    while (done < len) {
+        struct chunk c;
+        UINT br;
+        xQueueReceive(free_q, &c.idx, portMAX_DELAY);
+        uint64_t t = bflb_mtimer_get_time_us();
+        UINT n = min(len - done, (uint32_t)UPLOAD_CHUNK);
+        if (hooks && hooks->read)
+            r = hooks->read(ring[c.idx], n, &br, hooks->ctx);
+        else
+            r = stream_read(fp, ring[c.idx], n, &br);
+        read_us += bflb_mtimer_get_time_us() - t;
+        if (r != FR_OK || br == 0)
+            break;
+        if (hooks && hooks->transform)
+            hooks->transform(ring[c.idx], br, done, hooks->ctx);
+        c.len = br;
+        xQueueSend(full_q, &c, portMAX_DELAY);
+        done += br;
+        if (hooks && hooks->progress)
+            hooks->progress(done, len, hooks->ctx);
+    }
+
+    // wait for the sender to drain the ring
+    struct chunk end = {0, 0};
+    xQueueSend(full_q, &end, portMAX_DELAY);
+    xSemaphoreTake(done_sem, portMAX_DELAY);
+
+    if (stats) {
+        stats->bytes = done;
+        stats->us = bflb_mtimer_get_time_us() - start;
+        stats->read_us = read_us;
+        stats->send_us = send_us;
+        stats->fill_bytes = fill_bytes;
+    }
+    return r;
+}
+
+void upload_report(const struct upload_stats *st) {
+    uint32_t us = max(st->us, (uint32_t)1);
+    if (st->fill_bytes) {               // no room for the utilization then
+        overlay_status("%uK %uKB/s %uK filled", st->bytes >> 10,
+                       (uint32_t)((uint64_t)st->bytes * 1000000 / us / 1024), st->fill_bytes >> 10);
+        return;
+    }
+    overlay_status("%uK %uKB/s drive %u%% uart %u%%", st->bytes >> 10,
+                   (uint32_t)((uint64_t)st->bytes * 1000000 / us / 1024),
+                   (uint32_t)((uint64_t)st->read_us * 100 / us),
+                   (uint32_t)((uint64_t)st->send_us * 100 / us));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ff.h"
+
+// Pipelined ROM upload to the core
+//
+// The calling task reads the file into a ring of UPLOAD_DEPTH buffers of
+// UPLOAD_CHUNK bytes while the upload task sends full buffers to the core
+// as romdata packets (UART command 0x07). The drive and the UART then work
+// at the same time, and the UART never waits for the drive unless the ring
+// runs dry.
+//
+// On a core with CORE_CAP_FILL, the sender replaces runs of UPLOAD_FILL_MIN
+// or more equal bytes, like the 0xFF padding of GBA and Mega Drive dumps,
+// with fill commands (0x14), also across chunks. Other cores get every byte.
+
+#define UPLOAD_DEPTH        4
+#define UPLOAD_CHUNK        (4*1024)
+#define UPLOAD_FILL_MIN     32          // shorter runs cost more as a command than as data
+#define UPLOAD_FILL_MAX     0xffffff    // 24-bit length of command 0x14
+
+struct upload_stats {
+    uint32_t bytes;
+    uint32_t us;                        // wall time of the upload
+    uint32_t read_us;                   // time the reader spent reading the drive
+    uint32_t send_us;                   // time the sender spent writing the UART
+    uint32_t fill_bytes;                // sent as fill commands instead of data
+};
+
+// start the upload task
+void upload_init(void);
+
+// optional callbacks of an upload, run by the reader task
+struct upload_hooks {
+    // produce the data instead of reading it from fp, e.g. a patched ROM
+    FRESULT (*read)(BYTE *buf, UINT len, UINT *br, void *ctx);
+    // modify a chunk in place before it is sent. pos is its offset in the upload
+    void (*transform)(BYTE *buf, UINT len, uint32_t pos, void *ctx);
+    // called after every chunk
+    void (*progress)(uint32_t done, uint32_t len, void *ctx);
+    void *ctx;
+};
+
+// send `len` bytes from the current position of `fp` to the core
+// hooks may be NULL
+// needs the file system lock
+FRESULT upload_file(FIL *fp, uint32_t len, const struct upload_hooks *hooks,
+                    struct upload_stats *stats);
+
+// show size, rate and stage utilization of a finished upload on the status line
+void upload_report(const struct upload_stats *stats);
@@ -99,9 +99,9 @@
 #define CONFIG_USBHOST_MAX_INTF_ALTSETTINGS 2
 #define CONFIG_USBHOST_MAX_ENDPOINTS        4
 #define CONFIG_USBHOST_MAX_CDC_ACM_CLASS    0
-#define CONFIG_USBHOST_MAX_HID_CLASS        2
+#define CONFIG_USBHOST_MAX_HID_CLASS        4
 #define CONFIG_USBHOST_MAX_MSC_CLASS        2
-#define CONFIG_USBHOST_MAX_XBOX_CLASS       2
+#define CONFIG_USBHOST_MAX_XBOX_CLASS       4
 #define CONFIG_USBHOST_MAX_AUDIO_CLASS      0
 #define CONFIG_USBHOST_MAX_VIDEO_CLASS      0
 
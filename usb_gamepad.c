@@ -1,24 +1,39 @@
 // USB gamepad (Xinput and HID)
 // Based on FPGA-Companion by Till Harbaum
+#include <string.h>
 #include "usbh_core.h"
 #include "usb_config.h"
 #include "FreeRTOS.h"
 #include "task.h"
 #include "semphr.h"
- #include "bflb_mtimer.h"
+#include "queue.h"
+#include "bflb_mtimer.h"
+#include "usbh_xbox.h"
 #include "usb_gamepad.h"
 #include "hidparser.h"
+#include "remap.h"
 
 // Uncomment this to enable on-screen debug messages
 // #define DEBUG_ON
 
-#define MAX_REPORT_SIZE   8
+#define MAX_REPORT_SIZE  64         // max. full-speed interrupt packet, incl. report id
 #define XBOX_REPORT_SIZE 20
+#define XBOX_BUFFER_SIZE 32         // also holds the 32-byte string descriptor read during init
+
+// One task owns all gamepad URBs. URB completions and hotplug callbacks are
+// turned into events on input_queue, so a pad costs a few bytes of state
+// instead of a 1024/2048-word client task (plus the 2048-word hotplug poller).
+#define INPUT_TASK_STACK_SIZE 1536
+#define INPUT_QUEUE_LEN       16
+#define INPUT_RETRY_MS        10    // resubmit delay after a failed transfer
+#define KEY_QUEUE_LEN         16
+#define XBOX_OUT_TIMEOUT_MS   100
 
 #define STATE_NONE      0 
 #define STATE_DETECTED  1 
 #define STATE_RUNNING   2
 #define STATE_FAILED    3
+#define STATE_STOPPED   4           // class freed by the host stack, slot waits for its detach event
 
 #define XINPUT_GAMEPAD_DPAD_UP 0x0001
 #define XINPUT_GAMEPAD_DPAD_DOWN 0x0002
@@ -33,35 +48,57 @@ static struct usb_config {
     struct xbox_info_S {
         int index;
         int state;
-        struct usbh_hid *class;     // USB host Xbox class
+        struct usbh_xbox *class;    // USB host Xbox class
         uint8_t *buffer;
         int nbytes;
+        volatile bool retry;        // resubmit URB on next retry tick
+        bool player;                // holds a joystick index
         struct usb_config *usb;
-        SemaphoreHandle_t sem;
-        TaskHandle_t task_handle;    
         unsigned char last_state;
         unsigned char js_index;
         unsigned char last_state_btn_extra;
         int16_t last_state_x;
         int16_t last_state_y;    
+        struct remap_lut lut;       // state/extra -> SNES
     } xbox_info[CONFIG_USBHOST_MAX_XBOX_CLASS];
     struct hid_info_S {
         int index;
         int state;
         struct usbh_hid *class;     // USB host HID class
         uint8_t *buffer;            // URB transfer buffer
-        int nbytes;                 // number of bytes in the buffer
+        volatile bool retry;        // resubmit URB on next retry tick
+        bool player;                // holds a joystick index
         hid_report_t report;        // parsed HID report descriptor
         struct usb_config *usb;
-        SemaphoreHandle_t sem;
-        TaskHandle_t task_handle;    
         hid_state_t hid_state;
     } hid_info[CONFIG_USBHOST_MAX_HID_CLASS];
 } usb_config;
+
+#define INPUT_EVT_HID_ATTACH   0
+#define INPUT_EVT_HID_DETACH   1
+#define INPUT_EVT_HID_REPORT   2
+#define INPUT_EVT_XBOX_ATTACH  3
+#define INPUT_EVT_XBOX_DETACH  4
+#define INPUT_EVT_XBOX_REPORT  5
+#define INPUT_EVT_REMAP        6    // remap profiles changed
+
+struct input_event {
+    uint8_t type;                   // INPUT_EVT_...
+    uint8_t index;                  // hid_info/xbox_info slot, the slot count if there was no free slot
+    int16_t nbytes;                 // URB result for report events
+};
+
+static QueueHandle_t input_queue;
+// slot state and class pointers. CherryUSB frees a class instance as soon as
+// its stop callback returns, so the callback marks the slot STATE_STOPPED
+// under this lock, and the input task holds it whenever it uses a class
+static SemaphoreHandle_t input_mutex;
+static QueueHandle_t key_queue;                 // typed characters from USB keyboards
+static SemaphoreHandle_t xbox_out_sem;      // completion of Xbox init packets to EP2
  
 TaskHandle_t usb_handle;
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t hid_buffer[CONFIG_USBHOST_MAX_HID_CLASS][MAX_REPORT_SIZE];
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t xbox_buffer[CONFIG_USBHOST_MAX_XBOX_CLASS][XBOX_REPORT_SIZE];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t xbox_buffer[CONFIG_USBHOST_MAX_XBOX_CLASS][XBOX_BUFFER_SIZE];
 
 // keep a map of joysticks to be able to report
 // them individually
@@ -75,6 +112,7 @@ void overlay_status(const char *fmt, ...);
 #define DEBUG(fmt, ...) do {} while(0)
 #endif
 
+// players are assigned in plug-in order, reusing the lowest free slot
 uint8_t hid_allocate_joystick(void) {
     uint8_t idx;
     for(idx=0;joystick_map & (1<<idx);idx++);
@@ -85,6 +123,12 @@ uint8_t hid_allocate_joystick(void) {
 
 void hid_release_joystick(uint8_t idx) {
     joystick_map &= ~(1<<idx);
+    if (idx < INPUT_MAX_PLAYERS) {
+        // do not leave buttons of an unplugged pad pressed
+        xSemaphoreTake(state_mutex, portMAX_DELAY);
+        hid_states[idx] = 0;
+        xSemaphoreGive(state_mutex);
+    }
     DEBUG("Release joystick %d (map=%02x)\n", idx, joystick_map);
 }
 
@@ -97,125 +141,138 @@ uint8_t byteScaleAnalog(int16_t xbox_val)
     return scale_val;
 }
 
+// URB completion, called from the USB interrupt
 void usbh_hid_callback(void *arg, int nbytes) {
     struct hid_info_S *hid = (struct hid_info_S *)arg;
-    hid->nbytes = nbytes;
-    xSemaphoreGiveFromISR(hid->sem, NULL);
+    struct input_event evt = { INPUT_EVT_HID_REPORT, hid->index, nbytes };
+    BaseType_t woken = pdFALSE;
+    if (xQueueSendFromISR(input_queue, &evt, &woken) != pdTRUE)
+        hid->retry = true;          // queue full: the report is lost, the retry tick resubmits the URB
+    portYIELD_FROM_ISR(woken);
 }  
 
 void usbh_xbox_callback(void *arg, int nbytes) {
     struct xbox_info_S *xbox = (struct xbox_info_S *)arg;
-    xbox->nbytes = nbytes;
-    xSemaphoreGiveFromISR(xbox->sem, NULL);
+    struct input_event evt = { INPUT_EVT_XBOX_REPORT, xbox->index, nbytes };
+    BaseType_t woken = pdFALSE;
+    if (xQueueSendFromISR(input_queue, &evt, &woken) != pdTRUE)
+        xbox->retry = true;
+    portYIELD_FROM_ISR(woken);
 }
 
-#define print_usb_class_info(cls) \
-    DEBUG("Interval: %d, ", cls->hport->config.intf[i].altsetting[0].ep[0].ep_desc.bInterval); \
-    DEBUG("Interface %d, ", cls->intf); \
-    DEBUG("  class %d, ", cls->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceClass); \
-    DEBUG("  subclass %d, ", cls->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceSubClass); \
-    DEBUG("  protocol %d\n", cls->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceProtocol);
-
-uint8_t joy_driver_map = 0;
+static void usbh_xbox_out_callback(void *arg, int nbytes) {
+    struct xbox_info_S *xbox = (struct xbox_info_S *)arg;
+    xbox->nbytes = nbytes;
+    xSemaphoreGiveFromISR(xbox_out_sem, NULL);
+}
 
-static void usbh_update(struct usb_config *usb) {
-    // check status for tasks
+// Hotplug callbacks, called by the USB host stack (hub thread) after a class
+// instance is connected or right before it is freed. Slots are taken and
+// marked stopped right here, the input task does the rest.
+void usbh_hid_run(struct usbh_hid *hid_class) {
+    struct input_event evt = { INPUT_EVT_HID_ATTACH, CONFIG_USBHOST_MAX_HID_CLASS, 0 };
+    xSemaphoreTake(input_mutex, portMAX_DELAY);
     for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++) {
-        if (usb->hid_info[i].state != STATE_RUNNING) continue;
-        if (usb->hid_info[i].task_handle == NULL || 
-            eTaskGetState(usb->hid_info[i].task_handle) == eDeleted) {
-            INFO("HID client #%d: task died unexpectedly\n", i);
-            usb->hid_info[i].state = STATE_NONE;
-        }
-    }
-    for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
-        if (usb->xbox_info[i].state != STATE_RUNNING) continue;
-        if (usb->xbox_info[i].task_handle == NULL || 
-            eTaskGetState(usb->xbox_info[i].task_handle) == eDeleted) {
-            INFO("XBOX client #%d: task died unexpectedly\n", i);   
-            usb->xbox_info[i].state = STATE_NONE;
+        struct hid_info_S *hid = &usb_config.hid_info[i];
+        if (hid->state == STATE_NONE) {
+            hid->class = hid_class;
+            hid->state = STATE_DETECTED;
+            evt.index = i;
+            break;
         }
     }
+    xSemaphoreGive(input_mutex);
+    xQueueSend(input_queue, &evt, portMAX_DELAY);
+}
 
-    // check for active hid devices
-    for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
-        char *dev_str = "/dev/inputX";
-        dev_str[10] = '0' + i;
-        usb->hid_info[i].class = (struct usbh_hid *)usbh_find_class_instance(dev_str);
-        if (usb->hid_info[i].class) {
-            joy_driver_map |= (1 << i);
-        } else {
-            joy_driver_map &= ~(1 << i);
-        }
-        
-        if(usb->hid_info[i].class && usb->hid_info[i].state == STATE_NONE) {
-            INFO("HID %d connected\n", i);
-            print_usb_class_info(usb->hid_info[i].class);
-            bool skip = false;
-            uint16_t vendor_id = usb->hid_info[i].class->hport->device_desc.idVendor;
-            uint16_t product_id = usb->hid_info[i].class->hport->device_desc.idProduct;
-            if (vendor_id == 0x2dc8 && product_id == 0x3107) {  // 8bitdo wireless adapter
-                skip = true;
-            }
-            // DEBUG("report descriptor: %p", usb->hid_info[i].class->report_desc);
-            
-            // parse report descriptor ...
-            if(skip || !parse_report_descriptor(usb->hid_info[i].class->report_desc, 128, &usb->hid_info[i].report, NULL)) {
-                usb->hid_info[i].state = STATE_FAILED;   // parsing failed, don't use
-                return;
-            }
-            
-            usb->hid_info[i].state = STATE_DETECTED;
-        }
-        
-        else if(!usb->hid_info[i].class && usb->hid_info[i].state != STATE_NONE) {
-            INFO("HID %d disconnected\n", i);
-            if (usb->hid_info[i].task_handle) {
-                vTaskDelete( usb->hid_info[i].task_handle );
-                usb->hid_info[i].task_handle = NULL;
-                DEBUG("HID %d task deleted\n", i);
-            }
-            usb->hid_info[i].state = STATE_NONE;
-
-            if(usb->hid_info[i].report.type == REPORT_TYPE_JOYSTICK) {
-                DEBUG("Joystick %d gone", usb->hid_info[i].hid_state.joystick.js_index);
-                hid_release_joystick(usb->hid_info[i].hid_state.joystick.js_index);
-            }
+void usbh_hid_stop(struct usbh_hid *hid_class) {
+    struct input_event evt = { INPUT_EVT_HID_DETACH, 0, 0 };
+    bool found = false;
+    xSemaphoreTake(input_mutex, portMAX_DELAY);     // waits until the input task is done with the class
+    for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++) {
+        struct hid_info_S *hid = &usb_config.hid_info[i];
+        if (hid->state != STATE_NONE && hid->class == hid_class) {
+            hid->state = STATE_STOPPED;
+            evt.index = i;
+            found = true;
         }
     }
+    xSemaphoreGive(input_mutex);
+    if (found)
+        xQueueSend(input_queue, &evt, portMAX_DELAY);
+}
 
-    // check for active xbox devices
-    for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++) {
-        char *dev_str = "/dev/xboxX";
-        dev_str[9] = '0' + i;
-        usb->xbox_info[i].class = (struct usbh_hid *)usbh_find_class_instance(dev_str);
-        if (usb->xbox_info[i].class) {
-            joy_driver_map |= (1 << (i + 2));
-        } else {
-            joy_driver_map &= ~(1 << (i + 2));
-        }
-        
-        if(usb->xbox_info[i].class && usb->xbox_info[i].state == STATE_NONE) {
-            INFO("Xinput %d connected\n", i);
-            print_usb_class_info(usb->xbox_info[i].class);
-            usb->xbox_info[i].state = STATE_DETECTED;
+void usbh_xbox_run(struct usbh_xbox *xbox_class) {
+    struct input_event evt = { INPUT_EVT_XBOX_ATTACH, CONFIG_USBHOST_MAX_XBOX_CLASS, 0 };
+    xSemaphoreTake(input_mutex, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
+        struct xbox_info_S *xbox = &usb_config.xbox_info[i];
+        if (xbox->state == STATE_NONE) {
+            xbox->class = xbox_class;
+            xbox->state = STATE_DETECTED;
+            evt.index = i;
+            break;
         }
-        
-        else if(!usb->xbox_info[i].class && usb->xbox_info[i].state != STATE_NONE) {
-            INFO("Xinput %d disconnected\n", i);
-            if (usb->xbox_info[i].task_handle) {
-                vTaskDelete( usb->xbox_info[i].task_handle );
-                DEBUG("XBOX %d task deleted\n", i);
-                usb->xbox_info[i].task_handle = NULL;
-            }
-            usb->xbox_info[i].state = STATE_NONE;
+    }
+    xSemaphoreGive(input_mutex);
+    xQueueSend(input_queue, &evt, portMAX_DELAY);
+}
 
-            DEBUG("Joystick %d is gone", usb->xbox_info[i].js_index);
-            hid_release_joystick(usb->xbox_info[i].js_index);
+void usbh_xbox_stop(struct usbh_xbox *xbox_class) {
+    struct input_event evt = { INPUT_EVT_XBOX_DETACH, 0, 0 };
+    bool found = false;
+    xSemaphoreTake(input_mutex, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
+        struct xbox_info_S *xbox = &usb_config.xbox_info[i];
+        if (xbox->state != STATE_NONE && xbox->class == xbox_class) {
+            xbox->state = STATE_STOPPED;
+            evt.index = i;
+            found = true;
         }
     }
+    xSemaphoreGive(input_mutex);
+    if (found)
+        xQueueSend(input_queue, &evt, portMAX_DELAY);
+}
+
+#define print_usb_class_info(cls) \
+    DEBUG("Interval: %d, ", cls->hport->config.intf[cls->intf].altsetting[0].ep[0].ep_desc.bInterval); \
+    DEBUG("Interface %d, ", cls->intf); \
+    DEBUG("  class %d, ", cls->hport->config.intf[cls->intf].altsetting[0].intf_desc.bInterfaceClass); \
+    DEBUG("  subclass %d, ", cls->hport->config.intf[cls->intf].altsetting[0].intf_desc.bInterfaceSubClass); \
+    DEBUG("  protocol %d\n", cls->hport->config.intf[cls->intf].altsetting[0].intf_desc.bInterfaceProtocol);
+
+// bit i: HID slot i connected, bit CONFIG_USBHOST_MAX_HID_CLASS+i: Xinput slot i connected
+uint16_t joy_driver_map = 0;
+#define JOY_DRIVER_HID(i)   (1 << (i))
+#define JOY_DRIVER_XBOX(i)  (1 << (CONFIG_USBHOST_MAX_HID_CLASS + (i)))
+
+#define HID_QUIRK_IGNORE    0x01    // not a gamepad interface we can use
+
+// per-device quirks, keyed by VID/PID
+static const struct hid_quirk {
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t flags;
+} hid_quirks[] = {
+    {0x2dc8, 0x3107, HID_QUIRK_IGNORE},     // 8bitdo wireless adapter, served as Xinput
+};
+
+static uint8_t hid_get_quirks(uint16_t vid, uint16_t pid) {
+    for (int i = 0; i < sizeof(hid_quirks) / sizeof(hid_quirks[0]); i++)
+        if (hid_quirks[i].vid == vid && hid_quirks[i].pid == pid)
+            return hid_quirks[i].flags;
+    return 0;
 }
 
+// SNES: R  L  X A RT LT DN UP ST SE Y  B
+// XBOX:           X  Y  A  B  UP DN LT RT
+// EXTRA:                ST SE       R  L
+static const uint16_t xbox_snes_map[REMAP_INPUTS] = {
+    0x080, 0x040, 0x020, 0x010, 0x001, 0x100, 0x002, 0x200,     // RT LT DN UP B A Y X
+    0x400, 0x800, 0x000, 0x000, 0x004, 0x008, 0x000, 0x000,     // L R - - SE ST - -
+};
+
 static void xbox_parse(struct xbox_info_S *xbox) {
     // verify length field
     if(xbox->buffer[0] != 0 || xbox->buffer[1] != 20) {
@@ -266,41 +323,38 @@ static void xbox_parse(struct xbox_info_S *xbox) {
     }
 }
 
-// each HID client gets itws own thread which submits urbs
-// and waits for the interrupt to succeed
-static void usbh_hid_client_thread(void *arg) {
-    struct hid_info_S *hid = (struct hid_info_S *)arg;
+static void hid_submit(struct hid_info_S *hid) {
+    int ret = usbh_submit_urb(&hid->class->intin_urb);
+    hid->retry = ret < 0;
+    if (ret < 0)
+        DEBUG("HID client #%d: submit failed %d\n", hid->index, ret);
+}
 
-    INFO("HID #%d on        \n", hid->index);
+static void xbox_submit(struct xbox_info_S *xbox) {
+    int ret = usbh_submit_urb(&xbox->class->intin_urb);
+    xbox->retry = ret < 0;
+    if (ret < 0)
+        INFO("XBOX client #%d: submit failed %d\n", xbox->index, ret);
+}
 
-    while(1) {
-        int ret = usbh_submit_urb(&hid->class->intin_urb);
-        if (ret < 0)
-            DEBUG("HID client #%d: submit failed %d\n", hid->index, ret);
-        else {
-            // Wait for result
-            xSemaphoreTake(hid->sem, 0xffffffffUL);
-            if(hid->nbytes > 0) {       // use first two joysticks
-                hid_parse(&hid->report, &hid->hid_state, hid->buffer, hid->nbytes);
-                if (hid->hid_state.joystick.js_index < 2) {
-                    xSemaphoreTake(state_mutex, portMAX_DELAY);
-                    volatile uint16_t *snes = hid->hid_state.joystick.js_index == 0 ? &hid1_state : &hid2_state;
-                    uint8_t hid_state = hid->hid_state.joystick.last_state;
-                    uint8_t hid_extra = hid->hid_state.joystick.last_state_btn_extra;
-                    //       11 10 9 8 7  6  5  4  3  2  1  0
-                    // SNES: R  L  X A RT LT DN UP ST SE Y  B
-                    // HID:            Y  B  A  X  UP DN LT RT                     
-                    // EXTRA:                ST SE       R  L
-                    *snes = (hid_state & 1) << 7 | (hid_state & 2) << 5 | (hid_state & 4) << 3 | (hid_state & 8) << 1 |
-                            (hid_state & 0x10) << 5 | (hid_state & 0x20) << 3| (hid_state & 0x40) >> 6 | (hid_state & 0x80) >> 6 |
-                            (hid_extra & 0x01) << 10 | (hid_extra & 0x02) << 10 | (hid_extra & 0x10) >> 2 | (hid_extra & 0x20) >> 2;
-                    xSemaphoreGive(state_mutex);
-                }
-            }
-            
-            hid->nbytes = 0;
-        }      
-        vTaskDelay(pdMS_TO_TICKS(10));
+static void hid_report(struct hid_info_S *hid, int nbytes) {
+    if (nbytes > 0 && hid->report.type == REPORT_TYPE_KEYBOARD) {
+        char keys[6];
+        int n = keyboard_parse(&hid->report, &hid->hid_state.kbd, hid->buffer, nbytes, keys, sizeof(keys));
+        for (int i = 0; i < n; i++)
+            xQueueSend(key_queue, &keys[i], 0);     // drop keys nobody reads
+        hid_submit(hid);
+    } else if (nbytes > 0) {
+        hid_parse(&hid->report, &hid->hid_state, hid->buffer, nbytes);
+        if (hid->hid_state.joystick.js_index < INPUT_MAX_PLAYERS) {
+            xSemaphoreTake(state_mutex, portMAX_DELAY);
+            hid_states[hid->hid_state.joystick.js_index] = hid->hid_state.joystick.snes;
+            xSemaphoreGive(state_mutex);
+        }
+        hid_submit(hid);
+    } else {
+        // transfer error, try again on the next retry tick
+        hid->retry = true;
     }
 }
 
@@ -322,17 +376,19 @@ static void xbox_init(struct xbox_info_S *xbox) {
             xbox->class->hport,
             xbox->class->intout,
             xbox_ep2_packets[i], 3,
-            0, usbh_xbox_callback, xbox);
+            0, usbh_xbox_out_callback, xbox);
         int ret = usbh_submit_urb(&xbox->class->intout_urb);
         if (ret < 0)
             DEBUG("XBOX FATAL: submit EP2 failed %d", ret);
-        else
-            xSemaphoreTake(xbox->sem, 0xffffffffUL);    // wait for callback to finish
+        else if (xSemaphoreTake(xbox_out_sem, pdMS_TO_TICKS(XBOX_OUT_TIMEOUT_MS)) != pdTRUE) {
+            // never block the other pads on a hung device
+            DEBUG("XBOX: EP2 packet %d timeout", i);
+            usbh_kill_urb(&xbox->class->intout_urb);
+        }
     }
 }
 
-static void usbh_xbox_client_thread(void *arg) {
-    struct xbox_info_S *xbox = (struct xbox_info_S *)arg;
+static void xbox_start(struct xbox_info_S *xbox) {
     int ret = 0;
 
     INFO("Xinput #%d on        \n", xbox->index);
@@ -350,50 +406,156 @@ static void usbh_xbox_client_thread(void *arg) {
     usbh_int_urb_fill(&xbox->class->intin_urb, xbox->class->hport, 
             xbox->class->intin, xbox->buffer, XBOX_REPORT_SIZE,
             50, usbh_xbox_callback, xbox);
+    xbox_submit(xbox);
+}
 
-    int total = 0, error = 0;
-    while(1) {
-        int ret = usbh_submit_urb(&xbox->class->intin_urb);
-        total++;
-        if (ret < 0) {
-            error++;
-            INFO("XBOX client #%d: submit failed %d\n", xbox->index, ret);
-        } else {
-            xSemaphoreTake(xbox->sem, 0xffffffffUL);    // Wait for result
-            if (xbox->nbytes == XBOX_REPORT_SIZE) {     // 8bit wireless adapter sends 40-byte reports
-                xbox_parse(xbox);
-
-                if (xbox->js_index < 2) {
-                    xSemaphoreTake(state_mutex, portMAX_DELAY);
-                    volatile uint16_t *snes = xbox->js_index == 0 ? &hid1_state : &hid2_state;  
-                    uint8_t state = xbox->last_state;
-                    uint8_t state_extra = xbox->last_state_btn_extra;
-                    // SNES: R  L  X A RT LT DN UP ST SE Y  B
-                    // XBOX:           X  Y  A  B  UP DN LT RT
-                    // EXTRA:                ST SE       R  L
-                    *snes = (state & 1) << 7 | (state & 2) << 5 | (state & 4) << 3 | (state & 8) << 1 |
-                            (state & 0x10) >> 4 | (state & 0x20) << 3| (state & 0x40) >> 5 | (state & 0x80) << 2 |
-                            (state_extra & 0x01) << 10 | (state_extra & 0x02) << 10 | (state_extra & 0x10) >> 2 | (state_extra & 0x20) >> 2;
-                    xSemaphoreGive(state_mutex);
-                }
-            } else {
-                error++;
-                if (xbox->nbytes == -USB_ERR_TIMEOUT) {
-                    INFO("XBOX client #%d: timeout, reinit\n", xbox->index);
-                    usbh_kill_urb(&xbox->class->intin_urb);
-                    // reinit if we timeout (device could've gone asleep)
-                    xbox_init(xbox);
-                }
-            }
-            xbox->nbytes = 0;
-        }
-        if (total % 1000 == 0) {
-            DEBUG("XBOX client #%d: total %d, error %d\n", xbox->index, total, error);
+static void xbox_report(struct xbox_info_S *xbox, int nbytes) {
+    if (nbytes == XBOX_REPORT_SIZE) {           // 8bit wireless adapter sends 40-byte reports
+        xbox_parse(xbox);
+
+        if (xbox->js_index < INPUT_MAX_PLAYERS) {
+            xSemaphoreTake(state_mutex, portMAX_DELAY);
+            hid_states[xbox->js_index] = remap_apply(&xbox->lut, xbox->last_state, xbox->last_state_btn_extra);
+            xSemaphoreGive(state_mutex);
         }
-        vTaskDelay(pdMS_TO_TICKS(4));
+    } else if (nbytes == -USB_ERR_TIMEOUT) {
+        INFO("XBOX client #%d: timeout, reinit\n", xbox->index);
+        usbh_kill_urb(&xbox->class->intin_urb);
+        // reinit if we timeout (device could've gone asleep)
+        xbox_init(xbox);
+    } else if (nbytes < 0) {
+        // transfer error, try again on the next retry tick
+        xbox->retry = true;
+        return;
+    }
+    xbox_submit(xbox);
+}
+
+// attach and detach run with input_mutex held, on a slot that
+// usbh_hid_run() took or usbh_hid_stop() marked stopped
+static void hid_attach(struct hid_info_S *hid) {
+    int i = hid->index;
+    joy_driver_map |= JOY_DRIVER_HID(i);
+
+    INFO("HID %d connected\n", i);
+    print_usb_class_info(hid->class);
+    uint16_t vendor_id = hid->class->hport->device_desc.idVendor;
+    uint16_t product_id = hid->class->hport->device_desc.idProduct;
+    bool skip = hid_get_quirks(vendor_id, product_id) & HID_QUIRK_IGNORE;
+
+    // parse report descriptor (as much of it as the host class fetched) ...
+    if(skip || !parse_report_descriptor(hid->class->report_desc, sizeof(hid->class->report_desc), &hid->report, NULL)) {
+        hid->state = STATE_FAILED;      // parsing failed, don't use
+        return;
+    }
+
+    // the URB transfers a whole report into hid->buffer
+    if (hid->report.report_size + (hid->report.report_id_present ? 1:0) > MAX_REPORT_SIZE) {
+        INFO("HID %d: report too long (%d)\n", i, hid->report.report_size);
+        hid->state = STATE_FAILED;
+        return;
+    }
+
+    memset(&hid->hid_state, 0, sizeof(hid->hid_state));
+    if (hid->report.type == REPORT_TYPE_JOYSTICK) {
+        uint16_t map[REMAP_INPUTS];
+        hid_compile_plan(&hid->report, remap_find(vendor_id, product_id, hid_snes_map, map));
+    }
+
+    hid->state = STATE_RUNNING;
+    INFO("HID #%d on        \n", hid->index);
+
+    // allocate a joystick index (keyboards do not take a player slot)
+    if (hid->report.type == REPORT_TYPE_JOYSTICK) {
+        hid->hid_state.joystick.js_index = hid_allocate_joystick();
+        hid->player = true;
+        DEBUG("  -> joystick %d", hid->hid_state.joystick.js_index);
+    }
+
+    // setup urb
+    usbh_int_urb_fill(&hid->class->intin_urb, hid->class->hport, hid->class->intin, hid->buffer,
+            hid->report.report_size + (hid->report.report_id_present ? 1:0),
+            0, usbh_hid_callback, hid);
+    hid_submit(hid);
+}
+
+static void hid_detach(struct hid_info_S *hid) {
+    int i = hid->index;
+    INFO("HID %d disconnected\n", i);
+    if (hid->player) {
+        DEBUG("Joystick %d gone", hid->hid_state.joystick.js_index);
+        hid_release_joystick(hid->hid_state.joystick.js_index);
+        hid->player = false;
+    }
+    hid->state = STATE_NONE;
+    hid->class = NULL;
+    hid->retry = false;
+    joy_driver_map &= ~JOY_DRIVER_HID(i);
+}
+
+static void xbox_attach(struct xbox_info_S *xbox) {
+    int i = xbox->index;
+    joy_driver_map |= JOY_DRIVER_XBOX(i);
+
+    INFO("Xinput %d connected\n", i);
+    print_usb_class_info(xbox->class);
+    xbox->state = STATE_RUNNING;
+
+    uint16_t map[REMAP_INPUTS];
+    remap_compile(remap_find(xbox->class->hport->device_desc.idVendor, 
+                             xbox->class->hport->device_desc.idProduct, xbox_snes_map, map), &xbox->lut);
+
+    // allocate a joystick index
+    xbox->js_index = hid_allocate_joystick();
+    xbox->player = true;
+    DEBUG("  -> joystick %d", xbox->js_index);
+
+    xbox_start(xbox);
+}
+
+static void xbox_detach(struct xbox_info_S *xbox) {
+    int i = xbox->index;
+    INFO("Xinput %d disconnected\n", i);
+    if (xbox->player) {
+        DEBUG("Joystick %d is gone", xbox->js_index);
+        hid_release_joystick(xbox->js_index);
+        xbox->player = false;
+    }
+    xbox->state = STATE_NONE;
+    xbox->class = NULL;
+    xbox->retry = false;
+    joy_driver_map &= ~JOY_DRIVER_XBOX(i);
+}
+
+// recompile mappings of attached pads after profiles are (re)loaded
+static void remap_all(struct usb_config *usb) {
+    uint16_t map[REMAP_INPUTS];
+    for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++) {
+        struct hid_info_S *hid = &usb->hid_info[i];
+        if (hid->state != STATE_RUNNING || hid->report.type != REPORT_TYPE_JOYSTICK) continue;
+        hid_compile_plan(&hid->report, remap_find(hid->class->hport->device_desc.idVendor,
+                         hid->class->hport->device_desc.idProduct, hid_snes_map, map));
+    }
+    for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
+        struct xbox_info_S *xbox = &usb->xbox_info[i];
+        if (xbox->state != STATE_RUNNING) continue;
+        remap_compile(remap_find(xbox->class->hport->device_desc.idVendor,
+                      xbox->class->hport->device_desc.idProduct, xbox_snes_map, map), &xbox->lut);
     }
 }
 
+int usb_keyboard_getc(void) {
+    char c;
+    if (key_queue && xQueueReceive(key_queue, &c, 0) == pdTRUE)
+        return (uint8_t)c;
+    return -1;
+}
+
+void usb_gamepad_remap(void) {
+    struct input_event evt = { INPUT_EVT_REMAP, 0, 0 };
+    xQueueSend(input_queue, &evt, portMAX_DELAY);
+}
+
 #ifdef DEBUG_ON
 static const char *state2str(int state) {
     switch (state) {
@@ -401,71 +563,83 @@ static const char *state2str(int state) {
         case STATE_DETECTED: return "detected";
         case STATE_RUNNING: return "running";
         case STATE_FAILED: return "failed";
+        case STATE_STOPPED: return "stopped";
     }
     return "unknown";
 }
 #endif
 
-static void usbh_hid_thread(void *argument) {
+// The only gamepad task: handles hotplug events and URB completions for all pads
+static void usbh_input_thread(void *argument) {
     DEBUG("Starting usb gamepad host task...");
     uint64_t last_status = 0;
 
     struct usb_config *usb = (struct usb_config *)argument;
 
     while (1) {
-        // DEBUG("calling usbh_update()\n");
-        usbh_update(usb);
-
-        for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++) {
-            if (usb->hid_info[i].state == STATE_DETECTED) {
-                DEBUG("HID device %d is detected\n", i);
-                usb->hid_info[i].state = STATE_RUNNING;
-
-                // allocate a joystick index
-                usb->hid_info[i].hid_state.joystick.js_index = hid_allocate_joystick();
-                DEBUG("  -> joystick %d", usb->hid_info[i].hid_state.joystick.js_index);
-
-                // setup urb
-                usbh_int_urb_fill(&usb->hid_info[i].class->intin_urb,
-                        usb->hid_info[i].class->hport,
-                        usb->hid_info[i].class->intin, usb->hid_info[i].buffer,
-                        usb->hid_info[i].report.report_size + (usb->hid_info[i].report.report_id_present ? 1:0),
-                        0, usbh_hid_callback, &usb->hid_info[i]);     
-
-                xTaskCreate(usbh_hid_client_thread, (char *)"hid_client_task", 1024,
-                        &usb->hid_info[i], configMAX_PRIORITIES-3, &usb->hid_info[i].task_handle );
-            }
-        }
-
-        // check for active xbox pads
-        for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
-            if (usb->xbox_info[i].state == STATE_DETECTED) {
-                DEBUG("XBOX device %d is detected\n", i);
-                usb->xbox_info[i].state = STATE_RUNNING;
-                usb->xbox_info[i].js_index = i;
-
-                // allocate a joystick index
-                usb->xbox_info[i].js_index = hid_allocate_joystick();
-                DEBUG("  -> joystick %d", usb->xbox_info[i].js_index);
-
-                xTaskCreate(usbh_xbox_client_thread, (char *)"xbox_client_task", 2048,
-                        &usb->xbox_info[i], configMAX_PRIORITIES-3, &usb->xbox_info[i].task_handle );
+        bool retry = false;
+        for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++)
+            retry |= usb->hid_info[i].retry;
+        for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++)
+            retry |= usb->xbox_info[i].retry;
+
+        struct input_event evt;
+        bool got = xQueueReceive(input_queue, &evt, retry ? pdMS_TO_TICKS(INPUT_RETRY_MS) : portMAX_DELAY) == pdTRUE;
+        // a slot in STATE_RUNNING keeps its class until the lock is released
+        xSemaphoreTake(input_mutex, portMAX_DELAY);
+        if (got) {
+            switch (evt.type) {
+            case INPUT_EVT_HID_ATTACH:
+                if (evt.index == CONFIG_USBHOST_MAX_HID_CLASS)
+                    INFO("HID: no free slot\n");
+                else if (usb->hid_info[evt.index].state == STATE_DETECTED)    // not stopped since
+                    hid_attach(&usb->hid_info[evt.index]);
+                break;
+            case INPUT_EVT_HID_DETACH:
+                hid_detach(&usb->hid_info[evt.index]);
+                break;
+            case INPUT_EVT_HID_REPORT:
+                // completions of killed URBs can arrive after the stop
+                if (usb->hid_info[evt.index].state == STATE_RUNNING)
+                    hid_report(&usb->hid_info[evt.index], evt.nbytes);
+                break;
+            case INPUT_EVT_XBOX_ATTACH:
+                if (evt.index == CONFIG_USBHOST_MAX_XBOX_CLASS)
+                    INFO("Xinput: no free slot\n");
+                else if (usb->xbox_info[evt.index].state == STATE_DETECTED)
+                    xbox_attach(&usb->xbox_info[evt.index]);
+                break;
+            case INPUT_EVT_XBOX_DETACH:
+                xbox_detach(&usb->xbox_info[evt.index]);
+                break;
+            case INPUT_EVT_XBOX_REPORT:
+                if (usb->xbox_info[evt.index].state == STATE_RUNNING)
+                    xbox_report(&usb->xbox_info[evt.index], evt.nbytes);
+                break;
+            case INPUT_EVT_REMAP:
+                remap_all(usb);
+                break;
             }
+        } else {
+            // retry tick: resubmit URBs that failed
+            for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++)
+                if (usb->hid_info[i].retry && usb->hid_info[i].state == STATE_RUNNING)
+                    hid_submit(&usb->hid_info[i]);
+            for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++)
+                if (usb->xbox_info[i].retry && usb->xbox_info[i].state == STATE_RUNNING)
+                    xbox_submit(&usb->xbox_info[i]);
         }
+        xSemaphoreGive(input_mutex);
 
         uint64_t now = bflb_mtimer_get_time_ms();
         if (now - last_status > 5000) {
             last_status = now;
-            DEBUG("hid1: %s %s, hid2: %s %s, xbox1: %s %s, xbox2: %s %s", 
-                joy_driver_map & 1 ? "on" : "off", state2str(usb->hid_info[0].state),
-                joy_driver_map & 2 ? "on" : "off", state2str(usb->hid_info[1].state),
-                joy_driver_map & 4 ? "on" : "off", state2str(usb->xbox_info[0].state),
-                joy_driver_map & 8 ? "on" : "off", state2str(usb->xbox_info[1].state)
-            );
+            DEBUG("drivers: %04x, players: %02x", joy_driver_map, joystick_map);
+            for (int i = 0; i < CONFIG_USBHOST_MAX_HID_CLASS; i++)
+                DEBUG("hid%d: %s", i+1, state2str(usb->hid_info[i].state));
+            for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++)
+                DEBUG("xbox%d: %s", i+1, state2str(usb->xbox_info[i].state));
         }
-
-        // wait for 100ms as this thread only deals with device detection and leaving
-        vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
 
@@ -476,7 +650,6 @@ void usb_gamepad_init(void) {
         usb_config.hid_info[i].state = 0;
         usb_config.hid_info[i].buffer = hid_buffer[i];
         usb_config.hid_info[i].usb = &usb_config;
-        usb_config.hid_info[i].sem = xSemaphoreCreateBinary();
     }
 
     for (int i = 0; i < CONFIG_USBHOST_MAX_XBOX_CLASS; i++) {
@@ -484,8 +657,12 @@ void usb_gamepad_init(void) {
         usb_config.xbox_info[i].state = 0;
         usb_config.xbox_info[i].buffer = xbox_buffer[i];
         usb_config.xbox_info[i].usb = &usb_config;
-        usb_config.xbox_info[i].sem = xSemaphoreCreateBinary();
     }
 
-    xTaskCreate(usbh_hid_thread, (char *)"usbh_hid_task", 2048, &usb_config, configMAX_PRIORITIES-3, &usb_handle);
+    input_queue = xQueueCreate(INPUT_QUEUE_LEN, sizeof(struct input_event));
+    input_mutex = xSemaphoreCreateMutex();
+    key_queue = xQueueCreate(KEY_QUEUE_LEN, sizeof(char));
+    xbox_out_sem = xSemaphoreCreateBinary();
+
+    xTaskCreate(usbh_input_thread, (char *)"usbh_input_task", INPUT_TASK_STACK_SIZE, &usb_config, configMAX_PRIORITIES-3, &usb_handle);
 }
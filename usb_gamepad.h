@@ -9,7 +9,16 @@
 // Start USB gamepad tasks
 void usb_gamepad_init(void);
 
-// state will be written here by the USB gamepad task
-extern volatile uint16_t hid1_state;               // SNES-format gamepad state
-extern volatile uint16_t hid2_state;               // SNES-format gamepad state
+// Re-apply remap profiles to connected pads (after remap_load())
+void usb_gamepad_remap(void);
+
+// next key typed on a USB keyboard: upper-case ASCII, '\n' (enter),
+// '\b' (backspace) or 0x1b (escape). -1 if there is none
+int usb_keyboard_getc(void);
+
+// number of USB gamepads reported to the core
+#define INPUT_MAX_PLAYERS 4
+
+// state will be written here by the USB gamepad task, indexed by player
+extern volatile uint16_t hid_states[INPUT_MAX_PLAYERS];   // SNES-format gamepad state
 extern SemaphoreHandle_t state_mutex;              // for all global state access
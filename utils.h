@@ -91,10 +91,27 @@ void overlay_message(char* msg, int center);
 bool get_core_status(void);
 // read joypad states, joy1/2 comes from FPGA, hid1/2 comes from USB
 void get_joypad_states(uint16_t *joy1, uint16_t *joy2, uint16_t *hid1, uint16_t *hid2);
+// read USB gamepad states of all players (INPUT_MAX_PLAYERS entries)
+void get_hid_states(uint16_t *hid);
 extern int joy_choice(int start_line, int len, int *active, int overlay_key_code);
 extern void send_blank_packet(void);
 bool find_core_for_board(char *fname, const char *core_name);
 
+// FatFs is built without FF_FS_REENTRANT, so every task touching the file
+// system holds this (recursive) lock. main_task holds it while in file menus
+// and loading, and drops it while waiting for input. see volume.c
+void fs_lock(void);
+void fs_unlock(void);
+// take the lock only if no other task holds it. return true if taken
+bool fs_trylock(void);
+
+// command packets to the core on UART1 are written with this lock held
+void uart1_lock(void);
+void uart1_unlock(void);
+
+// hidden folder for firmware caches on the USB drive
+#define TANGCORE_DIR "usb:.tangcore"
+
 extern void bflb_uart_set_console(struct bflb_device_s *dev);
 extern char *strcasestr(const char *haystack, const char *needle);
 
@@ -108,16 +125,28 @@ static inline void delay(uint32_t ms)
 #endif
 }
 
+struct rom_format;                  // see loader.h
 struct core_info {
     uint16_t id;                    // 1: NES, 2: SNES, 3: GB, 4: GENESIS, 0: end
     const char *display_name;
     const char *rom_dir;            // usb:nes, usb:snes, etc.
     const char *core_file;          // core file in cores/
-    int (*load_rom)(const char *fname);
+    const struct rom_format *format;    // how rom_load() loads ROMs of this core
 };
 extern struct core_info core_info_list[];
 extern int16_t main_menu_config[];
 
+// core capabilities, reported by the core in response to UART command 0x0B
+#define CORE_CAP_MULTI_INPUT        0x0001      // accepts command 0x0A (USB gamepads of up to 255 players)
+#define CORE_CAP_BACKUP_TYPE        0x0002      // accepts command 0x0C (GBA save type)
+#define CORE_CAP_SAVE_RAM           0x0004      // accepts commands 0x0D/0x0E and loading state 2
+#define CORE_CAP_SAVE_STATE         0x0008      // accepts command 0x0F and loading state 3
+#define CORE_CAP_MSU                0x0010      // sends MSU-1 requests 0x16, accepts replies 0x10
+#define CORE_CAP_DISC               0x0020      // sends disc requests 0x17, accepts replies 0x11
+#define CORE_CAP_PAGED              0x0040      // accepts commands 0x12/0x13, sends page requests 0x18
+#define CORE_CAP_FILL               0x0080      // accepts command 0x14 (fill runs of ROM data)
+extern uint16_t core_caps;
+
 #define OPTION_OSD_KEY_SELECT_START 1
 #define OPTION_OSD_KEY_SELECT_RIGHT 2
 
@@ -0,0 +1,111 @@
+// Mount-once manager for the USB drive, see volume.h
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "ff.h"
+#include "usbh_core.h"
+#include "usbh_msc.h"
+#include "bflb_mtimer.h"
+
+#include "disk_cache.h"
+#include "volume.h"
+#include "utils.h"
+
+extern FATFS fs;
+
+static SemaphoreHandle_t fs_mutex;      // for file system access, see fs_lock()
+static EventGroupHandle_t events;
+static StaticEventGroup_t events_buf;
+
+static volatile uint32_t generation;    // written by the USB host thread only
+static uint32_t mounted_gen;            // generation `fs` was mounted in
+static bool mounted;
+static uint32_t mount_ms;
+static uint32_t mounts_saved;
+
+void fs_lock(void) {
+    xSemaphoreTakeRecursive(fs_mutex, portMAX_DELAY);
+}
+
+void fs_unlock(void) {
+    xSemaphoreGiveRecursive(fs_mutex);
+}
+
+bool fs_trylock(void) {
+    return xSemaphoreTakeRecursive(fs_mutex, 0) == pdTRUE;
+}
+
+void volume_init(void) {
+    fs_mutex = xSemaphoreCreateRecursiveMutex();
+    events = xEventGroupCreateStatic(&events_buf);
+    xEventGroupSetBits(events, VOLUME_EVT_DETACHED);
+}
+
+// CherryUSB callbacks, run in the USB host thread
+void usbh_msc_run(struct usbh_msc *msc_class) {
+    generation++;
+    xEventGroupClearBits(events, VOLUME_EVT_DETACHED);
+    xEventGroupSetBits(events, VOLUME_EVT_ATTACHED);
+}
+
+void usbh_msc_stop(struct usbh_msc *msc_class) {
+    generation++;
+    disk_cache_detach();                // no reads through a stale class instance
+    xEventGroupClearBits(events, VOLUME_EVT_ATTACHED);
+    xEventGroupSetBits(events, VOLUME_EVT_DETACHED);
+}
+
+// `remount`: the caller used to mount the drive itself, count a reuse as saved
+static FRESULT mount(bool remount) {
+    FRESULT r = FR_OK;
+    fs_lock();
+    uint32_t gen = generation;
+    bool attached = xEventGroupGetBits(events) & VOLUME_EVT_ATTACHED;
+    if (mounted && mounted_gen == gen && attached) {
+        if (remount)
+            mounts_saved++;
+    } else if (!attached) {
+        if (mounted)
+            f_unmount("usb:");          // so that nobody uses the stale volume
+        mounted = false;
+        r = FR_NOT_READY;
+    } else {
+        uint64_t start = bflb_mtimer_get_time_us();
+        r = f_mount(&fs, "usb:", 1);
+        mount_ms = (bflb_mtimer_get_time_us() - start) / 1000;
+        mounted = r == FR_OK;
+        mounted_gen = gen;
+    }
+    fs_unlock();
+    return r;
+}
+
+FRESULT volume_mount(void) {
+    return mount(false);
+}
+
+FRESULT volume_remount(void) {
+    return mount(true);
+}
+
+void volume_wait(void) {
+    while (volume_mount() != FR_OK)
+        xEventGroupWaitBits(events, VOLUME_EVT_ATTACHED, pdFALSE, pdFALSE, pdMS_TO_TICKS(100));
+}
+
+uint32_t volume_generation(void) {
+    return generation;
+}
+
+uint32_t volume_mount_ms(void) {
+    return mount_ms;
+}
+
+uint32_t volume_mounts_saved(void) {
+    return mounts_saved;
+}
+
+EventGroupHandle_t volume_events(void) {
+    return events;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "event_groups.h"
+
+#include "ff.h"
+
+// USB drive volume
+//
+// The drive is mounted once after the USB host reports a mass storage
+// device, and stays mounted until it is unplugged. volume_mount() is what
+// loaders and menus call before touching files: it only mounts if the drive
+// was attached since the last mount, and otherwise returns at once.
+//
+// Attach and detach are published from the CherryUSB host thread
+// (usbh_msc_run/stop) as VOLUME_EVT_* bits of volume_events. The volume
+// also owns the file system lock, fs_lock() in utils.h.
+
+#define VOLUME_EVT_ATTACHED     0x01    // set while a drive is plugged in
+#define VOLUME_EVT_DETACHED     0x02    // set while no drive is plugged in
+
+// create the lock and the event group, before the USB host is started
+void volume_init(void);
+
+// make sure the drive is mounted. cheap when it already is.
+// return FR_NOT_READY if no drive is attached, FRESULT of f_mount() otherwise
+FRESULT volume_mount(void);
+
+// volume_mount() for the core and ROM loaders, which mounted the drive on
+// every call before: a reuse of the mounted volume counts as a mount saved
+FRESULT volume_remount(void);
+
+// block until a drive is attached and mounted
+void volume_wait(void);
+
+// bumped on every attach and detach
+uint32_t volume_generation(void);
+
+// time the last real mount took, and number of volume_remount() calls that
+// reused the mounted volume instead
+uint32_t volume_mount_ms(void);
+uint32_t volume_mounts_saved(void);
+
+EventGroupHandle_t volume_events(void);